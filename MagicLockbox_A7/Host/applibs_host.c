@@ -0,0 +1,1080 @@
+/* Host stand-ins for the applibs GPIO, I2C, PWM, Storage and networking APIs, with simple
+   models of the devices on the board. See Host/README.md */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <applibs/gpio.h>
+#include <applibs/i2c.h>
+#include <applibs/networking.h>
+#include <applibs/pwm.h>
+#include <applibs/storage.h>
+#include <applibs/wificonfig.h>
+#include "host_runtime.h"
+
+#define HOST_GPIO_COUNT 128
+#define HOST_MAX_HANDLES 32
+#define HOST_PWM_CHANNELS 4
+#define HOST_I2C_MESSAGE_QUEUE 32
+#define HOST_FIFO_WORDS 512
+#define HOST_FIFO_WORD_SIZE 7
+
+/// <summary>
+///     The level a GPIO reads back: external is what the devices and the trace drive, output
+///     what the application drives when it opened the line as output. edgeFd is signalled on
+///     rising edges, see HostGpio_OpenEdgeNotifier.
+/// </summary>
+typedef struct {
+    bool isOutput;
+    GPIO_OutputMode_Type outputMode;
+    bool output;
+    bool external;
+    int edgeFd;
+} HostGpioLine;
+
+typedef enum {
+    HostHandle_Gpio,
+    HostHandle_I2c,
+    HostHandle_Pwm,
+} HostHandleType;
+
+/// <summary>
+///     Every handle the application gets is a real (event) file descriptor, so that close() and
+///     epoll work on it.
+/// </summary>
+typedef struct {
+    int fd;
+    HostHandleType type;
+    int id;
+} HostHandle;
+
+typedef enum {
+    HostI2cModel_Registers,
+    HostI2cModel_Messages,
+} HostI2cModel;
+
+/// <summary>
+///     Model of the LSM6DSO FIFO. While the virtual clock advances, samples of a resting
+///     device are batched at the rates set in FIFO_CTRL3; FIFO_DATA_OUT_TAG to _Z_H read the
+///     oldest word, which is removed once _Z_H has been read. nextNs is 0 for a sensor which is
+///     not batched. With compression enabled, as the samples never change, a sensor's samples
+///     go in as one 3XC word of zero differences per three samples, after an uncompressed word
+///     at the start and within every UNCOPTR_RATE samples; slot counts the samples since then.
+/// </summary>
+typedef struct {
+    uint8_t words[HOST_FIFO_WORDS][HOST_FIFO_WORD_SIZE];
+    size_t head;
+    size_t count;
+    bool overrun;
+    uint8_t rate[2];
+    uint64_t nextNs[2];
+    uint32_t slot[2];
+} HostFifo;
+
+/// <summary>
+///     Model of an I2C device. Register devices have an auto-incrementing register pointer and
+///     up to three banks selected by bankRegister; clear-on-read registers are status registers
+///     which the device clears once read, and interruptPin is driven high while any of them is
+///     set. Message devices return queued messages one per read, zeros once the queue is empty,
+///     and drive readyPin low while a message is waiting. A device with hasTimestamp counts the virtual time since
+///     TIMESTAMP_EN was set in TIMESTAMP0..3, latched when TIMESTAMP0 is read. A device with
+///     hasSensorHub runs sensor hub cycles at hubNextNs, see RunSensorHubCycle; an auxiliary
+///     device is on the bus of a sensor hub and does not answer the application's master.
+/// </summary>
+typedef struct {
+    uint8_t address;
+    const char *name;
+    HostI2cModel model;
+    uint8_t registers[3][256];
+    uint8_t defaults[256];
+    uint8_t pointer;
+    int bankRegister;
+    uint8_t resetRegister;
+    uint8_t resetMask;
+    uint8_t clearOnRead[256 / 8];
+    int interruptPin;
+    HostFifo *fifo;
+    bool hasTimestamp;
+    uint64_t timestampSinceNs;
+    uint32_t timestampLatch;
+    bool hasSensorHub;
+    uint64_t hubNextNs;
+    bool auxiliary;
+    struct {
+        uint8_t *data;
+        size_t length;
+    } messages[HOST_I2C_MESSAGE_QUEUE];
+    size_t messageHead;
+    size_t messageCount;
+    int readyPin;
+    // Line which resets the device while driven low, -1 if it has none
+    int resetPin;
+} HostI2cDevice;
+
+static HostGpioLine gpioLines[HOST_GPIO_COUNT];
+static HostHandle handles[HOST_MAX_HANDLES];
+static PwmState pwmStates[HOST_MAX_HANDLES][HOST_PWM_CHANNELS];
+
+static struct {
+    uint32_t speedHz;
+    uint32_t timeoutMs;
+    uint64_t transfers;
+    uint64_t bytes;
+    uint64_t busNs;
+    // A slave stopped in the middle of a byte holds SDA low, whatever the master does, until
+    // it is reset through stuckResetPin; -1 if it has no reset line
+    bool stuck;
+    int stuckResetPin;
+} i2cBus = {.speedHz = I2C_BUS_SPEED_STANDARD, .timeoutMs = 100};
+
+static HostFifo lsm6dsoFifo;
+
+// LSM6DSO on INT1 = GPIO6 with the LPS22HH on its sensor hub, MGC3130 with TS = GPIO28 as on the
+// board.
+static HostI2cDevice i2cDevices[] = {
+    {.address = 0x6A,
+     .name = "lsm6dso",
+     .model = HostI2cModel_Registers,
+     .bankRegister = 0x01,
+     .resetRegister = 0x12,
+     .resetMask = 0x81,
+     .interruptPin = 6,
+     .fifo = &lsm6dsoFifo,
+     .hasTimestamp = true,
+     .hasSensorHub = true,
+     .readyPin = -1,
+     .resetPin = -1},
+    {.address = 0x5D,
+     .name = "lps22hh",
+     .model = HostI2cModel_Registers,
+     .bankRegister = -1,
+     .resetRegister = 0x11,
+     .resetMask = 0x84,
+     .interruptPin = -1,
+     .auxiliary = true,
+     .readyPin = -1,
+     .resetPin = -1},
+    {.address = 0x42,
+     .name = "mgc3130",
+     .model = HostI2cModel_Messages,
+     .bankRegister = -1,
+     .interruptPin = -1,
+     .readyPin = 28,
+     .resetPin = 26},
+};
+
+static char storagePath[256];
+static bool storageIsTemporary;
+
+static HostHandle *FindHandle(int fd, HostHandleType type)
+{
+    for (int i = 0; i < HOST_MAX_HANDLES; i++) {
+        if (handles[i].fd == fd && handles[i].type == type && fd >= 0) {
+            return &handles[i];
+        }
+    }
+    errno = EBADF;
+    return NULL;
+}
+
+static int OpenHandle(HostHandleType type, int id)
+{
+    int fd = eventfd(0, EFD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // A closed handle's fd number may come back; the new handle replaces the stale one.
+    HostHandle *slot = NULL;
+    for (int i = 0; i < HOST_MAX_HANDLES; i++) {
+        if (handles[i].fd == fd || (slot == NULL && handles[i].fd < 0)) {
+            slot = &handles[i];
+            if (handles[i].fd == fd) {
+                break;
+            }
+        }
+    }
+    if (slot == NULL) {
+        close(fd);
+        errno = EMFILE;
+        return -1;
+    }
+
+    slot->fd = fd;
+    slot->type = type;
+    slot->id = id;
+    return fd;
+}
+
+static bool GetGpioLevel(const HostGpioLine *line)
+{
+    if (!line->isOutput) {
+        return line->external;
+    }
+    switch (line->outputMode) {
+    case GPIO_OutputMode_OpenDrain:
+        return line->output && line->external;
+    case GPIO_OutputMode_OpenSource:
+        return line->output || line->external;
+    default:
+        return line->output;
+    }
+}
+
+static void NotifyGpioEdge(HostGpioLine *line, bool wasHigh)
+{
+    if (line->edgeFd >= 0 && !wasHigh && GetGpioLevel(line)) {
+        uint64_t one = 1;
+        if (write(line->edgeFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            fprintf(stderr, "host runtime: could not signal GPIO edge: %s\n", strerror(errno));
+        }
+    }
+}
+
+void HostGpio_Drive(int pin, bool high)
+{
+    if (pin >= 0 && pin < HOST_GPIO_COUNT) {
+        HostGpioLine *line = &gpioLines[pin];
+        bool wasHigh = GetGpioLevel(line);
+        line->external = high;
+        NotifyGpioEdge(line, wasHigh);
+    }
+}
+
+int HostGpio_OpenEdgeNotifier(int pin)
+{
+    if (pin < 0 || pin >= HOST_GPIO_COUNT) {
+        errno = ENODEV;
+        return -1;
+    }
+    if (gpioLines[pin].edgeFd >= 0) {
+        errno = EBUSY;
+        return -1;
+    }
+    gpioLines[pin].edgeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    return gpioLines[pin].edgeFd;
+}
+
+void HostGpio_ForgetFd(int fd)
+{
+    for (int pin = 0; pin < HOST_GPIO_COUNT && fd >= 0; pin++) {
+        if (gpioLines[pin].edgeFd == fd) {
+            gpioLines[pin].edgeFd = -1;
+        }
+    }
+}
+
+int GPIO_OpenAsInput(GPIO_Id gpioId)
+{
+    if (gpioId < 0 || gpioId >= HOST_GPIO_COUNT) {
+        errno = ENODEV;
+        return -1;
+    }
+    gpioLines[gpioId].isOutput = false;
+    return OpenHandle(HostHandle_Gpio, gpioId);
+}
+
+int GPIO_OpenAsOutput(GPIO_Id gpioId, GPIO_OutputMode_Type outputMode,
+                      GPIO_Value_Type initialValue)
+{
+    if (gpioId < 0 || gpioId >= HOST_GPIO_COUNT) {
+        errno = ENODEV;
+        return -1;
+    }
+    gpioLines[gpioId].isOutput = true;
+    gpioLines[gpioId].outputMode = outputMode;
+    gpioLines[gpioId].output = initialValue != GPIO_Value_Low;
+    return OpenHandle(HostHandle_Gpio, gpioId);
+}
+
+int GPIO_GetValue(int gpioFd, GPIO_Value_Type *outValue)
+{
+    HostHandle *handle = FindHandle(gpioFd, HostHandle_Gpio);
+    if (handle == NULL) {
+        return -1;
+    }
+    *outValue = GetGpioLevel(&gpioLines[handle->id]) ? GPIO_Value_High : GPIO_Value_Low;
+    return 0;
+}
+
+int GPIO_SetValue(int gpioFd, GPIO_Value_Type value)
+{
+    HostHandle *handle = FindHandle(gpioFd, HostHandle_Gpio);
+    if (handle == NULL) {
+        return -1;
+    }
+    HostGpioLine *line = &gpioLines[handle->id];
+    if (!line->isOutput) {
+        errno = EPERM;
+        return -1;
+    }
+
+    bool high = value != GPIO_Value_Low;
+    if (line->output != high) {
+        bool wasHigh = GetGpioLevel(line);
+        line->output = high;
+        HostRuntime_Output("gpio %d %d", handle->id, high ? 1 : 0);
+        NotifyGpioEdge(line, wasHigh);
+        if (!high && i2cBus.stuck && handle->id == i2cBus.stuckResetPin) {
+            // The reset abandons the byte the slave was stopped in and frees SDA.
+            i2cBus.stuck = false;
+        }
+    }
+    return 0;
+}
+
+static HostI2cDevice *FindI2cDevice(uint8_t address)
+{
+    for (size_t i = 0; i < sizeof(i2cDevices) / sizeof(i2cDevices[0]); i++) {
+        if (i2cDevices[i].address == address) {
+            return &i2cDevices[i];
+        }
+    }
+    return NULL;
+}
+
+static bool IsClearOnRead(const HostI2cDevice *device, uint8_t reg)
+{
+    return (device->clearOnRead[reg / 8] & (1U << (reg % 8))) != 0;
+}
+
+// LSM6DSO FIFO registers, and CTRL1_XL followed by CTRL2_G
+#define HOST_FIFO_CTRL1 0x07
+#define HOST_FIFO_CTRL2 0x08
+#define HOST_FIFO_CTRL4 0x0A
+#define HOST_FIFO_INT1_CTRL 0x0D
+#define HOST_CTRL1_XL 0x10
+#define HOST_CTRL10_C 0x19
+#define HOST_TIMESTAMP0 0x40
+#define HOST_TIMESTAMP3 0x43
+#define HOST_FIFO_STATUS1 0x3A
+#define HOST_FIFO_STATUS2 0x3B
+#define HOST_FIFO_DATA_OUT_TAG 0x78
+#define HOST_FIFO_DATA_OUT_Z_H 0x7E
+// EMB_FUNC_EN_B in the embedded functions bank, FIFO_COMPR_EN
+#define HOST_EMB_FUNC_EN_B 0x05
+#define HOST_FIFO_COMPR_EN 0x08
+// FIFO_COMPR_RT_EN and UNCOPTR_RATE of FIFO_CTRL2
+#define HOST_FIFO_COMPR_RT_EN 0x40
+#define HOST_UNCOPTR_RATE(ctrl2) (((ctrl2) >> 1) & 0x03)
+
+// Batch data rates of the BDR_XL and BDR_GY codes, 0 is not batched.
+static const double fifoBatchRateHz[16] = {0,    12.5,   26,     52,  104, 208, 417, 833,
+                                           1667, 3333.0, 6667.0, 6.5, 0,   0,   0,   0};
+
+// Raw samples of a device lying flat at rest: 1 g on Z at 2 g full scale, no rotation.
+static const int16_t fifoRestSample[2][3] = {{0, 0, 16393}, {0, 0, 0}};
+
+static bool IsFifoAtWatermark(const HostI2cDevice *device)
+{
+    const uint8_t *registers = device->registers[0];
+    size_t watermark = ((size_t)(registers[HOST_FIFO_CTRL1 + 1] & 0x01) << 8) |
+                       registers[HOST_FIFO_CTRL1];
+    return watermark != 0 && device->fifo->count >= watermark;
+}
+
+static void UpdateInterruptPin(HostI2cDevice *device)
+{
+    if (device->interruptPin < 0) {
+        return;
+    }
+    // INT1_FIFO_TH follows the FIFO level, it is not latched.
+    bool pending = device->fifo != NULL &&
+                   (device->registers[0][HOST_FIFO_INT1_CTRL] & 0x08) != 0 &&
+                   IsFifoAtWatermark(device);
+    for (unsigned int reg = 0; reg < 256; reg++) {
+        if (IsClearOnRead(device, (uint8_t)reg) && device->registers[0][reg] != 0) {
+            pending = true;
+            break;
+        }
+    }
+    HostGpio_Drive(device->interruptPin, pending);
+}
+
+/// <summary>
+///     Applies FIFO_CTRL3 and FIFO_CTRL4: bypass mode empties the FIFO, a changed batch rate
+///     restarts the batching of that sensor.
+/// </summary>
+static void ConfigureFifo(HostI2cDevice *device)
+{
+    HostFifo *fifo = device->fifo;
+    uint8_t rates = device->registers[0][HOST_FIFO_CTRL1 + 2];
+    bool bypass = (device->registers[0][HOST_FIFO_CTRL4] & 0x07) == 0;
+    if (bypass) {
+        fifo->head = 0;
+        fifo->count = 0;
+        fifo->overrun = false;
+        memset(fifo->slot, 0, sizeof(fifo->slot));
+    }
+
+    for (int sensor = 0; sensor < 2; sensor++) {
+        uint8_t rate = bypass ? 0 : (uint8_t)((rates >> (sensor * 4)) & 0x0F);
+        if (rate == fifo->rate[sensor]) {
+            continue;
+        }
+        fifo->rate[sensor] = rate;
+        fifo->nextNs[sensor] = fifoBatchRateHz[rate] == 0
+                                   ? 0
+                                   : HostRuntime_GetTimeNs() +
+                                         (uint64_t)(1e9 / fifoBatchRateHz[rate]);
+    }
+}
+
+static bool IsFifoCompressed(const HostI2cDevice *device)
+{
+    return (device->registers[1][HOST_EMB_FUNC_EN_B] & HOST_FIFO_COMPR_EN) != 0 &&
+           (device->registers[0][HOST_FIFO_CTRL2] & HOST_FIFO_COMPR_RT_EN) != 0;
+}
+
+/// <summary>
+///     Returns the tag of the word of the sample just taken by sensor, or 0 when the sample
+///     waits to be compressed with the next ones.
+/// </summary>
+static uint8_t GetFifoSampleTag(HostI2cDevice *device, int sensor)
+{
+    // TAG_SENSOR of the uncompressed and the 3XC words of the accelerometer and gyroscope.
+    static const uint8_t uncompressedTags[2] = {0x02, 0x01};
+    static const uint8_t compressedTags[2] = {0x09, 0x0D};
+    if (!IsFifoCompressed(device)) {
+        return uncompressedTags[sensor];
+    }
+
+    HostFifo *fifo = device->fifo;
+    unsigned int uncompressedRate = HOST_UNCOPTR_RATE(device->registers[0][HOST_FIFO_CTRL2]);
+    uint32_t period = uncompressedRate == 0 ? 0 : 4U << uncompressedRate;
+    uint32_t slot = fifo->slot[sensor]++;
+    if (slot == 0) {
+        return uncompressedTags[sensor];
+    }
+    if (slot % 3 != 0) {
+        return 0;
+    }
+    if (period != 0 && slot + 3 > period) {
+        // The next sample goes in uncompressed.
+        fifo->slot[sensor] = 0;
+    }
+    return compressedTags[sensor];
+}
+
+/// <summary>
+///     Appends a word with tag to the FIFO.
+/// </summary>
+/// <returns>The word, for the caller to fill in its data, or NULL when the FIFO is full in
+/// FIFO mode</returns>
+static uint8_t *AppendFifoWord(HostI2cDevice *device, uint8_t tag)
+{
+    HostFifo *fifo = device->fifo;
+    if (fifo->count == HOST_FIFO_WORDS) {
+        fifo->overrun = true;
+        if ((device->registers[0][HOST_FIFO_CTRL4] & 0x07) != 0x06) {
+            // FIFO mode stops collecting when full, stream mode drops the oldest word.
+            return NULL;
+        }
+        fifo->head = (fifo->head + 1) % HOST_FIFO_WORDS;
+        fifo->count--;
+    }
+
+    uint8_t *word = fifo->words[(fifo->head + fifo->count) % HOST_FIFO_WORDS];
+    // TAG_SENSOR in bits 7:3.
+    word[0] = (uint8_t)(tag << 3);
+    fifo->count++;
+    return word;
+}
+
+static void BatchFifoSample(HostI2cDevice *device, int sensor)
+{
+    // A sensor in power-down (ODR 0) has no samples to batch.
+    if ((device->registers[0][HOST_CTRL1_XL + sensor] & 0xF0) == 0) {
+        return;
+    }
+    uint8_t tag = GetFifoSampleTag(device, sensor);
+    if (tag == 0) {
+        return;
+    }
+    uint8_t *word = AppendFifoWord(device, tag);
+    if (word == NULL) {
+        return;
+    }
+    if (tag > 0x02) {
+        // Differences to the samples before, all zero.
+        memset(&word[1], 0, HOST_FIFO_WORD_SIZE - 1);
+        return;
+    }
+    for (int axis = 0; axis < 3; axis++) {
+        word[1 + axis * 2] = (uint8_t)(fifoRestSample[sensor][axis] & 0xFF);
+        word[2 + axis * 2] = (uint8_t)((uint16_t)fifoRestSample[sensor][axis] >> 8);
+    }
+}
+
+static uint8_t ReadFifoRegister(HostI2cDevice *device, uint8_t reg)
+{
+    HostFifo *fifo = device->fifo;
+    if (reg == HOST_FIFO_STATUS1) {
+        return (uint8_t)(fifo->count & 0xFF);
+    }
+    if (reg == HOST_FIFO_STATUS2) {
+        uint8_t value = (uint8_t)((fifo->count >> 8) & 0x03);
+        value |= IsFifoAtWatermark(device) ? 0x80 : 0;
+        value |= fifo->overrun ? 0x48 : 0;
+        value |= fifo->count == HOST_FIFO_WORDS ? 0x20 : 0;
+        fifo->overrun = false;
+        return value;
+    }
+
+    if (fifo->count == 0) {
+        return 0;
+    }
+    uint8_t value = fifo->words[fifo->head][reg - HOST_FIFO_DATA_OUT_TAG];
+    if (reg == HOST_FIFO_DATA_OUT_Z_H) {
+        fifo->head = (fifo->head + 1) % HOST_FIFO_WORDS;
+        fifo->count--;
+    }
+    return value;
+}
+
+static bool IsFifoRegister(const HostI2cDevice *device, uint8_t reg)
+{
+    return device->fifo != NULL && (reg == HOST_FIFO_STATUS1 || reg == HOST_FIFO_STATUS2 ||
+                                    (reg >= HOST_FIFO_DATA_OUT_TAG && reg <= HOST_FIFO_DATA_OUT_Z_H));
+}
+
+// Sensor hub bank registers of the LSM6DSO: SENSOR_HUB_1, MASTER_CONFIG with MASTER_ON, slave 0
+// with SHUB_ODR and BATCH_EXT_SENS_0_EN in SLV0_CONFIG, and STATUS_MASTER
+#define HOST_SENSOR_HUB_1 0x02
+#define HOST_MASTER_CONFIG 0x14
+#define HOST_MASTER_ON 0x04
+#define HOST_SLV0_ADD 0x15
+#define HOST_SLV0_SUBADD 0x16
+#define HOST_SLV0_CONFIG 0x17
+#define HOST_BATCH_EXT_SENS_0_EN 0x08
+#define HOST_DATAWRITE_SLV0 0x21
+#define HOST_STATUS_MASTER 0x22
+// SENS_HUB_ENDOP, SLAVE0_NACK and WR_ONCE_DONE of STATUS_MASTER
+#define HOST_SENS_HUB_ENDOP 0x01
+#define HOST_SLAVE0_NACK 0x08
+#define HOST_WR_ONCE_DONE 0x80
+// TAG_SENSOR of SENSORHUB_SLAVE0 words
+#define HOST_SENSORHUB_SLAVE0_TAG 0x0E
+
+// Sensor hub rates of the SHUB_ODR codes.
+static const double sensorHubRateHz[4] = {104, 52, 26, 12.5};
+
+static uint64_t GetSensorHubPeriodNs(const HostI2cDevice *device)
+{
+    return (uint64_t)(1e9 / sensorHubRateHz[device->registers[2][HOST_SLV0_CONFIG] >> 6]);
+}
+
+static void WriteRegister(HostI2cDevice *device, uint8_t reg, uint8_t value);
+static uint8_t ReadRegister(HostI2cDevice *device, uint8_t reg);
+
+/// <summary>
+///     Runs one cycle of the sensor hub, slave 0 only: a slave addressed for writing in SLV0_ADD
+///     gets DATAWRITE_SLV0 written, one addressed for reading has SLAVE0_NUMOP registers read
+///     into SENSOR_HUB_1 and on, batched into the FIFO with BATCH_EXT_SENS_0_EN unless it is in
+///     bypass mode. The cycle is triggered by the accelerometer and skipped while it is powered
+///     down. STATUS_MASTER latches the flags of the cycles until it is read.
+/// </summary>
+static void RunSensorHubCycle(HostI2cDevice *device)
+{
+    if ((device->registers[0][HOST_CTRL1_XL] & 0xF0) == 0) {
+        return;
+    }
+    uint8_t *hub = device->registers[2];
+    HostI2cDevice *slave = FindI2cDevice(hub[HOST_SLV0_ADD] >> 1);
+    if (slave == NULL || !slave->auxiliary) {
+        hub[HOST_STATUS_MASTER] |= HOST_SENS_HUB_ENDOP | HOST_SLAVE0_NACK;
+        return;
+    }
+    if ((hub[HOST_SLV0_ADD] & 0x01) == 0) {
+        WriteRegister(slave, hub[HOST_SLV0_SUBADD], hub[HOST_DATAWRITE_SLV0]);
+        hub[HOST_STATUS_MASTER] |= HOST_SENS_HUB_ENDOP | HOST_WR_ONCE_DONE;
+        return;
+    }
+
+    unsigned int count = hub[HOST_SLV0_CONFIG] & 0x07;
+    for (unsigned int i = 0; i < count; i++) {
+        hub[HOST_SENSOR_HUB_1 + i] = ReadRegister(slave, (uint8_t)(hub[HOST_SLV0_SUBADD] + i));
+    }
+    hub[HOST_STATUS_MASTER] |= HOST_SENS_HUB_ENDOP;
+    if ((hub[HOST_SLV0_CONFIG] & HOST_BATCH_EXT_SENS_0_EN) != 0 &&
+        (device->registers[0][HOST_FIFO_CTRL4] & 0x07) != 0) {
+        uint8_t *word = AppendFifoWord(device, HOST_SENSORHUB_SLAVE0_TAG);
+        if (word != NULL) {
+            memset(&word[1], 0, HOST_FIFO_WORD_SIZE - 1);
+            memcpy(&word[1], &hub[HOST_SENSOR_HUB_1], count < 6 ? count : 6);
+        }
+    }
+}
+
+// TIMESTAMP_EN of CTRL10_C, and the counter's tick
+#define HOST_TIMESTAMP_EN 0x20
+#define HOST_TIMESTAMP_TICK_NS 25000
+
+static bool IsTimestampRegister(const HostI2cDevice *device, uint8_t reg)
+{
+    return device->hasTimestamp && reg >= HOST_TIMESTAMP0 && reg <= HOST_TIMESTAMP3;
+}
+
+static uint8_t ReadTimestampRegister(HostI2cDevice *device, uint8_t reg)
+{
+    if (reg == HOST_TIMESTAMP0) {
+        bool enabled = (device->registers[0][HOST_CTRL10_C] & HOST_TIMESTAMP_EN) != 0;
+        device->timestampLatch =
+            enabled ? (uint32_t)((HostRuntime_GetTimeNs() - device->timestampSinceNs) /
+                                 HOST_TIMESTAMP_TICK_NS)
+                    : 0;
+    }
+    return (uint8_t)(device->timestampLatch >> (8 * (reg - HOST_TIMESTAMP0)));
+}
+
+static void ResetI2cDevice(HostI2cDevice *device)
+{
+    memset(device->registers, 0, sizeof(device->registers));
+    memcpy(device->registers[0], device->defaults, sizeof(device->defaults));
+    device->hubNextNs = 0;
+    if (device->fifo != NULL) {
+        ConfigureFifo(device);
+    }
+    UpdateInterruptPin(device);
+}
+
+static unsigned int GetRegisterBank(const HostI2cDevice *device, uint8_t reg)
+{
+    if (device->bankRegister < 0 || reg == device->bankRegister) {
+        return 0;
+    }
+    uint8_t select = device->registers[0][device->bankRegister];
+    return (select & 0x80) != 0 ? 1 : (select & 0x40) != 0 ? 2 : 0;
+}
+
+static void WriteRegister(HostI2cDevice *device, uint8_t reg, uint8_t value)
+{
+    unsigned int bank = GetRegisterBank(device, reg);
+    if (bank == 0 && reg == device->resetRegister && (value & device->resetMask) != 0) {
+        // Software reset and reboot complete instantly and clear themselves.
+        ResetI2cDevice(device);
+        return;
+    }
+    if (bank == 0 && device->hasTimestamp && reg == HOST_CTRL10_C &&
+        (value & ~device->registers[0][reg] & HOST_TIMESTAMP_EN) != 0) {
+        device->timestampSinceNs = HostRuntime_GetTimeNs();
+    }
+    device->registers[bank][reg] = value;
+    if (bank == 0 && device->fifo != NULL && reg >= HOST_FIFO_CTRL1 && reg <= HOST_FIFO_CTRL4) {
+        ConfigureFifo(device);
+    }
+    if (bank == 2 && device->hasSensorHub && reg == HOST_MASTER_CONFIG) {
+        // The first cycle comes with the next sensor hub period.
+        bool on = (value & HOST_MASTER_ON) != 0;
+        if (on && device->hubNextNs == 0) {
+            device->hubNextNs = HostRuntime_GetTimeNs() + GetSensorHubPeriodNs(device);
+        } else if (!on) {
+            device->hubNextNs = 0;
+        }
+    }
+}
+
+static uint8_t ReadRegister(HostI2cDevice *device, uint8_t reg)
+{
+    unsigned int bank = GetRegisterBank(device, reg);
+    if (bank == 0 && IsFifoRegister(device, reg)) {
+        return ReadFifoRegister(device, reg);
+    }
+    if (bank == 0 && IsTimestampRegister(device, reg)) {
+        return ReadTimestampRegister(device, reg);
+    }
+    uint8_t value = device->registers[bank][reg];
+    if (bank == 0 && IsClearOnRead(device, reg)) {
+        device->registers[0][reg] = 0;
+    }
+    if (bank == 2 && device->hasSensorHub && reg == HOST_STATUS_MASTER) {
+        device->registers[2][reg] = 0;
+    }
+    return value;
+}
+
+void HostI2c_SetRegisters(uint8_t address, uint8_t reg, const uint8_t *data, size_t length)
+{
+    HostI2cDevice *device = FindI2cDevice(address);
+    if (device == NULL || device->model != HostI2cModel_Registers) {
+        fprintf(stderr, "host runtime: no register device at I2C address 0x%02x\n", address);
+        return;
+    }
+    for (size_t i = 0; i < length; i++) {
+        device->registers[GetRegisterBank(device, reg)][reg] = data[i];
+        reg++;
+    }
+    UpdateInterruptPin(device);
+}
+
+uint64_t HostI2c_GetNextEventNs(void)
+{
+    uint64_t next = UINT64_MAX;
+    for (size_t i = 0; i < sizeof(i2cDevices) / sizeof(i2cDevices[0]); i++) {
+        const HostFifo *fifo = i2cDevices[i].fifo;
+        for (int sensor = 0; fifo != NULL && sensor < 2; sensor++) {
+            if (fifo->nextNs[sensor] != 0 && fifo->nextNs[sensor] < next) {
+                next = fifo->nextNs[sensor];
+            }
+        }
+        if (i2cDevices[i].hubNextNs != 0 && i2cDevices[i].hubNextNs < next) {
+            next = i2cDevices[i].hubNextNs;
+        }
+    }
+    return next;
+}
+
+void HostI2c_RunEvents(uint64_t nowNs)
+{
+    for (size_t i = 0; i < sizeof(i2cDevices) / sizeof(i2cDevices[0]); i++) {
+        HostI2cDevice *device = &i2cDevices[i];
+        HostFifo *fifo = device->fifo;
+        if (fifo == NULL) {
+            continue;
+        }
+        for (int sensor = 0; sensor < 2; sensor++) {
+            while (fifo->nextNs[sensor] != 0 && fifo->nextNs[sensor] <= nowNs) {
+                BatchFifoSample(device, sensor);
+                fifo->nextNs[sensor] += (uint64_t)(1e9 / fifoBatchRateHz[fifo->rate[sensor]]);
+            }
+        }
+        while (device->hubNextNs != 0 && device->hubNextNs <= nowNs) {
+            RunSensorHubCycle(device);
+            device->hubNextNs += GetSensorHubPeriodNs(device);
+        }
+        UpdateInterruptPin(device);
+    }
+}
+
+void HostI2c_QueueMessage(uint8_t address, const uint8_t *data, size_t length)
+{
+    HostI2cDevice *device = FindI2cDevice(address);
+    if (device == NULL || device->model != HostI2cModel_Messages) {
+        fprintf(stderr, "host runtime: no message device at I2C address 0x%02x\n", address);
+        return;
+    }
+    if (device->messageCount == HOST_I2C_MESSAGE_QUEUE) {
+        fprintf(stderr, "host runtime: %s message queue full, message dropped\n", device->name);
+        return;
+    }
+
+    size_t index = (device->messageHead + device->messageCount) % HOST_I2C_MESSAGE_QUEUE;
+    device->messages[index].data = malloc(length);
+    memcpy(device->messages[index].data, data, length);
+    device->messages[index].length = length;
+    device->messageCount++;
+    HostGpio_Drive(device->readyPin, false);
+}
+
+/// <summary>
+///     Advances the virtual clock by the time the transfer takes on the bus: a start and
+///     address byte plus the data bytes, nine clocks per byte.
+/// </summary>
+static void AccountI2cTransfer(size_t length)
+{
+    uint64_t ns = (uint64_t)(length + 1) * 9 * 1000000000ULL / i2cBus.speedHz;
+    i2cBus.transfers++;
+    i2cBus.bytes += length;
+    i2cBus.busNs += ns;
+    HostRuntime_Sleep(ns);
+}
+
+/// <summary>
+///     Answers a Request_Message (0x06) for Fw_Version_Info (0x83) written to a message device
+///     with a Fw_Version_Info message, behind the pad byte the bus returns in front of every
+///     message. Other messages written to it are ignored.
+/// </summary>
+static void MessageDeviceWrite(HostI2cDevice *device, const uint8_t *data, size_t length)
+{
+    if (length < 5 || data[3] != 0x06 || data[4] != 0x83) {
+        return;
+    }
+    static const char version[] = "1.3.14;p:HillstarV01;x:Hillstar;DSP:ID9000r2963";
+    uint8_t answer[1 + 0x84] = {0};
+    answer[1] = 0x84; // size
+    answer[4] = 0x83; // Fw_Version_Info
+    answer[5] = 0xAA; // FwValid, valid GestIC library
+    memcpy(&answer[13], version, sizeof(version));
+    HostI2c_QueueMessage(device->address, answer, sizeof(answer));
+}
+
+static void DeviceWrite(HostI2cDevice *device, const uint8_t *data, size_t length)
+{
+    if (device->model == HostI2cModel_Messages) {
+        MessageDeviceWrite(device, data, length);
+        return;
+    }
+    if (length == 0) {
+        return;
+    }
+    device->pointer = data[0];
+    for (size_t i = 1; i < length; i++) {
+        WriteRegister(device, device->pointer++, data[i]);
+    }
+    UpdateInterruptPin(device);
+}
+
+static void DeviceRead(HostI2cDevice *device, uint8_t *buffer, size_t length)
+{
+    if (device->model == HostI2cModel_Registers) {
+        for (size_t i = 0; i < length; i++) {
+            buffer[i] = ReadRegister(device, device->pointer++);
+            if (device->fifo != NULL && device->pointer == HOST_FIFO_DATA_OUT_Z_H + 1) {
+                // The FIFO output registers roll over so that words can be read in one burst.
+                device->pointer = HOST_FIFO_DATA_OUT_TAG;
+            }
+        }
+        UpdateInterruptPin(device);
+        return;
+    }
+
+    memset(buffer, 0, length);
+    if (device->messageCount == 0) {
+        return;
+    }
+    size_t index = device->messageHead;
+    size_t copy = device->messages[index].length < length ? device->messages[index].length : length;
+    memcpy(buffer, device->messages[index].data, copy);
+    free(device->messages[index].data);
+    device->messageHead = (device->messageHead + 1) % HOST_I2C_MESSAGE_QUEUE;
+    device->messageCount--;
+    if (device->messageCount == 0) {
+        HostGpio_Drive(device->readyPin, true);
+    }
+}
+
+void HostI2c_HoldBus(uint8_t address)
+{
+    if (FindI2cDevice(address) == NULL) {
+        fprintf(stderr, "host runtime: no device at I2C address 0x%02x\n", address);
+        return;
+    }
+    i2cBus.stuck = true;
+    i2cBus.stuckResetPin = FindI2cDevice(address)->resetPin;
+}
+
+static HostI2cDevice *GetI2cTarget(int fd, I2C_DeviceAddress address)
+{
+    if (FindHandle(fd, HostHandle_I2c) == NULL) {
+        return NULL;
+    }
+    if (i2cBus.stuck) {
+        // No start condition while SDA is held low, the transfer times out.
+        HostRuntime_Sleep((uint64_t)i2cBus.timeoutMs * 1000000ULL);
+        errno = ETIMEDOUT;
+        return NULL;
+    }
+    HostI2cDevice *device = FindI2cDevice((uint8_t)address);
+    if (device == NULL || device->auxiliary) {
+        // No acknowledge from the address.
+        AccountI2cTransfer(0);
+        errno = ENXIO;
+    }
+    return device;
+}
+
+int I2CMaster_Open(I2C_InterfaceId id)
+{
+    return OpenHandle(HostHandle_I2c, id);
+}
+
+int I2CMaster_SetBusSpeed(int fd, uint32_t speedInHz)
+{
+    if (FindHandle(fd, HostHandle_I2c) == NULL) {
+        return -1;
+    }
+    if (speedInHz == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    i2cBus.speedHz = speedInHz;
+    return 0;
+}
+
+int I2CMaster_SetTimeout(int fd, uint32_t timeoutInMs)
+{
+    if (FindHandle(fd, HostHandle_I2c) == NULL) {
+        return -1;
+    }
+    i2cBus.timeoutMs = timeoutInMs;
+    return 0;
+}
+
+int I2CMaster_SetDefaultTargetAddress(int fd, I2C_DeviceAddress address)
+{
+    return FindHandle(fd, HostHandle_I2c) == NULL ? -1 : 0;
+}
+
+ssize_t I2CMaster_Write(int fd, I2C_DeviceAddress address, const uint8_t *data, size_t length)
+{
+    HostI2cDevice *device = GetI2cTarget(fd, address);
+    if (device == NULL) {
+        return -1;
+    }
+    DeviceWrite(device, data, length);
+    AccountI2cTransfer(length);
+    return (ssize_t)length;
+}
+
+ssize_t I2CMaster_Read(int fd, I2C_DeviceAddress address, uint8_t *buffer, size_t maxLength)
+{
+    HostI2cDevice *device = GetI2cTarget(fd, address);
+    if (device == NULL) {
+        return -1;
+    }
+    DeviceRead(device, buffer, maxLength);
+    AccountI2cTransfer(maxLength);
+    return (ssize_t)maxLength;
+}
+
+ssize_t I2CMaster_WriteThenRead(int fd, I2C_DeviceAddress address, const uint8_t *writeData,
+                                size_t lenWriteData, uint8_t *readData, size_t lenReadData)
+{
+    HostI2cDevice *device = GetI2cTarget(fd, address);
+    if (device == NULL) {
+        return -1;
+    }
+    DeviceWrite(device, writeData, lenWriteData);
+    DeviceRead(device, readData, lenReadData);
+    // One repeated start instead of a stop and a new start.
+    AccountI2cTransfer(lenWriteData + lenReadData + 1);
+    return (ssize_t)(lenWriteData + lenReadData);
+}
+
+int PWM_Open(PWM_ControllerId pwm)
+{
+    int fd = OpenHandle(HostHandle_Pwm, (int)pwm);
+    if (fd >= 0) {
+        HostHandle *handle = FindHandle(fd, HostHandle_Pwm);
+        memset(pwmStates[handle - handles], 0, sizeof(pwmStates[0]));
+    }
+    return fd;
+}
+
+int PWM_Apply(int pwmFd, PWM_ChannelId pwmChannel, const PwmState *newState)
+{
+    HostHandle *handle = FindHandle(pwmFd, HostHandle_Pwm);
+    if (handle == NULL) {
+        return -1;
+    }
+    if (pwmChannel >= HOST_PWM_CHANNELS || newState->dutyCycle_nsec > newState->period_nsec) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    PwmState *state = &pwmStates[handle - handles][pwmChannel];
+    if (memcmp(state, newState, sizeof(PwmState)) != 0) {
+        *state = *newState;
+        HostRuntime_Output("pwm %d %u %u/%u %s%s", handle->id, pwmChannel,
+                           newState->dutyCycle_nsec, newState->period_nsec,
+                           newState->enabled ? "on" : "off",
+                           newState->polarity == PWM_Polarity_Inversed ? " inversed" : "");
+    }
+    return 0;
+}
+
+static void RemoveTemporaryStorage(void)
+{
+    if (storageIsTemporary) {
+        unlink(storagePath);
+    }
+}
+
+int Storage_OpenMutableFile(void)
+{
+    if (storagePath[0] == '\0') {
+        const char *path = getenv("MAGICLOCKBOX_STORAGE");
+        if (path != NULL && path[0] != '\0') {
+            snprintf(storagePath, sizeof(storagePath), "%s", path);
+        } else {
+            // A fresh, empty file per run keeps runs independent of each other.
+            snprintf(storagePath, sizeof(storagePath), "/tmp/magiclockbox-storage-XXXXXX");
+            int fd = mkstemp(storagePath);
+            if (fd < 0) {
+                storagePath[0] = '\0';
+                return -1;
+            }
+            close(fd);
+            storageIsTemporary = true;
+            atexit(RemoveTemporaryStorage);
+        }
+    }
+    return open(storagePath, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+}
+
+int Storage_DeleteMutableFile(void)
+{
+    if (storagePath[0] != '\0' && unlink(storagePath) != 0 && errno != ENOENT) {
+        return -1;
+    }
+    return 0;
+}
+
+int Storage_OpenFileInImagePackage(const char *relativePath)
+{
+    const char *imageDir = getenv("MAGICLOCKBOX_IMAGE_DIR");
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", imageDir != NULL ? imageDir : ".", relativePath);
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+int WifiConfig_GetCurrentNetwork(WifiConfig_ConnectedNetwork *connectedNetwork)
+{
+    errno = ENOTCONN;
+    return -1;
+}
+
+int Networking_IsNetworkingReady(bool *outIsNetworkingReady)
+{
+    *outIsNetworkingReady = true;
+    return 0;
+}
+
+static void PrintI2cSummary(void)
+{
+    fflush(stdout);
+    fprintf(stderr, "host runtime: i2c %llu transfers, %llu bytes, %.3f ms bus time\n",
+            (unsigned long long)i2cBus.transfers, (unsigned long long)i2cBus.bytes,
+            (double)i2cBus.busNs / 1e6);
+}
+
+__attribute__((constructor)) static void InitializeHostDevices(void)
+{
+    for (int i = 0; i < HOST_MAX_HANDLES; i++) {
+        handles[i].fd = -1;
+    }
+
+    // Undriven lines read high, as with the pull-ups of the buttons.
+    for (int pin = 0; pin < HOST_GPIO_COUNT; pin++) {
+        gpioLines[pin].external = true;
+        gpioLines[pin].edgeFd = -1;
+    }
+
+    HostI2cDevice *lsm6dso = FindI2cDevice(0x6A);
+    lsm6dso->defaults[0x0F] = 0x6C; // WHO_AM_I
+    lsm6dso->defaults[0x12] = 0x04; // CTRL3_C, IF_INC
+    // Latched WAKE_UP_SRC, TAP_SRC, D6D_SRC and ALL_INT_SRC clear when read.
+    for (uint8_t reg = 0x1A; reg <= 0x1D; reg++) {
+        lsm6dso->clearOnRead[reg / 8] |= (uint8_t)(1U << (reg % 8));
+    }
+    // So are EMB_FUNC_STATUS and the FSM_STATUS_A/B of the main page.
+    for (uint8_t reg = 0x35; reg <= 0x37; reg++) {
+        lsm6dso->clearOnRead[reg / 8] |= (uint8_t)(1U << (reg % 8));
+    }
+    ResetI2cDevice(lsm6dso);
+
+    // 1013.25 hPa and 23 degrees at rest.
+    HostI2cDevice *lps22hh = FindI2cDevice(0x5D);
+    lps22hh->defaults[0x0F] = 0xB3; // WHO_AM_I
+    lps22hh->defaults[0x11] = 0x10; // CTRL_REG2, IF_ADD_INC
+    static const uint8_t lps22hhOutputs[] = {0x00, 0x54, 0x3F, 0xFC, 0x08};
+    memcpy(&lps22hh->defaults[0x28], lps22hhOutputs, sizeof(lps22hhOutputs));
+    ResetI2cDevice(lps22hh);
+
+    atexit(PrintI2cSummary);
+}
@@ -0,0 +1,192 @@
+/* Host stand-in for azure_iot_utilities.c, see Host/README.md. The client is always
+   "connected"; outgoing traffic is written to stdout and incoming twin updates and direct
+   method calls come from the replayed trace. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <azureiot/iothub_device_client_ll.h>
+#include "../azure_iot_utilities.h"
+#include "host_runtime.h"
+
+#define HOST_AZURE_IOT_QUEUE 16
+
+IOTHUB_DEVICE_CLIENT_LL_HANDLE iothubClientHandle = NULL;
+
+static char hostClient;
+static MessageReceivedFnType messageReceivedCb;
+static TwinUpdateFnType twinUpdateCb;
+static DirectMethodCallFnType directMethodCb;
+static ConnectionStatusFnType connectionStatusCb;
+static MessageDeliveryConfirmationFnType messageConfirmationCb;
+static DeviceTwinDeliveryConfirmationFnType twinConfirmationCb;
+
+/// <summary>
+///     Cloud to device traffic waiting for the next AzureIoT_DoPeriodicTasks call, which is
+///     where the SDK delivers it on the device as well.
+/// </summary>
+static struct {
+    char *name;
+    char *payload;
+} incoming[HOST_AZURE_IOT_QUEUE];
+static size_t incomingCount;
+
+static void QueueIncoming(const char *name, const char *payload)
+{
+    if (incomingCount == HOST_AZURE_IOT_QUEUE) {
+        HostRuntime_Output("cloud dropped %s", name != NULL ? name : "twin update");
+        return;
+    }
+    incoming[incomingCount].name = name != NULL ? strdup(name) : NULL;
+    incoming[incomingCount].payload = strdup(payload);
+    incomingCount++;
+}
+
+void HostAzureIoT_QueueTwinUpdate(const char *json)
+{
+    QueueIncoming(NULL, json);
+}
+
+void HostAzureIoT_QueueDirectMethod(const char *name, const char *payload)
+{
+    QueueIncoming(name, payload);
+}
+
+static void DeliverTwinUpdate(const char *json)
+{
+    JSON_Value *rootProperties = json_parse_string(json);
+    if (rootProperties == NULL) {
+        HostRuntime_Output("cloud invalid twin document %s", json);
+        return;
+    }
+
+    JSON_Object *rootObject = json_value_get_object(rootProperties);
+    JSON_Object *desiredProperties = json_object_dotget_object(rootObject, "desired");
+    if (desiredProperties == NULL) {
+        desiredProperties = rootObject;
+    }
+    if (twinUpdateCb != NULL) {
+        twinUpdateCb(desiredProperties);
+    }
+    json_value_free(rootProperties);
+}
+
+static void DeliverDirectMethod(const char *name, const char *payload)
+{
+    if (directMethodCb == NULL) {
+        return;
+    }
+
+    char *response = NULL;
+    size_t responseSize = 0;
+    int status = directMethodCb(name, payload, strlen(payload), &response, &responseSize);
+    HostRuntime_Output("cloud method %s status %d %.*s", name, status, (int)responseSize,
+                       response != NULL ? response : "");
+    free(response);
+}
+
+bool AzureIoT_SetupClient(void)
+{
+    if (iothubClientHandle != NULL) {
+        return true;
+    }
+    iothubClientHandle = &hostClient;
+    if (connectionStatusCb != NULL) {
+        connectionStatusCb(true);
+    }
+    return true;
+}
+
+void AzureIoT_DestroyClient(void)
+{
+    iothubClientHandle = NULL;
+}
+
+void AzureIoT_DoPeriodicTasks(void)
+{
+    // Take the queue first; handlers may trigger more traffic.
+    size_t count = incomingCount;
+    incomingCount = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (incoming[i].name == NULL) {
+            DeliverTwinUpdate(incoming[i].payload);
+        } else {
+            DeliverDirectMethod(incoming[i].name, incoming[i].payload);
+        }
+        free(incoming[i].name);
+        free(incoming[i].payload);
+    }
+}
+
+void AzureIoT_SendMessage(const char *messagePayload)
+{
+    if (iothubClientHandle == NULL) {
+        return;
+    }
+    HostRuntime_Output("cloud message %s", messagePayload);
+    if (messageConfirmationCb != NULL) {
+        messageConfirmationCb(true);
+    }
+}
+
+void AzureIoT_TwinReportStateJson(char *reportedPropertiesString, size_t reportedPropertiesSize)
+{
+    if (iothubClientHandle == NULL) {
+        return;
+    }
+    HostRuntime_Output("cloud reported %.*s", (int)reportedPropertiesSize,
+                       reportedPropertiesString);
+    if (twinConfirmationCb != NULL) {
+        twinConfirmationCb(204);
+    }
+}
+
+void AzureIoT_TwinReportState(const char *propertyName, size_t propertyValue)
+{
+    if (iothubClientHandle == NULL) {
+        return;
+    }
+    HostRuntime_Output("cloud reported {\"%s\":%zu}", propertyName, propertyValue);
+    if (twinConfirmationCb != NULL) {
+        twinConfirmationCb(204);
+    }
+}
+
+void AzureIoT_SetMessageReceivedCallback(MessageReceivedFnType callback)
+{
+    messageReceivedCb = callback;
+}
+
+void AzureIoT_SetDeviceTwinUpdateCallback(TwinUpdateFnType callback)
+{
+    twinUpdateCb = callback;
+}
+
+void AzureIoT_SetDirectMethodCallback(DirectMethodCallFnType callback)
+{
+    directMethodCb = callback;
+}
+
+void AzureIoT_SetConnectionStatusCallback(ConnectionStatusFnType callback)
+{
+    connectionStatusCb = callback;
+}
+
+void AzureIoT_SetMessageConfirmationCallback(MessageDeliveryConfirmationFnType callback)
+{
+    messageConfirmationCb = callback;
+}
+
+void AzureIoT_SetDeviceTwinDeliveryConfirmationCallback(
+    DeviceTwinDeliveryConfirmationFnType callback)
+{
+    twinConfirmationCb = callback;
+}
+
+bool AzureIoT_Initialize(void)
+{
+    return true;
+}
+
+void AzureIoT_Deinitialize(void)
+{
+}
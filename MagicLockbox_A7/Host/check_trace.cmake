@@ -0,0 +1,38 @@
+#  Copyright (c) Microsoft Corporation. All rights reserved.
+#  Licensed under the MIT License.
+
+# Replays a trace on the host runtime and compares its out lines with the expected ones, see
+# Host/README.md. Run with cmake -DAPP=<executable> -DTRACE=<trace> -DEXPECTED=<file>
+# -DACTUAL=<file> [-DLOG_FILTER=<regex>] -P check_trace.cmake. With LOG_FILTER the log
+# lines matching it are compared as well.
+
+IF(LOG_FILTER)
+    SET(LOG 1)
+ELSE()
+    SET(LOG 0)
+ENDIF()
+EXECUTE_PROCESS(
+    COMMAND ${CMAKE_COMMAND} -E env MAGICLOCKBOX_LOG=${LOG} MAGICLOCKBOX_TRACE=${TRACE} ${APP} test
+    OUTPUT_FILE ${ACTUAL}.log
+    ERROR_VARIABLE SUMMARY
+    RESULT_VARIABLE EXIT_CODE)
+IF(NOT EXIT_CODE EQUAL 0)
+    MESSAGE(FATAL_ERROR "${APP} exited with ${EXIT_CODE} replaying ${TRACE}:\n${SUMMARY}")
+ENDIF()
+
+IF(LOG_FILTER)
+    SET(PATTERN " out |${LOG_FILTER}")
+ELSE()
+    SET(PATTERN " out ")
+ENDIF()
+EXECUTE_PROCESS(
+    COMMAND grep -E ${PATTERN} ${ACTUAL}.log
+    OUTPUT_FILE ${ACTUAL})
+
+EXECUTE_PROCESS(
+    COMMAND diff -u ${EXPECTED} ${ACTUAL}
+    OUTPUT_VARIABLE DIFFERENCES
+    RESULT_VARIABLE DIFF_CODE)
+IF(NOT DIFF_CODE EQUAL 0)
+    MESSAGE(FATAL_ERROR "${TRACE} replays differently from ${EXPECTED}:\n${DIFFERENCES}")
+ENDIF()
@@ -0,0 +1,650 @@
+/* Virtual clock host runtime, see Host/README.md */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <applibs/log.h>
+#include "host_runtime.h"
+
+/// <summary>
+///     Maximum number of timerfds open at the same time.
+/// </summary>
+#define HOST_RUNTIME_MAX_TIMERS 16
+
+/// <summary>
+///     CLOCK_REALTIME at the start of the run, 2020-01-01T00:00:00Z, so that runs do not depend
+///     on the date either.
+/// </summary>
+#define HOST_RUNTIME_REALTIME_START_S 1577836800ULL
+
+typedef enum {
+    TraceRecord_Gpio,
+    TraceRecord_I2cRegisters,
+    TraceRecord_I2cMessage,
+    TraceRecord_I2cStuck,
+    TraceRecord_Twin,
+    TraceRecord_Method,
+} TraceRecordType;
+
+typedef struct {
+    uint64_t timeNs;
+    TraceRecordType type;
+    unsigned int address;
+    unsigned int value;
+    uint8_t *data;
+    size_t length;
+    char *text;
+    char *payload;
+} TraceRecord;
+
+/// <summary>
+///     A timerfd is an eventfd which is written when the virtual clock passes its deadline.
+///     deadlineNs is 0 while disarmed.
+/// </summary>
+typedef struct {
+    int fd;
+    uint64_t deadlineNs;
+    uint64_t intervalNs;
+} HostTimer;
+
+static struct {
+    uint64_t nowNs;
+    uint64_t endNs;
+    bool finished;
+    bool logEnabled;
+    bool atLineStart;
+    TraceRecord *records;
+    size_t recordCount;
+    size_t nextRecord;
+    HostTimer timers[HOST_RUNTIME_MAX_TIMERS];
+    uint64_t epollWaits;
+    uint64_t timerExpirations;
+    struct timespec wallStart;
+    clock_t cpuStart;
+} host = {.nowNs = HOST_RUNTIME_CLOCK_START_NS, .atLineStart = true};
+
+static void FormatTime(char *buffer, size_t size)
+{
+    uint64_t us = (host.nowNs - HOST_RUNTIME_CLOCK_START_NS) / 1000;
+    snprintf(buffer, size, "[%6llu.%06llu]", (unsigned long long)(us / 1000000),
+             (unsigned long long)(us % 1000000));
+}
+
+void Log_DebugVarArgs(const char *fmt, va_list args)
+{
+    if (!host.logEnabled) {
+        return;
+    }
+
+    char message[512];
+    int length = vsnprintf(message, sizeof(message), fmt, args);
+    if (length <= 0) {
+        return;
+    }
+
+    if (host.atLineStart) {
+        char time[24];
+        FormatTime(time, sizeof(time));
+        fputs(time, stdout);
+        fputc(' ', stdout);
+    }
+    fputs(message, stdout);
+    size_t written = strlen(message);
+    host.atLineStart = written > 0 && message[written - 1] == '\n';
+}
+
+void Log_Debug(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    Log_DebugVarArgs(fmt, args);
+    va_end(args);
+}
+
+void HostRuntime_Output(const char *fmt, ...)
+{
+    char time[24];
+    FormatTime(time, sizeof(time));
+    if (!host.atLineStart) {
+        fputc('\n', stdout);
+        host.atLineStart = true;
+    }
+    printf("%s out ", time);
+
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    fputc('\n', stdout);
+}
+
+bool HostRuntime_IsLogEnabled(void)
+{
+    return host.logEnabled;
+}
+
+uint64_t HostRuntime_GetTimeNs(void)
+{
+    return host.nowNs;
+}
+
+static void ApplyTraceRecord(const TraceRecord *record)
+{
+    switch (record->type) {
+    case TraceRecord_Gpio:
+        HostGpio_Drive((int)record->address, record->value != 0);
+        break;
+    case TraceRecord_I2cRegisters:
+        HostI2c_SetRegisters((uint8_t)record->address, (uint8_t)record->value, record->data,
+                             record->length);
+        break;
+    case TraceRecord_I2cMessage:
+        HostI2c_QueueMessage((uint8_t)record->address, record->data, record->length);
+        break;
+    case TraceRecord_I2cStuck:
+        HostI2c_HoldBus((uint8_t)record->address);
+        break;
+    case TraceRecord_Twin:
+        HostAzureIoT_QueueTwinUpdate(record->text);
+        break;
+    case TraceRecord_Method:
+        HostAzureIoT_QueueDirectMethod(record->text, record->payload);
+        break;
+    }
+}
+
+static int GetEarliestTimer(void)
+{
+    int earliest = -1;
+    for (int i = 0; i < HOST_RUNTIME_MAX_TIMERS; i++) {
+        if (host.timers[i].fd >= 0 && host.timers[i].deadlineNs != 0 &&
+            (earliest < 0 || host.timers[i].deadlineNs < host.timers[earliest].deadlineNs)) {
+            earliest = i;
+        }
+    }
+    return earliest;
+}
+
+static void FireTimer(HostTimer *timer)
+{
+    uint64_t expirations = 1;
+    if (timer->intervalNs != 0) {
+        uint64_t missed = (host.nowNs - timer->deadlineNs) / timer->intervalNs;
+        expirations += missed;
+        timer->deadlineNs += (missed + 1) * timer->intervalNs;
+    } else {
+        timer->deadlineNs = 0;
+    }
+
+    host.timerExpirations += expirations;
+    if (write(timer->fd, &expirations, sizeof(expirations)) < 0) {
+        fprintf(stderr, "host runtime: could not signal timerfd %d: %s\n", timer->fd,
+                strerror(errno));
+    }
+}
+
+/// <summary>
+///     Returns the virtual time of the next trace record, device model event or timer expiry,
+///     or UINT64_MAX.
+/// </summary>
+static uint64_t GetNextActivityNs(void)
+{
+    uint64_t next = UINT64_MAX;
+    if (host.nextRecord < host.recordCount) {
+        next = HOST_RUNTIME_CLOCK_START_NS + host.records[host.nextRecord].timeNs;
+    }
+    uint64_t deviceNs = HostI2c_GetNextEventNs();
+    if (deviceNs < next) {
+        next = deviceNs;
+    }
+    int timer = GetEarliestTimer();
+    if (timer >= 0 && host.timers[timer].deadlineNs < next) {
+        next = host.timers[timer].deadlineNs;
+    }
+    return next;
+}
+
+/// <summary>
+///     Moves the virtual clock to targetNs. Trace records, device model events and timer
+///     expiries on the way are processed in time order; at the same time a trace record goes
+///     first and a timer last, and timers due at the same time fire in creation order.
+/// </summary>
+static void AdvanceClockTo(uint64_t targetNs)
+{
+    for (;;) {
+        uint64_t recordNs = UINT64_MAX;
+        if (host.nextRecord < host.recordCount) {
+            recordNs = HOST_RUNTIME_CLOCK_START_NS + host.records[host.nextRecord].timeNs;
+        }
+        int timer = GetEarliestTimer();
+        uint64_t timerNs = timer >= 0 ? host.timers[timer].deadlineNs : UINT64_MAX;
+        uint64_t deviceNs = HostI2c_GetNextEventNs();
+
+        if (recordNs <= targetNs && recordNs <= timerNs && recordNs <= deviceNs) {
+            if (host.nowNs < recordNs) {
+                host.nowNs = recordNs;
+            }
+            ApplyTraceRecord(&host.records[host.nextRecord++]);
+        } else if (deviceNs <= targetNs && deviceNs <= timerNs) {
+            if (host.nowNs < deviceNs) {
+                host.nowNs = deviceNs;
+            }
+            HostI2c_RunEvents(host.nowNs);
+        } else if (timerNs <= targetNs) {
+            if (host.nowNs < timerNs) {
+                host.nowNs = timerNs;
+            }
+            FireTimer(&host.timers[timer]);
+        } else {
+            break;
+        }
+    }
+
+    if (host.nowNs < targetNs) {
+        host.nowNs = targetNs;
+    }
+}
+
+void HostRuntime_Sleep(uint64_t ns)
+{
+    AdvanceClockTo(host.nowNs + ns);
+}
+
+static uint64_t TimespecToNs(const struct timespec *ts)
+{
+    return (uint64_t)ts->tv_sec * 1000000000ULL + (uint64_t)ts->tv_nsec;
+}
+
+static void NsToTimespec(uint64_t ns, struct timespec *ts)
+{
+    ts->tv_sec = (time_t)(ns / 1000000000ULL);
+    ts->tv_nsec = (long)(ns % 1000000000ULL);
+}
+
+// The functions below replace the libc functions of the same name for the application code.
+// Calls made from inside libc itself keep using the real clock.
+
+int clock_gettime(clockid_t clockId, struct timespec *tp)
+{
+    switch (clockId) {
+    case CLOCK_MONOTONIC:
+    case CLOCK_MONOTONIC_RAW:
+    case CLOCK_MONOTONIC_COARSE:
+    case CLOCK_BOOTTIME:
+        NsToTimespec(host.nowNs, tp);
+        return 0;
+    case CLOCK_REALTIME:
+    case CLOCK_REALTIME_COARSE:
+        NsToTimespec(HOST_RUNTIME_REALTIME_START_S * 1000000000ULL + host.nowNs -
+                         HOST_RUNTIME_CLOCK_START_NS,
+                     tp);
+        return 0;
+    default:
+        return (int)syscall(SYS_clock_gettime, clockId, tp);
+    }
+}
+
+int nanosleep(const struct timespec *request, struct timespec *remaining)
+{
+    if (request == NULL || request->tv_nsec < 0 || request->tv_nsec >= 1000000000L ||
+        request->tv_sec < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    HostRuntime_Sleep(TimespecToNs(request));
+    if (remaining != NULL) {
+        remaining->tv_sec = 0;
+        remaining->tv_nsec = 0;
+    }
+    return 0;
+}
+
+int clock_nanosleep(clockid_t clockId, int flags, const struct timespec *request,
+                    struct timespec *remaining)
+{
+    if (request == NULL || request->tv_nsec < 0 || request->tv_nsec >= 1000000000L) {
+        return EINVAL;
+    }
+
+    uint64_t requestNs = TimespecToNs(request);
+    if ((flags & TIMER_ABSTIME) != 0) {
+        AdvanceClockTo(requestNs);
+    } else {
+        HostRuntime_Sleep(requestNs);
+    }
+    if (remaining != NULL && (flags & TIMER_ABSTIME) == 0) {
+        remaining->tv_sec = 0;
+        remaining->tv_nsec = 0;
+    }
+    return 0;
+}
+
+int usleep(useconds_t us)
+{
+    HostRuntime_Sleep((uint64_t)us * 1000);
+    return 0;
+}
+
+static HostTimer *FindTimer(int fd)
+{
+    for (int i = 0; i < HOST_RUNTIME_MAX_TIMERS; i++) {
+        if (host.timers[i].fd == fd && fd >= 0) {
+            return &host.timers[i];
+        }
+    }
+    return NULL;
+}
+
+int timerfd_create(int clockId, int flags)
+{
+    HostTimer *timer = NULL;
+    for (int i = 0; timer == NULL && i < HOST_RUNTIME_MAX_TIMERS; i++) {
+        if (host.timers[i].fd < 0) {
+            timer = &host.timers[i];
+        }
+    }
+    if (timer == NULL) {
+        errno = EMFILE;
+        return -1;
+    }
+
+    // Always non-blocking: a blocking read of an unexpired timer would never return.
+    int fd = eventfd(0, EFD_NONBLOCK | ((flags & TFD_CLOEXEC) != 0 ? EFD_CLOEXEC : 0));
+    if (fd < 0) {
+        return -1;
+    }
+
+    timer->fd = fd;
+    timer->deadlineNs = 0;
+    timer->intervalNs = 0;
+    return fd;
+}
+
+int timerfd_settime(int fd, int flags, const struct itimerspec *newValue,
+                    struct itimerspec *oldValue)
+{
+    HostTimer *timer = FindTimer(fd);
+    if (timer == NULL || newValue == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (oldValue != NULL) {
+        NsToTimespec(timer->deadlineNs > host.nowNs ? timer->deadlineNs - host.nowNs : 0,
+                     &oldValue->it_value);
+        NsToTimespec(timer->intervalNs, &oldValue->it_interval);
+    }
+
+    // Like the kernel, setting the timer discards expirations which have not been read.
+    uint64_t pending;
+    while (read(fd, &pending, sizeof(pending)) > 0) {
+    }
+
+    uint64_t valueNs = TimespecToNs(&newValue->it_value);
+    timer->intervalNs = TimespecToNs(&newValue->it_interval);
+    if (valueNs == 0) {
+        timer->deadlineNs = 0;
+    } else if ((flags & TFD_TIMER_ABSTIME) != 0) {
+        timer->deadlineNs = valueNs;
+    } else {
+        timer->deadlineNs = host.nowNs + valueNs;
+    }
+    return 0;
+}
+
+int close(int fd)
+{
+    HostTimer *timer = FindTimer(fd);
+    if (timer != NULL) {
+        timer->fd = -1;
+        timer->deadlineNs = 0;
+    }
+    HostGpio_ForgetFd(fd);
+    return (int)syscall(SYS_close, fd);
+}
+
+/// <summary>
+///     Returns the events which are ready without blocking. When none are, the virtual clock
+///     jumps straight to the next trace record or timer expiry instead of sleeping. At the end
+///     of the run SIGTERM is raised, so the application shuts down as it does on the device.
+/// </summary>
+int epoll_wait(int epollFd, struct epoll_event *events, int maxEvents, int timeout)
+{
+    host.epollWaits++;
+    uint64_t timeoutNs =
+        timeout < 0 ? UINT64_MAX : host.nowNs + (uint64_t)timeout * 1000000ULL;
+
+    for (;;) {
+        int ready = epoll_pwait(epollFd, events, maxEvents, 0, NULL);
+        if (ready != 0 || timeout == 0) {
+            return ready;
+        }
+
+        if (host.finished) {
+            errno = EINTR;
+            return -1;
+        }
+
+        uint64_t next = GetNextActivityNs();
+        if (next > host.endNs && host.endNs <= timeoutNs) {
+            AdvanceClockTo(host.endNs);
+            host.finished = true;
+            raise(SIGTERM);
+            errno = EINTR;
+            return -1;
+        }
+        if (next > timeoutNs) {
+            AdvanceClockTo(timeoutNs);
+            return 0;
+        }
+        AdvanceClockTo(next);
+    }
+}
+
+static void TraceError(const char *path, unsigned int line, const char *message)
+{
+    fprintf(stderr, "host runtime: %s:%u: %s\n", path, line, message);
+    exit(2);
+}
+
+static bool ParseNumber(const char *token, unsigned long max, unsigned long *value)
+{
+    char *end;
+    errno = 0;
+    *value = strtoul(token, &end, 0);
+    return token[0] != '\0' && *end == '\0' && errno == 0 && *value <= max;
+}
+
+static const char *SkipSpaces(const char *text)
+{
+    while (*text == ' ' || *text == '\t') {
+        text++;
+    }
+    return text;
+}
+
+/// <summary>
+///     Parses the byte list which makes up the rest of a trace line.
+/// </summary>
+static void ParseTraceBytes(const char *path, unsigned int line, char **savePtr,
+                            TraceRecord *record)
+{
+    char *token;
+    while ((token = strtok_r(NULL, " \t", savePtr)) != NULL) {
+        unsigned long byte;
+        if (!ParseNumber(token, 0xFF, &byte)) {
+            TraceError(path, line, "invalid byte");
+        }
+        record->data = realloc(record->data, record->length + 1);
+        record->data[record->length++] = (uint8_t)byte;
+    }
+    if (record->length == 0) {
+        TraceError(path, line, "missing data bytes");
+    }
+}
+
+static void LoadTrace(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "host runtime: cannot open trace %s: %s\n", path, strerror(errno));
+        exit(2);
+    }
+
+    char *lineBuffer = NULL;
+    size_t lineSize = 0;
+    unsigned int lineNumber = 0;
+    uint64_t lastNs = 0;
+    bool ended = false;
+
+    while (getline(&lineBuffer, &lineSize, file) != -1) {
+        lineNumber++;
+        lineBuffer[strcspn(lineBuffer, "#\r\n")] = '\0';
+
+        char *savePtr;
+        char *token = strtok_r(lineBuffer, " \t", &savePtr);
+        if (token == NULL) {
+            continue;
+        }
+        if (ended) {
+            TraceError(path, lineNumber, "record after \"end\"");
+        }
+
+        unsigned long long timeUs;
+        char *end;
+        timeUs = strtoull(token, &end, 10);
+        if (*end != '\0') {
+            TraceError(path, lineNumber, "invalid time");
+        }
+        TraceRecord record = {.timeNs = timeUs * 1000ULL};
+        if (record.timeNs < lastNs) {
+            TraceError(path, lineNumber, "records are not in time order");
+        }
+        lastNs = record.timeNs;
+
+        const char *kind = strtok_r(NULL, " \t", &savePtr);
+        if (kind == NULL) {
+            TraceError(path, lineNumber, "missing record type");
+        }
+
+        unsigned long value;
+        if (strcmp(kind, "end") == 0) {
+            host.endNs = HOST_RUNTIME_CLOCK_START_NS + record.timeNs;
+            ended = true;
+            continue;
+        } else if (strcmp(kind, "gpio") == 0) {
+            record.type = TraceRecord_Gpio;
+            token = strtok_r(NULL, " \t", &savePtr);
+            if (token == NULL || !ParseNumber(token, 255, &value)) {
+                TraceError(path, lineNumber, "invalid GPIO number");
+            }
+            record.address = (unsigned int)value;
+            token = strtok_r(NULL, " \t", &savePtr);
+            if (token == NULL || !ParseNumber(token, 1, &value)) {
+                TraceError(path, lineNumber, "GPIO level must be 0 or 1");
+            }
+            record.value = (unsigned int)value;
+        } else if (strcmp(kind, "i2c") == 0 || strcmp(kind, "i2c_rx") == 0) {
+            bool registers = strcmp(kind, "i2c") == 0;
+            record.type = registers ? TraceRecord_I2cRegisters : TraceRecord_I2cMessage;
+            token = strtok_r(NULL, " \t", &savePtr);
+            if (token == NULL || !ParseNumber(token, 0x7F, &value)) {
+                TraceError(path, lineNumber, "invalid I2C address");
+            }
+            record.address = (unsigned int)value;
+            if (registers) {
+                token = strtok_r(NULL, " \t", &savePtr);
+                if (token == NULL || !ParseNumber(token, 0xFF, &value)) {
+                    TraceError(path, lineNumber, "invalid register");
+                }
+                record.value = (unsigned int)value;
+            }
+            ParseTraceBytes(path, lineNumber, &savePtr, &record);
+        } else if (strcmp(kind, "i2c_stuck") == 0) {
+            record.type = TraceRecord_I2cStuck;
+            token = strtok_r(NULL, " \t", &savePtr);
+            if (token == NULL || !ParseNumber(token, 0x7F, &value)) {
+                TraceError(path, lineNumber, "invalid I2C address");
+            }
+            record.address = (unsigned int)value;
+        } else if (strcmp(kind, "twin") == 0) {
+            // The JSON document is the rest of the line, spaces included.
+            record.type = TraceRecord_Twin;
+            if (savePtr == NULL || *SkipSpaces(savePtr) == '\0') {
+                TraceError(path, lineNumber, "missing twin document");
+            }
+            record.text = strdup(SkipSpaces(savePtr));
+        } else if (strcmp(kind, "method") == 0) {
+            record.type = TraceRecord_Method;
+            token = strtok_r(NULL, " \t", &savePtr);
+            if (token == NULL) {
+                TraceError(path, lineNumber, "missing method name");
+            }
+            record.text = strdup(token);
+            record.payload = strdup(savePtr != NULL ? SkipSpaces(savePtr) : "");
+        } else {
+            TraceError(path, lineNumber, "unknown record type");
+        }
+
+        host.records = realloc(host.records, (host.recordCount + 1) * sizeof(TraceRecord));
+        host.records[host.recordCount++] = record;
+    }
+
+    free(lineBuffer);
+    fclose(file);
+
+    if (!ended) {
+        host.endNs = HOST_RUNTIME_CLOCK_START_NS + lastNs + HOST_RUNTIME_DEFAULT_TAIL_NS;
+    }
+}
+
+static void PrintSummary(void)
+{
+    fflush(stdout);
+
+    struct timespec wallEnd;
+    timespec_get(&wallEnd, TIME_UTC);
+    double wallS = (double)(wallEnd.tv_sec - host.wallStart.tv_sec) +
+                   (double)(wallEnd.tv_nsec - host.wallStart.tv_nsec) / 1e9;
+    double cpuS = (double)(clock() - host.cpuStart) / CLOCKS_PER_SEC;
+    double virtualS = (double)(host.nowNs - HOST_RUNTIME_CLOCK_START_NS) / 1e9;
+
+    fprintf(stderr,
+            "host runtime: %.3f s virtual in %.3f s wall, %.3f s cpu (%.0fx real time), "
+            "%llu epoll waits, %llu timer expirations, %zu of %zu trace records\n",
+            virtualS, wallS, cpuS, wallS > 0 ? virtualS / wallS : 0.0,
+            (unsigned long long)host.epollWaits, (unsigned long long)host.timerExpirations,
+            host.nextRecord, host.recordCount);
+}
+
+__attribute__((constructor)) static void InitializeHostRuntime(void)
+{
+    for (int i = 0; i < HOST_RUNTIME_MAX_TIMERS; i++) {
+        host.timers[i].fd = -1;
+    }
+
+    const char *log = getenv("MAGICLOCKBOX_LOG");
+    host.logEnabled = log == NULL || strcmp(log, "0") != 0;
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+
+    host.endNs = HOST_RUNTIME_CLOCK_START_NS + HOST_RUNTIME_DEFAULT_TAIL_NS;
+    const char *tracePath = getenv("MAGICLOCKBOX_TRACE");
+    if (tracePath != NULL && tracePath[0] != '\0') {
+        LoadTrace(tracePath);
+    }
+
+    timespec_get(&host.wallStart, TIME_UTC);
+    host.cpuStart = clock();
+    atexit(PrintSummary);
+}
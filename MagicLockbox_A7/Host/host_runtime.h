@@ -0,0 +1,96 @@
+/* Virtual clock host runtime, see Host/README.md */
+
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// <summary>
+///     Value of the virtual CLOCK_MONOTONIC when the application starts. Trace times are
+///     relative to it. It is not zero so that absolute timer expiries are never zero.
+/// </summary>
+#define HOST_RUNTIME_CLOCK_START_NS 1000000000ULL
+
+/// <summary>
+///     Virtual time added after the last trace record before the run ends, unless the trace
+///     has an explicit "end" record.
+/// </summary>
+#define HOST_RUNTIME_DEFAULT_TAIL_NS 10000000000ULL
+
+/// <summary>
+///     Returns the virtual CLOCK_MONOTONIC time.
+/// </summary>
+uint64_t HostRuntime_GetTimeNs(void);
+
+/// <summary>
+///     Advances the virtual clock by ns, applying the trace records and firing the timerfds
+///     which fall due on the way. Stands in for every sleep of the application.
+/// </summary>
+void HostRuntime_Sleep(uint64_t ns);
+
+/// <summary>
+///     Writes an "out" line with the virtual time to stdout. Used for the observable outputs
+///     of the application (PWM, GPIO outputs, cloud traffic), which are printed even when
+///     Log_Debug output is disabled so that runs can be diffed.
+/// </summary>
+void HostRuntime_Output(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/// <summary>
+///     Returns true when Log_Debug output is enabled (MAGICLOCKBOX_LOG is not "0").
+/// </summary>
+bool HostRuntime_IsLogEnabled(void);
+
+/// <summary>
+///     Sets the level a device or the trace drives onto a GPIO line.
+/// </summary>
+void HostGpio_Drive(int pin, bool high);
+
+/// <summary>
+///     Opens a stand-in for a GPIO edge notification: a nonblocking eventfd which is
+///     signalled every time the line goes from low to high.
+/// </summary>
+/// <returns>The eventfd, or -1 with errno set</returns>
+int HostGpio_OpenEdgeNotifier(int pin);
+
+/// <summary>
+///     Called by close() so that a closed edge notifier fd is no longer signalled.
+/// </summary>
+void HostGpio_ForgetFd(int fd);
+
+/// <summary>
+///     Writes registers of a register mapped I2C device model, as the device itself would.
+/// </summary>
+void HostI2c_SetRegisters(uint8_t address, uint8_t reg, const uint8_t *data, size_t length);
+
+/// <summary>
+///     Queues a message which a message based I2C device model returns on its next read.
+/// </summary>
+void HostI2c_QueueMessage(uint8_t address, const uint8_t *data, size_t length);
+
+/// <summary>
+///     Makes the I2C device model at address hold SDA low, as a slave stopped in the middle of
+///     a byte does, until a read on a re-opened master clocks it out.
+/// </summary>
+void HostI2c_HoldBus(uint8_t address);
+
+/// <summary>
+///     Returns the virtual time of the next change the I2C device models make by themselves,
+///     such as a sample batched into a FIFO, or UINT64_MAX.
+/// </summary>
+uint64_t HostI2c_GetNextEventNs(void);
+
+/// <summary>
+///     Lets the I2C device models catch up with the virtual clock at nowNs.
+/// </summary>
+void HostI2c_RunEvents(uint64_t nowNs);
+
+/// <summary>
+///     Queues a desired properties document, delivered to the twin callback by the next
+///     AzureIoT_DoPeriodicTasks call.
+/// </summary>
+void HostAzureIoT_QueueTwinUpdate(const char *json);
+
+/// <summary>
+///     Queues a direct method call, delivered by the next AzureIoT_DoPeriodicTasks call.
+/// </summary>
+void HostAzureIoT_QueueDirectMethod(const char *name, const char *payload);
@@ -0,0 +1,3 @@
+/* Host stand-in for the Azure Sphere applibs API, see Host/README.md */
+
+#pragma once
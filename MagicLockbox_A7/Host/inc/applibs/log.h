@@ -0,0 +1,14 @@
+/* Host stand-in for the Azure Sphere applibs API, see Host/README.md */
+
+#pragma once
+#include <stdarg.h>
+
+/// <summary>
+///     Writes a debug message to stdout, prefixed with the virtual time at line starts.
+/// </summary>
+void Log_Debug(const char *fmt, ...);
+
+/// <summary>
+///     va_list variant of <see cref="Log_Debug" />.
+/// </summary>
+void Log_DebugVarArgs(const char *fmt, va_list args);
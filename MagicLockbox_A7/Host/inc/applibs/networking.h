@@ -0,0 +1,6 @@
+/* Host stand-in for the Azure Sphere applibs API, see Host/README.md */
+
+#pragma once
+#include <stdbool.h>
+
+int Networking_IsNetworkingReady(bool *outIsNetworkingReady);
@@ -0,0 +1,27 @@
+/* Host stand-in for the Azure Sphere applibs API, see Host/README.md */
+
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef uint32_t PWM_ControllerId;
+typedef uint32_t PWM_ChannelId;
+
+typedef enum {
+    PWM_Polarity_Normal,
+    PWM_Polarity_Inversed
+} PwmPolarity;
+
+typedef struct {
+    unsigned int period_nsec;
+    unsigned int dutyCycle_nsec;
+    PwmPolarity polarity;
+    bool enabled;
+} PwmState;
+
+int PWM_Open(PWM_ControllerId pwm);
+
+/// <summary>
+///     Applies a channel state. Changes are written to stdout as "out pwm" lines.
+/// </summary>
+int PWM_Apply(int pwmFd, PWM_ChannelId pwmChannel, const PwmState *newState);
@@ -0,0 +1,16 @@
+/* Host stand-in for the Azure Sphere applibs API, see Host/README.md */
+
+#pragma once
+
+/// <summary>
+///     Opens the mutable storage file, MAGICLOCKBOX_STORAGE or a temporary file which is
+///     removed at exit.
+/// </summary>
+int Storage_OpenMutableFile(void);
+
+int Storage_DeleteMutableFile(void);
+
+/// <summary>
+///     Opens a file relative to MAGICLOCKBOX_IMAGE_DIR, the current directory by default.
+/// </summary>
+int Storage_OpenFileInImagePackage(const char *relativePath);
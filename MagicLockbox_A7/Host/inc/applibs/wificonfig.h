@@ -0,0 +1,23 @@
+/* Host stand-in for the Azure Sphere applibs API, see Host/README.md */
+
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+#define WIFICONFIG_SSID_MAX_LENGTH 32
+#define WIFICONFIG_BSSID_BUFFER_SIZE 6
+
+typedef struct {
+    uint32_t z__magicAndVersion;
+    uint8_t ssid[WIFICONFIG_SSID_MAX_LENGTH];
+    uint8_t bssid[WIFICONFIG_BSSID_BUFFER_SIZE];
+    uint8_t ssidLength;
+    uint8_t security;
+    uint32_t frequencyMHz;
+    int8_t signalRssi;
+} WifiConfig_ConnectedNetwork;
+
+/// <summary>
+///     The host is never connected to a Wi-Fi network; fails with ENOTCONN.
+/// </summary>
+int WifiConfig_GetCurrentNetwork(WifiConfig_ConnectedNetwork *connectedNetwork);
@@ -0,0 +1,5 @@
+/* Host stand-in for the Azure IoT C SDK, see Host/README.md */
+
+#pragma once
+
+typedef void *IOTHUB_DEVICE_CLIENT_LL_HANDLE;
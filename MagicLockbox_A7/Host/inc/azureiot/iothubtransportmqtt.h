@@ -0,0 +1,4 @@
+/* Host stand-in for the Azure IoT C SDK, see Host/README.md */
+
+#pragma once
+#include "iothub_device_client_ll.h"
@@ -0,0 +1,137 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <applibs/log.h>
+#include <applibs/storage.h>
+
+#include "accel_fsm.h"
+#include "magicKey.h"
+
+// Fixed part of a program: CONFIG_A, CONFIG_B, SIZE, SETTINGS, RESET and PROGRAM POINTER
+#define ACCEL_FSM_HEADER_SIZE 6
+#define ACCEL_FSM_SIZE_BYTE 2
+
+// ln_pg_write takes at most 255 bytes at a time
+#define ACCEL_FSM_WRITE_CHUNK 255
+
+typedef struct {
+	const char *path;
+	KeyEvent_t event;
+} AccelFsmProgram;
+
+static const AccelFsmProgram programs[] = {
+	{ "fsm/knock.bin", event_fsm_knock },
+	{ "fsm/twist.bin", event_fsm_twist },
+	{ "fsm/shake.bin", event_fsm_shake },
+};
+
+// Event of each loaded program, by FSM number - 1
+static KeyEvent_t programEvents[ACCEL_FSM_MAX_PROGRAMS];
+static uint8_t programCount;
+
+///<summary>
+///		Appends a program file of the image package to memory.
+///</summary>
+///<returns>The size of the program, 0 if the package does not have it, or -1 if it is not a
+///valid program or does not fit</returns>
+static int ReadProgram(const char *path, uint8_t *memory, size_t space)
+{
+	int fd = Storage_OpenFileInImagePackage(path);
+	if (fd < 0) {
+		return errno == ENOENT ? 0 : -1;
+	}
+
+	// One byte more than fits, to tell a program which does not fit
+	uint8_t program[ACCEL_FSM_MEMORY_SIZE + 1];
+	ssize_t size = read(fd, program, sizeof(program));
+	close(fd);
+	if (size < ACCEL_FSM_HEADER_SIZE || program[ACCEL_FSM_SIZE_BYTE] != size || (size_t)size > space) {
+		return -1;
+	}
+	memcpy(memory, program, (size_t)size);
+	return (int)size;
+}
+
+///<summary>
+///		Writes the programs to the page memory and starts them, in the order of ST's FSM
+///		examples.
+///</summary>
+static int32_t WritePrograms(lsm6dso_ctx_t *ctx, lsm6dso_fsm_odr_t fsmRate, uint8_t *memory, size_t size)
+{
+	uint16_t enabled = (uint16_t)((1U << programCount) - 1);
+	lsm6dso_pin_int1_route_t routing;
+	int32_t ret = lsm6dso_pin_int1_route_get(ctx, &routing);
+	if (ret == 0) {
+		*(uint8_t *)&routing.fsm_int1_a = (uint8_t)(enabled & 0xFF);
+		*(uint8_t *)&routing.fsm_int1_b = (uint8_t)(enabled >> 8);
+		ret = lsm6dso_pin_int1_route_set(ctx, &routing);
+	}
+
+	lsm6dso_emb_fsm_enable_t fsmEnable;
+	*(uint8_t *)&fsmEnable.fsm_enable_a = (uint8_t)(enabled & 0xFF);
+	*(uint8_t *)&fsmEnable.fsm_enable_b = (uint8_t)(enabled >> 8);
+	if (ret == 0) {
+		ret = lsm6dso_fsm_enable_set(ctx, &fsmEnable);
+	}
+	if (ret == 0) {
+		ret = lsm6dso_fsm_data_rate_set(ctx, fsmRate);
+	}
+	if (ret == 0) {
+		ret = lsm6dso_fsm_number_of_programs_set(ctx, &programCount);
+	}
+	uint8_t startAddress[2] = { ACCEL_FSM_START_ADDRESS & 0xFF, ACCEL_FSM_START_ADDRESS >> 8 };
+	if (ret == 0) {
+		ret = lsm6dso_fsm_start_address_set(ctx, startAddress);
+	}
+	for (size_t offset = 0; ret == 0 && offset < size; offset += ACCEL_FSM_WRITE_CHUNK) {
+		size_t chunk = size - offset < ACCEL_FSM_WRITE_CHUNK ? size - offset : ACCEL_FSM_WRITE_CHUNK;
+		ret = lsm6dso_ln_pg_write(ctx, (uint16_t)(ACCEL_FSM_START_ADDRESS + offset), &memory[offset], (uint8_t)chunk);
+	}
+	return ret;
+}
+
+int AccelFsm_Load(lsm6dso_ctx_t *ctx, lsm6dso_fsm_odr_t fsmRate)
+{
+	static uint8_t memory[ACCEL_FSM_MEMORY_SIZE];
+	size_t used = 0;
+
+	programCount = 0;
+	for (size_t i = 0; i < sizeof(programs) / sizeof(programs[0]) && programCount < ACCEL_FSM_MAX_PROGRAMS; i++) {
+		int size = ReadProgram(programs[i].path, &memory[used], sizeof(memory) - used);
+		if (size < 0) {
+			Log_Debug("ERROR: FSM program %s is not valid or does not fit, skipped.\n", programs[i].path);
+			continue;
+		}
+		if (size == 0) {
+			continue;
+		}
+		Log_Debug("FSM program %u: %s, %d bytes.\n", programCount + 1, programs[i].path, size);
+		programEvents[programCount++] = programs[i].event;
+		used += (size_t)size;
+	}
+
+	if (programCount == 0) {
+		Log_Debug("INFO: No FSM programs in the image package.\n");
+		return 0;
+	}
+	if (WritePrograms(ctx, fsmRate, memory, used) != 0) {
+		Log_Debug("ERROR: Could not load the FSM programs.\n");
+		programCount = 0;
+		return -1;
+	}
+	return programCount;
+}
+
+void AccelFsm_HandleStatus(const lsm6dso_all_sources_t *sources, uint64_t eventNs)
+{
+	uint16_t status = (uint16_t)(*(const uint8_t *)&sources->fsm_status_a |
+		*(const uint8_t *)&sources->fsm_status_b << 8);
+
+	for (uint8_t i = 0; i < programCount; i++) {
+		if ((status & (1U << i)) != 0) {
+			Log_Debug("\nFSM program %u\n", i + 1);
+			magicLockbox_registerEventAt(programEvents[i], eventNs);
+		}
+	}
+}
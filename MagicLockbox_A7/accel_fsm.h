@@ -0,0 +1,39 @@
+#pragma once
+
+#include "lsm6dso_reg.h"
+
+/**
+ >>> Finite state machine programs
+The LSM6DSO runs up to 16 finite state machine programs on its own samples and latches a
+status bit per program when one detects its gesture, so gestures such as knocks, twists or
+shakes are classified in the sensor without streaming samples to the application.
+
+Programs are binary images as written to the sensor's program memory, one per file, generated
+with ST's FSM tools. They are read from the image package at start-up:
+	fsm/knock.bin	event_fsm_knock
+	fsm/twist.bin	event_fsm_twist
+	fsm/shake.bin	event_fsm_shake
+Missing files are skipped, so a package without programs runs without the FSM.
+**/
+
+// Most programs the FSM runs, one status bit each in FSM_STATUS_A/B
+#define ACCEL_FSM_MAX_PROGRAMS 16
+
+// Address of the first program in the embedded function page memory
+#define ACCEL_FSM_START_ADDRESS 0x0400
+
+// Bytes of page memory available to the programs
+#define ACCEL_FSM_MEMORY_SIZE 1024
+
+///<summary>
+///		Loads the FSM programs found in the image package onto the LSM6DSO, enables them at
+///		fsmRate and routes their interrupts to INT1. Call after the sensor has been configured.
+///</summary>
+///<returns>The number of programs loaded, or -1 on failure</returns>
+int AccelFsm_Load(lsm6dso_ctx_t *ctx, lsm6dso_fsm_odr_t fsmRate);
+
+///<summary>
+///		Registers the events of the programs whose bits are set in the FSM_STATUS_A/B of
+///		sources, as read with LSM6DSO_SOURCES_EMB_FUNC, as detected at eventNs (CLOCK_MONOTONIC).
+///</summary>
+void AccelFsm_HandleStatus(const lsm6dso_all_sources_t *sources, uint64_t eventNs);
@@ -0,0 +1,218 @@
+#include <errno.h>
+#include <string.h>
+
+#include <applibs/log.h>
+
+#include "accel_hub.h"
+#include "epoll_timerfd_utilities.h"
+
+// LPS22HH registers: WHO_AM_I, CTRL_REG1 with the ODR in bits 6:4 and BDU, and the outputs,
+// PRESS_OUT_XL to _H followed by TEMP_OUT_L and _H
+#define LPS22HH_WHO_AM_I 0x0F
+#define LPS22HH_ID 0xB3
+#define LPS22HH_CTRL_REG1 0x10
+#define LPS22HH_BDU 0x02
+#define LPS22HH_PRESS_OUT_XL 0x28
+#define LPS22HH_OUTPUT_LENGTH 5
+
+// Sensor hub cycles run at 104 Hz at most while the LPS22HH is configured, polling for the end
+// of one gives up after ACCEL_HUB_MAX_POLLS * ACCEL_HUB_POLL_MS
+#define ACCEL_HUB_POLL_MS 2
+#define ACCEL_HUB_MAX_POLLS 50
+
+// STATUS_MASTER flags
+#define ACCEL_HUB_SENS_HUB_ENDOP 0x01
+#define ACCEL_HUB_SLAVE0_NACK 0x08
+#define ACCEL_HUB_WR_ONCE_DONE 0x80
+
+typedef struct {
+	uint32_t samples;
+	int32_t lastPressure;
+	int16_t lastTemperature;
+} AccelHubStats;
+
+// Steps of the configuration of the LPS22HH, each waiting for the end of a sensor hub cycle
+typedef enum {
+	AccelHubStep_Idle,
+	AccelHubStep_ReadId,
+	AccelHubStep_WriteRate,
+} AccelHubStep;
+
+static AccelHubStats stats;
+
+static struct {
+	lsm6dso_ctx_t *ctx;
+	uint8_t address;
+	uint8_t lps22hhRate;
+	lsm6dso_shub_odr_t readRate;
+	AccelHubStep step;
+	// STATUS_MASTER flag raised by the end of the cycle of the step
+	uint8_t flag;
+	uint32_t polls;
+} hub;
+
+static void HubPollTimerEventHandler(EventData *eventData);
+
+static SoftTimer hubPollTimer = { .eventData.eventHandler = &HubPollTimerEventHandler, .eventData.name = "accelHubPoll", .eventData.priority = EventPriority_Sensor };
+
+///<summary>
+///		Runs the sensor hub master for the cycle of step, which ends by raising flag in
+///		STATUS_MASTER, and polls for it from hubPollTimer.
+///</summary>
+///<returns>0 on success, or -1 on failure</returns>
+static int StartHubCycle(AccelHubStep step, uint8_t flag)
+{
+	lsm6dso_status_master_t status;
+	// The flags are latched until read, drop those of an earlier cycle
+	if (lsm6dso_sh_status_get(hub.ctx, &status) != 0 || lsm6dso_sh_master_set(hub.ctx, PROPERTY_ENABLE) != 0) {
+		return -1;
+	}
+	static const struct timespec poll = { .tv_sec = 0, .tv_nsec = ACCEL_HUB_POLL_MS * 1000000 };
+	if (SetSoftTimerToPeriod(&hubPollTimer, &poll) < 0) {
+		lsm6dso_sh_master_set(hub.ctx, PROPERTY_DISABLE);
+		return -1;
+	}
+	hub.step = step;
+	hub.flag = flag;
+	hub.polls = 0;
+	return 0;
+}
+
+///<summary>
+///		Logs why the configuration stopped at the current step, errno telling, and leaves the
+///		sensor hub master off.
+///</summary>
+static void FailHubStep(void)
+{
+	int error = errno;
+	CancelSoftTimer(&hubPollTimer);
+	lsm6dso_sh_master_set(hub.ctx, PROPERTY_DISABLE);
+	if (hub.step == AccelHubStep_ReadId) {
+		Log_Debug("ERROR: No LPS22HH at 0x%02x behind the LSM6DSO sensor hub: %s (%d).\n", hub.address, strerror(error), error);
+	}
+	else {
+		Log_Debug("ERROR: Could not configure the LPS22HH: %s (%d).\n", strerror(error), error);
+	}
+	hub.step = AccelHubStep_Idle;
+}
+
+///<summary>
+///		Starts the cycle writing one register of the slave in a write-once cycle.
+///</summary>
+///<returns>0 on success, or -1 on failure</returns>
+static int StartSlaveWrite(uint8_t reg, uint8_t value)
+{
+	lsm6dso_sh_cfg_write_t write = { .slv0_add = hub.address, .slv0_subadd = reg, .slv0_data = value };
+	if (lsm6dso_sh_cfg_write(hub.ctx, &write) != 0) {
+		return -1;
+	}
+	return StartHubCycle(AccelHubStep_WriteRate, ACCEL_HUB_WR_ONCE_DONE);
+}
+
+///<summary>
+///		Lets every cycle from now on read the outputs of the LPS22HH into the FIFO.
+///</summary>
+static void StartReading(void)
+{
+	hub.step = AccelHubStep_Idle;
+	lsm6dso_sh_cfg_read_t read = { .slv_add = hub.address, .slv_subadd = LPS22HH_PRESS_OUT_XL, .slv_len = LPS22HH_OUTPUT_LENGTH };
+	if (lsm6dso_sh_slv0_cfg_read(hub.ctx, &read) != 0 || lsm6dso_sh_data_rate_set(hub.ctx, hub.readRate) != 0 ||
+		lsm6dso_sh_batch_slave_0_set(hub.ctx, PROPERTY_ENABLE) != 0 || lsm6dso_sh_master_set(hub.ctx, PROPERTY_ENABLE) != 0) {
+		Log_Debug("ERROR: Could not start the LSM6DSO sensor hub.\n");
+		lsm6dso_sh_master_set(hub.ctx, PROPERTY_DISABLE);
+		return;
+	}
+	Log_Debug("LSM6DSO sensor hub reading the LPS22HH at 0x%02x.\n", hub.address);
+}
+
+///<summary>
+///		Checks whether the cycle of the current step has ended, and if so goes on to the next
+///		step with the master off in between.
+///</summary>
+static void HubPollTimerEventHandler(EventData *eventData)
+{
+	uint8_t flags;
+	if (lsm6dso_sh_status_get(hub.ctx, (lsm6dso_status_master_t *)&flags) != 0) {
+		FailHubStep();
+		return;
+	}
+	if ((flags & ACCEL_HUB_SLAVE0_NACK) != 0) {
+		errno = ENXIO;
+		FailHubStep();
+		return;
+	}
+	if ((flags & hub.flag) == 0) {
+		if (++hub.polls == ACCEL_HUB_MAX_POLLS) {
+			errno = ETIMEDOUT;
+			FailHubStep();
+		}
+		return;
+	}
+
+	CancelSoftTimer(&hubPollTimer);
+	if (lsm6dso_sh_master_set(hub.ctx, PROPERTY_DISABLE) != 0) {
+		FailHubStep();
+		return;
+	}
+	if (hub.step == AccelHubStep_WriteRate) {
+		StartReading();
+		return;
+	}
+
+	lsm6dso_emb_sh_read_t output;
+	if (lsm6dso_sh_read_data_raw_get(hub.ctx, &output) != 0) {
+		FailHubStep();
+		return;
+	}
+	uint8_t id = *(const uint8_t *)&output;
+	if (id != LPS22HH_ID) {
+		Log_Debug("ERROR: Device at 0x%02x behind the LSM6DSO sensor hub is not an LPS22HH (0x%02x).\n", hub.address, id);
+		hub.step = AccelHubStep_Idle;
+		return;
+	}
+	if (StartSlaveWrite(LPS22HH_CTRL_REG1, (uint8_t)(hub.lps22hhRate << 4 | LPS22HH_BDU)) != 0) {
+		hub.step = AccelHubStep_WriteRate;
+		FailHubStep();
+	}
+}
+
+int AccelHub_Init(lsm6dso_ctx_t *ctx, uint8_t address, uint8_t lps22hhRate, lsm6dso_shub_odr_t readRate)
+{
+	// A configuration still running is started over
+	CancelSoftTimer(&hubPollTimer);
+	hub.ctx = ctx;
+	hub.address = address;
+	hub.lps22hhRate = lps22hhRate;
+	hub.readRate = readRate;
+	hub.step = AccelHubStep_ReadId;
+
+	// Read WHO_AM_I of the slave
+	lsm6dso_sh_cfg_read_t read = { .slv_add = address, .slv_subadd = LPS22HH_WHO_AM_I, .slv_len = 1 };
+	if (lsm6dso_sh_slave_connected_set(ctx, LSM6DSO_SLV_0) != 0 ||
+		lsm6dso_sh_write_mode_set(ctx, LSM6DSO_ONLY_FIRST_CYCLE) != 0 ||
+		lsm6dso_sh_slv0_cfg_read(ctx, &read) != 0 || StartHubCycle(AccelHubStep_ReadId, ACCEL_HUB_SENS_HUB_ENDOP) != 0) {
+		FailHubStep();
+		return -1;
+	}
+	return 0;
+}
+
+void AccelHub_HandleFifoWord(const uint8_t *data, ImuSample *sample)
+{
+	// 24 bit pressure in 1/4096 hPa and 16 bit temperature in 1/100 degrees, both signed
+	uint32_t pressure = (uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16;
+	stats.lastPressure = (int32_t)(pressure << 8) >> 8;
+	stats.lastTemperature = (int16_t)(data[3] | data[4] << 8);
+	stats.samples++;
+
+	sample->sensor = ImuSensor_Pressure;
+	sample->x = (int16_t)(data[0] | data[1] << 8);
+	sample->y = (int8_t)data[2];
+	sample->z = stats.lastTemperature;
+}
+
+void AccelHub_LogStats(void)
+{
+	Log_Debug("INFO: LSM6DSO sensor hub: %u LPS22HH samples, last %.2f hPa, %.2f C.\n", stats.samples,
+		(float)stats.lastPressure / 4096.0f, (float)stats.lastTemperature / 100.0f);
+}
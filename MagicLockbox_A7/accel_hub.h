@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "imu_ring.h"
+#include "lsm6dso_reg.h"
+
+/**
+ >>> Sensor hub
+The LPS22HH pressure sensor of the board hangs off the auxiliary I2C master of the LSM6DSO, not
+off ISU2. The sensor hub reads its pressure and temperature at a fixed rate and batches
+each read into the LSM6DSO FIFO as a SENSORHUB_SLAVE0 word, in line with the accelerometer and
+gyroscope samples of the same moment, so the drain of the FIFO brings them in with the rest of
+the burst and the LPS22HH costs no transfers of its own on the shared bus. The samples go into
+the IMU ring at the position of their word, and from there into the IMU telemetry.
+
+The LPS22HH is configured once through the hub's write-once cycles; afterwards the hub only
+reads it. The cycles are waited for by polling STATUS_MASTER from a soft timer, never by
+sleeping on the event loop.
+**/
+
+///<summary>
+///		Starts checking for the LPS22HH at address (7 bit) behind the sensor hub, setting its
+///		output rate to the ODR code of its CTRL_REG1 and batching its samples into the FIFO at
+///		readRate. Each step waits for a sensor hub cycle, polled from a soft timer, so this
+///		returns at once and the outcome is logged. Call after the LSM6DSO has been configured
+///		with the accelerometer running; a configuration still running is started over.
+///</summary>
+///<returns>0 if the configuration has started, or -1 on failure with the sensor hub master off</returns>
+int AccelHub_Init(lsm6dso_ctx_t *ctx, uint8_t address, uint8_t lps22hhRate, lsm6dso_shub_odr_t readRate);
+
+///<summary>
+///		Takes the data of a SENSORHUB_SLAVE0 word of the FIFO, the 6 bytes after the tag, and
+///		returns it as an ImuSensor_Pressure sample.
+///</summary>
+void AccelHub_HandleFifoWord(const uint8_t *data, ImuSample *sample);
+
+///<summary>
+///		Prints the samples taken and the last one with Log_Debug.
+///</summary>
+void AccelHub_LogStats(void);
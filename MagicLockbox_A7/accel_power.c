@@ -0,0 +1,173 @@
+#include <errno.h>
+#include <string.h>
+
+#include <applibs/log.h>
+
+#include "accel_power.h"
+#include "i2c_scheduler.h"
+
+// XL_HM_MODE of CTRL6_C: high-performance mode of the accelerometer disabled
+#define CTRL6_C_XL_HM_MODE 0x10
+
+static const char *modeNames[ACCEL_POWER_MODES] = { "full rate", "low power" };
+
+// CTRL1_XL and CTRL2_G, and CTRL6_C, of each mode
+static uint8_t odrRegisters[ACCEL_POWER_MODES][2];
+static uint8_t ctrl6Registers[ACCEL_POWER_MODES];
+
+static lsm6dso_ctx_t *sensor;
+static AccelPowerMode currentMode;
+static AccelPowerMode requestedMode;
+// Mode being written while transitionBusy
+static AccelPowerMode transitionMode;
+static bool transitionBusy;
+
+typedef struct {
+	uint32_t transitions[ACCEL_POWER_MODES];
+	uint32_t failures;
+	uint64_t maxTransitionNs[ACCEL_POWER_MODES];
+	uint64_t residencyNs[ACCEL_POWER_MODES];
+	uint32_t wakeUps;
+	uint64_t totalWakeLatencyNs;
+	uint64_t maxWakeLatencyNs;
+} AccelPowerStats;
+
+static AccelPowerStats stats;
+static uint64_t modeSinceNs;
+static uint64_t requestNs;
+// Time of the last wake-up while its first event is outstanding, otherwise 0
+static uint64_t wakeNs;
+
+static void OdrWriteDone(I2cTransaction *transaction);
+static void Ctrl6WriteDone(I2cTransaction *transaction);
+
+static uint8_t odrWriteData[3] = { LSM6DSO_CTRL1_XL };
+static I2cTransaction odrWrite = { .writeData = odrWriteData, .writeLength = sizeof(odrWriteData), .callback = OdrWriteDone };
+static uint8_t ctrl6WriteData[2] = { LSM6DSO_CTRL6_C };
+static I2cTransaction ctrl6Write = { .writeData = ctrl6WriteData, .writeLength = sizeof(ctrl6WriteData), .callback = Ctrl6WriteDone };
+
+///<summary>
+///		Queues the writes of requestedMode: CTRL6_C, then CTRL1_XL and CTRL2_G in one burst.
+///		The transition ends when the second write completes, the queue keeps their order.
+///</summary>
+static void StartTransition(void)
+{
+	transitionBusy = true;
+	transitionMode = requestedMode;
+	requestNs = GetMonotonicNs();
+	ctrl6WriteData[1] = ctrl6Registers[transitionMode];
+	memcpy(&odrWriteData[1], odrRegisters[transitionMode], sizeof(odrRegisters[transitionMode]));
+	if (I2cScheduler_Submit(&ctrl6Write) != 0 || I2cScheduler_Submit(&odrWrite) != 0) {
+		Log_Debug("ERROR: Could not queue the LSM6DSO %s mode: %s (%d).\n", modeNames[transitionMode], strerror(errno), errno);
+		transitionBusy = false;
+	}
+}
+
+static void Ctrl6WriteDone(I2cTransaction *transaction)
+{
+	lsm6dso_shadow_written(sensor, LSM6DSO_CTRL6_C, &ctrl6WriteData[1], 1, transaction->result < 0 ? -1 : 0);
+}
+
+static void OdrWriteDone(I2cTransaction *transaction)
+{
+	lsm6dso_shadow_written(sensor, LSM6DSO_CTRL1_XL, &odrWriteData[1], 2, transaction->result < 0 ? -1 : 0);
+	transitionBusy = false;
+
+	uint64_t nowNs = GetMonotonicNs();
+	AccelPowerMode mode = transitionMode;
+	if (transaction->result < 0 || ctrl6Write.result < 0) {
+		// The sensor may be in either mode now; the request is dropped rather than retried on a
+		// failing bus, the next sleep change writes both registers again
+		stats.failures++;
+		requestedMode = currentMode;
+		int error = transaction->result < 0 ? transaction->error : ctrl6Write.error;
+		Log_Debug("ERROR: LSM6DSO %s mode failed: %s (%d).\n", modeNames[mode], strerror(error), error);
+	}
+	else {
+		uint64_t transitionNs = nowNs - requestNs;
+		stats.transitions[mode]++;
+		if (transitionNs > stats.maxTransitionNs[mode]) {
+			stats.maxTransitionNs[mode] = transitionNs;
+		}
+		stats.residencyNs[currentMode] += nowNs - modeSinceNs;
+		modeSinceNs = nowNs;
+		currentMode = mode;
+		Log_Debug("LSM6DSO %s in %u us.\n", modeNames[mode], (unsigned int)(transitionNs / 1000));
+	}
+
+	if (requestedMode != currentMode) {
+		StartTransition();
+	}
+}
+
+int AccelPower_Init(lsm6dso_ctx_t *ctx, I2cTransportDevice *device, lsm6dso_odr_xl_t lowXlRate, lsm6dso_odr_g_t lowGyRate)
+{
+	sensor = ctx;
+	odrWrite.device = device;
+	ctrl6Write.device = device;
+
+	uint8_t ctrl6;
+	if (lsm6dso_read_reg(ctx, LSM6DSO_CTRL1_XL, odrRegisters[AccelPower_Full], 2) != 0 ||
+		lsm6dso_read_reg(ctx, LSM6DSO_CTRL6_C, &ctrl6, 1) != 0) {
+		Log_Debug("ERROR: Could not read the LSM6DSO power mode.\n");
+		return -1;
+	}
+	// The ODR is in bits 7:4 of both registers, the full scale and filter bits stay
+	odrRegisters[AccelPower_Low][0] = (uint8_t)((odrRegisters[AccelPower_Full][0] & 0x0F) | lowXlRate << 4);
+	odrRegisters[AccelPower_Low][1] = (uint8_t)((odrRegisters[AccelPower_Full][1] & 0x0F) | lowGyRate << 4);
+	ctrl6Registers[AccelPower_Full] = (uint8_t)(ctrl6 & ~CTRL6_C_XL_HM_MODE);
+	ctrl6Registers[AccelPower_Low] = (uint8_t)(ctrl6 | CTRL6_C_XL_HM_MODE);
+
+	currentMode = AccelPower_Full;
+	requestedMode = AccelPower_Full;
+	modeSinceNs = GetMonotonicNs();
+	return 0;
+}
+
+void AccelPower_Request(AccelPowerMode mode)
+{
+	if (sensor == NULL) {
+		return;
+	}
+	if (mode == AccelPower_Full && currentMode != AccelPower_Full) {
+		wakeNs = GetMonotonicNs();
+	}
+	requestedMode = mode;
+	if (!transitionBusy && requestedMode != currentMode) {
+		StartTransition();
+	}
+}
+
+void AccelPower_EventDetected(void)
+{
+	if (wakeNs == 0) {
+		return;
+	}
+	uint64_t latencyNs = GetMonotonicNs() - wakeNs;
+	wakeNs = 0;
+	stats.wakeUps++;
+	stats.totalWakeLatencyNs += latencyNs;
+	if (latencyNs > stats.maxWakeLatencyNs) {
+		stats.maxWakeLatencyNs = latencyNs;
+	}
+}
+
+void AccelPower_LogStats(void)
+{
+	if (sensor == NULL) {
+		return;
+	}
+	uint64_t residencyNs[ACCEL_POWER_MODES];
+	memcpy(residencyNs, stats.residencyNs, sizeof(residencyNs));
+	residencyNs[currentMode] += GetMonotonicNs() - modeSinceNs;
+	uint64_t totalNs = residencyNs[AccelPower_Full] + residencyNs[AccelPower_Low];
+
+	for (int mode = 0; mode < ACCEL_POWER_MODES; mode++) {
+		Log_Debug("INFO: LSM6DSO %s: %u transitions, longest %u us, %u%% of the time.\n", modeNames[mode],
+			stats.transitions[mode], (unsigned int)(stats.maxTransitionNs[mode] / 1000),
+			totalNs == 0 ? 0 : (unsigned int)(residencyNs[mode] * 100 / totalNs));
+	}
+	Log_Debug("INFO: LSM6DSO wake-up to first event: %u times, avg %u ms, max %u ms; %u failed transitions.\n",
+		stats.wakeUps, stats.wakeUps == 0 ? 0 : (unsigned int)(stats.totalWakeLatencyNs / stats.wakeUps / 1000000),
+		(unsigned int)(stats.maxWakeLatencyNs / 1000000), stats.failures);
+}
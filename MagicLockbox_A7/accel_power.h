@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "i2c_transport.h"
+#include "lsm6dso_reg.h"
+
+/**
+ >>> Power modes
+While the box is inactive the LSM6DSO runs the accelerometer at a low rate in its low-power
+mode and the gyroscope at a low rate or off; the sleep change interrupt switches between the
+modes. The writes are queued on the I2C scheduler, so the interrupt handler does not wait for
+the bus.
+
+Every transition is counted and timed from the sleep change to the completion of its writes,
+the time spent in each mode is accumulated, and the latency from waking up to the first
+accelerometer event is measured, so the savings can be weighed against the slower response.
+**/
+
+typedef enum {
+	AccelPower_Full,
+	AccelPower_Low,
+	ACCEL_POWER_MODES
+} AccelPowerMode;
+
+///<summary>
+///		Takes the configuration written so far as the full rate mode and derives the low power
+///		mode from it. Call after the sensor has been configured, outside of event handlers.
+///</summary>
+///<returns>0 on success, or -1 on failure</returns>
+int AccelPower_Init(lsm6dso_ctx_t *ctx, I2cTransportDevice *device, lsm6dso_odr_xl_t lowXlRate, lsm6dso_odr_g_t lowGyRate);
+
+///<summary>
+///		Switches to a mode. A request made while a transition is under way is applied when
+///		that one has completed.
+///</summary>
+void AccelPower_Request(AccelPowerMode mode);
+
+///<summary>
+///		Reports that the accelerometer detected an event, for the wake-up latency.
+///</summary>
+void AccelPower_EventDetected(void);
+
+///<summary>
+///		Prints the transitions, residency and wake-up latency with Log_Debug.
+///</summary>
+void AccelPower_LogStats(void);
@@ -24,9 +24,132 @@
 #endif 
 
 
-// Defines how quickly the accelerator data is read and reported
+// Defines how quickly the accelerator data is read and reported when INT1 has to be polled
 #define ACCEL_READ_PERIOD_SECONDS 0
 #define ACCEL_READ_PERIOD_NANO_SECONDS 1000
 
+// Wait for LSM6DSO INT1 edge notifications instead of polling the line, where the platform has them
+#define ACCEL_USE_INT1_EDGE_NOTIFICATIONS
+
+// Safety net poll of INT1 while edge notifications are used; the interrupts are latched, so an
+// event whose edge was missed is picked up by the next poll
+#define ACCEL_FALLBACK_POLL_PERIOD_MS 500
+
+// Keep a shadow copy of the LSM6DSO configuration registers so that the driver's read-modify-write
+// setters only write
+#define ACCEL_SHADOW_REGISTERS
+
+// Read the LSM6DSO configuration back after writing it and fail initialization on a mismatch
+//#define ACCEL_VERIFY_CONFIGURATION
+
+// Batch accelerometer and gyroscope samples in the LSM6DSO FIFO and drain them into the IMU sample
+// ring whenever the FIFO watermark interrupt raises INT1
+#define ACCEL_FIFO_STREAMING
+
+// Rates at which the accelerometer and gyroscope samples are batched into the FIFO
+#define ACCEL_FIFO_XL_BATCH_RATE LSM6DSO_XL_BATCHED_AT_26Hz
+#define ACCEL_FIFO_GY_BATCH_RATE LSM6DSO_GY_BATCHED_AT_26Hz
+
+// FIFO words (one sample of one sensor each, up to three when compressed) which raise the
+// watermark interrupt. Each word takes 7 bytes of the burst read draining the FIFO, keep the burst
+// within the handler time budget.
+#define ACCEL_FIFO_WATERMARK 12
+
+// Compress the samples in the FIFO as differences to the samples before, with an uncompressed
+// word at the rate below on which the decoding resynchronizes
+#define ACCEL_FIFO_COMPRESSION
+#define ACCEL_FIFO_UNCOMPRESSED_RATE LSM6DSO_CMP_8_TO_1
+
+// Stream the raw IMU samples to the cloud, delta packed and batched into large messages, see
+// imu_telemetry.h. Off until the ImuTelemetryBytesPerSecond twin property sets a bandwidth cap.
+#define IMU_TELEMETRY
+
+// Read the LPS22HH pressure sensor behind the LSM6DSO through the LSM6DSO sensor hub and batch its
+// samples into the LSM6DSO FIFO, see accel_hub.h. Needs ACCEL_FIFO_STREAMING.
+#define ACCEL_SENSOR_HUB
+
+// Address of the LPS22HH on the sensor hub bus, its output rate as the ODR code of its CTRL_REG1
+// (2 is 10 Hz) and the rate at which the sensor hub reads it
+#define ACCEL_HUB_LPS22HH_ADDRESS 0x5D
+#define ACCEL_HUB_LPS22HH_RATE 2
+#define ACCEL_HUB_READ_RATE LSM6DSO_SH_ODR_13Hz
+
+// Load the finite state machine programs of the image package (fsm/*.bin) onto the LSM6DSO and
+// register their detections as events, see accel_fsm.h. No programs ship with the image yet, so
+// enable this together with the .bin files built for the gestures in accel_fsm.c
+//#define ACCEL_FSM_PROGRAMS
+
+// Rate at which the FSM programs run, 104 Hz is the highest the LSM6DSO FSM supports
+#define ACCEL_FSM_RATE LSM6DSO_ODR_FSM_104Hz
+
+// Drop the LSM6DSO to a low-power mode while the box is inactive and restore the full rate on
+// wake-up, see accel_power.h
+#define ACCEL_ADAPTIVE_ODR
+
+// Rates while inactive. The accelerometer keeps at least the FSM rate while FSM programs run.
+#define ACCEL_INACTIVE_XL_RATE LSM6DSO_XL_ODR_26Hz
+#define ACCEL_INACTIVE_GY_RATE LSM6DSO_GY_ODR_OFF
+
+// Detect double taps on the LSM6DSO and register them as events 'X', 'Y' and 'Z'. The first tap
+// of a double tap is registered as a single tap, which the double tap overwrites. The window for
+// the second tap is in units of 32 accelerometer samples, 7 is 537 ms at 417 Hz.
+#define ACCEL_DOUBLE_TAP
+#define ACCEL_DOUBLE_TAP_WINDOW 7
+
+// Detect free fall on the LSM6DSO and register it as event 'f': all axes below the threshold for
+// the number of accelerometer samples (up to 63), 6 is 14 ms at 417 Hz
+#define ACCEL_FREE_FALL
+#define ACCEL_FREE_FALL_THRESHOLD LSM6DSO_FF_TSH_312mg
+#define ACCEL_FREE_FALL_SAMPLES 6
+
+// Bus speed of each I2C device, see I2cSpeed in i2c_transport.h. At startup the speed is lowered
+// until the bus takes it and the device answers, the LSM6DSO being checked with WHO_AM_I reads.
+#define LSM6DSO_I2C_SPEED I2cSpeed_Fast
+#define MGC3130_I2C_SPEED I2cSpeed_Fast
+#define LSM6DSO_SPEED_PROBE_READS 8
+
+// Time after which the I2C master gives up on a transfer. It must be longer than the longest
+// transfer, a 192 byte MGC3130 message read takes 18 ms at standard speed.
+#define I2C_BUS_TIMEOUT_MS 50
+
+// Recover the I2C bus when this many transactions in a row have failed: re-open the bus, reset
+// the MGC3130 should it hold SDA and configure the devices whose transactions failed again
+#define I2C_BUS_RECOVERY
+#define I2C_RECOVERY_FAILURE_THRESHOLD 3
+
+// Backend of the sensor HAL, see sensor_hal.h. SensorHalBackend_Recorder writes all sensor traffic
+// to the debug log as a recording; on the host runtime MAGICLOCKBOX_HAL_RECORDING=<file> replays
+// one instead.
+#define SENSOR_HAL_BACKEND SensorHalBackend_Applibs
+
+// How often the MGC3130 is checked for gesture messages
+#define GESTURE_POLL_PERIOD_MS 10
+
+// Time TS is left released after a message read before the MGC3130 is read again, it needs
+// 200 us to release TS itself once it has no message left
+#define MGC3130_TS_RELEASE_MS 1
+
+// Resolution of the timer wheel driving all software timers, timer periods are rounded up to it
+#define TIMER_WHEEL_TICK_NANO_SECONDS 1000000
+
+// Maximum number of ready events drained and dispatched per event loop wakeup
+#define EVENT_LOOP_MAX_EVENTS_PER_WAIT 16
+
+// Period of dumping the event loop histograms to the debug log and the device twin
+#define EVENT_LOOP_STATS_REPORT_PERIOD_S 300
+
+// Default time budget of an event handler call, longer calls are counted and logged as overruns
+#define EVENT_HANDLER_BUDGET_US 10000
+
+// How late the coarse periodic timers (state notification, cloud work, Wi-Fi check, loop stats)
+// may expire, in percent of their period. Timers whose windows overlap share one wakeup.
+#define COARSE_TIMER_SLACK_PERCENT 10
+
+// Cadence of the Azure IoT client work (client setup, AzureIoT_DoPeriodicTasks)
+#define AZURE_IOT_DO_WORK_PERIOD_MS 100
+
+// Cadence of checking the connected Wi-Fi network and reporting changes to the device twin
+#define WIFI_STATUS_CHECK_PERIOD_S 10
+
 // Enables I2C read/write debug
 //#define ENABLE_READ_WRITE_DEBUG
\ No newline at end of file
@@ -22,6 +22,7 @@
 #include "parson.h"
 #include "build_options.h"
 #include "magicKey.h"
+#include "imu_telemetry.h"
 
 extern volatile sig_atomic_t terminationRequired;
 
@@ -46,6 +47,9 @@ static const char cstrDeviceTwinJsonStringIOTC[]  = "{\"%s\": {\"value\": \"%s\"
 // .active_high - true if GPIO item is active high, false if active low.  This is used to init the GPIO 
 twin_t twinArray[] = {
 	{.twinKey = "MagicLockboxRecipe",.twinVar = magicKeyRecipe, .twinSize = sizeof(magicKeyRecipe),.twinFd = NULL,.twinGPIO = NO_GPIO_ASSOCIATED_WITH_TWIN,.twinType = TYPE_STRING,.active_high = true},
+#ifdef IMU_TELEMETRY
+	{.twinKey = "ImuTelemetryBytesPerSecond",.twinVar = &imuTelemetryBytesPerSecond, .twinSize = sizeof(imuTelemetryBytesPerSecond),.twinFd = NULL,.twinGPIO = NO_GPIO_ASSOCIATED_WITH_TWIN,.twinType = TYPE_INT,.active_high = true},
+#endif
 };
 
 // Calculate how many twin_t items are in the array.  We use this to iterate through the structure.
@@ -302,4 +306,6 @@ void deviceTwinChangedHandler(JSON_Object * desiredProperties)
 	}
 #endif 
 
+	// The recipe may have changed, let the lockbox re-evaluate it
+	magicLockbox_markDirty();
 }
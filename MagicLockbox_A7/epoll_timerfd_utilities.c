@@ -2,12 +2,230 @@
    Licensed under the MIT License. */
 
 #include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include <sys/timerfd.h>
 #include <applibs/log.h>
 #include "epoll_timerfd_utilities.h"
 
+static EventBatchStats batchStats;
+static uint64_t lastWakeupNs;
+static EventData *instrumentedEventData;
+static uint32_t defaultBudgetUs;
+
+static uint64_t TimespecToNs(const struct timespec *ts)
+{
+    return (uint64_t)ts->tv_sec * 1000000000ULL + (uint64_t)ts->tv_nsec;
+}
+
+uint64_t GetMonotonicNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return TimespecToNs(&now);
+}
+
+static void AddHistogramSample(EventHistogram *histogram, uint64_t ns)
+{
+    unsigned int bucket = 0;
+    uint64_t us = ns / 1000;
+    while (us != 0 && bucket < EVENT_HISTOGRAM_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    histogram->totalNs += ns;
+    if (histogram->maxNs < ns) {
+        histogram->maxNs = ns;
+    }
+}
+
+/// <summary>
+///     Counts a handler call which exceeded its time budget and logs it, unless the handler
+///     has already been logged within EVENT_OVERRUN_LOG_INTERVAL_MS.
+/// </summary>
+static void RecordOverrun(EventData *eventData, uint64_t runNs, uint32_t budgetUs, uint64_t nowNs)
+{
+    EventHandlerStats *stats = &eventData->stats;
+    stats->overruns++;
+    stats->unloggedOverruns++;
+    batchStats.budgetOverruns++;
+
+    if (stats->lastOverrunLogNs != 0 &&
+        nowNs - stats->lastOverrunLogNs < EVENT_OVERRUN_LOG_INTERVAL_MS * 1000000ULL) {
+        return;
+    }
+    Log_Debug("WARNING: Handler %s ran %llu us, budget %u us (%u overruns since last report, %u "
+              "total).\n",
+              eventData->name != NULL ? eventData->name : "(unnamed)",
+              (unsigned long long)(runNs / 1000), budgetUs, stats->unloggedOverruns,
+              stats->overruns);
+    stats->unloggedOverruns = 0;
+    stats->lastOverrunLogNs = nowNs;
+}
+
+/// <summary>
+///     Calls the handler of an event and records how long it waited and how long it ran.
+/// </summary>
+/// <param name="eventData">The event to dispatch</param>
+/// <param name="readyNs">CLOCK_MONOTONIC time at which the event became ready</param>
+static void CallEventHandler(EventData *eventData, uint64_t readyNs)
+{
+    uint64_t startNs = GetMonotonicNs();
+    eventData->eventHandler(eventData);
+    uint64_t endNs = GetMonotonicNs();
+
+    EventHandlerStats *stats = &eventData->stats;
+    if (!stats->registered) {
+        stats->registered = true;
+        stats->next = instrumentedEventData;
+        instrumentedEventData = eventData;
+    }
+    AddHistogramSample(&stats->queueDelay, startNs > readyNs ? startNs - readyNs : 0);
+    AddHistogramSample(&stats->runTime, endNs - startNs);
+
+    uint32_t budgetUs = eventData->budgetUs != 0 ? eventData->budgetUs : defaultBudgetUs;
+    if (budgetUs != 0 && endNs - startNs > (uint64_t)budgetUs * 1000) {
+        RecordOverrun(eventData, endNs - startNs, budgetUs, endNs);
+    }
+}
+
+/// <summary>
+///     Per priority class FIFOs of handlers ready to run in the current batch. bypassed counts
+///     the handlers of higher classes run while the queue was waiting.
+/// </summary>
+static struct {
+    EventData *head;
+    EventData *tail;
+    uint32_t bypassed;
+} readyQueues[EVENT_PRIORITY_CLASSES];
+
+static unsigned int GetPriorityIndex(EventPriority priority)
+{
+    if (priority < EVENT_PRIORITY_HIGHEST) {
+        return 0;
+    }
+    if (priority >= EVENT_PRIORITY_HIGHEST + EVENT_PRIORITY_CLASSES) {
+        return EVENT_PRIORITY_CLASSES - 1;
+    }
+    return (unsigned int)(priority - EVENT_PRIORITY_HIGHEST);
+}
+
+/// <summary>
+///     Queues a handler to run in the current batch. A handler which is already queued is not
+///     queued twice, so repeated expirations within one batch are coalesced.
+/// </summary>
+static void EnqueueReadyEvent(EventData *eventData, uint64_t readyNs)
+{
+    if (eventData->queued) {
+        return;
+    }
+
+    unsigned int index = GetPriorityIndex(eventData->priority);
+    eventData->queued = true;
+    eventData->readyNs = readyNs;
+    eventData->readyClass = index;
+    eventData->nextReady = NULL;
+    eventData->prevReady = readyQueues[index].tail;
+    if (readyQueues[index].tail != NULL) {
+        readyQueues[index].tail->nextReady = eventData;
+    } else {
+        readyQueues[index].head = eventData;
+    }
+    readyQueues[index].tail = eventData;
+}
+
+static void RemoveReadyEvent(EventData *eventData)
+{
+    if (!eventData->queued) {
+        return;
+    }
+
+    unsigned int index = eventData->readyClass;
+    if (eventData->prevReady != NULL) {
+        eventData->prevReady->nextReady = eventData->nextReady;
+    } else {
+        readyQueues[index].head = eventData->nextReady;
+    }
+    if (eventData->nextReady != NULL) {
+        eventData->nextReady->prevReady = eventData->prevReady;
+    } else {
+        readyQueues[index].tail = eventData->prevReady;
+    }
+    if (readyQueues[index].head == NULL) {
+        readyQueues[index].bypassed = 0;
+    }
+    eventData->queued = false;
+    eventData->nextReady = NULL;
+    eventData->prevReady = NULL;
+}
+
+/// <summary>
+///     Pops the next handler to run: the head of the lowest class which has been bypassed
+///     EVENT_STARVATION_LIMIT times, otherwise the head of the highest non-empty class.
+/// </summary>
+static EventData *DequeueReadyEvent(void)
+{
+    int pick = -1;
+    for (int index = EVENT_PRIORITY_CLASSES - 1; index > 0; index--) {
+        if (readyQueues[index].head != NULL &&
+            readyQueues[index].bypassed >= EVENT_STARVATION_LIMIT) {
+            pick = index;
+            batchStats.starvationPromotions++;
+            break;
+        }
+    }
+    if (pick < 0) {
+        for (int index = 0; index < EVENT_PRIORITY_CLASSES; index++) {
+            if (readyQueues[index].head != NULL) {
+                pick = index;
+                break;
+            }
+        }
+    }
+    if (pick < 0) {
+        return NULL;
+    }
+
+    for (int index = pick + 1; index < EVENT_PRIORITY_CLASSES; index++) {
+        if (readyQueues[index].head != NULL) {
+            readyQueues[index].bypassed++;
+        }
+    }
+    readyQueues[pick].bypassed = 0;
+
+    EventData *eventData = readyQueues[pick].head;
+    readyQueues[pick].head = eventData->nextReady;
+    if (readyQueues[pick].head != NULL) {
+        readyQueues[pick].head->prevReady = NULL;
+    } else {
+        readyQueues[pick].tail = NULL;
+    }
+    eventData->nextReady = NULL;
+    eventData->queued = false;
+    batchStats.dispatchedPerPriority[pick]++;
+    return eventData;
+}
+
+/// <summary>
+///     Runs queued handlers until all queues are empty, including handlers queued meanwhile.
+/// </summary>
+/// <returns>The number of handlers called</returns>
+static int RunReadyEvents(void)
+{
+    int dispatched = 0;
+    EventData *eventData;
+    while ((eventData = DequeueReadyEvent()) != NULL) {
+        CallEventHandler(eventData, eventData->readyNs);
+        dispatched++;
+    }
+    return dispatched;
+}
+
 int CreateEpollFd(void)
 {
     int epollFd = -1;
@@ -43,6 +261,14 @@ int RegisterEventHandlerToEpoll(int epollFd, int eventFd, EventData *persistentE
     return 0;
 }
 
+int RegisterEventHandlerToEpollWithPriority(int epollFd, int eventFd,
+                                            EventData *persistentEventData,
+                                            const uint32_t epollEventMask, EventPriority priority)
+{
+    persistentEventData->priority = priority;
+    return RegisterEventHandlerToEpoll(epollFd, eventFd, persistentEventData, epollEventMask);
+}
+
 int UnregisterEventHandlerFromEpoll(int epollFd, int eventFd)
 {
     int res = 0;
@@ -121,8 +347,21 @@ int CreateTimerFdAndAddToEpoll(int epollFd, const struct timespec *period,
 
 int WaitForEventAndCallHandler(int epollFd)
 {
-    struct epoll_event event;
-    int numEventsOccurred = epoll_wait(epollFd, &event, 1, -1);
+    return WaitForEventsAndCallHandlers(epollFd, 1) < 0 ? -1 : 0;
+}
+
+int WaitForEventsAndCallHandlers(int epollFd, int maxEvents)
+{
+    struct epoll_event events[MAX_EVENTS_PER_WAIT_LIMIT];
+
+    if (maxEvents < 1) {
+        maxEvents = 1;
+    } else if (maxEvents > MAX_EVENTS_PER_WAIT_LIMIT) {
+        maxEvents = MAX_EVENTS_PER_WAIT_LIMIT;
+    }
+
+    int numEventsOccurred = epoll_wait(epollFd, events, maxEvents, -1);
+    lastWakeupNs = GetMonotonicNs();
 
     if (numEventsOccurred == -1) {
         if (errno == EINTR) {
@@ -133,9 +372,718 @@ int WaitForEventAndCallHandler(int epollFd)
         return -1;
     }
 
-    if (numEventsOccurred == 1 && event.data.ptr != NULL) {
-        EventData *eventData = event.data.ptr;
-        eventData->eventHandler(eventData);
+    for (int i = 0; i < numEventsOccurred; i++) {
+        EventData *eventData = events[i].data.ptr;
+        if (eventData != NULL) {
+            EnqueueReadyEvent(eventData, lastWakeupNs);
+        }
+    }
+    int dispatched = RunReadyEvents();
+
+    if (numEventsOccurred > 0) {
+        batchStats.wakeups++;
+        batchStats.eventsDispatched += (uint64_t)dispatched;
+        batchStats.lastBatchSize = (uint32_t)numEventsOccurred;
+        if (batchStats.maxBatchSize < (uint32_t)numEventsOccurred) {
+            batchStats.maxBatchSize = (uint32_t)numEventsOccurred;
+        }
+        batchStats.batchSizeHistogram[numEventsOccurred]++;
+    }
+
+    return dispatched;
+}
+
+const EventBatchStats *GetEventBatchStats(void)
+{
+    return &batchStats;
+}
+
+void ResetEventBatchStats(void)
+{
+    memset(&batchStats, 0, sizeof(batchStats));
+}
+
+void LogEventBatchStats(void)
+{
+    Log_Debug("INFO: Event loop: %llu wakeups, %llu events, max batch %u.\n",
+              (unsigned long long)batchStats.wakeups,
+              (unsigned long long)batchStats.eventsDispatched, batchStats.maxBatchSize);
+    for (int i = 1; i <= MAX_EVENTS_PER_WAIT_LIMIT; i++) {
+        if (batchStats.batchSizeHistogram[i] != 0) {
+            Log_Debug("INFO:   batch of %2d: %u\n", i, batchStats.batchSizeHistogram[i]);
+        }
+    }
+    Log_Debug("INFO:   handlers per priority class:");
+    for (int i = 0; i < EVENT_PRIORITY_CLASSES; i++) {
+        Log_Debug(" %llu", (unsigned long long)batchStats.dispatchedPerPriority[i]);
+    }
+    Log_Debug(", %u starvation promotions, %u budget overruns\n",
+              batchStats.starvationPromotions, batchStats.budgetOverruns);
+}
+
+void GetLastWakeupTime(struct timespec *wakeupTime)
+{
+    wakeupTime->tv_sec = (time_t)(lastWakeupNs / 1000000000ULL);
+    wakeupTime->tv_nsec = (long)(lastWakeupNs % 1000000000ULL);
+}
+
+EventData *GetInstrumentedEventDataList(void)
+{
+    return instrumentedEventData;
+}
+
+uint32_t GetEventHistogramPercentileUs(const EventHistogram *histogram, unsigned int percentile)
+{
+    if (histogram->count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = ((uint64_t)histogram->count * percentile + 99) / 100;
+    uint64_t seen = 0;
+    for (unsigned int bucket = 0; bucket < EVENT_HISTOGRAM_BUCKETS - 1; bucket++) {
+        seen += histogram->buckets[bucket];
+        if (seen >= rank && seen != 0) {
+            return 1U << bucket;
+        }
+    }
+    return (uint32_t)(histogram->maxNs / 1000);
+}
+
+int FormatEventHandlerStats(const EventData *eventData, char *buffer, size_t bufferSize)
+{
+    const EventHandlerStats *stats = &eventData->stats;
+    int length = snprintf(buffer, bufferSize, "q %u/%u/%u r %u/%u/%u",
+                          GetEventHistogramPercentileUs(&stats->queueDelay, 50),
+                          GetEventHistogramPercentileUs(&stats->queueDelay, 99),
+                          (uint32_t)(stats->queueDelay.maxNs / 1000),
+                          GetEventHistogramPercentileUs(&stats->runTime, 50),
+                          GetEventHistogramPercentileUs(&stats->runTime, 99),
+                          (uint32_t)(stats->runTime.maxNs / 1000));
+    if (stats->overruns == 0 || length < 0 || (size_t)length >= bufferSize) {
+        return length;
+    }
+    int overrunLength =
+        snprintf(buffer + length, bufferSize - (size_t)length, " o %u", stats->overruns);
+    return overrunLength < 0 ? overrunLength : length + overrunLength;
+}
+
+static void LogEventHistogram(const char *label, const EventHistogram *histogram)
+{
+    Log_Debug("INFO:   %s:", label);
+    for (unsigned int bucket = 0; bucket < EVENT_HISTOGRAM_BUCKETS; bucket++) {
+        Log_Debug(" %u", histogram->buckets[bucket]);
+    }
+    Log_Debug(" (avg %llu us, max %llu us)\n",
+              (unsigned long long)(histogram->totalNs / histogram->count / 1000),
+              (unsigned long long)(histogram->maxNs / 1000));
+}
+
+void LogEventHandlerStats(void)
+{
+    Log_Debug("INFO: Event handler histograms, buckets <1us, <2us, <4us ... >=%uus:\n",
+              1U << (EVENT_HISTOGRAM_BUCKETS - 2));
+    for (EventData *eventData = instrumentedEventData; eventData != NULL;
+         eventData = eventData->stats.next) {
+        if (eventData->stats.runTime.count == 0) {
+            continue;
+        }
+        if (eventData->name != NULL) {
+            Log_Debug("INFO: %s, %u calls\n", eventData->name, eventData->stats.runTime.count);
+        } else {
+            Log_Debug("INFO: handler %p, %u calls\n", (void *)eventData->eventHandler,
+                      eventData->stats.runTime.count);
+        }
+        LogEventHistogram("queue delay", &eventData->stats.queueDelay);
+        LogEventHistogram("run time   ", &eventData->stats.runTime);
+        if (eventData->stats.overruns != 0) {
+            Log_Debug("INFO:   budget overruns: %u\n", eventData->stats.overruns);
+        }
+    }
+}
+
+void SetEventHandlerTimeBudget(uint32_t budgetUs)
+{
+    defaultBudgetUs = budgetUs;
+}
+
+void ResetEventHandlerStats(void)
+{
+    for (EventData *eventData = instrumentedEventData; eventData != NULL;
+         eventData = eventData->stats.next) {
+        memset(&eventData->stats.queueDelay, 0, sizeof(eventData->stats.queueDelay));
+        memset(&eventData->stats.runTime, 0, sizeof(eventData->stats.runTime));
+        eventData->stats.overruns = 0;
+        eventData->stats.unloggedOverruns = 0;
+    }
+}
+
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_LEVEL_BITS)
+#define TIMER_WHEEL_SLOT_MASK ((uint64_t)TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_RANGE ((uint64_t)1 << (TIMER_WHEEL_LEVEL_BITS * TIMER_WHEEL_LEVELS))
+#define TIMER_WHEEL_DISARMED UINT64_MAX
+#define TIMER_WHEEL_MAX_COALESCED_TICKS 16
+
+static void TimerWheelEventHandler(EventData *eventData);
+
+/// <summary>
+///     State of the hierarchical timer wheel. Level 0 holds timers due within the next
+///     TIMER_WHEEL_SLOTS ticks, one slot per tick; each further level covers
+///     TIMER_WHEEL_SLOTS times the span of the previous one and is cascaded down when the
+///     lower level wraps around. Bit n of occupied[level] is set while slot n is non-empty.
+///     Timers with slack sit in the wheel at the end of their slack window and are also linked
+///     into slackTimers, so that a wakeup can run them early. coalescedTicks collects the
+///     distinct due ticks of the timers run by the current wakeup, wakeTick.
+/// </summary>
+static struct {
+    int timerFd;
+    uint64_t tickNs;
+    uint64_t currentTick;
+    uint64_t programmedTick;
+    bool running;
+    uint64_t occupied[TIMER_WHEEL_LEVELS];
+    SoftTimer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    SoftTimer *expiring;
+    SoftTimer *slackTimers;
+    uint64_t wakeTick;
+    uint64_t coalescedTicks[TIMER_WHEEL_MAX_COALESCED_TICKS];
+    unsigned int coalescedCount;
+    TimerWheelStats stats;
+    EventData eventData;
+} wheel = {.timerFd = -1,
+           .programmedTick = TIMER_WHEEL_DISARMED,
+           .eventData = {.eventHandler = TimerWheelEventHandler,
+                         .name = "timerWheel",
+                         .priority = EventPriority_Sensor}};
+
+static uint64_t GetCurrentTick(void)
+{
+    return GetMonotonicNs() / wheel.tickNs;
+}
+
+/// <summary>
+///     Returns the index of the first set bit of bits at or after position start, counting
+///     around the end of the word, as an offset from start. bits must be non-zero.
+/// </summary>
+static unsigned int FirstSlotFrom(uint64_t bits, unsigned int start)
+{
+    uint64_t rotated = start == 0 ? bits : (bits >> start) | (bits << (TIMER_WHEEL_SLOTS - start));
+    return (unsigned int)__builtin_ctzll(rotated);
+}
+
+static void UnlinkSoftTimer(SoftTimer *timer)
+{
+    if (timer->prev != NULL) {
+        timer->prev->next = timer->next;
+    } else {
+        *timer->listHead = timer->next;
+    }
+    if (timer->next != NULL) {
+        timer->next->prev = timer->prev;
+    }
+
+    // Clear the occupancy bit once the last timer of a wheel slot is gone.
+    if (*timer->listHead == NULL && timer->listHead != &wheel.expiring) {
+        ptrdiff_t index = timer->listHead - &wheel.slots[0][0];
+        wheel.occupied[index / TIMER_WHEEL_SLOTS] &= ~(1ULL << (index % TIMER_WHEEL_SLOTS));
+    }
+
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->listHead = NULL;
+}
+
+static void LinkSoftTimer(SoftTimer *timer, SoftTimer **listHead)
+{
+    timer->listHead = listHead;
+    timer->prev = NULL;
+    timer->next = *listHead;
+    if (timer->next != NULL) {
+        timer->next->prev = timer;
+    }
+    *listHead = timer;
+}
+
+/// <summary>
+///     Places a timer in the wheel according to the distance of the end of its slack window
+///     from the current tick, and
+///     returns the tick at which the wheel has to look at it next: its expiry when it lands in
+///     level 0, or the tick at which its slot is cascaded otherwise.
+/// </summary>
+static uint64_t InsertSoftTimer(SoftTimer *timer)
+{
+    uint64_t expires = timer->expiresTick + timer->slackTicks;
+    uint64_t delta = expires > wheel.currentTick ? expires - wheel.currentTick : 0;
+    if (delta >= TIMER_WHEEL_RANGE) {
+        // Park far timers in the outermost level; they are re-placed when it is cascaded.
+        delta = TIMER_WHEEL_RANGE - 1;
+    }
+    expires = wheel.currentTick + delta;
+
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+           delta >= (1ULL << (TIMER_WHEEL_LEVEL_BITS * (level + 1)))) {
+        level++;
+    }
+    unsigned int shift = (unsigned int)(TIMER_WHEEL_LEVEL_BITS * level);
+    unsigned int slot = (unsigned int)((expires >> shift) & TIMER_WHEEL_SLOT_MASK);
+
+    LinkSoftTimer(timer, &wheel.slots[level][slot]);
+    wheel.occupied[level] |= 1ULL << slot;
+
+    if (level == 0) {
+        return expires;
+    }
+    uint64_t span = 1ULL << shift;
+    uint64_t cascadeTick = ((wheel.currentTick + span - 1) >> shift) << shift;
+    unsigned int cascadeSlot = (unsigned int)((cascadeTick >> shift) & TIMER_WHEEL_SLOT_MASK);
+    return cascadeTick + (((slot - cascadeSlot) & TIMER_WHEEL_SLOT_MASK) << shift);
+}
+
+/// <summary>
+///     Returns the earliest tick at which the wheel has work to do, or TIMER_WHEEL_DISARMED.
+///     For levels above 0 this is the tick at which the first occupied slot is cascaded.
+/// </summary>
+static uint64_t GetNextWheelTick(void)
+{
+    uint64_t next = TIMER_WHEEL_DISARMED;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        if (wheel.occupied[level] == 0) {
+            continue;
+        }
+        unsigned int shift = (unsigned int)(TIMER_WHEEL_LEVEL_BITS * level);
+        uint64_t span = 1ULL << shift;
+        uint64_t firstTick = ((wheel.currentTick + span - 1) >> shift) << shift;
+        unsigned int firstSlot = (unsigned int)((firstTick >> shift) & TIMER_WHEEL_SLOT_MASK);
+        uint64_t candidate =
+            firstTick + ((uint64_t)FirstSlotFrom(wheel.occupied[level], firstSlot) << shift);
+        if (candidate < next) {
+            next = candidate;
+        }
+    }
+    return next;
+}
+
+/// <summary>
+///     Programs the wheel timerfd to fire at the given tick, or disarms it.
+/// </summary>
+static void ProgramWheelTimerFd(uint64_t tick)
+{
+    struct itimerspec newValue = {.it_value = {}, .it_interval = {}};
+    if (tick != TIMER_WHEEL_DISARMED) {
+        uint64_t ns = tick * wheel.tickNs;
+        newValue.it_value.tv_sec = (time_t)(ns / 1000000000ULL);
+        newValue.it_value.tv_nsec = (long)(ns % 1000000000ULL);
+    }
+
+    if (timerfd_settime(wheel.timerFd, TFD_TIMER_ABSTIME, &newValue, NULL) < 0) {
+        Log_Debug("ERROR: Could not set timer wheel expiry: %s (%d).\n", strerror(errno), errno);
+        return;
+    }
+    wheel.programmedTick = tick;
+}
+
+static void AddSlackTimer(SoftTimer *timer)
+{
+    timer->prevSlack = NULL;
+    timer->nextSlack = wheel.slackTimers;
+    if (timer->nextSlack != NULL) {
+        timer->nextSlack->prevSlack = timer;
+    }
+    wheel.slackTimers = timer;
+}
+
+static void RemoveSlackTimer(SoftTimer *timer)
+{
+    if (timer->prevSlack != NULL) {
+        timer->prevSlack->nextSlack = timer->nextSlack;
+    } else if (wheel.slackTimers == timer) {
+        wheel.slackTimers = timer->nextSlack;
+    } else {
+        // Not in the list
+        return;
+    }
+    if (timer->nextSlack != NULL) {
+        timer->nextSlack->prevSlack = timer->prevSlack;
+    }
+    timer->nextSlack = NULL;
+    timer->prevSlack = NULL;
+}
+
+/// <summary>
+///     Records the tick at which an expiry run by the current wakeup would have needed a wakeup
+///     of its own: the due tick for timers with slack, the wakeup itself for all others. Every
+///     distinct tick beyond the first is a saved wakeup; the wheel did not wake up at a past due
+///     tick, otherwise the timer would have run then.
+/// </summary>
+static void CountCoalescedExpiry(uint64_t dueTick)
+{
+    unsigned int stored = wheel.coalescedCount < TIMER_WHEEL_MAX_COALESCED_TICKS
+                              ? wheel.coalescedCount
+                              : TIMER_WHEEL_MAX_COALESCED_TICKS;
+    for (unsigned int i = 0; i < stored; i++) {
+        if (wheel.coalescedTicks[i] == dueTick) {
+            return;
+        }
+    }
+    if (stored < TIMER_WHEEL_MAX_COALESCED_TICKS) {
+        wheel.coalescedTicks[stored] = dueTick;
+    }
+    wheel.coalescedCount++;
+}
+
+/// <summary>
+///     Queues the handler of a timer which has been unlinked from the wheel, and re-inserts the
+///     timer if it is periodic.
+/// </summary>
+static void ExpireSoftTimer(SoftTimer *timer, uint64_t expiredTick)
+{
+    wheel.stats.expirations++;
+    CountCoalescedExpiry(timer->slackTicks != 0 ? timer->expiresTick : wheel.wakeTick);
+
+    if (timer->periodTicks != 0) {
+        timer->expiresTick += timer->periodTicks;
+        if (timer->expiresTick <= expiredTick) {
+            // Overran by more than a period; skip the missed expirations.
+            timer->expiresTick = expiredTick + timer->periodTicks;
+        }
+        InsertSoftTimer(timer);
+    } else if (timer->slackTicks != 0) {
+        RemoveSlackTimer(timer);
+    }
+    EnqueueReadyEvent(&timer->eventData, expiredTick * wheel.tickNs);
+}
+
+/// <summary>
+///     Runs the timers with slack whose window has opened by nowTick ahead of the end of their
+///     window, sharing the current wakeup.
+/// </summary>
+static void RunOpenSlackWindows(uint64_t nowTick)
+{
+    SoftTimer *next;
+    for (SoftTimer *timer = wheel.slackTimers; timer != NULL; timer = next) {
+        next = timer->nextSlack;
+        if (timer->listHead != NULL && timer->expiresTick <= nowTick) {
+            UnlinkSoftTimer(timer);
+            ExpireSoftTimer(timer, nowTick);
+        }
+    }
+}
+
+static void CascadeSoftTimers(int level, unsigned int slot)
+{
+    SoftTimer *timer;
+    while ((timer = wheel.slots[level][slot]) != NULL) {
+        UnlinkSoftTimer(timer);
+        InsertSoftTimer(timer);
+    }
+}
+
+/// <summary>
+///     Processes every tick up to and including lastTick: cascades higher levels on wrap-around
+///     and calls the handlers of expired timers. Empty stretches of level 0 are skipped.
+/// </summary>
+static void AdvanceTimerWheel(uint64_t lastTick)
+{
+    while (wheel.currentTick <= lastTick) {
+        unsigned int index = (unsigned int)(wheel.currentTick & TIMER_WHEEL_SLOT_MASK);
+
+        if (index == 0) {
+            for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+                unsigned int shift = (unsigned int)(TIMER_WHEEL_LEVEL_BITS * level);
+                unsigned int slot =
+                    (unsigned int)((wheel.currentTick >> shift) & TIMER_WHEEL_SLOT_MASK);
+                CascadeSoftTimers(level, slot);
+                if (slot != 0) {
+                    break;
+                }
+            }
+        }
+
+        // Skip empty slots, up to the next wrap-around of level 0 but never past lastTick.
+        uint64_t pending = wheel.occupied[0] >> index;
+        uint64_t nextTick = pending == 0 ? (wheel.currentTick | TIMER_WHEEL_SLOT_MASK) + 1
+                                         : wheel.currentTick + __builtin_ctzll(pending);
+        if (nextTick != wheel.currentTick) {
+            wheel.currentTick = nextTick <= lastTick ? nextTick : lastTick + 1;
+            continue;
+        }
+
+        // Move the whole slot aside, periodic timers may be re-inserted into the same slot.
+        wheel.expiring = wheel.slots[0][index];
+        wheel.slots[0][index] = NULL;
+        wheel.occupied[0] &= ~(1ULL << index);
+        for (SoftTimer *timer = wheel.expiring; timer != NULL; timer = timer->next) {
+            timer->listHead = &wheel.expiring;
+        }
+        uint64_t expiredTick = wheel.currentTick++;
+
+        SoftTimer *timer;
+        while ((timer = wheel.expiring) != NULL) {
+            UnlinkSoftTimer(timer);
+            ExpireSoftTimer(timer, expiredTick);
+        }
+    }
+}
+
+static void TimerWheelEventHandler(EventData *eventData)
+{
+    uint64_t expirations;
+    if (read(wheel.timerFd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+        Log_Debug("ERROR: Could not read timer wheel timerfd %s (%d).\n", strerror(errno), errno);
+    }
+
+    wheel.stats.wakeups++;
+    wheel.coalescedCount = 0;
+    wheel.running = true;
+    wheel.wakeTick = GetCurrentTick();
+    AdvanceTimerWheel(wheel.wakeTick);
+    RunOpenSlackWindows(wheel.wakeTick);
+    wheel.running = false;
+    if (wheel.coalescedCount > 1) {
+        wheel.stats.wakeupsSaved += wheel.coalescedCount - 1;
+    }
+
+    ProgramWheelTimerFd(GetNextWheelTick());
+}
+
+int CreateTimerWheelAndAddToEpoll(int epollFd, const struct timespec *tickPeriod)
+{
+    wheel.tickNs = TimespecToNs(tickPeriod);
+    if (wheel.tickNs == 0) {
+        Log_Debug("ERROR: Timer wheel tick must not be zero.\n");
+        return -1;
+    }
+
+    wheel.timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (wheel.timerFd < 0) {
+        Log_Debug("ERROR: Could not create timer wheel timerfd: %s (%d).\n", strerror(errno),
+                  errno);
+        return -1;
+    }
+    wheel.currentTick = GetCurrentTick();
+    wheel.programmedTick = TIMER_WHEEL_DISARMED;
+    ResetTimerWheelStats();
+
+    if (RegisterEventHandlerToEpoll(epollFd, wheel.timerFd, &wheel.eventData, EPOLLIN) != 0) {
+        CloseTimerWheel();
+        return -1;
+    }
+
+    return 0;
+}
+
+void CloseTimerWheel(void)
+{
+    CloseFdAndPrintError(wheel.timerFd, "TimerWheel");
+    wheel.timerFd = -1;
+}
+
+/// <summary>
+///     Arms timer to expire after the given delay and then every periodTicks ticks (0 for a
+///     single expiry), each time up to slack late. Reprograms the timerfd only when the timer
+///     becomes the earliest one.
+/// </summary>
+static int ArmSoftTimer(SoftTimer *timer, const struct timespec *delay, uint64_t periodTicks,
+                        const struct timespec *slack)
+{
+    if (wheel.timerFd < 0) {
+        Log_Debug("ERROR: Timer wheel not created.\n");
+        return -1;
+    }
+
+    CancelSoftTimer(timer);
+    uint64_t delayNs = TimespecToNs(delay);
+    if (delayNs == 0) {
+        return 0;
+    }
+
+    // Round up so that a timer never expires before the requested delay has elapsed.
+    timer->eventData.fd = -1;
+    timer->periodTicks = periodTicks;
+    timer->expiresTick = (GetMonotonicNs() + delayNs + wheel.tickNs - 1) / wheel.tickNs;
+    timer->slackTicks = slack != NULL ? TimespecToNs(slack) / wheel.tickNs : 0;
+    if (timer->slackTicks != 0) {
+        AddSlackTimer(timer);
+    }
+
+    uint64_t wakeTick = InsertSoftTimer(timer);
+    if (!wheel.running && wakeTick < wheel.programmedTick) {
+        ProgramWheelTimerFd(wakeTick);
+    }
+
+    return 0;
+}
+
+int SetSoftTimerToPeriod(SoftTimer *timer, const struct timespec *period)
+{
+    return SetSoftTimerToPeriodWithSlack(timer, period, NULL);
+}
+
+int SetSoftTimerToSingleExpiry(SoftTimer *timer, const struct timespec *expiry)
+{
+    return ArmSoftTimer(timer, expiry, 0, NULL);
+}
+
+int SetSoftTimerToPeriodWithSlack(SoftTimer *timer, const struct timespec *period,
+                                  const struct timespec *slack)
+{
+    uint64_t periodNs = TimespecToNs(period);
+    uint64_t periodTicks = wheel.tickNs == 0 ? 0 : (periodNs + wheel.tickNs - 1) / wheel.tickNs;
+    return ArmSoftTimer(timer, period, periodTicks, slack);
+}
+
+int SetSoftTimerToSingleExpiryWithSlack(SoftTimer *timer, const struct timespec *expiry,
+                                        const struct timespec *slack)
+{
+    return ArmSoftTimer(timer, expiry, 0, slack);
+}
+
+void CancelSoftTimer(SoftTimer *timer)
+{
+    if (timer->listHead != NULL) {
+        // The timerfd stays programmed; an early wakeup with nothing to do is harmless.
+        UnlinkSoftTimer(timer);
+    }
+    if (timer->slackTicks != 0) {
+        RemoveSlackTimer(timer);
+        timer->slackTicks = 0;
+    }
+    // An expiry waiting in the run queue of the current batch is dropped as well.
+    RemoveReadyEvent(&timer->eventData);
+}
+
+bool IsSoftTimerArmed(const SoftTimer *timer)
+{
+    return timer->listHead != NULL;
+}
+
+const TimerWheelStats *GetTimerWheelStats(void)
+{
+    return &wheel.stats;
+}
+
+uint32_t GetTimerWheelWakeupsSavedPerMinute(void)
+{
+    uint64_t elapsedNs = GetMonotonicNs() - wheel.stats.sinceNs;
+    if (elapsedNs == 0) {
+        return 0;
+    }
+    return (uint32_t)(wheel.stats.wakeupsSaved * 60000000000ULL / elapsedNs);
+}
+
+void ResetTimerWheelStats(void)
+{
+    memset(&wheel.stats, 0, sizeof(wheel.stats));
+    wheel.stats.sinceNs = GetMonotonicNs();
+}
+
+void LogTimerWheelStats(void)
+{
+    Log_Debug("INFO: Timer wheel: %llu wakeups, %llu expirations, %llu wakeups saved by slack "
+              "(%u per minute).\n",
+              (unsigned long long)wheel.stats.wakeups, (unsigned long long)wheel.stats.expirations,
+              (unsigned long long)wheel.stats.wakeupsSaved, GetTimerWheelWakeupsSavedPerMinute());
+}
+
+static void DeferredTaskEventHandler(EventData *eventData);
+
+/// <summary>
+///     FIFO of posted deferred tasks and the eventfd signalled when it becomes non-empty.
+/// </summary>
+static struct {
+    int eventFd;
+    DeferredTask *head;
+    DeferredTask *tail;
+    EventData eventData;
+} deferredTasks = {.eventFd = -1,
+                   .eventData = {.eventHandler = DeferredTaskEventHandler,
+                                 .name = "deferredTasks",
+                                 .priority = EventPriority_Sensor}};
+
+static void DeferredTaskEventHandler(EventData *eventData)
+{
+    uint64_t count;
+    if (read(deferredTasks.eventFd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        Log_Debug("ERROR: Could not read deferred task eventfd %s (%d).\n", strerror(errno),
+                  errno);
+    }
+
+    // Detach the current queue so that tasks posted from handlers wait for the next pass.
+    DeferredTask *task = deferredTasks.head;
+    deferredTasks.head = NULL;
+    deferredTasks.tail = NULL;
+
+    while (task != NULL) {
+        DeferredTask *next = task->next;
+        task->next = NULL;
+        task->pending = false;
+        EnqueueReadyEvent(&task->eventData, task->postedNs);
+        task = next;
+    }
+}
+
+int CreateDeferredTaskQueueAndAddToEpoll(int epollFd)
+{
+    deferredTasks.eventFd = eventfd(0, EFD_NONBLOCK);
+    if (deferredTasks.eventFd < 0) {
+        Log_Debug("ERROR: Could not create deferred task eventfd: %s (%d).\n", strerror(errno),
+                  errno);
+        return -1;
+    }
+
+    if (RegisterEventHandlerToEpoll(epollFd, deferredTasks.eventFd, &deferredTasks.eventData,
+                                    EPOLLIN) != 0) {
+        CloseDeferredTaskQueue();
+        return -1;
+    }
+
+    // Tasks may have been posted before the queue existed.
+    if (deferredTasks.head != NULL) {
+        uint64_t one = 1;
+        if (write(deferredTasks.eventFd, &one, sizeof(one)) == -1) {
+            Log_Debug("ERROR: Could not signal deferred task eventfd: %s (%d).\n",
+                      strerror(errno), errno);
+            CloseDeferredTaskQueue();
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void CloseDeferredTaskQueue(void)
+{
+    CloseFdAndPrintError(deferredTasks.eventFd, "DeferredTasks");
+    deferredTasks.eventFd = -1;
+}
+
+int PostDeferredTask(DeferredTask *task)
+{
+    if (task->pending) {
+        return 0;
+    }
+
+    task->pending = true;
+    task->next = NULL;
+    task->eventData.fd = -1;
+    task->postedNs = GetMonotonicNs();
+
+    bool wasEmpty = deferredTasks.head == NULL;
+    if (wasEmpty) {
+        deferredTasks.head = task;
+    } else {
+        deferredTasks.tail->next = task;
+    }
+    deferredTasks.tail = task;
+
+    // One eventfd write per batch of postings is enough to wake the loop.
+    if (wasEmpty && deferredTasks.eventFd >= 0) {
+        uint64_t one = 1;
+        if (write(deferredTasks.eventFd, &one, sizeof(one)) == -1) {
+            Log_Debug("ERROR: Could not signal deferred task eventfd: %s (%d).\n",
+                      strerror(errno), errno);
+            return -1;
+        }
     }
 
     return 0;
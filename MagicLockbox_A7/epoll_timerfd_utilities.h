@@ -2,19 +2,109 @@
    Licensed under the MIT License. */
 
 #pragma once
+#include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 #include <sys/epoll.h>
 #include <unistd.h>
 
+/// <summary>
+///     Upper bound on the number of ready events drained by a single epoll_wait call in
+///     <see cref="WaitForEventsAndCallHandlers" />.
+/// </summary>
+#define MAX_EVENTS_PER_WAIT_LIMIT 32
+
+/// <summary>
+///     Every level of the timer wheel has 1 &lt;&lt; TIMER_WHEEL_LEVEL_BITS slots. With four
+///     levels the wheel covers 2^24 ticks before timers are parked in the outermost level.
+/// </summary>
+#define TIMER_WHEEL_LEVEL_BITS 6
+#define TIMER_WHEEL_LEVELS 4
+
+/// <summary>
+///     Number of log2 buckets of the per-handler histograms. Bucket 0 counts samples below
+///     1 us, bucket n samples in [2^(n-1), 2^n) us, and the last bucket everything above.
+/// </summary>
+#define EVENT_HISTOGRAM_BUCKETS 20
+
+/// <summary>
+///     Number of consecutive handlers of higher priority classes after which a waiting handler
+///     of a lower class is dispatched anyway. Larger than any regular batch, so within normal
+///     operation priority order is strict and this only bounds pathological bursts.
+/// </summary>
+#define EVENT_STARVATION_LIMIT 64
+
+/// <summary>
+///     Minimum interval between two overrun warnings of the same handler. Overruns in between
+///     are counted and summarized by the next warning.
+/// </summary>
+#define EVENT_OVERRUN_LOG_INTERVAL_MS 10000
+
 /// Forward declaration of the data type passed to the handlers.
 struct EventData;
 
+/// <summary>
+///     Log-bucketed histogram of durations measured by the event loop.
+/// </summary>
+typedef struct EventHistogram {
+    uint32_t buckets[EVENT_HISTOGRAM_BUCKETS];
+    uint32_t count;
+    uint64_t totalNs;
+    uint64_t maxNs;
+} EventHistogram;
+
+/// <summary>
+///     Timing statistics kept by the event loop for every handler it has called.
+/// </summary>
+typedef struct EventHandlerStats {
+    /// <summary>
+    /// Delay between the event becoming ready (wakeup, or timer expiry for software timers)
+    /// and the handler starting.
+    /// </summary>
+    EventHistogram queueDelay;
+    /// <summary>
+    /// Time spent inside the handler.
+    /// </summary>
+    EventHistogram runTime;
+    /// <summary>
+    /// Number of calls which ran longer than the time budget of the handler.
+    /// </summary>
+    uint32_t overruns;
+    /// <summary>
+    /// Overruns not logged yet because of EVENT_OVERRUN_LOG_INTERVAL_MS, and the time of the
+    /// last overrun warning.
+    /// </summary>
+    uint32_t unloggedOverruns;
+    uint64_t lastOverrunLogNs;
+    /// <summary>
+    /// Next handler in the list returned by <see cref="GetInstrumentedEventDataList" />.
+    /// </summary>
+    struct EventData *next;
+    bool registered;
+} EventHandlerStats;
+
 /// <summary>
 ///     Function signature for event handlers.
 /// </summary>
 /// <param name="eventData">The provided event data</param>
 typedef void (*EventHandler)(struct EventData *eventData);
 
+/// <summary>
+///     Priority classes of event handlers. Within a batch, ready handlers of a lower value run
+///     first; handlers of the same class run in the order they became ready. The default of a
+///     zero-initialized EventData is EventPriority_Normal.
+/// </summary>
+typedef enum EventPriority {
+    EventPriority_Sensor = -2,
+    EventPriority_Actuator = -1,
+    EventPriority_Normal = 0,
+    EventPriority_Cloud = 1,
+    EventPriority_Housekeeping = 2,
+} EventPriority;
+
+#define EVENT_PRIORITY_HIGHEST EventPriority_Sensor
+#define EVENT_PRIORITY_CLASSES (EventPriority_Housekeeping - EventPriority_Sensor + 1)
+
 /// <summary>
 /// <para>Contains context data for epoll events.</para>
 /// <para>When an event is registered with RegisterEventHandlerToEpoll, supply
@@ -31,6 +121,32 @@ typedef struct EventData {
     /// The file descriptor that generated the event.
     /// </summary>
     int fd;
+    /// <summary>
+    /// Optional name used when reporting the statistics of this handler.
+    /// </summary>
+    const char *name;
+    /// <summary>
+    /// Priority class of the handler, see <see cref="EventPriority" />.
+    /// </summary>
+    EventPriority priority;
+    /// <summary>
+    /// Longest time, in microseconds, the handler may run before the call is counted as an
+    /// overrun. 0 selects the default set by <see cref="SetEventHandlerTimeBudget" />.
+    /// </summary>
+    uint32_t budgetUs;
+    /// <summary>
+    /// Timing statistics, maintained by the event loop.
+    /// </summary>
+    EventHandlerStats stats;
+    /// <summary>
+    /// Run queue bookkeeping, owned by epoll_timerfd_utilities.c. readyClass is the queue the
+    /// handler was put in, the priority may change while it is queued.
+    /// </summary>
+    struct EventData *nextReady;
+    struct EventData *prevReady;
+    uint64_t readyNs;
+    unsigned int readyClass;
+    bool queued;
 } EventData;
 
 /// <summary>
@@ -52,6 +168,21 @@ int CreateEpollFd(void);
 int RegisterEventHandlerToEpoll(int epollFd, int eventFd, EventData *persistentEventData,
                                 const uint32_t epollEventMask);
 
+/// <summary>
+///     Sets the priority class of an event and registers it with the epoll instance, see
+///     <see cref="RegisterEventHandlerToEpoll" />.
+/// </summary>
+/// <param name="epollFd">Epoll file descriptor</param>
+/// <param name="eventFd">File descriptor generating events for the epoll</param>
+/// <param name="persistentEventData">Persistent event data structure. This must stay in memory
+/// until the handler is removed from the epoll.</param>
+/// <param name="epollEventMask">Bit mask for the epoll event type</param>
+/// <param name="priority">Priority class of the handler</param>
+/// <returns>0 on success, or -1 on failure</returns>
+int RegisterEventHandlerToEpollWithPriority(int epollFd, int eventFd,
+                                            EventData *persistentEventData,
+                                            const uint32_t epollEventMask, EventPriority priority);
+
 /// <summary>
 ///     Unregisters an event with the epoll instance.
 /// </summary>
@@ -105,6 +236,293 @@ int CreateTimerFdAndAddToEpoll(int epollFd, const struct timespec *period,
 /// <returns>0 on success, or -1 on failure</returns>
 int WaitForEventAndCallHandler(int epollFd);
 
+/// <summary>
+///     Waits for events on an epoll instance and triggers the handler of every event that is
+///     ready, draining up to maxEvents events with a single epoll_wait call.
+/// </summary>
+/// <param name="epollFd">
+///     Epoll file descriptor which was created with <see cref="CreateEpollFd" />.
+/// </param>
+/// <param name="maxEvents">
+///     Maximum number of events dispatched per call, clamped to 1..MAX_EVENTS_PER_WAIT_LIMIT.
+/// </param>
+/// <returns>The number of handlers called in this batch, or -1 on failure</returns>
+/// <remarks>
+///     <para>Handlers of one batch run back to back. An EventData whose fd is unregistered by an
+///     earlier handler of the same batch is still called once, so EventData instances must stay
+///     valid until the call returns.</para>
+///     <para>Ready epoll events, expired software timers and deferred tasks are queued per
+///     <see cref="EventPriority" /> class and run highest class first. A handler which has been
+///     passed over EVENT_STARVATION_LIMIT times in a row runs next regardless of its class.
+///     Cancelling a software timer also drops it from the queue.</para>
+/// </remarks>
+int WaitForEventsAndCallHandlers(int epollFd, int maxEvents);
+
+/// <summary>
+///     Statistics about the batches dispatched by <see cref="WaitForEventsAndCallHandlers" />.
+/// </summary>
+typedef struct EventBatchStats {
+    /// <summary>Number of epoll_wait calls which returned at least one event.</summary>
+    uint64_t wakeups;
+    /// <summary>Total number of handlers called.</summary>
+    uint64_t eventsDispatched;
+    /// <summary>Size of the most recent batch.</summary>
+    uint32_t lastBatchSize;
+    /// <summary>Largest batch seen so far.</summary>
+    uint32_t maxBatchSize;
+    /// <summary>Number of batches of each size, indexed by batch size.</summary>
+    uint32_t batchSizeHistogram[MAX_EVENTS_PER_WAIT_LIMIT + 1];
+    /// <summary>Handlers called per priority class, indexed by priority - EVENT_PRIORITY_HIGHEST.</summary>
+    uint64_t dispatchedPerPriority[EVENT_PRIORITY_CLASSES];
+    /// <summary>Handlers run ahead of their class by the starvation bound.</summary>
+    uint32_t starvationPromotions;
+    /// <summary>Handler calls which exceeded their time budget.</summary>
+    uint32_t budgetOverruns;
+} EventBatchStats;
+
+/// <summary>
+///     Returns the batch statistics collected since start-up or the last reset.
+/// </summary>
+const EventBatchStats *GetEventBatchStats(void);
+
+/// <summary>
+///     Clears the batch statistics.
+/// </summary>
+void ResetEventBatchStats(void);
+
+/// <summary>
+///     Prints the batch statistics with Log_Debug.
+/// </summary>
+void LogEventBatchStats(void);
+
+/// <summary>
+/// <para>A software timer multiplexed with all other software timers onto the single
+/// timerfd of the timer wheel.</para>
+/// <para>Only eventData.eventHandler needs to be populated; the handler is called from the
+/// event loop when the timer expires, with eventData.fd set to -1. The struct must remain
+/// valid for as long as the timer is armed.</para>
+/// </summary>
+/// <seealso cref="CreateTimerWheelAndAddToEpoll" />
+typedef struct SoftTimer {
+    /// <summary>
+    /// Handler called when the timer expires.
+    /// </summary>
+    EventData eventData;
+    /// <summary>
+    /// Timer wheel bookkeeping, owned by epoll_timerfd_utilities.c.
+    /// </summary>
+    struct SoftTimer *next;
+    struct SoftTimer *prev;
+    struct SoftTimer **listHead;
+    struct SoftTimer *nextSlack;
+    struct SoftTimer *prevSlack;
+    uint64_t expiresTick;
+    uint64_t periodTicks;
+    uint64_t slackTicks;
+} SoftTimer;
+
+/// <summary>
+///     Creates the timer wheel which drives all software timers from one timerfd, and adds
+///     that timerfd to an epoll instance. The timerfd is only armed while software timers are
+///     armed, and is programmed for the earliest pending expiry.
+/// </summary>
+/// <param name="epollFd">Epoll file descriptor</param>
+/// <param name="tickPeriod">Resolution of the wheel; timer periods are rounded up to it</param>
+/// <returns>0 on success, or -1 on failure</returns>
+int CreateTimerWheelAndAddToEpoll(int epollFd, const struct timespec *tickPeriod);
+
+/// <summary>
+///     Closes the timerfd of the timer wheel. Armed software timers never expire afterwards.
+/// </summary>
+void CloseTimerWheel(void);
+
+/// <summary>
+///     Arms a software timer to expire periodically. Re-arming an armed timer moves it.
+///     A zero period disarms the timer.
+/// </summary>
+/// <param name="timer">Persistent timer, see <see cref="SoftTimer" /></param>
+/// <param name="period">The timer period</param>
+/// <returns>0 on success, or -1 on failure</returns>
+int SetSoftTimerToPeriod(SoftTimer *timer, const struct timespec *period);
+
+/// <summary>
+///     Arms a software timer to expire once only. Re-arming an armed timer moves it.
+///     A zero expiry disarms the timer.
+/// </summary>
+/// <param name="timer">Persistent timer, see <see cref="SoftTimer" /></param>
+/// <param name="expiry">The time elapsed before it expires once</param>
+/// <returns>0 on success, or -1 on failure</returns>
+int SetSoftTimerToSingleExpiry(SoftTimer *timer, const struct timespec *expiry);
+
+/// <summary>
+/// <para>Arms a software timer to expire periodically, at any time between each expiry and
+/// slack later. See <see cref="SetSoftTimerToPeriod" />.</para>
+/// <para>The wheel wakes up at the end of the slack window and runs every timer whose window
+/// has opened by then, so timers with overlapping windows share one wakeup. The slack is
+/// rounded down to whole ticks and should be shorter than the period.</para>
+/// </summary>
+/// <param name="timer">Persistent timer, see <see cref="SoftTimer" /></param>
+/// <param name="period">The timer period</param>
+/// <param name="slack">How late the timer may expire</param>
+/// <returns>0 on success, or -1 on failure</returns>
+int SetSoftTimerToPeriodWithSlack(SoftTimer *timer, const struct timespec *period,
+                                  const struct timespec *slack);
+
+/// <summary>
+///     Arms a software timer to expire once, at any time between expiry and slack later.
+///     See <see cref="SetSoftTimerToPeriodWithSlack" />.
+/// </summary>
+/// <param name="timer">Persistent timer, see <see cref="SoftTimer" /></param>
+/// <param name="expiry">The time elapsed before it may expire</param>
+/// <param name="slack">How late the timer may expire</param>
+/// <returns>0 on success, or -1 on failure</returns>
+int SetSoftTimerToSingleExpiryWithSlack(SoftTimer *timer, const struct timespec *expiry,
+                                        const struct timespec *slack);
+
+/// <summary>
+///     Disarms a software timer. Does nothing if the timer is not armed.
+/// </summary>
+/// <param name="timer">The timer to disarm</param>
+void CancelSoftTimer(SoftTimer *timer);
+
+/// <summary>
+///     Returns true while the software timer is armed.
+/// </summary>
+bool IsSoftTimerArmed(const SoftTimer *timer);
+
+/// <summary>
+///     Statistics of the timer wheel since its creation or the last reset.
+/// </summary>
+typedef struct TimerWheelStats {
+    /// <summary>Number of times the wheel timerfd fired.</summary>
+    uint64_t wakeups;
+    /// <summary>Number of software timer expirations.</summary>
+    uint64_t expirations;
+    /// <summary>
+    /// Ticks at which a timer with slack was due but the wheel did not wake up, because the
+    /// timer was run later together with others. Each is a wakeup saved by coalescing.
+    /// </summary>
+    uint64_t wakeupsSaved;
+    /// <summary>CLOCK_MONOTONIC time at which collection started, in nanoseconds.</summary>
+    uint64_t sinceNs;
+} TimerWheelStats;
+
+/// <summary>
+///     Returns the timer wheel statistics.
+/// </summary>
+const TimerWheelStats *GetTimerWheelStats(void);
+
+/// <summary>
+///     Returns the average number of wakeups saved per minute by timer slack since the
+///     statistics were last reset.
+/// </summary>
+uint32_t GetTimerWheelWakeupsSavedPerMinute(void);
+
+/// <summary>
+///     Clears the timer wheel statistics.
+/// </summary>
+void ResetTimerWheelStats(void);
+
+/// <summary>
+///     Prints the timer wheel statistics with Log_Debug.
+/// </summary>
+void LogTimerWheelStats(void);
+
+/// <summary>
+/// <para>A unit of deferred work run by the event loop only when it has been posted.</para>
+/// <para>Only eventData.eventHandler needs to be populated; the handler is called once per
+/// posting, with eventData.fd set to -1. Posting an already pending task does nothing, so a
+/// module can mark itself dirty as often as it likes. The struct must remain valid for as long
+/// as the task is pending.</para>
+/// </summary>
+/// <seealso cref="CreateDeferredTaskQueueAndAddToEpoll" />
+typedef struct DeferredTask {
+    /// <summary>
+    /// Handler called when the task runs.
+    /// </summary>
+    EventData eventData;
+    /// <summary>
+    /// Queue bookkeeping, owned by epoll_timerfd_utilities.c.
+    /// </summary>
+    struct DeferredTask *next;
+    bool pending;
+    uint64_t postedNs;
+} DeferredTask;
+
+/// <summary>
+///     Creates the eventfd which wakes the event loop when deferred tasks are posted, and adds
+///     it to an epoll instance.
+/// </summary>
+/// <param name="epollFd">Epoll file descriptor</param>
+/// <returns>0 on success, or -1 on failure</returns>
+int CreateDeferredTaskQueueAndAddToEpoll(int epollFd);
+
+/// <summary>
+///     Closes the eventfd of the deferred task queue.
+/// </summary>
+void CloseDeferredTaskQueue(void);
+
+/// <summary>
+///     Queues a task to run on the next pass of the event loop. Tasks of the same priority class
+///     run in posting order. A task posted while the queue is being run is run on the following
+///     pass.
+/// </summary>
+/// <param name="task">Persistent task, see <see cref="DeferredTask" /></param>
+/// <returns>0 on success, or -1 on failure</returns>
+int PostDeferredTask(DeferredTask *task);
+
+/// <summary>
+///     Returns the time at which the last epoll_wait call of the event loop returned.
+/// </summary>
+/// <param name="wakeupTime">Receives the CLOCK_MONOTONIC time of the last wakeup</param>
+void GetLastWakeupTime(struct timespec *wakeupTime);
+
+/// <summary>
+///     Returns the CLOCK_MONOTONIC time in nanoseconds, the clock of every timestamp kept by
+///     the event loop.
+/// </summary>
+uint64_t GetMonotonicNs(void);
+
+/// <summary>
+///     Returns the first handler that has been called at least once since start-up; the rest
+///     are linked through stats.next.
+/// </summary>
+EventData *GetInstrumentedEventDataList(void);
+
+/// <summary>
+///     Returns the upper bound, in microseconds, of the histogram bucket holding the given
+///     percentile of the samples, or 0 if the histogram is empty.
+/// </summary>
+/// <param name="histogram">The histogram to evaluate</param>
+/// <param name="percentile">Percentile in the range 0..100</param>
+uint32_t GetEventHistogramPercentileUs(const EventHistogram *histogram, unsigned int percentile);
+
+/// <summary>
+///     Formats a compact summary of the queueing delay and run time of a handler as
+///     "q p50/p99/max r p50/p99/max" in microseconds, followed by " o overruns" if the handler
+///     has exceeded its time budget.
+/// </summary>
+/// <returns>The number of characters written, as snprintf</returns>
+int FormatEventHandlerStats(const EventData *eventData, char *buffer, size_t bufferSize);
+
+/// <summary>
+///     Sets the time budget of handlers which do not set EventData.budgetUs. A handler call
+///     which runs longer is counted in its stats and in the batch stats, and logged at most
+///     once per EVENT_OVERRUN_LOG_INTERVAL_MS per handler. 0 disables the check.
+/// </summary>
+/// <param name="budgetUs">Default budget in microseconds</param>
+void SetEventHandlerTimeBudget(uint32_t budgetUs);
+
+/// <summary>
+///     Prints the histograms of every handler with Log_Debug.
+/// </summary>
+void LogEventHandlerStats(void);
+
+/// <summary>
+///     Clears the histograms and overrun counts of every handler.
+/// </summary>
+void ResetEventHandlerStats(void);
+
 /// <summary>
 ///     Closes a file descriptor and prints an error on failure.
 /// </summary>
@@ -0,0 +1,35 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <applibs/log.h>
+
+#include "gpio_edge.h"
+
+#ifdef MAGICLOCKBOX_HOST_RUNTIME
+#include "Host/host_runtime.h"
+#endif
+
+int GpioEdge_OpenRisingEdgeNotifier(GPIO_Id gpioId)
+{
+#ifdef MAGICLOCKBOX_HOST_RUNTIME
+	return HostGpio_OpenEdgeNotifier(gpioId);
+#else
+	// The high-level core has no GPIO interrupts; edges could only be forwarded by an
+	// application on a real-time core, which this project does not have yet
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+uint64_t GpioEdge_ConsumeEdges(int notifierFd)
+{
+	uint64_t edges = 0;
+	if (read(notifierFd, &edges, sizeof(edges)) == -1) {
+		if (errno != EAGAIN) {
+			Log_Debug("ERROR: Could not read GPIO edge notifier: %s (%d).\n", strerror(errno), errno);
+		}
+		return 0;
+	}
+	return edges;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+#include <applibs/gpio.h>
+
+///<summary>
+///		Opens a file descriptor which becomes readable every time the GPIO line goes from low
+///		to high. Each read of 8 bytes returns and clears the number of edges since the last
+///		read, as with an eventfd. The descriptor can be added to the epoll.
+///</summary>
+///<param name="gpioId">GPIO line to watch, which must also be opened as input</param>
+///<returns>The file descriptor, or -1 with errno set to ENOTSUP where the platform has no
+///edge notifications and the line has to be polled</returns>
+int GpioEdge_OpenRisingEdgeNotifier(GPIO_Id gpioId);
+
+///<summary>
+///		Consumes the pending edges of a notifier.
+///</summary>
+///<returns>The number of edges since the last call, or 0 if there were none</returns>
+uint64_t GpioEdge_ConsumeEdges(int notifierFd);
@@ -36,6 +36,8 @@
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 // applibs_versions.h defines the API struct versions to use for applibs APIs.
 #include "applibs_versions.h"
@@ -47,8 +49,15 @@
 #include "deviceTwin.h"
 #include "azure_iot_utilities.h"
 #include "build_options.h"
+#include "gpio_edge.h"
 #include "i2c.h"
+#include "i2c_scheduler.h"
+#include "i2c_transport.h"
+#include "sensor_hal.h"
 #include "lsm6dso_reg.h"
+#include "accel_fsm.h"
+#include "accel_power.h"
+#include "accel_hub.h"
 
 #include "magicKey.h"
 #include "libs/Seeed_3D_touch_mgc3030.h"
@@ -59,9 +68,17 @@ uint8_t data[256];
 /* Private variables ---------------------------------------------------------*/
 
 static uint8_t whoamI, rst;
-static int accelTimerFd = -1;
 const uint8_t lsm6dsOAddress = LSM6DSO_ADDRESS;     // Addr = 0x6A
 lsm6dso_ctx_t dev_ctx;
+#ifdef ACCEL_SHADOW_REGISTERS
+static lsm6dso_shadow_t dev_shadow;
+#endif
+#ifdef ACCEL_FSM_PROGRAMS
+// FSM programs running on the LSM6DSO, their status is only read when there are some
+static int accelFsmPrograms;
+#endif
+// INT1 servicing goes before the bulk reads of the MGC3130 on the bus
+static I2cTransportDevice lsm6dsoDevice = { .name = "lsm6dso", .address = LSM6DSO_ADDRESS, .priority = I2cPriority_Interrupt };
 
 //Extern variables
 int i2cFd = -1;
@@ -84,21 +101,389 @@ void HAL_Delay(int delayTime) {
 }
 
 int lsm6dsoInt1GpioFd = -1;
+static int lsm6dsoInt1EdgeFd = -1;
+
+ImuRing imuSampleRing;
+
+static void FinishAccelService(void);
+
+#if defined(ACCEL_SENSOR_HUB) && !defined(ACCEL_FIFO_STREAMING)
+#error "ACCEL_SENSOR_HUB needs ACCEL_FIFO_STREAMING, the sensor hub samples come in through the FIFO"
+#endif
+
+#ifdef ACCEL_FIFO_STREAMING
+// Largest number of FIFO words read in one burst, a burst of the whole FIFO would hold the bus for
+// hundreds of milliseconds
+#define ACCEL_FIFO_MAX_BURST (2 * ACCEL_FIFO_WATERMARK)
+#define ACCEL_FIFO_WORD_SIZE 7
+
+static uint32_t accelFifoSamples;
+static uint32_t accelFifoOverruns;
+// Last sample of each sensor, to which the differences of compressed words are added
+static ImuSample accelFifoLast[2];
+static bool accelFifoLastValid[2];
+// Words left to read of the current drain
+static uint16_t accelFifoLevel;
+
+static void AccelFifoStatusReadDone(I2cTransaction *transaction);
+static void AccelFifoWordsReadDone(I2cTransaction *transaction);
+
+static const uint8_t accelFifoStatusRegister = LSM6DSO_FIFO_STATUS1;
+static uint8_t accelFifoStatus[2];
+static I2cTransaction accelFifoStatusRead = { .device = &lsm6dsoDevice, .writeData = &accelFifoStatusRegister, .writeLength = 1,
+	.readData = accelFifoStatus, .readLength = sizeof(accelFifoStatus), .callback = AccelFifoStatusReadDone };
+
+static const uint8_t accelFifoWordsRegister = LSM6DSO_FIFO_DATA_OUT_TAG;
+static uint8_t accelFifoWords[ACCEL_FIFO_MAX_BURST * ACCEL_FIFO_WORD_SIZE];
+static I2cTransaction accelFifoWordsRead = { .device = &lsm6dsoDevice, .writeData = &accelFifoWordsRegister, .writeLength = 1,
+	.readData = accelFifoWords, .callback = AccelFifoWordsReadDone };
+
 /// <summary>
-///     Print latest data from on-board sensors.
+///     Starts draining the LSM6DSO FIFO into imuSampleRing: the fill level and the status in one
+///     read, then the words in bursts of up to ACCEL_FIFO_MAX_BURST, each queued when the one
+///     before has completed.
 /// </summary>
-void AccelTimerEventHandler(EventData *eventData)
+static void DrainAccelFifo(void)
 {
-	// Consume the event.  If we don't do this we'll come right back 
-	// to process the same event again
-	if (ConsumeTimerFdEvent(accelTimerFd) != 0) {
-		terminationRequired = true;
+	if (I2cScheduler_Submit(&accelFifoStatusRead) != 0) {
+		FinishAccelService();
+	}
+}
+
+static void ReadAccelFifoWords(void)
+{
+	if (accelFifoLevel == 0) {
+		FinishAccelService();
+		return;
+	}
+	uint16_t count = accelFifoLevel < ACCEL_FIFO_MAX_BURST ? accelFifoLevel : ACCEL_FIFO_MAX_BURST;
+	accelFifoWordsRead.readLength = (size_t)count * ACCEL_FIFO_WORD_SIZE;
+	if (I2cScheduler_Submit(&accelFifoWordsRead) != 0) {
+		FinishAccelService();
+	}
+}
+
+static void AccelFifoStatusReadDone(I2cTransaction *transaction)
+{
+	if (transaction->result < 0) {
+		FinishAccelService();
+		return;
+	}
+	lsm6dso_fifo_status2_t status;
+	lsm6dso_fifo_level_status_unpack(accelFifoStatus, &accelFifoLevel, &status);
+	if (status.fifo_ovr_ia) {
+		accelFifoOverruns++;
+	}
+	ReadAccelFifoWords();
+}
+
+/// <summary>
+///     Decodes one FIFO word into samples of its sensor: one of an uncompressed word (NC,
+///     NC_T_1, NC_T_2), two of a 2XC word with 8 bit differences and three of a 3XC word with
+///     5 bit differences, each difference to the sample before. A sensor hub word is decoded
+///     by the sensor hub into one pressure sample, words of other sensors and differences coming before the first uncompressed
+///     word of their sensor are skipped.
+/// </summary>
+/// <returns>The number of samples decoded</returns>
+static size_t DecodeAccelFifoWord(const uint8_t *word, ImuSample *samples)
+{
+	// TAG_SENSOR is in bits 7:3 of the tag byte, the rest is the counter and parity
+	lsm6dso_fifo_tag_t tag = (lsm6dso_fifo_tag_t)(word[0] >> 3);
+	ImuSensor sensor;
+	size_t count;
+	switch (tag) {
+	case LSM6DSO_XL_NC_TAG:
+	case LSM6DSO_XL_NC_T_1_TAG:
+	case LSM6DSO_XL_NC_T_2_TAG:
+		sensor = ImuSensor_Accel;
+		count = 1;
+		break;
+	case LSM6DSO_XL_2XC_TAG:
+		sensor = ImuSensor_Accel;
+		count = 2;
+		break;
+	case LSM6DSO_XL_3XC_TAG:
+		sensor = ImuSensor_Accel;
+		count = 3;
+		break;
+	case LSM6DSO_GYRO_NC_TAG:
+	case LSM6DSO_GYRO_NC_T_1_TAG:
+	case LSM6DSO_GYRO_NC_T_2_TAG:
+		sensor = ImuSensor_Gyro;
+		count = 1;
+		break;
+	case LSM6DSO_GYRO_2XC_TAG:
+		sensor = ImuSensor_Gyro;
+		count = 2;
+		break;
+	case LSM6DSO_GYRO_3XC_TAG:
+		sensor = ImuSensor_Gyro;
+		count = 3;
+		break;
+#ifdef ACCEL_SENSOR_HUB
+	case LSM6DSO_SENSORHUB_SLAVE0_TAG:
+		AccelHub_HandleFifoWord(&word[1], &samples[0]);
+		return 1;
+#endif
+	default:
+		return 0;
+	}
+
+	ImuSample *last = &accelFifoLast[sensor];
+	if (count == 1) {
+		last->sensor = sensor;
+		last->x = (int16_t)(word[1] | word[2] << 8);
+		last->y = (int16_t)(word[3] | word[4] << 8);
+		last->z = (int16_t)(word[5] | word[6] << 8);
+		accelFifoLastValid[sensor] = true;
+		samples[0] = *last;
+		return 1;
+	}
+	if (!accelFifoLastValid[sensor]) {
+		return 0;
+	}
+	for (size_t i = 0; i < count; i++) {
+		int16_t diff[3];
+		if (count == 2) {
+			for (int axis = 0; axis < 3; axis++) {
+				diff[axis] = (int8_t)word[1 + i * 3 + axis];
+			}
+		}
+		else {
+			uint16_t packed = (uint16_t)(word[1 + i * 2] | word[2 + i * 2] << 8);
+			for (int axis = 0; axis < 3; axis++) {
+				int16_t value = (int16_t)((packed >> (axis * 5)) & 0x1F);
+				diff[axis] = value >= 16 ? (int16_t)(value - 32) : value;
+			}
+		}
+		last->x = (int16_t)(last->x + diff[0]);
+		last->y = (int16_t)(last->y + diff[1]);
+		last->z = (int16_t)(last->z + diff[2]);
+		samples[i] = *last;
+	}
+	return count;
+}
+
+static void AccelFifoWordsReadDone(I2cTransaction *transaction)
+{
+	if (transaction->result < 0) {
+		FinishAccelService();
 		return;
 	}
+	uint16_t count = (uint16_t)(transaction->readLength / ACCEL_FIFO_WORD_SIZE);
+	accelFifoLevel -= count;
+
+	// Up to three samples per compressed word
+	ImuSample samples[ACCEL_FIFO_MAX_BURST * 3];
+	size_t sampleCount = 0;
+	for (uint16_t i = 0; i < count; i++) {
+		sampleCount += DecodeAccelFifoWord(&accelFifoWords[i * ACCEL_FIFO_WORD_SIZE], &samples[sampleCount]);
+	}
+	accelFifoSamples += (uint32_t)sampleCount;
+	ImuRing_Write(&imuSampleRing, samples, sampleCount);
+
+	ReadAccelFifoWords();
+}
+#endif
+
+static void ReadAccelInterruptSources(void);
+static void AccelSourcesReadDone(I2cTransaction *transaction);
+
+// Time at which INT1 went high for the current INT1 service, 0 where it is polled. The LSM6DSO
+// latches no time with its event sources, so the edge is the earliest sign of an event.
+static uint64_t accelEventNs;
+// Time of the first INT1 edge not serviced yet, 0 if there is none
+static uint64_t accelEdgeNs;
+
+// WAKE_UP_SRC to D6D_SRC, followed by EMB_FUNC_STATUS and FSM_STATUS_A/B when FSM programs run
+static uint8_t accelSources[6];
+static const uint8_t accelSourcesRegister = LSM6DSO_WAKE_UP_SRC;
+static I2cTransaction accelSourcesRead = { .device = &lsm6dsoDevice, .writeData = &accelSourcesRegister, .writeLength = 1,
+	.readData = accelSources, .readLength = 3, .callback = AccelSourcesReadDone };
+#ifdef ACCEL_FSM_PROGRAMS
+static const uint8_t accelFsmStatusRegister = LSM6DSO_EMB_FUNC_STATUS_MAINPAGE;
+static I2cTransaction accelFsmStatusRead = { .device = &lsm6dsoDevice, .writeData = &accelFsmStatusRegister, .writeLength = 1,
+	.readData = &accelSources[3], .readLength = 3, .callback = AccelSourcesReadDone };
+#endif
+
+// Set while the reads servicing INT1 are queued, and when INT1 was found high again meanwhile
+static bool accelServiceBusy;
+static bool accelServiceAgain;
+
+/// <summary>
+///     Ends the service of INT1, starting the next one if INT1 went high while it ran, since
+///     its reads may have come before the new sources were latched.
+/// </summary>
+static void FinishAccelService(void)
+{
+	accelServiceBusy = false;
+	if (accelServiceAgain) {
+		accelServiceAgain = false;
+		ReadAccelInterruptSources();
+	}
+}
 
+/// <summary>
+///     Registers the events detected by the LSM6DSO at eventNs.
+/// </summary>
+static void HandleAccelInterruptSources(const lsm6dso_all_sources_t *sources, uint64_t eventNs)
+{
+	if (sources->wake_up_src.sleep_change_ia)
+	{
+		if (sources->wake_up_src.sleep_state)
+		{
+#ifdef ACCEL_ADAPTIVE_ODR
+			AccelPower_Request(AccelPower_Low);
+#endif
+			magicLockbox_notifyState(state_inactivity);
+		}
+		else
+		{
+#ifdef ACCEL_ADAPTIVE_ODR
+			AccelPower_Request(AccelPower_Full);
+#endif
+			magicLockbox_notifyState(state_activity);
+		}
+	}
+#ifdef ACCEL_ADAPTIVE_ODR
+	if (sources->tap_src.single_tap || sources->tap_src.double_tap || sources->d6d_src.d6d_ia ||
+		sources->wake_up_src.ff_ia || *(const uint8_t *)&sources->fsm_status_a != 0 || *(const uint8_t *)&sources->fsm_status_b != 0)
+	{
+		AccelPower_EventDetected();
+	}
+#endif
+#ifdef ACCEL_FSM_PROGRAMS
+	AccelFsm_HandleStatus(sources, eventNs);
+#endif
+#ifdef ACCEL_FREE_FALL
+	// The impact ending a fall may come with a tap or a 6D change, the fall is the event
+	if (sources->wake_up_src.ff_ia)
+	{
+		Log_Debug("\nFree fall\n");
+		magicLockbox_registerEventAt(event_free_fall, eventNs);
+		return;
+	}
+#endif
+#ifdef ACCEL_DOUBLE_TAP
+	// The second tap of a double tap may set the single tap bit as well
+	if (sources->tap_src.double_tap)
+	{
+		Log_Debug("\nDouble tap, %d\n", *(const uint8_t *)&sources->tap_src);
+		if (sources->tap_src.x_tap)
+		{
+			Log_Debug(" on X\n");
+			magicLockbox_registerEventAt(event_double_tap_x, eventNs);
+		}
+		else if (sources->tap_src.y_tap)
+		{
+			Log_Debug(" on Y\n");
+			magicLockbox_registerEventAt(event_double_tap_y, eventNs);
+		}
+		else if (sources->tap_src.z_tap)
+		{
+			Log_Debug(" on Z\n");
+			magicLockbox_registerEventAt(event_double_tap_z, eventNs);
+		}
+		return;
+	}
+#endif
+	if (sources->tap_src.single_tap)
+	{
+		Log_Debug("\nSingle tap, %d\n", *(const uint8_t *)&sources->tap_src);
+		if (sources->tap_src.x_tap)
+		{
+			Log_Debug(" on X\n");				
+			magicLockbox_registerEventAt(event_tap_x, eventNs);				
+		}
+		else if (sources->tap_src.y_tap)
+		{
+			Log_Debug(" on Y\n");				
+			magicLockbox_registerEventAt(event_tap_y, eventNs);				
+		}
+		else if (sources->tap_src.z_tap)
+		{
+			Log_Debug(" on Z\n");				
+			magicLockbox_registerEventAt(event_tap_z, eventNs);				
+		}
+		return;
+	}						
+	if (sources->d6d_src.d6d_ia)
+	{
+		Log_Debug("\n6d sense\n");
+		if (sources->d6d_src.xh)
+		{
+			Log_Debug(" on xh\n");
+			magicLockbox_registerEventAt(event_4d_top_x, eventNs);
+		}
+		else if (sources->d6d_src.xl)
+		{
+			Log_Debug(" on xl\n");
+			magicLockbox_registerEventAt(event_4d_bottom_x, eventNs);
+		}
+		else if (sources->d6d_src.yh)
+		{
+			Log_Debug(" on yh\n");
+			magicLockbox_registerEventAt(event_4d_top_y, eventNs);
+		}
+		else if (sources->d6d_src.yl)
+		{
+			Log_Debug(" on yl\n");
+			magicLockbox_registerEventAt(event_4d_bottom_y, eventNs);
+		}
+		else if (sources->d6d_src.zh)
+		{
+			Log_Debug(" on zh\n");
+			magicLockbox_registerEventAt(event_4d_top_z, eventNs);
+		}
+		else if (sources->d6d_src.zl)
+		{
+			Log_Debug(" on zl\n");
+			magicLockbox_registerEventAt(event_4d_bottom_z, eventNs);
+		}
+	}
+}
+
+static void AccelSourcesReadDone(I2cTransaction *transaction)
+{
+	if (transaction->result < 0) {
+		FinishAccelService();
+		return;
+	}
+
+	uint8_t select = 0;
+#ifdef ACCEL_FSM_PROGRAMS
+	if (accelFsmPrograms > 0) {
+		if (transaction == &accelSourcesRead) {
+			if (I2cScheduler_Submit(&accelFsmStatusRead) != 0) {
+				FinishAccelService();
+			}
+			return;
+		}
+		select = LSM6DSO_SOURCES_EMB_FUNC;
+	}
+#endif
+	static lsm6dso_all_sources_t sources;
+	lsm6dso_all_sources_unpack(&sources, accelSources, select);
+	// Without an edge the events are taken as detected when their sources were read
+	HandleAccelInterruptSources(&sources, accelEventNs != 0 ? accelEventNs : accelSourcesRead.startedNs);
+
+#ifdef ACCEL_FIFO_STREAMING
+	// INT1 may be up for the FIFO watermark as well
+	DrainAccelFifo();
+#else
+	FinishAccelService();
+#endif
+}
+
+/// <summary>
+///     Queues the reads of the latched LSM6DSO interrupt sources if INT1 is asserted. The
+///     events are registered when the reads complete.
+/// </summary>
+static void ReadAccelInterruptSources(void)
+{
 	// Check for interrupt
 	static GPIO_Value_Type newIntState;
-	int result = GPIO_GetValue(lsm6dsoInt1GpioFd, &newIntState);
+	int result = SensorHal_GpioGetValue(lsm6dsoInt1GpioFd, &newIntState);
 	if (result != 0) {
 		Log_Debug("ERROR: Could not read interrupt GPIO: %s (%d).\n", strerror(errno), errno);
 		terminationRequired = true;
@@ -107,79 +492,32 @@ void AccelTimerEventHandler(EventData *eventData)
 
 	if (newIntState == GPIO_Value_High)
 	{
-		//newIntState = GPIO_Value_Low;
-		static lsm6dso_all_sources_t sources;
-
-		lsm6dso_all_sources_get(&dev_ctx, &sources);
-			
-		if (sources.wake_up_src.sleep_change_ia)
-		{
-			if (sources.wake_up_src.sleep_state)
-			{
-				magicLockbox_notifyState(state_inactivity);
-			}
-			else
-			{
-				magicLockbox_notifyState(state_activity);
-			}
-		}
-		if (sources.tap_src.single_tap)
-		{
-			Log_Debug("\nSingle tap, %d\n", sources.tap_src);
-			if (sources.tap_src.x_tap)
-			{
-				Log_Debug(" on X\n");				
-				magicLockbox_registerEvent(event_tap_x);				
-			}
-			else if (sources.tap_src.y_tap)
-			{
-				Log_Debug(" on Y\n");				
-				magicLockbox_registerEvent(event_tap_y);				
-			}
-			else if (sources.tap_src.z_tap)
-			{
-				Log_Debug(" on Z\n");				
-				magicLockbox_registerEvent(event_tap_z);				
-			}
+		if (accelServiceBusy) {
+			accelServiceAgain = true;
 			return;
-		}						
-		if (sources.d6d_src.d6d_ia)
-		{
-			Log_Debug("\n6d sense\n");
-			if (sources.d6d_src.xh)
-			{
-				Log_Debug(" on xh\n");
-				magicLockbox_registerEvent(event_4d_top_x);
-			}
-			else if (sources.d6d_src.xl)
-			{
-				Log_Debug(" on xl\n");
-				magicLockbox_registerEvent(event_4d_bottom_x);
-			}
-			else if (sources.d6d_src.yh)
-			{
-				Log_Debug(" on yh\n");
-				magicLockbox_registerEvent(event_4d_top_y);
-			}
-			else if (sources.d6d_src.yl)
-			{
-				Log_Debug(" on yl\n");
-				magicLockbox_registerEvent(event_4d_bottom_y);
-			}
-			else if (sources.d6d_src.zh)
-			{
-				Log_Debug(" on zh\n");
-				magicLockbox_registerEvent(event_4d_top_z);
-			}
-			else if (sources.d6d_src.zl)
-			{
-				Log_Debug(" on zl\n");
-				magicLockbox_registerEvent(event_4d_bottom_z);
-			}
 		}
+		accelServiceBusy = true;
+		accelEventNs = accelEdgeNs;
+		accelEdgeNs = 0;
+		if (I2cScheduler_Submit(&accelSourcesRead) != 0) {
+			accelServiceBusy = false;
+		}
+	}
+	else
+	{
+		accelEdgeNs = 0;
 	}
+}
+
+// Time at which TS was found low for the queued read
+static uint64_t gestureDetectedNs;
 
-	if (mg3030_read_data(data) >= 3)
+/// <summary>
+///     Registers the swipe of a gesture message read from the MGC3130.
+/// </summary>
+static void GestureReadDone(int32_t length)
+{
+	if (length >= 3)
 	{
 		//there is a bug that causes additional value to be inserted
 		//into recevied buffer, actual data starts from second byte
@@ -187,50 +525,480 @@ void AccelTimerEventHandler(EventData *eventData)
 		Gest_t gesture = get_last_gesture();
 		if (gesture == GESTURE_EAST_TO_WEST)
 		{
-			magicLockbox_registerEvent(event_swipe_left);
+			magicLockbox_registerEventAt(event_swipe_left, gestureDetectedNs);
 		}
 		else if (gesture == GESTURE_WEST_TO_EAST)
 		{
-			magicLockbox_registerEvent(event_swipe_right);
+			magicLockbox_registerEventAt(event_swipe_right, gestureDetectedNs);
 		}
 		else if (gesture == GESTURE_SOUTH_TO_NORTH)
 		{
-			magicLockbox_registerEvent(event_swipe_up);
+			magicLockbox_registerEventAt(event_swipe_up, gestureDetectedNs);
 		}
 		else if (gesture == GESTURE_NORTH_TO_SOUTH)
 		{
-			magicLockbox_registerEvent(event_swipe_down);
+			magicLockbox_registerEventAt(event_swipe_down, gestureDetectedNs);
 		}
 	}
+}
+
+/// <summary>
+///     Queues the read of a pending gesture message from the MGC3130, unless the last read is
+///     not finished yet.
+/// </summary>
+static void ReadGestureSensor(void)
+{
+	// The read starts by checking TS, a message found waiting is stamped with the time of the check
+	uint64_t nowNs = GetMonotonicNs();
+	if (mg3030_read_data_async(data, GestureReadDone) == 0)
+	{
+		gestureDetectedNs = nowNs;
+	}
+}
 
-	return;
+/// <summary>
+///     Polls INT1, either as the only way of acquiring accelerometer events or as the safety
+///     net of edge notifications.
+/// </summary>
+static void AccelTimerEventHandler(EventData *eventData)
+{
+	ReadAccelInterruptSources();
 }
 
 /// <summary>
-///     Initializes the I2C interface.
+///     Reads the interrupt sources when INT1 has gone high.
+/// </summary>
+static void AccelInt1EdgeEventHandler(EventData *eventData)
+{
+	if (GpioEdge_ConsumeEdges(lsm6dsoInt1EdgeFd) != 0) {
+		if (accelEdgeNs == 0) {
+			accelEdgeNs = GetMonotonicNs();
+		}
+		ReadAccelInterruptSources();
+	}
+}
+
+/// <summary>
+///     Checks the MGC3130 for gesture messages. The sensor holds TS low until its message has
+///     been read, so nothing is lost between two polls.
+/// </summary>
+static void GestureTimerEventHandler(EventData *eventData)
+{
+	ReadGestureSensor();
+}
+
+// Timer data structures: the event handler, the name in the handler stats and the priority class.
+static SoftTimer accelTimer = { .eventData.eventHandler = &AccelTimerEventHandler, .eventData.name = "accelPoll", .eventData.priority = EventPriority_Sensor };
+static SoftTimer gestureTimer = { .eventData.eventHandler = &GestureTimerEventHandler, .eventData.name = "gesturePoll", .eventData.priority = EventPriority_Sensor };
+static EventData accelInt1Event = { .eventHandler = &AccelInt1EdgeEventHandler, .name = "accelInt1" };
+
+#ifdef ACCEL_FIFO_STREAMING
+#define ACCEL_INT1_CTRL 0x08	// INT1_FIFO_TH
+#else
+#define ACCEL_INT1_CTRL 0x00
+#endif
+
+#ifdef ACCEL_DOUBLE_TAP
+#define ACCEL_TAP_MODE LSM6DSO_BOTH_SINGLE_DOUBLE
+#define ACCEL_TAP_WINDOW ACCEL_DOUBLE_TAP_WINDOW
+#define ACCEL_INT1_DOUBLE_TAP 0x08	// INT1_DOUBLE_TAP
+#else
+#define ACCEL_TAP_MODE LSM6DSO_ONLY_SINGLE
+#define ACCEL_TAP_WINDOW 0x01
+#define ACCEL_INT1_DOUBLE_TAP 0x00
+#endif
+
+#ifdef ACCEL_FREE_FALL
+#define ACCEL_FF_SAMPLES ACCEL_FREE_FALL_SAMPLES
+#define ACCEL_FF_THRESHOLD ACCEL_FREE_FALL_THRESHOLD
+#define ACCEL_INT1_FF 0x10	// INT1_FF
+#else
+#define ACCEL_FF_SAMPLES 0x00
+#define ACCEL_FF_THRESHOLD 0x00
+#define ACCEL_INT1_FF 0x00
+#endif
+
+// LSM6DSO configuration applied after the software reset. Each entry sets the bits of its mask;
+// the entries are sorted by bank and register so that adjacent registers go out in one burst.
+static const lsm6dso_reg_setting_t accelConfiguration[] = {
+#ifdef ACCEL_FIFO_STREAMING
+	// FIFO: watermark, batch rates of both sensors and stream mode, the oldest samples are
+	// overwritten if the FIFO is not drained in time
+	{ LSM6DSO_USER_BANK, LSM6DSO_FIFO_CTRL1, ACCEL_FIFO_WATERMARK & 0xFF, 0xFF },
+	{ LSM6DSO_USER_BANK, LSM6DSO_FIFO_CTRL2, ACCEL_FIFO_WATERMARK >> 8, 0x01 },
+	{ LSM6DSO_USER_BANK, LSM6DSO_FIFO_CTRL3, ACCEL_FIFO_GY_BATCH_RATE << 4 | ACCEL_FIFO_XL_BATCH_RATE, 0xFF },
+	{ LSM6DSO_USER_BANK, LSM6DSO_FIFO_CTRL4, LSM6DSO_STREAM_MODE, 0x07 },
+#endif
+	{ LSM6DSO_USER_BANK, LSM6DSO_INT1_CTRL, ACCEL_INT1_CTRL, 0xFF },
+	// Accelerometer 417 Hz, 2 g, LPF2 on the output
+	{ LSM6DSO_USER_BANK, LSM6DSO_CTRL1_XL, LSM6DSO_XL_ODR_417Hz << 4 | LSM6DSO_2g << 2 | 0x02, 0xFE },
+	// Gyroscope 417 Hz, 250 dps
+	{ LSM6DSO_USER_BANK, LSM6DSO_CTRL2_G, LSM6DSO_GY_ODR_417Hz << 4 | LSM6DSO_250dps << 1, 0xFE },
+	// Block data update
+	{ LSM6DSO_USER_BANK, LSM6DSO_CTRL3_C, 0x40, 0x40 },
+	// LPF2 cutoff ODR/400 (HPCF_XL), LPF2 also feeding 6D
+	{ LSM6DSO_USER_BANK, LSM6DSO_CTRL8_XL, (LSM6DSO_LP_ODR_DIV_400 & 0x07) << 5 | 0x01, 0xF5 },
+	// I3C_DISABLE as written by lsm6dso_i3c_disable_set(LSM6DSO_I3C_DISABLE)
+	{ LSM6DSO_USER_BANK, LSM6DSO_CTRL9_XL, 0x00, 0x02 },
+	// Latched interrupts, cleared on read because of the latency of reads; tap detection on
+	// all axes; HPF path for wake-up
+	{ LSM6DSO_USER_BANK, LSM6DSO_TAP_CFG0, 0x40 | LSM6DSO_USE_HPF << 4 | 0x0E | 0x01, 0x5F },
+	// Tap axes priority ZYX; tap thresholds high enough to ignore light or unintended taps
+	{ LSM6DSO_USER_BANK, LSM6DSO_TAP_CFG1, LSM6DSO_ZYX << 5 | 0x09, 0xFF },
+	{ LSM6DSO_USER_BANK, LSM6DSO_TAP_CFG2, 0x80 | 0x0B, 0x9F },	// and INTERRUPTS_ENABLE
+	// 6D threshold 60 degrees instead of 80 for less sharp detection
+	{ LSM6DSO_USER_BANK, LSM6DSO_TAP_THS_6D, LSM6DSO_DEG_60 << 5 | 0x0F, 0x7F },
+	// Double tap window, quiet and shock windows
+	{ LSM6DSO_USER_BANK, LSM6DSO_INT_DUR2, (ACCEL_TAP_WINDOW & 0x0F) << 4 | 0x01 << 2 | 0x02, 0xFF },
+	// Single or single and double tap, wake-up threshold
+	{ LSM6DSO_USER_BANK, LSM6DSO_WAKE_UP_THS, ACCEL_TAP_MODE << 7 | 0x02, 0xBF },
+	// Free fall duration bit 5, sleep and wake-up durations
+	{ LSM6DSO_USER_BANK, LSM6DSO_WAKE_UP_DUR, (ACCEL_FF_SAMPLES >> 5 & 0x01) << 7 | 0x00 << 5 | 0x09, 0xEF },
+	// Free fall duration bits 4:0 and threshold
+	{ LSM6DSO_USER_BANK, LSM6DSO_FREE_FALL, (ACCEL_FF_SAMPLES & 0x1F) << 3 | ACCEL_FF_THRESHOLD, 0xFF },
+	// INT1: single tap, 6D, activity/inactivity, and double tap and free fall where detected
+	{ LSM6DSO_USER_BANK, LSM6DSO_MD1_CFG, 0x80 | 0x40 | ACCEL_INT1_FF | ACCEL_INT1_DOUBLE_TAP | 0x04, 0xFF },
+	{ LSM6DSO_USER_BANK, LSM6DSO_I3C_BUS_AVB, 0x00, 0x18 },
+	// No embedded function events on INT1, embedded function interrupts latched as well
+	{ LSM6DSO_EMBEDDED_FUNC_BANK, LSM6DSO_EMB_FUNC_INT1, 0x00, 0xFF },
+	{ LSM6DSO_EMBEDDED_FUNC_BANK, LSM6DSO_FSM_INT1_A, 0x00, 0xFF },
+	{ LSM6DSO_EMBEDDED_FUNC_BANK, LSM6DSO_FSM_INT1_B, 0x00, 0xFF },
+	{ LSM6DSO_EMBEDDED_FUNC_BANK, LSM6DSO_PAGE_RW, 0x80, 0x80 },
+};
+
+/// <summary>
+///     Writes accelConfiguration to the LSM6DSO, verifying it when ACCEL_VERIFY_CONFIGURATION is
+///     defined, and logs how long that took.
 /// </summary>
 /// <returns>0 on success, or -1 on failure</returns>
-int initI2c(void) {
+static int ApplyAccelConfiguration(void)
+{
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-	// Begin MT3620 I2C init 
+#ifdef ACCEL_VERIFY_CONFIGURATION
+	uint8_t verify = PROPERTY_ENABLE;
+#else
+	uint8_t verify = PROPERTY_DISABLE;
+#endif
+	lsm6dso_reg_table_result_t result;
+	int32_t ret = lsm6dso_reg_table_apply(&dev_ctx, accelConfiguration,
+		sizeof(accelConfiguration) / sizeof(accelConfiguration[0]), verify, &result);
 
-	i2cFd = I2CMaster_Open(MT3620_ISU2_I2C);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	long us = (long)(end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+	if (ret != 0) {
+		Log_Debug("ERROR: LSM6DSO configuration failed after %ld us.\n", us);
+		return -1;
+	}
+	Log_Debug("LSM6DSO configured in %ld us, %u bursts.\n", us, result.bursts);
+	if (result.mismatches != 0) {
+		Log_Debug("ERROR: LSM6DSO configuration: %u registers read back different.\n", result.mismatches);
+		return -1;
+	}
+	return 0;
+}
+
+/// <summary>
+///     Opens ISU2 as the I2C master of the transport. The bus starts at standard speed, the
+///     transport switches it to the speed of each device.
+/// </summary>
+/// <returns>0 on success, or -1 on failure</returns>
+static int OpenI2cBus(void)
+{
+	i2cFd = SensorHal_I2cOpen(MT3620_ISU2_I2C);
 	if (i2cFd < 0) {
 		Log_Debug("ERROR: I2CMaster_Open: errno=%d (%s)\n", errno, strerror(errno));
 		return -1;
 	}
 
-	int result = I2CMaster_SetBusSpeed(i2cFd, I2C_BUS_SPEED_STANDARD);
+	int result = SensorHal_I2cSetBusSpeed(i2cFd, I2C_BUS_SPEED_STANDARD);
 	if (result != 0) {
 		Log_Debug("ERROR: I2CMaster_SetBusSpeed: errno=%d (%s)\n", errno, strerror(errno));
 		return -1;
 	}
 
-	result = I2CMaster_SetTimeout(i2cFd, 100);
+	result = SensorHal_I2cSetTimeout(i2cFd, I2C_BUS_TIMEOUT_MS);
 	if (result != 0) {
 		Log_Debug("ERROR: I2CMaster_SetTimeout: errno=%d (%s)\n", errno, strerror(errno));
 		return -1;
 	}
+	I2cTransport_SetBusFd(i2cFd);
+	return 0;
+}
+
+/// <summary>
+///     Checks the LSM6DSO at a bus speed with WHO_AM_I reads, a marginal bus shows up as a
+///     failed read or a wrong value now and then. The reads go past the shadow registers.
+/// </summary>
+static int ProbeAccel(I2cTransportDevice *device)
+{
+	static const uint8_t whoAmIRegister = LSM6DSO_WHO_AM_I;
+	uint8_t id;
+	I2cTransaction transaction = { .device = device, .writeData = &whoAmIRegister, .writeLength = 1, .readData = &id, .readLength = 1 };
+	for (int i = 0; i < LSM6DSO_SPEED_PROBE_READS; i++) {
+		id = 0;
+		if (I2cScheduler_Transfer(&transaction) < 0 || id != LSM6DSO_ID) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Failed transactions of each device when it was last configured; a recovery configures the
+// devices whose transactions have failed since then again
+static uint32_t lsm6dsoErrorsConfigured;
+static uint32_t mgc3130ErrorsConfigured;
+
+/// <summary>
+///     Restores the default configuration of the LSM6DSO and configures it.
+/// </summary>
+/// <returns>0 on success, or -1 on failure</returns>
+static int ConfigureAccel(void)
+{
+	 // Restore default configuration
+	if (lsm6dso_reset_set(&dev_ctx, PROPERTY_ENABLE) != 0) {
+		return -1;
+	}
+	do {
+		if (lsm6dso_reset_get(&dev_ctx, &rst) != 0) {
+			return -1;
+		}
+	} while (rst);
+
+	if (ApplyAccelConfiguration() < 0) {
+		return -1;
+	}
+
+#ifdef ACCEL_FSM_PROGRAMS
+	accelFsmPrograms = AccelFsm_Load(&dev_ctx, ACCEL_FSM_RATE);
+	if (accelFsmPrograms < 0) {
+		return -1;
+	}
+#endif
+
+#ifdef ACCEL_SENSOR_HUB
+	// The box works without the pressure sensor; its configuration goes on from a timer
+	AccelHub_Init(&dev_ctx, ACCEL_HUB_LPS22HH_ADDRESS, ACCEL_HUB_LPS22HH_RATE, ACCEL_HUB_READ_RATE);
+#endif
+
+#ifdef ACCEL_FIFO_STREAMING
+	// Differences in the FIFO are to samples batched after the reset
+	accelFifoLastValid[ImuSensor_Accel] = false;
+	accelFifoLastValid[ImuSensor_Gyro] = false;
+#ifdef ACCEL_FIFO_COMPRESSION
+	// Compression starts from the samples batched after its initialization
+	if (lsm6dso_compression_algo_init_set(&dev_ctx, PROPERTY_ENABLE) != 0 ||
+		lsm6dso_compression_algo_set(&dev_ctx, ACCEL_FIFO_UNCOMPRESSED_RATE) != 0) {
+		Log_Debug("ERROR: Could not enable the LSM6DSO FIFO compression.\n");
+		return -1;
+	}
+#endif
+#endif
+
+#ifdef ACCEL_ADAPTIVE_ODR
+	lsm6dso_odr_xl_t inactiveXlRate = ACCEL_INACTIVE_XL_RATE;
+#ifdef ACCEL_FSM_PROGRAMS
+	// The FSM rates are one step below the accelerometer rates of the same frequency
+	if (accelFsmPrograms > 0 && inactiveXlRate < (lsm6dso_odr_xl_t)(ACCEL_FSM_RATE + 1)) {
+		inactiveXlRate = (lsm6dso_odr_xl_t)(ACCEL_FSM_RATE + 1);
+	}
+#endif
+	if (AccelPower_Init(&dev_ctx, &lsm6dsoDevice, inactiveXlRate, ACCEL_INACTIVE_GY_RATE) < 0) {
+		return -1;
+	}
+#endif
+	lsm6dsoErrorsConfigured = lsm6dsoDevice.stats.errors;
+	return 0;
+}
+
+/// <summary>
+///     Records the configuration of the MGC3130 once its runtime parameters are written.
+/// </summary>
+static void GestureSensorConfigured(int32_t result)
+{
+	if (result < 0) {
+		Log_Debug("MGC3130 init failed!!\n");
+		return;
+	}
+	mgc3130ErrorsConfigured = i2c_error_count();
+}
+
+/// <summary>
+///     Starts resetting the MGC3130 and configuring its gestures, which goes on from timers
+///     and queued transactions; done is called on the loop at the end.
+/// </summary>
+/// <returns>0 if the configuration has started, or -1 on failure</returns>
+static int ConfigureGestureSensor(basic_init_done_t done)
+{
+	if (basic_init(done) < 0) {
+		Log_Debug("Basic init failed!!\n");
+		return -1;
+	}
+
+	// The runtime parameters are queued, and written once the device has started
+	if (mgc3030_init() < 0) {
+		Log_Debug("MGC3130 init failed!!\n");
+		return -1;
+	}
+	return 0;
+}
+
+#ifdef I2C_BUS_RECOVERY
+typedef struct {
+	uint32_t recoveries;
+	uint32_t failures;
+	uint64_t totalNs;
+	uint64_t maxNs;
+} I2cRecoveryStats;
+
+static I2cRecoveryStats recoveryStats;
+// CLOCK_MONOTONIC time at which the running recovery started, and the result of configuring
+// the LSM6DSO again while the MGC3130 is being reset
+static uint64_t recoveryStartNs;
+static int recoveryAccelResult;
+static uint8_t recoveryWhoAmI;
+
+static void RecoverI2cBus(EventData *eventData);
+static void RecoveryWhoAmIDone(I2cTransaction *transaction);
+
+// Only the re-open runs in the task, the recovery goes on from a transaction callback and the
+// timers of the MGC3130 reset
+static DeferredTask recoveryTask = { .eventData.eventHandler = &RecoverI2cBus, .eventData.name = "i2cRecovery",
+	.eventData.priority = EventPriority_Sensor };
+static const uint8_t whoAmIRegister = LSM6DSO_WHO_AM_I;
+static I2cTransaction recoveryWhoAmITransaction = { .device = &lsm6dsoDevice, .writeData = &whoAmIRegister, .writeLength = 1,
+	.readData = &recoveryWhoAmI, .readLength = 1, .callback = &RecoveryWhoAmIDone };
+
+/// <summary>
+///     Ends a recovery, counting its duration from the re-open of the bus.
+/// </summary>
+static void FinishBusRecovery(int result)
+{
+	uint64_t durationNs = GetMonotonicNs() - recoveryStartNs;
+	recoveryStats.recoveries++;
+	recoveryStats.totalNs += durationNs;
+	if (durationNs > recoveryStats.maxNs) {
+		recoveryStats.maxNs = durationNs;
+	}
+	if (result != 0) {
+		recoveryStats.failures++;
+		Log_Debug("ERROR: I2C bus recovery failed after %u ms.\n", (unsigned int)(durationNs / 1000000));
+	}
+	else {
+		Log_Debug("I2C bus recovered in %u ms.\n", (unsigned int)(durationNs / 1000000));
+	}
+	I2cScheduler_RecoveryDone();
+}
+
+/// <summary>
+///     Configures the LSM6DSO again if its transactions have failed since it was configured.
+/// </summary>
+/// <returns>0 on success, or -1 on failure</returns>
+static int ReconfigureAccel(void)
+{
+	if (lsm6dsoDevice.stats.errors == lsm6dsoErrorsConfigured) {
+		return 0;
+	}
+	// The LSM6DSO may have lost power or been left in the embedded functions bank
+	lsm6dso_shadow_invalidate(&dev_ctx);
+	return lsm6dso_mem_bank_set(&dev_ctx, LSM6DSO_USER_BANK) == 0 ? ConfigureAccel() : -1;
+}
+
+/// <summary>
+///     Ends a recovery which has reset the MGC3130, once it has been configured again.
+/// </summary>
+static void GestureSensorRecovered(int32_t result)
+{
+	GestureSensorConfigured(result);
+	FinishBusRecovery(result < 0 ? -1 : recoveryAccelResult);
+}
+
+/// <summary>
+///     Checks the bus with the LSM6DSO once it has been re-opened, and resets the MGC3130 if
+///     it still fails.
+/// </summary>
+static void RecoveryWhoAmIDone(I2cTransaction *transaction)
+{
+	if (transaction->result >= 0) {
+		FinishBusRecovery(ReconfigureAccel());
+		return;
+	}
+	if (ConfigureGestureSensor(GestureSensorRecovered) < 0) {
+		FinishBusRecovery(-1);
+		return;
+	}
+	recoveryAccelResult = ReconfigureAccel();
+}
+
+/// <summary>
+///     Brings the bus back after a run of failed transactions. The master is re-opened, which
+///     resets a wedged controller. A slave stopped in the middle of a byte holds SDA low, and
+///     then the controller cannot even issue a start; the ISU2 pins cannot be driven as GPIOs
+///     to clock it out while ISU2 is the I2C master. Only the MGC3130 has a reset line, so it
+///     is reset when its transactions have failed or a WHO_AM_I read of the LSM6DSO still
+///     fails after the re-open, which frees SDA if it was holding it; a bus held by the
+///     LSM6DSO cannot be recovered this way. The devices whose transactions have failed are
+///     configured again, since they may have been reset or left half written. The MGC3130 is
+///     reset once, by its configuration, and the loop never waits for it.
+/// </summary>
+static void RecoverI2cBus(EventData *eventData)
+{
+	recoveryStartNs = GetMonotonicNs();
+	recoveryAccelResult = 0;
+
+	I2cScheduler_Suspend();
+	CloseFdAndPrintError(i2cFd, "i2c");
+	int result = OpenI2cBus();
+	// The reset line goes low before the queue runs again, freeing SDA for the transactions
+	// waiting in it
+	bool resetGestureSensor = result == 0 && i2c_error_count() != mgc3130ErrorsConfigured;
+	if (resetGestureSensor && ConfigureGestureSensor(GestureSensorRecovered) < 0) {
+		result = -1;
+	}
+	I2cScheduler_Resume();
+
+	if (result != 0) {
+		FinishBusRecovery(-1);
+	}
+	else if (resetGestureSensor) {
+		recoveryAccelResult = ReconfigureAccel();
+	}
+	else if (I2cScheduler_Submit(&recoveryWhoAmITransaction) < 0) {
+		FinishBusRecovery(-1);
+	}
+}
+#endif
+
+/// <summary>
+///     Initializes the I2C interface.
+/// </summary>
+/// <returns>0 on success, or -1 on failure</returns>
+int initI2c(void) {
+
+	// Begin MT3620 I2C init 
+
+	SensorHalBackendId halBackend = SENSOR_HAL_BACKEND;
+	const char *halRecording = NULL;
+#ifdef MAGICLOCKBOX_HOST_RUNTIME
+	// A recording taken on a box answers the sensor traffic instead of the device models
+	halRecording = getenv("MAGICLOCKBOX_HAL_RECORDING");
+	if (halRecording != NULL) {
+		halBackend = SensorHalBackend_Player;
+	}
+#endif
+	if (SensorHal_Init(halBackend, halRecording) < 0) {
+		return -1;
+	}
+
+	if (OpenI2cBus() < 0) {
+		return -1;
+	}
+
+	// From here on all transfers of both devices are queued on the scheduler
+	if (I2cScheduler_Start(epollFd) < 0) {
+		return -1;
+	}
 	
 	// Start lsm6dso specific init
 
@@ -238,6 +1006,9 @@ int initI2c(void) {
 	dev_ctx.write_reg = platform_write;
 	dev_ctx.read_reg = platform_read;
 	dev_ctx.handle = &i2cFd;
+#ifdef ACCEL_SHADOW_REGISTERS
+	dev_ctx.shadow = &dev_shadow;
+#endif
 
 	// Check device ID
 	lsm6dso_device_id_get(&dev_ctx, &whoamI);
@@ -248,102 +1019,61 @@ int initI2c(void) {
 	else {
 		Log_Debug("LSM6DSO Found!\n");
 	}
-		
-	 // Restore default configuration
-	lsm6dso_reset_set(&dev_ctx, PROPERTY_ENABLE);
-	do {
-		lsm6dso_reset_get(&dev_ctx, &rst);
-	} while (rst);
 
-	 // Disable I3C interface
-	lsm6dso_i3c_disable_set(&dev_ctx, LSM6DSO_I3C_DISABLE);
-
-	// Enable Block Data Update
-	lsm6dso_block_data_update_set(&dev_ctx, PROPERTY_ENABLE);
-
-	 // Set Output Data Rate
-	lsm6dso_xl_data_rate_set(&dev_ctx, LSM6DSO_XL_ODR_417Hz);
-	lsm6dso_gy_data_rate_set(&dev_ctx, LSM6DSO_GY_ODR_417Hz);
-
-	 // Set full scale
-	lsm6dso_xl_full_scale_set(&dev_ctx, LSM6DSO_2g);
-	lsm6dso_gy_full_scale_set(&dev_ctx, LSM6DSO_250dps);
-
-	// Configure filtering chain(No aux interface)
-	// Accelerometer - LPF1 + LPF2 path	
-	lsm6dso_xl_hp_path_on_out_set(&dev_ctx, LSM6DSO_LP_ODR_DIV_400);
-	lsm6dso_xl_filter_lp2_set(&dev_ctx, PROPERTY_ENABLE);
-
-	//Enable tap and double tap detection
-	lsm6dso_tap_mode_set(&dev_ctx, PROPERTY_DISABLE);
-	lsm6dso_tap_detection_on_x_set(&dev_ctx, PROPERTY_ENABLE);
-	lsm6dso_tap_detection_on_y_set(&dev_ctx, PROPERTY_ENABLE);
-	lsm6dso_tap_detection_on_z_set(&dev_ctx, PROPERTY_ENABLE);
-	// Set tap axes detection priority to be ZXY
-	lsm6dso_tap_axis_priority_set(&dev_ctx, LSM6DSO_ZYX);
-	//Set duration between double tap and between taps as well as max vibration duration to be still recognized as tap	 
-	lsm6dso_tap_dur_set(&dev_ctx, 0b01);
-	lsm6dso_tap_shock_set(&dev_ctx, 0b10);
-	lsm6dso_tap_quiet_set(&dev_ctx, 0b01);
-	//Set thresholds to eliminate light taps/ unintended taps
-	lsm6dso_tap_threshold_x_set(&dev_ctx, 0b1001);
-	lsm6dso_tap_threshold_y_set(&dev_ctx, 0b1011);
-	lsm6dso_tap_threshold_z_set(&dev_ctx, 0b1111);
-
-	// route detected activities to interrupt pin int1 
-	static lsm6dso_pin_int1_route_t activities_int_routing;
-	lsm6dso_pin_int1_route_get(&dev_ctx, &activities_int_routing);
-	activities_int_routing.md1_cfg.int1_single_tap = PROPERTY_ENABLE;
-	activities_int_routing.md1_cfg.int1_6d = PROPERTY_ENABLE;
-	activities_int_routing.md1_cfg.int1_double_tap = PROPERTY_DISABLE;
-	activities_int_routing.md1_cfg.int1_sleep_change = PROPERTY_ENABLE;
-	activities_int_routing.md1_cfg.int1_wu = PROPERTY_DISABLE;
-	
-	lsm6dso_pin_int1_route_set(&dev_ctx, &activities_int_routing);
-	lsm6dso_xl_hp_path_internal_set(&dev_ctx, LSM6DSO_USE_HPF);
-	//lsm6dso_act_pin_notification_set(&dev_ctx, LSM6DSO_DRIVE_SLEEP_STATUS);
-		
-	//Use latched interrupts because of latency of reads
-	lsm6dso_int_notification_set(&dev_ctx, LSM6DSO_ALL_INT_LATCHED);
-	//4D is enabled by default, set threshold lower than default 80deg for less sharp detection
-	lsm6dso_6d_threshold_set(&dev_ctx, LSM6DSO_DEG_60);
-	lsm6dso_xl_lp2_on_6d_set(&dev_ctx, PROPERTY_ENABLE);
-
-	//setup sleep wake thresholds and duraiton
-	lsm6dso_wkup_dur_set(&dev_ctx, 0x04);
-	lsm6dso_sleep_dur_set(&dev_ctx, 0x09);
-	lsm6dso_wkup_threshold_set(&dev_ctx, 0x02);	
+	if (I2cTransport_SelectSpeed(&lsm6dsoDevice, LSM6DSO_I2C_SPEED, ProbeAccel) < 0) {
+		return -1;
+	}
+
+	if (ConfigureAccel() < 0) {
+		return -1;
+	}
 
 	//Setup pin as input to detect interrupt 
-	lsm6dsoInt1GpioFd = GPIO_OpenAsInput(MT3620_GPIO6);
+	lsm6dsoInt1GpioFd = SensorHal_GpioOpenAsInput(MT3620_GPIO6);
 	if (lsm6dsoInt1GpioFd < 0) {
 		Log_Debug("ERROR: Could not open lsm6dso int1 GPIO6: %s (%d).\n", strerror(errno), errno);
 		return -1;
 	}
 
-	// Define the period in the build_options.h file
-	struct timespec accelReadPeriod = { .tv_sec = ACCEL_READ_PERIOD_SECONDS,.tv_nsec = ACCEL_READ_PERIOD_NANO_SECONDS };
-	// event handler data structures. Only the event handler field needs to be populated.
-	static EventData accelEventData = { .eventHandler = &AccelTimerEventHandler };
-	accelTimerFd = CreateTimerFdAndAddToEpoll(epollFd, &accelReadPeriod, &accelEventData, EPOLLIN);
-	if (accelTimerFd < 0) {
-		return -1;
-	}	
+#ifdef ACCEL_USE_INT1_EDGE_NOTIFICATIONS
+	// Wait for INT1 to go high where the platform can tell, and poll slowly as a safety net
+	lsm6dsoInt1EdgeFd = SensorHal_GpioOpenEdgeNotifier(MT3620_GPIO6);
+	if (lsm6dsoInt1EdgeFd >= 0) {
+		if (RegisterEventHandlerToEpollWithPriority(epollFd, lsm6dsoInt1EdgeFd, &accelInt1Event, EPOLLIN, EventPriority_Sensor) < 0) {
+			return -1;
+		}
+		static const struct timespec accelFallbackPeriod = { .tv_sec = ACCEL_FALLBACK_POLL_PERIOD_MS / 1000,.tv_nsec = ACCEL_FALLBACK_POLL_PERIOD_MS % 1000 * 1000000 };
+		static const struct timespec accelFallbackSlack = { .tv_sec = ACCEL_FALLBACK_POLL_PERIOD_MS / 2000,.tv_nsec = ACCEL_FALLBACK_POLL_PERIOD_MS / 2 % 1000 * 1000000 };
+		if (SetSoftTimerToPeriodWithSlack(&accelTimer, &accelFallbackPeriod, &accelFallbackSlack) < 0) {
+			return -1;
+		}
+		Log_Debug("LSM6DSO INT1 edge notifications enabled.\n");
+	}
+	else {
+		Log_Debug("INFO: No INT1 edge notifications (%s), polling.\n", strerror(errno));
+	}
+#endif
 
-	if (basic_init() < 0) {
-		Log_Debug("Basic init failed!!\n");
-		return -1;
+	if (lsm6dsoInt1EdgeFd < 0) {
+		// Define the period in the build_options.h file, it is rounded up to the timer wheel tick
+		struct timespec accelReadPeriod = { .tv_sec = ACCEL_READ_PERIOD_SECONDS,.tv_nsec = ACCEL_READ_PERIOD_NANO_SECONDS };
+		if (SetSoftTimerToPeriod(&accelTimer, &accelReadPeriod) < 0) {
+			return -1;
+		}
 	}
 
-	read_version_info(data);
+	static const struct timespec gesturePollPeriod = { .tv_sec = 0,.tv_nsec = GESTURE_POLL_PERIOD_MS * 1000000 };
+	if (SetSoftTimerToPeriod(&gestureTimer, &gesturePollPeriod) < 0) {
+		return -1;
+	}
 
-	HAL_Delay(150);
-	
-	if (mgc3030_init() < 0) {
-		Log_Debug("MGC3130 init failed!!\n");
+	if (ConfigureGestureSensor(GestureSensorConfigured) < 0) {
 		return -1;
 	}
-	
+
+#ifdef I2C_BUS_RECOVERY
+	I2cScheduler_SetRecoveryTask(&recoveryTask, I2C_RECOVERY_FAILURE_THRESHOLD);
+#endif
 	
 	return 0;
 }
@@ -353,8 +1083,32 @@ int initI2c(void) {
 /// </summary>
 void closeI2c(void) {
 
+	CancelSoftTimer(&accelTimer);
+	CancelSoftTimer(&gestureTimer);
+#ifdef ACCEL_SHADOW_REGISTERS
+	Log_Debug("INFO: LSM6DSO shadow registers: %u reads saved.\n", dev_shadow.hits);
+#endif
+#ifdef ACCEL_ADAPTIVE_ODR
+	AccelPower_LogStats();
+#endif
+#ifdef I2C_BUS_RECOVERY
+	Log_Debug("INFO: I2C bus recoveries: %u, %u failed, avg %u ms, max %u ms.\n", recoveryStats.recoveries,
+		recoveryStats.failures, recoveryStats.recoveries == 0 ? 0 : (unsigned int)(recoveryStats.totalNs / recoveryStats.recoveries / 1000000),
+		(unsigned int)(recoveryStats.maxNs / 1000000));
+#endif
+#ifdef ACCEL_SENSOR_HUB
+	AccelHub_LogStats();
+#endif
+#ifdef ACCEL_FIFO_STREAMING
+	Log_Debug("INFO: LSM6DSO FIFO: %u samples, %u overruns, %u dropped by the sample ring.\n",
+		accelFifoSamples, accelFifoOverruns, ImuRing_GetDropped(&imuSampleRing));
+#endif
+	if (lsm6dsoInt1EdgeFd >= 0) {
+		CloseFdAndPrintError(lsm6dsoInt1EdgeFd, "lsm6dsoInt1Edge");
+	}
+	I2cScheduler_Stop();
+	SensorHal_LogStats();
 	CloseFdAndPrintError(i2cFd, "i2c");
-	CloseFdAndPrintError(accelTimerFd, "accelTimer");
 }
 
 /// <summary>
@@ -378,30 +1132,15 @@ int32_t platform_write(int *fD, uint8_t reg, uint8_t *bufp,
 	Log_Debug("\n");
 #endif 
 
-	// Construct a new command buffer that contains the register to write to, then the data to write
-	uint8_t cmdBuffer[len + 1];
-	cmdBuffer[0] = reg;
-	for (int i = 0; i < len; i++) {
-		cmdBuffer[i + 1] = bufp[i];
-	}
-
-#ifdef ENABLE_READ_WRITE_DEBUG
-	Log_Debug("cmdBuffer contents: ");
-	for (int i = 0; i < len + 1; i++) {
-
-		Log_Debug("%0x: ", cmdBuffer[i]);
-	}
-	Log_Debug("\n");
-#endif
-
-	// Write the data to the device
-	int32_t retVal = I2CMaster_Write(*fD, lsm6dsOAddress, cmdBuffer, (size_t)len + 1);
-	if (retVal < 0) {
+	// Write the register address followed by the data to the device, gathered by the transport
+	const I2cTransportSegment segments[] = { { .data = &reg, .length = 1 }, { .data = bufp, .length = len } };
+	I2cTransaction transaction = { .device = &lsm6dsoDevice, .writeSegments = segments, .writeSegmentCount = 2 };
+	if (I2cScheduler_Transfer(&transaction) < 0) {
 		Log_Debug("ERROR: platform_write: errno=%d (%s)\n", errno, strerror(errno));
 		return -1;
 	}
 #ifdef ENABLE_READ_WRITE_DEBUG
-	Log_Debug("Wrote %d bytes to device.\n\n", retVal);
+	Log_Debug("Wrote %d bytes to device.\n\n", len + 1);
 #endif
 	return 0;
 }
@@ -432,17 +1171,10 @@ int32_t platform_read(int *fD, uint8_t reg, uint8_t *bufp,
 ;
 #endif
 
-	// Set the register address to read
-	int32_t retVal = I2CMaster_Write(*fD, lsm6dsOAddress, &reg, 1);
-	if (retVal < 0) {
-		Log_Debug("ERROR: platform_read(write step): errno=%d (%s)\n", errno, strerror(errno));
-		return -1;
-	}
-
-	// Read the data into the provided buffer
-	retVal = I2CMaster_Read(*fD, lsm6dsOAddress, bufp, len);
-	if (retVal < 0) {
-		Log_Debug("ERROR: platform_read(read step): errno=%d (%s)\n", errno, strerror(errno));
+	// Set the register address and read the data into the provided buffer with a repeated start
+	I2cTransaction transaction = { .device = &lsm6dsoDevice, .writeData = &reg, .writeLength = 1, .readData = bufp, .readLength = len };
+	if (I2cScheduler_Transfer(&transaction) < 0) {
+		Log_Debug("ERROR: platform_read: errno=%d (%s)\n", errno, strerror(errno));
 		return -1;
 	}
 
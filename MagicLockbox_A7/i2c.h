@@ -6,6 +6,7 @@ extern "C" {
 
 #include <stdbool.h>
 #include "epoll_timerfd_utilities.h"
+#include "imu_ring.h"
 
 
 
@@ -18,6 +19,9 @@ void closeI2c(void);
 // Export to use I2C in other file
 extern int i2cFd;
 
+// Samples batched in the LSM6DSO FIFO, for consumers reading them in blocks with ImuRing_Read
+extern ImuRing imuSampleRing;
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
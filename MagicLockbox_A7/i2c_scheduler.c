@@ -0,0 +1,478 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <applibs/log.h>
+#include "epoll_timerfd_utilities.h"
+#include "i2c_scheduler.h"
+
+static void CompletionEventHandler(EventData *eventData);
+
+/// <summary>
+///     Queues per priority class, the completed transactions waiting for their callbacks and
+///     the worker. The lock guards everything but eventData and the failure counting, which
+///     belong to the event loop thread; the worker thread only exists on the device.
+/// </summary>
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t workQueued;
+    pthread_cond_t transferDone;
+    pthread_t worker;
+    bool workerRunning;
+    bool stopping;
+    bool suspended;
+    // Set while the worker runs a transfer without the lock
+    bool workerBusy;
+    I2cTransaction *queueHead[I2C_PRIORITY_CLASSES];
+    I2cTransaction *queueTail[I2C_PRIORITY_CLASSES];
+    I2cTransaction *completedHead;
+    I2cTransaction *completedTail;
+    int eventFd;
+    EventData eventData;
+    I2cSchedulerStats stats;
+    DeferredTask *recoveryTask;
+    uint32_t recoveryThreshold;
+    uint32_t failuresInRow;
+    bool recoveryPosted;
+} scheduler = {.lock = PTHREAD_MUTEX_INITIALIZER,
+               .workQueued = PTHREAD_COND_INITIALIZER,
+               .transferDone = PTHREAD_COND_INITIALIZER,
+               .eventFd = -1,
+               .eventData = {.eventHandler = CompletionEventHandler,
+                             .name = "i2cDone",
+                             .priority = EventPriority_Sensor}};
+
+static unsigned int GetPriorityClass(const I2cTransportDevice *device)
+{
+    int priority = device->priority;
+    if (priority < I2C_PRIORITY_HIGHEST) {
+        priority = I2C_PRIORITY_HIGHEST;
+    } else if (priority >= I2C_PRIORITY_HIGHEST + I2C_PRIORITY_CLASSES) {
+        priority = I2C_PRIORITY_HIGHEST + I2C_PRIORITY_CLASSES - 1;
+    }
+    return (unsigned int)(priority - I2C_PRIORITY_HIGHEST);
+}
+
+/// <summary>
+///     Appends a transaction to the queue of its priority class. Called with the lock held.
+/// </summary>
+static void Enqueue(I2cTransaction *transaction)
+{
+    unsigned int priorityClass = GetPriorityClass(transaction->device);
+    transaction->pending = true;
+    transaction->next = NULL;
+    transaction->queuedNs = GetMonotonicNs();
+    if (scheduler.queueTail[priorityClass] == NULL) {
+        scheduler.queueHead[priorityClass] = transaction;
+    } else {
+        scheduler.queueTail[priorityClass]->next = transaction;
+    }
+    scheduler.queueTail[priorityClass] = transaction;
+
+    I2cSchedulerStats *stats = &scheduler.stats;
+    stats->submitted[priorityClass]++;
+    stats->depth++;
+    stats->depthSum += stats->depth;
+    if (stats->depth > stats->maxDepth) {
+        stats->maxDepth = stats->depth;
+    }
+}
+
+/// <summary>
+///     Removes the oldest transaction of the highest non-empty priority class. Called with the
+///     lock held.
+/// </summary>
+/// <returns>The transaction, or NULL if all queues are empty</returns>
+static I2cTransaction *Dequeue(void)
+{
+    for (unsigned int i = 0; i < I2C_PRIORITY_CLASSES; i++) {
+        I2cTransaction *transaction = scheduler.queueHead[i];
+        if (transaction == NULL) {
+            continue;
+        }
+        scheduler.queueHead[i] = transaction->next;
+        if (scheduler.queueHead[i] == NULL) {
+            scheduler.queueTail[i] = NULL;
+        }
+        scheduler.stats.depth--;
+        uint64_t waitNs = GetMonotonicNs() - transaction->queuedNs;
+        if (waitNs > scheduler.stats.maxWaitNs) {
+            scheduler.stats.maxWaitNs = waitNs;
+        }
+        return transaction;
+    }
+    return NULL;
+}
+
+/// <summary>
+///     Performs the transfer of a transaction on the bus.
+/// </summary>
+/// <returns>The time the transfer took</returns>
+static uint64_t RunTransaction(I2cTransaction *transaction)
+{
+    uint64_t startNs = GetMonotonicNs();
+    ssize_t result;
+    if (transaction->writeSegments != NULL) {
+        result = I2cTransport_WriteSegments(transaction->device, transaction->writeSegments,
+                                            transaction->writeSegmentCount);
+    } else if (transaction->readLength == 0) {
+        const I2cTransportSegment segment = {.data = transaction->writeData,
+                                             .length = transaction->writeLength};
+        result = I2cTransport_WriteSegments(transaction->device, &segment, 1);
+    } else if (transaction->writeLength == 0) {
+        result = I2cTransport_Read(transaction->device, transaction->readData,
+                                   transaction->readLength);
+    } else {
+        result = I2cTransport_WriteThenRead(transaction->device, transaction->writeData,
+                                            transaction->writeLength, transaction->readData,
+                                            transaction->readLength);
+    }
+    transaction->result = result;
+    transaction->error = result < 0 ? errno : 0;
+    transaction->startedNs = startNs;
+    transaction->completedNs = GetMonotonicNs();
+    return transaction->completedNs - startNs;
+}
+
+/// <summary>
+///     Hands a transaction which has run back to its submitter: wakes the thread waiting for a
+///     synchronous one, or queues the callback of an asynchronous one for the event loop.
+///     Called with the lock held.
+/// </summary>
+static void Complete(I2cTransaction *transaction, uint64_t busyNs)
+{
+    scheduler.stats.busyNs += busyNs;
+    if (transaction->result < 0) {
+        scheduler.stats.failed++;
+    }
+
+    if (transaction->synchronous) {
+        transaction->pending = false;
+        pthread_cond_broadcast(&scheduler.transferDone);
+        return;
+    }
+
+    transaction->next = NULL;
+    bool wasEmpty = scheduler.completedHead == NULL;
+    if (wasEmpty) {
+        scheduler.completedHead = transaction;
+    } else {
+        scheduler.completedTail->next = transaction;
+    }
+    scheduler.completedTail = transaction;
+
+    // One eventfd write per batch of completions is enough to wake the loop.
+    if (wasEmpty && scheduler.eventFd >= 0) {
+        uint64_t one = 1;
+        if (write(scheduler.eventFd, &one, sizeof(one)) < 0) {
+            Log_Debug("ERROR: Could not signal I2C completion eventfd: %s (%d).\n",
+                      strerror(errno), errno);
+        }
+    }
+}
+
+/// <summary>
+///     Runs every queued transaction on the calling thread, where there is no worker. Called
+///     with the lock held.
+/// </summary>
+static void RunQueue(void)
+{
+    I2cTransaction *transaction;
+    while ((transaction = Dequeue()) != NULL) {
+        Complete(transaction, RunTransaction(transaction));
+    }
+}
+
+#ifndef MAGICLOCKBOX_HOST_RUNTIME
+static void *WorkerThread(void *arg)
+{
+    pthread_mutex_lock(&scheduler.lock);
+    for (;;) {
+        I2cTransaction *transaction = NULL;
+        while (!scheduler.stopping && (scheduler.suspended || (transaction = Dequeue()) == NULL)) {
+            pthread_cond_wait(&scheduler.workQueued, &scheduler.lock);
+        }
+        if (scheduler.stopping) {
+            break;
+        }
+
+        // The bus is not held under the lock, so that submitters never wait for a transfer.
+        scheduler.workerBusy = true;
+        pthread_mutex_unlock(&scheduler.lock);
+        uint64_t busyNs = RunTransaction(transaction);
+        pthread_mutex_lock(&scheduler.lock);
+        scheduler.workerBusy = false;
+        Complete(transaction, busyNs);
+        if (scheduler.suspended) {
+            pthread_cond_broadcast(&scheduler.transferDone);
+        }
+    }
+    pthread_mutex_unlock(&scheduler.lock);
+    return NULL;
+}
+#endif
+
+/// <summary>
+///     Counts a run of failed transactions and posts the recovery task when it reaches the
+///     threshold. Called on the event loop thread.
+/// </summary>
+static void CountOutcome(const I2cTransaction *transaction)
+{
+    if (transaction->result >= 0) {
+        scheduler.failuresInRow = 0;
+        return;
+    }
+    scheduler.failuresInRow++;
+    if (scheduler.recoveryTask != NULL && !scheduler.recoveryPosted &&
+        scheduler.failuresInRow >= scheduler.recoveryThreshold) {
+        Log_Debug("ERROR: %u I2C transactions failed in a row, recovering the bus.\n",
+                  scheduler.failuresInRow);
+        scheduler.recoveryPosted = true;
+        PostDeferredTask(scheduler.recoveryTask);
+    }
+}
+
+/// <summary>
+///     Calls the callbacks of the completed transactions, in completion order.
+/// </summary>
+static void CompletionEventHandler(EventData *eventData)
+{
+    uint64_t count;
+    if (read(scheduler.eventFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        Log_Debug("ERROR: Could not read I2C completion eventfd: %s (%d).\n", strerror(errno),
+                  errno);
+    }
+
+    pthread_mutex_lock(&scheduler.lock);
+    I2cTransaction *transaction = scheduler.completedHead;
+    scheduler.completedHead = NULL;
+    scheduler.completedTail = NULL;
+    pthread_mutex_unlock(&scheduler.lock);
+
+    while (transaction != NULL) {
+        I2cTransaction *next = transaction->next;
+        transaction->pending = false;
+        CountOutcome(transaction);
+        if (transaction->callback != NULL) {
+            transaction->callback(transaction);
+        }
+        transaction = next;
+    }
+}
+
+int I2cScheduler_Start(int epollFd)
+{
+    scheduler.stats.sinceNs = GetMonotonicNs();
+    scheduler.stopping = false;
+
+    scheduler.eventFd = eventfd(0, EFD_NONBLOCK);
+    if (scheduler.eventFd < 0) {
+        Log_Debug("ERROR: Could not create I2C completion eventfd: %s (%d).\n", strerror(errno),
+                  errno);
+        return -1;
+    }
+    if (RegisterEventHandlerToEpollWithPriority(epollFd, scheduler.eventFd, &scheduler.eventData,
+                                                EPOLLIN, scheduler.eventData.priority) != 0) {
+        I2cScheduler_Stop();
+        return -1;
+    }
+
+#ifndef MAGICLOCKBOX_HOST_RUNTIME
+    int result = pthread_create(&scheduler.worker, NULL, WorkerThread, NULL);
+    if (result != 0) {
+        Log_Debug("ERROR: Could not start the I2C worker thread: %s (%d).\n", strerror(result),
+                  result);
+        I2cScheduler_Stop();
+        return -1;
+    }
+    scheduler.workerRunning = true;
+#endif
+
+    // Transactions may have completed before the eventfd existed.
+    pthread_mutex_lock(&scheduler.lock);
+    bool signalled = true;
+    if (scheduler.completedHead != NULL) {
+        uint64_t one = 1;
+        if (write(scheduler.eventFd, &one, sizeof(one)) < 0) {
+            Log_Debug("ERROR: Could not signal I2C completion eventfd: %s (%d).\n",
+                      strerror(errno), errno);
+            signalled = false;
+        }
+    }
+    pthread_mutex_unlock(&scheduler.lock);
+    if (!signalled) {
+        I2cScheduler_Stop();
+        return -1;
+    }
+    return 0;
+}
+
+void I2cScheduler_Stop(void)
+{
+    pthread_mutex_lock(&scheduler.lock);
+    scheduler.stopping = true;
+    scheduler.suspended = false;
+    pthread_cond_broadcast(&scheduler.workQueued);
+    pthread_mutex_unlock(&scheduler.lock);
+    if (scheduler.workerRunning) {
+        pthread_join(scheduler.worker, NULL);
+        scheduler.workerRunning = false;
+    }
+
+    // Drop what is left, so the transactions can be submitted again after a restart.
+    I2cTransaction *transaction;
+    while ((transaction = Dequeue()) != NULL) {
+        transaction->pending = false;
+    }
+    for (transaction = scheduler.completedHead; transaction != NULL; transaction = transaction->next) {
+        transaction->pending = false;
+    }
+    scheduler.completedHead = NULL;
+    scheduler.completedTail = NULL;
+
+    if (scheduler.eventFd >= 0) {
+        CloseFdAndPrintError(scheduler.eventFd, "I2cCompletion");
+        scheduler.eventFd = -1;
+    }
+}
+
+int I2cScheduler_Submit(I2cTransaction *transaction)
+{
+    if (transaction->pending) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    transaction->synchronous = false;
+    pthread_mutex_lock(&scheduler.lock);
+    Enqueue(transaction);
+    if (scheduler.workerRunning) {
+        pthread_cond_signal(&scheduler.workQueued);
+    } else if (!scheduler.suspended) {
+        RunQueue();
+    }
+    pthread_mutex_unlock(&scheduler.lock);
+    return 0;
+}
+
+ssize_t I2cScheduler_Transfer(I2cTransaction *transaction)
+{
+    if (transaction->pending) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    transaction->synchronous = true;
+    pthread_mutex_lock(&scheduler.lock);
+    if (scheduler.suspended) {
+        // It would wait for the resume, which comes from this thread.
+        pthread_mutex_unlock(&scheduler.lock);
+        errno = EAGAIN;
+        return -1;
+    }
+    Enqueue(transaction);
+    if (scheduler.workerRunning) {
+        pthread_cond_signal(&scheduler.workQueued);
+        while (transaction->pending) {
+            pthread_cond_wait(&scheduler.transferDone, &scheduler.lock);
+        }
+    } else {
+        RunQueue();
+    }
+    pthread_mutex_unlock(&scheduler.lock);
+
+    CountOutcome(transaction);
+    errno = transaction->error;
+    return transaction->result;
+}
+
+void I2cScheduler_SetRecoveryTask(DeferredTask *task, uint32_t failureThreshold)
+{
+    scheduler.recoveryTask = task;
+    scheduler.recoveryThreshold = failureThreshold;
+    I2cScheduler_RecoveryDone();
+}
+
+void I2cScheduler_RecoveryDone(void)
+{
+    scheduler.failuresInRow = 0;
+    scheduler.recoveryPosted = false;
+}
+
+void I2cScheduler_Suspend(void)
+{
+    pthread_mutex_lock(&scheduler.lock);
+    scheduler.suspended = true;
+    while (scheduler.workerBusy) {
+        pthread_cond_wait(&scheduler.transferDone, &scheduler.lock);
+    }
+    pthread_mutex_unlock(&scheduler.lock);
+}
+
+void I2cScheduler_Resume(void)
+{
+    pthread_mutex_lock(&scheduler.lock);
+    scheduler.suspended = false;
+    if (scheduler.workerRunning) {
+        pthread_cond_signal(&scheduler.workQueued);
+    } else {
+        RunQueue();
+    }
+    pthread_mutex_unlock(&scheduler.lock);
+}
+
+const I2cSchedulerStats *I2cScheduler_GetStats(void)
+{
+    return &scheduler.stats;
+}
+
+uint32_t I2cScheduler_GetBusUtilizationPercent(void)
+{
+    uint64_t elapsedNs = GetMonotonicNs() - scheduler.stats.sinceNs;
+    return elapsedNs == 0 ? 0 : (uint32_t)(scheduler.stats.busyNs * 100 / elapsedNs);
+}
+
+/// <summary>
+///     Returns the average queue depth seen by the submitted transactions, in tenths.
+/// </summary>
+static uint32_t GetAverageDepthTenths(const I2cSchedulerStats *stats, uint64_t *submitted)
+{
+    *submitted = 0;
+    for (unsigned int i = 0; i < I2C_PRIORITY_CLASSES; i++) {
+        *submitted += stats->submitted[i];
+    }
+    return *submitted == 0 ? 0 : (uint32_t)(stats->depthSum * 10 / *submitted);
+}
+
+int I2cScheduler_FormatStats(char *buffer, size_t bufferSize)
+{
+    pthread_mutex_lock(&scheduler.lock);
+    I2cSchedulerStats stats = scheduler.stats;
+    pthread_mutex_unlock(&scheduler.lock);
+
+    uint64_t submitted;
+    uint32_t depth = GetAverageDepthTenths(&stats, &submitted);
+    return snprintf(buffer, bufferSize, "q %u.%u/%u w %u u %u", depth / 10, depth % 10,
+                    stats.maxDepth, (uint32_t)(stats.maxWaitNs / 1000),
+                    I2cScheduler_GetBusUtilizationPercent());
+}
+
+void I2cScheduler_LogStats(void)
+{
+    pthread_mutex_lock(&scheduler.lock);
+    I2cSchedulerStats stats = scheduler.stats;
+    pthread_mutex_unlock(&scheduler.lock);
+
+    uint64_t submitted;
+    uint32_t depth = GetAverageDepthTenths(&stats, &submitted);
+    Log_Debug("INFO: I2C scheduler: %llu transactions (%llu interrupt, %llu normal, %llu bulk), "
+              "%u failed; queue depth avg %u.%u max %u, longest wait %u us; bus busy %u%%.\n",
+              (unsigned long long)submitted,
+              (unsigned long long)stats.submitted[I2cPriority_Interrupt - I2C_PRIORITY_HIGHEST],
+              (unsigned long long)stats.submitted[I2cPriority_Normal - I2C_PRIORITY_HIGHEST],
+              (unsigned long long)stats.submitted[I2cPriority_Bulk - I2C_PRIORITY_HIGHEST],
+              stats.failed, depth / 10, depth % 10, stats.maxDepth,
+              (uint32_t)(stats.maxWaitNs / 1000), I2cScheduler_GetBusUtilizationPercent());
+}
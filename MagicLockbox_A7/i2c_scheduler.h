@@ -0,0 +1,171 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "epoll_timerfd_utilities.h"
+#include "i2c_transport.h"
+
+/// <summary>
+/// <para>The I2C scheduler owns the bus: every transfer of every device goes through its queue,
+/// one transaction at a time, highest <see cref="I2cPriority" /> of the device first and in
+/// submission order within a priority.</para>
+/// <para>On the device a worker thread runs the transactions, so an event handler queues its
+/// transfers with <see cref="I2cScheduler_Submit" /> and returns without waiting for the bus.
+/// The completion callbacks run later on the event loop thread, woken through an eventfd.</para>
+/// <para>The host runtime has no real bus and a virtual clock, so there the transactions run
+/// inline when submitted; the callbacks are still deferred to the event loop.</para>
+/// <para>Failed transactions are counted as they complete on the event loop thread. A run of
+/// them posts the recovery task set with <see cref="I2cScheduler_SetRecoveryTask" />, which
+/// takes the bus over between <see cref="I2cScheduler_Suspend" /> and
+/// <see cref="I2cScheduler_Resume" />.</para>
+/// </summary>
+
+struct I2cTransaction;
+
+/// <summary>
+///     Called on the event loop thread when a submitted transaction has completed.
+/// </summary>
+typedef void (*I2cTransactionCallback)(struct I2cTransaction *transaction);
+
+/// <summary>
+/// <para>One bus transaction: a write, a read, or a write then read with a repeated start when
+/// both lengths are set. A write without a read may instead be given as segments, written as
+/// their concatenation, see <see cref="I2cTransport_WriteSegments" />.</para>
+/// <para>The struct and its buffers must remain valid until the callback has been called. A
+/// transaction can be submitted again from its own callback.</para>
+/// </summary>
+typedef struct I2cTransaction {
+    I2cTransportDevice *device;
+    const uint8_t *writeData;
+    size_t writeLength;
+    uint8_t *readData;
+    size_t readLength;
+    /// <summary>
+    /// Used instead of writeData when not NULL, with readLength 0.
+    /// </summary>
+    const I2cTransportSegment *writeSegments;
+    size_t writeSegmentCount;
+    /// <summary>
+    /// Called when the transaction has completed, may be NULL.
+    /// </summary>
+    I2cTransactionCallback callback;
+    /// <summary>
+    /// Free for the submitter.
+    /// </summary>
+    void *context;
+    /// <summary>
+    /// Bytes transferred, or -1 with the errno of the failure in error.
+    /// </summary>
+    ssize_t result;
+    int error;
+    /// <summary>
+    /// CLOCK_MONOTONIC times at which the transfer started and ended on the bus, in
+    /// nanoseconds.
+    /// </summary>
+    uint64_t startedNs;
+    uint64_t completedNs;
+    /// <summary>
+    /// Queue bookkeeping, owned by i2c_scheduler.c.
+    /// </summary>
+    struct I2cTransaction *next;
+    uint64_t queuedNs;
+    bool pending;
+    bool synchronous;
+} I2cTransaction;
+
+/// <summary>
+///     Statistics of the scheduler since its start.
+/// </summary>
+typedef struct I2cSchedulerStats {
+    /// <summary>Transactions submitted, per priority class.</summary>
+    uint64_t submitted[I2C_PRIORITY_CLASSES];
+    /// <summary>Transactions which failed.</summary>
+    uint32_t failed;
+    /// <summary>Transactions waiting in the queue, and the most there have been.</summary>
+    uint32_t depth;
+    uint32_t maxDepth;
+    /// <summary>Sum of the queue depths seen by the submitted transactions, themselves
+    /// included.</summary>
+    uint64_t depthSum;
+    /// <summary>Longest time a transaction waited in the queue.</summary>
+    uint64_t maxWaitNs;
+    /// <summary>Time the bus was busy with transfers.</summary>
+    uint64_t busyNs;
+    /// <summary>CLOCK_MONOTONIC time at which the scheduler started, in nanoseconds.</summary>
+    uint64_t sinceNs;
+} I2cSchedulerStats;
+
+/// <summary>
+///     Starts the scheduler on the bus set with <see cref="I2cTransport_SetBusFd" /> and adds
+///     its completion eventfd to an epoll instance.
+/// </summary>
+/// <param name="epollFd">Epoll file descriptor</param>
+/// <returns>0 on success, or -1 on failure</returns>
+int I2cScheduler_Start(int epollFd);
+
+/// <summary>
+///     Stops the worker and closes the completion eventfd. Transactions still queued are
+///     dropped without their callbacks.
+/// </summary>
+void I2cScheduler_Stop(void);
+
+/// <summary>
+///     Queues a transaction. Returns at once; the callback reports the outcome.
+/// </summary>
+/// <returns>0 on success, or -1 with errno set (EBUSY if the transaction is still
+/// pending)</returns>
+int I2cScheduler_Submit(I2cTransaction *transaction);
+
+/// <summary>
+///     Queues a transaction and waits for it to complete, for initialization and other code
+///     outside of event handlers. The callback is not called.
+/// </summary>
+/// <returns>The result of the transaction, see <see cref="I2cTransaction" /></returns>
+ssize_t I2cScheduler_Transfer(I2cTransaction *transaction);
+
+/// <summary>
+///     Sets the task posted when failureThreshold transactions in a row have failed, counting
+///     from now. It is not posted again until <see cref="I2cScheduler_RecoveryDone" /> has
+///     been called.
+/// </summary>
+void I2cScheduler_SetRecoveryTask(DeferredTask *task, uint32_t failureThreshold);
+
+/// <summary>
+///     Ends a recovery: the failures start counting from zero and the recovery task can be
+///     posted again.
+/// </summary>
+void I2cScheduler_RecoveryDone(void);
+
+/// <summary>
+///     Holds the queue and waits for the transfer on the bus to end, after which the caller owns
+///     the bus and may use the transport directly. Transactions submitted meanwhile stay queued
+///     and <see cref="I2cScheduler_Transfer" /> fails with EAGAIN. Call on the event loop thread.
+/// </summary>
+void I2cScheduler_Suspend(void);
+
+/// <summary>
+///     Runs the queue again after <see cref="I2cScheduler_Suspend" />.
+/// </summary>
+void I2cScheduler_Resume(void);
+
+/// <summary>
+///     Returns the scheduler statistics.
+/// </summary>
+const I2cSchedulerStats *I2cScheduler_GetStats(void);
+
+/// <summary>
+///     Returns the percentage of the time since the start the bus has been busy.
+/// </summary>
+uint32_t I2cScheduler_GetBusUtilizationPercent(void);
+
+/// <summary>
+///     Formats the statistics as "q avg/max w maxUs u percent".
+/// </summary>
+/// <returns>The number of characters written, as snprintf</returns>
+int I2cScheduler_FormatStats(char *buffer, size_t bufferSize);
+
+/// <summary>
+///     Prints the statistics with Log_Debug.
+/// </summary>
+void I2cScheduler_LogStats(void);
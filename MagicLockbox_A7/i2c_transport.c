@@ -0,0 +1,166 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <applibs/log.h>
+#include "i2c_transport.h"
+#include "sensor_hal.h"
+
+static int busFd = -1;
+// Speed the bus runs at, 0 when not set on busFd yet
+static uint32_t busSpeedHz;
+static I2cTransportDevice *devices;
+
+static const uint32_t speedsHz[] = {I2C_BUS_SPEED_STANDARD, I2C_BUS_SPEED_FAST,
+                                    I2C_BUS_SPEED_FAST_PLUS};
+
+/// <summary>
+///     Counts a transaction of a device, adding the device to the list on first use.
+/// </summary>
+static void CountTransaction(I2cTransportDevice *device, ssize_t result, size_t written,
+                             size_t read)
+{
+    if (!device->registered) {
+        device->registered = true;
+        device->next = devices;
+        devices = device;
+    }
+
+    device->stats.transactions++;
+    if (result < 0) {
+        device->stats.errors++;
+        return;
+    }
+    device->stats.bytesWritten += (uint32_t)written;
+    device->stats.bytesRead += (uint32_t)read;
+}
+
+/// <summary>
+///     Switches the bus to the speed of a device, counting a failure as a failed transaction.
+/// </summary>
+/// <returns>0 on success, or -1 with errno set</returns>
+static int ApplySpeed(I2cTransportDevice *device)
+{
+    uint32_t speedHz = I2cTransport_GetSpeedHz(device->speed);
+    if (speedHz == busSpeedHz) {
+        return 0;
+    }
+    if (SensorHal_I2cSetBusSpeed(busFd, speedHz) != 0) {
+        CountTransaction(device, -1, 0, 0);
+        return -1;
+    }
+    busSpeedHz = speedHz;
+    return 0;
+}
+
+void I2cTransport_SetBusFd(int i2cFd)
+{
+    busFd = i2cFd;
+    busSpeedHz = 0;
+}
+
+uint32_t I2cTransport_GetSpeedHz(I2cSpeed speed)
+{
+    if (speed < I2cSpeed_Standard || speed > I2cSpeed_FastPlus) {
+        return speedsHz[I2cSpeed_Standard];
+    }
+    return speedsHz[speed];
+}
+
+int I2cTransport_SelectSpeed(I2cTransportDevice *device, I2cSpeed fastest, I2cTransportProbe probe)
+{
+    for (int speed = fastest; speed >= I2cSpeed_Standard; speed--) {
+        device->speed = (I2cSpeed)speed;
+        uint32_t speedHz = I2cTransport_GetSpeedHz(device->speed);
+        // Set directly, so that a speed the bus rejects is not counted against the device
+        busSpeedHz = 0;
+        if (SensorHal_I2cSetBusSpeed(busFd, speedHz) != 0) {
+            Log_Debug("INFO: I2C bus does not take %u kHz: %s (%d).\n", speedHz / 1000,
+                      strerror(errno), errno);
+            continue;
+        }
+        busSpeedHz = speedHz;
+        if (probe == NULL || probe(device) == 0) {
+            Log_Debug("I2C %s at %u kHz.\n", device->name, speedHz / 1000);
+            return 0;
+        }
+        Log_Debug("INFO: I2C %s does not answer at %u kHz.\n", device->name, speedHz / 1000);
+    }
+    device->speed = I2cSpeed_Standard;
+    return -1;
+}
+
+ssize_t I2cTransport_WriteThenRead(I2cTransportDevice *device, const uint8_t *writeData,
+                                   size_t writeLength, uint8_t *readData, size_t readLength)
+{
+    if (ApplySpeed(device) != 0) {
+        return -1;
+    }
+    ssize_t result = SensorHal_I2cWriteThenRead(busFd, device->address, writeData, writeLength,
+                                                readData, readLength);
+    CountTransaction(device, result, writeLength, readLength);
+    return result;
+}
+
+ssize_t I2cTransport_Read(I2cTransportDevice *device, uint8_t *buffer, size_t length)
+{
+    if (ApplySpeed(device) != 0) {
+        return -1;
+    }
+    ssize_t result = SensorHal_I2cRead(busFd, device->address, buffer, length);
+    CountTransaction(device, result, 0, length);
+    return result;
+}
+
+ssize_t I2cTransport_WriteSegments(I2cTransportDevice *device,
+                                   const I2cTransportSegment *segments, size_t segmentCount)
+{
+    const uint8_t *data;
+    size_t length;
+    uint8_t gathered[I2C_TRANSPORT_MAX_WRITE];
+
+    if (segmentCount == 1) {
+        // Nothing to gather, write straight from the caller's buffer.
+        data = segments[0].data;
+        length = segments[0].length;
+    } else {
+        length = 0;
+        for (size_t i = 0; i < segmentCount; i++) {
+            if (segments[i].length > sizeof(gathered) - length) {
+                errno = EMSGSIZE;
+                return -1;
+            }
+            memcpy(gathered + length, segments[i].data, segments[i].length);
+            length += segments[i].length;
+        }
+        data = gathered;
+    }
+
+    if (ApplySpeed(device) != 0) {
+        return -1;
+    }
+    ssize_t result = SensorHal_I2cWrite(busFd, device->address, data, length);
+    CountTransaction(device, result, length, 0);
+    return result;
+}
+
+I2cTransportDevice *I2cTransport_GetDeviceList(void)
+{
+    return devices;
+}
+
+int I2cTransport_FormatStats(const I2cTransportDevice *device, char *buffer, size_t bufferSize)
+{
+    return snprintf(buffer, bufferSize, "t %u w %u r %u e %u", device->stats.transactions,
+                    device->stats.bytesWritten, device->stats.bytesRead, device->stats.errors);
+}
+
+void I2cTransport_LogStats(void)
+{
+    for (I2cTransportDevice *device = devices; device != NULL; device = device->next) {
+        Log_Debug("INFO: I2C %s (0x%02x) at %u kHz: %u transactions, %u bytes written, %u bytes "
+                  "read, %u errors.\n",
+                  device->name, (unsigned int)device->address,
+                  I2cTransport_GetSpeedHz(device->speed) / 1000, device->stats.transactions,
+                  device->stats.bytesWritten, device->stats.bytesRead, device->stats.errors);
+    }
+}
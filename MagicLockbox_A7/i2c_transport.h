@@ -0,0 +1,151 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <applibs/i2c.h>
+
+/// <summary>
+///     Largest write, register address included, that <see cref="I2cTransport_WriteSegments" />
+///     gathers. The bus API takes one contiguous buffer, so the segments are gathered into a
+///     buffer of this size on the stack.
+/// </summary>
+#define I2C_TRANSPORT_MAX_WRITE 64
+
+/// <summary>
+///     Bus traffic of one device, counted by the transport.
+/// </summary>
+typedef struct I2cTransportStats {
+    /// <summary>Bus transactions, a write-then-read with repeated start counting as one.</summary>
+    uint32_t transactions;
+    uint32_t bytesWritten;
+    uint32_t bytesRead;
+    /// <summary>Transactions which failed.</summary>
+    uint32_t errors;
+} I2cTransportStats;
+
+/// <summary>
+///     Priority of the queued transactions of a device in the I2C scheduler, see
+///     i2c_scheduler.h. Transactions of a lower value go first. The default of a
+///     zero-initialized device is I2cPriority_Normal.
+/// </summary>
+typedef enum I2cPriority {
+    I2cPriority_Interrupt = -1,
+    I2cPriority_Normal = 0,
+    I2cPriority_Bulk = 1,
+} I2cPriority;
+
+#define I2C_PRIORITY_HIGHEST I2cPriority_Interrupt
+#define I2C_PRIORITY_CLASSES (I2cPriority_Bulk - I2cPriority_Interrupt + 1)
+
+/// <summary>
+///     Bus speed profile of a device: standard mode (100 kHz), fast mode (400 kHz) or fast mode
+///     plus (1 MHz). The default of a zero-initialized device is I2cSpeed_Standard.
+/// </summary>
+typedef enum I2cSpeed {
+    I2cSpeed_Standard = 0,
+    I2cSpeed_Fast = 1,
+    I2cSpeed_FastPlus = 2,
+} I2cSpeed;
+
+struct I2cTransportDevice;
+
+/// <summary>
+///     Checks a device at a bus speed, see <see cref="I2cTransport_SelectSpeed" />.
+/// </summary>
+/// <returns>0 if the device works, or -1</returns>
+typedef int (*I2cTransportProbe)(struct I2cTransportDevice *device);
+
+/// <summary>
+/// <para>A device on the I2C bus. Only name and address need to be populated; the struct must
+/// stay valid for as long as it is used.</para>
+/// </summary>
+typedef struct I2cTransportDevice {
+    const char *name;
+    I2C_DeviceAddress address;
+    /// <summary>
+    /// Priority of the transactions of the device in the I2C scheduler.
+    /// </summary>
+    I2cPriority priority;
+    /// <summary>
+    /// Bus speed of the transfers of the device, the transport switches the bus to it when
+    /// the device before ran at another one.
+    /// </summary>
+    I2cSpeed speed;
+    /// <summary>
+    /// Traffic statistics, maintained by the transport.
+    /// </summary>
+    I2cTransportStats stats;
+    /// <summary>
+    /// Next device in the list returned by <see cref="I2cTransport_GetDeviceList" />.
+    /// </summary>
+    struct I2cTransportDevice *next;
+    bool registered;
+} I2cTransportDevice;
+
+/// <summary>
+///     One piece of a gathered write.
+/// </summary>
+typedef struct I2cTransportSegment {
+    const uint8_t *data;
+    size_t length;
+} I2cTransportSegment;
+
+/// <summary>
+///     Sets the file descriptor of the I2C master all transfers go through. The bus speed of
+///     the new descriptor is set again by the next transfer.
+/// </summary>
+void I2cTransport_SetBusFd(int i2cFd);
+
+/// <summary>
+///     Returns the bus clock of a speed profile, in Hz.
+/// </summary>
+uint32_t I2cTransport_GetSpeedHz(I2cSpeed speed);
+
+/// <summary>
+///     Sets the speed of a device to the fastest profile up to fastest that the bus accepts and
+///     at which probe, if not NULL, succeeds. Call while no transfers are running, such as at
+///     startup.
+/// </summary>
+/// <returns>0 on success, or -1 if the device does not even work at I2cSpeed_Standard</returns>
+int I2cTransport_SelectSpeed(I2cTransportDevice *device, I2cSpeed fastest, I2cTransportProbe probe);
+
+/// <summary>
+///     Writes writeData and reads readLength bytes back in one transaction with a repeated
+///     start, without releasing the bus in between.
+/// </summary>
+/// <returns>The number of bytes transferred, or -1 with errno set</returns>
+ssize_t I2cTransport_WriteThenRead(I2cTransportDevice *device, const uint8_t *writeData,
+                                   size_t writeLength, uint8_t *readData, size_t readLength);
+
+/// <summary>
+///     Reads from a device which does not need a register address, such as a message based
+///     device.
+/// </summary>
+/// <returns>The number of bytes read, or -1 with errno set</returns>
+ssize_t I2cTransport_Read(I2cTransportDevice *device, uint8_t *buffer, size_t length);
+
+/// <summary>
+///     Writes the concatenation of the segments in one transaction.
+/// </summary>
+/// <returns>The number of bytes written, or -1 with errno set (EMSGSIZE if longer than
+/// I2C_TRANSPORT_MAX_WRITE)</returns>
+ssize_t I2cTransport_WriteSegments(I2cTransportDevice *device,
+                                   const I2cTransportSegment *segments, size_t segmentCount);
+
+/// <summary>
+///     Returns the first device that has been used at least once; the rest are linked through
+///     next.
+/// </summary>
+I2cTransportDevice *I2cTransport_GetDeviceList(void);
+
+/// <summary>
+///     Formats the statistics of a device as "t transactions w bytes r bytes e errors".
+/// </summary>
+/// <returns>The number of characters written, as snprintf</returns>
+int I2cTransport_FormatStats(const I2cTransportDevice *device, char *buffer, size_t bufferSize);
+
+/// <summary>
+///     Prints the statistics of every device with Log_Debug.
+/// </summary>
+void I2cTransport_LogStats(void);
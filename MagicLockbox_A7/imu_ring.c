@@ -0,0 +1,73 @@
+#include <string.h>
+#include "imu_ring.h"
+
+#define IMU_RING_MASK (IMU_RING_CAPACITY - 1)
+
+_Static_assert((IMU_RING_CAPACITY & IMU_RING_MASK) == 0, "IMU_RING_CAPACITY must be a power of two");
+
+/// <summary>
+///     Copies count samples between the ring and a linear buffer, in at most two pieces as the
+///     block may wrap around the end of the ring.
+/// </summary>
+static void CopyOut(const ImuRing *ring, uint32_t index, ImuSample *samples, size_t count)
+{
+    size_t first = IMU_RING_CAPACITY - (index & IMU_RING_MASK);
+    if (first > count) {
+        first = count;
+    }
+    memcpy(samples, &ring->samples[index & IMU_RING_MASK], first * sizeof(ImuSample));
+    memcpy(samples + first, &ring->samples[0], (count - first) * sizeof(ImuSample));
+}
+
+static void CopyIn(ImuRing *ring, uint32_t index, const ImuSample *samples, size_t count)
+{
+    size_t first = IMU_RING_CAPACITY - (index & IMU_RING_MASK);
+    if (first > count) {
+        first = count;
+    }
+    memcpy(&ring->samples[index & IMU_RING_MASK], samples, first * sizeof(ImuSample));
+    memcpy(&ring->samples[0], samples + first, (count - first) * sizeof(ImuSample));
+}
+
+size_t ImuRing_Write(ImuRing *ring, const ImuSample *samples, size_t count)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    // Acquire pairs with the release in ImuRing_Read: the consumer is done with the slots.
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t space = IMU_RING_CAPACITY - (size_t)(head - tail);
+
+    if (count > space) {
+        atomic_fetch_add_explicit(&ring->dropped, (uint32_t)(count - space), memory_order_relaxed);
+        count = space;
+    }
+    CopyIn(ring, head, samples, count);
+    // Release publishes the copied samples before the new head.
+    atomic_store_explicit(&ring->head, head + (uint32_t)count, memory_order_release);
+    return count;
+}
+
+size_t ImuRing_Read(ImuRing *ring, ImuSample *samples, size_t maxCount)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t count = (size_t)(head - tail);
+
+    if (count > maxCount) {
+        count = maxCount;
+    }
+    CopyOut(ring, tail, samples, count);
+    atomic_store_explicit(&ring->tail, tail + (uint32_t)count, memory_order_release);
+    return count;
+}
+
+size_t ImuRing_Available(ImuRing *ring)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    return (size_t)(head - tail);
+}
+
+uint32_t ImuRing_GetDropped(ImuRing *ring)
+{
+    return atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+}
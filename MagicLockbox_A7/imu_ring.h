@@ -0,0 +1,65 @@
+#pragma once
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// <summary>
+///     Number of samples an <see cref="ImuRing" /> holds, a power of two.
+/// </summary>
+#define IMU_RING_CAPACITY 512
+
+typedef enum {
+    ImuSensor_Accel,
+    ImuSensor_Gyro,
+    ImuSensor_Pressure,
+} ImuSensor;
+
+/// <summary>
+///     One raw sample taken from the LSM6DSO FIFO, in the LSB of the configured full scale. A
+///     pressure sample is the LPS22HH read by the sensor hub: x holds the low 16 bits and y the
+///     sign extended high 8 bits of the pressure in 1/4096 hPa, z the temperature in 1/100
+///     degrees Celsius.
+/// </summary>
+typedef struct ImuSample {
+    int16_t x;
+    int16_t y;
+    int16_t z;
+    ImuSensor sensor;
+} ImuSample;
+
+/// <summary>
+/// <para>Lock-free ring of IMU samples with one producer and one consumer. The producer only
+/// writes head and the consumer only writes tail, so neither needs a lock and the two may run
+/// on different threads.</para>
+/// <para>Zero initialized is empty.</para>
+/// </summary>
+typedef struct ImuRing {
+    _Atomic uint32_t head;
+    _Atomic uint32_t tail;
+    /// <summary>Samples the producer dropped because the ring was full.</summary>
+    _Atomic uint32_t dropped;
+    ImuSample samples[IMU_RING_CAPACITY];
+} ImuRing;
+
+/// <summary>
+///     Appends a block of samples; called by the producer only. Samples which do not fit are
+///     dropped and counted, the samples already in the ring are never overwritten.
+/// </summary>
+/// <returns>The number of samples appended</returns>
+size_t ImuRing_Write(ImuRing *ring, const ImuSample *samples, size_t count);
+
+/// <summary>
+///     Removes up to maxCount of the oldest samples; called by the consumer only.
+/// </summary>
+/// <returns>The number of samples copied to samples</returns>
+size_t ImuRing_Read(ImuRing *ring, ImuSample *samples, size_t maxCount);
+
+/// <summary>
+///     Returns the number of samples waiting to be read.
+/// </summary>
+size_t ImuRing_Available(ImuRing *ring);
+
+/// <summary>
+///     Returns the number of samples dropped since the ring was initialized.
+/// </summary>
+uint32_t ImuRing_GetDropped(ImuRing *ring);
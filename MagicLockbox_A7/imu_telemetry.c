@@ -0,0 +1,294 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <applibs/log.h>
+
+#include "azure_iot_utilities.h"
+#include "build_options.h"
+#include "epoll_timerfd_utilities.h"
+#include "imu_telemetry.h"
+
+#if (defined(IOT_CENTRAL_APPLICATION) || defined(IOT_HUB_APPLICATION))
+extern IOTHUB_DEVICE_CLIENT_LL_HANDLE iothubClientHandle;
+#endif
+
+#define IMU_TELEMETRY_KIND_REPEAT 0x00
+#define IMU_TELEMETRY_KIND_DELTA8 0x20
+#define IMU_TELEMETRY_KIND_RAW 0x40
+#define IMU_TELEMETRY_KIND_PRESSURE 0x60
+#define IMU_TELEMETRY_GYRO 0x80
+#define IMU_TELEMETRY_MAX_REPEAT 32
+// Longest record, a raw sample
+#define IMU_TELEMETRY_MAX_RECORD 7
+
+// The JSON envelope around the base64 data
+#define IMU_TELEMETRY_ENVELOPE "{\"imu\":{\"seq\":%u,\"samples\":%u,\"dropped\":%u,\"data\":\"%s\"}}"
+#define IMU_TELEMETRY_MAX_MESSAGE \
+    (sizeof(IMU_TELEMETRY_ENVELOPE) + 3 * 10 + (IMU_TELEMETRY_BATCH_BYTES + 2) / 3 * 4)
+
+int imuTelemetryBytesPerSecond = 0;
+
+typedef struct {
+    uint32_t messages;
+    uint64_t messageBytes;
+    uint64_t samples;
+    uint64_t packedBytes;
+    uint32_t samplesDropped;
+} ImuTelemetryStats;
+
+static struct {
+    ImuRing *ring;
+    uint8_t batch[IMU_TELEMETRY_BATCH_BYTES];
+    size_t batchLength;
+    uint32_t batchSamples;
+    uint64_t batchStartNs;
+    /// <summary>Last sample of each sensor in the batch, and the offset of its repeat record
+    /// while that is the sensor's last record, otherwise -1.</summary>
+    ImuSample previous[2];
+    bool previousValid[2];
+    long repeatOffset[2];
+    /// <summary>Allowance of the bandwidth cap in bytes scaled by 10^9, and when it was last
+    /// topped up.</summary>
+    uint64_t budget;
+    uint64_t budgetNs;
+    uint32_t sequence;
+    uint32_t droppedSinceSent;
+    /// <summary>Samples dropped by the ring when last counted.</summary>
+    uint32_t ringDropped;
+    ImuTelemetryStats stats;
+} telemetry;
+
+static char encoded[(IMU_TELEMETRY_BATCH_BYTES + 2) / 3 * 4 + 1];
+static char message[IMU_TELEMETRY_MAX_MESSAGE];
+
+static void TelemetryTimerEventHandler(EventData *eventData);
+
+static SoftTimer telemetryTimer = {.eventData.eventHandler = &TelemetryTimerEventHandler,
+                                   .eventData.name = "imuTelemetry",
+                                   .eventData.priority = EventPriority_Cloud};
+
+static void ClearBatch(void)
+{
+    telemetry.batchLength = 0;
+    telemetry.batchSamples = 0;
+    memset(telemetry.previousValid, 0, sizeof(telemetry.previousValid));
+    telemetry.repeatOffset[0] = -1;
+    telemetry.repeatOffset[1] = -1;
+}
+
+/// <summary>
+///     Writes the base64 encoding of data with its terminating null to out, which must hold
+///     (length + 2) / 3 * 4 + 1 characters.
+/// </summary>
+static void EncodeBase64(const uint8_t *data, size_t length, char *out)
+{
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    for (size_t i = 0; i < length; i += 3) {
+        uint32_t bits = (uint32_t)data[i] << 16;
+        if (i + 1 < length) {
+            bits |= (uint32_t)data[i + 1] << 8;
+        }
+        if (i + 2 < length) {
+            bits |= data[i + 2];
+        }
+        *out++ = alphabet[(bits >> 18) & 0x3F];
+        *out++ = alphabet[(bits >> 12) & 0x3F];
+        *out++ = i + 1 < length ? alphabet[(bits >> 6) & 0x3F] : '=';
+        *out++ = i + 2 < length ? alphabet[bits & 0x3F] : '=';
+    }
+    *out = '\0';
+}
+
+/// <summary>
+///     Adds the allowance of the bandwidth cap since the last call. The allowance is capped at
+///     one full message, so idle time does not add up to a burst over the cap.
+/// </summary>
+static void RefillBudget(uint64_t nowNs)
+{
+    uint64_t elapsedNs = nowNs - telemetry.budgetNs;
+    telemetry.budgetNs = nowNs;
+    uint64_t rate = imuTelemetryBytesPerSecond > 0 ? (uint64_t)imuTelemetryBytesPerSecond : 0;
+    const uint64_t limit = (uint64_t)IMU_TELEMETRY_MAX_MESSAGE * 1000000000ULL;
+    // Any longer fills the allowance anyway, and rate * elapsedNs could overflow
+    if (rate != 0 && elapsedNs > limit / rate) {
+        elapsedNs = limit / rate;
+    }
+    telemetry.budget += rate * elapsedNs;
+    if (telemetry.budget > limit) {
+        telemetry.budget = limit;
+    }
+}
+
+/// <summary>
+///     Sends the batch as one message if the bandwidth cap allows, otherwise drops it, and
+///     starts a new batch.
+/// </summary>
+static void SendBatch(void)
+{
+    if (telemetry.batchSamples == 0) {
+        return;
+    }
+
+    EncodeBase64(telemetry.batch, telemetry.batchLength, encoded);
+    int length = snprintf(message, sizeof(message), IMU_TELEMETRY_ENVELOPE, telemetry.sequence,
+                          telemetry.batchSamples, telemetry.droppedSinceSent, encoded);
+
+    RefillBudget(GetMonotonicNs());
+    uint64_t cost = (uint64_t)length * 1000000000ULL;
+    bool connected = false;
+#if (defined(IOT_CENTRAL_APPLICATION) || defined(IOT_HUB_APPLICATION))
+    connected = iothubClientHandle != NULL;
+#endif
+    if (length > 0 && (size_t)length < sizeof(message) && connected && telemetry.budget >= cost) {
+        telemetry.budget -= cost;
+        AzureIoT_SendMessage(message);
+        telemetry.sequence++;
+        telemetry.droppedSinceSent = 0;
+        telemetry.stats.messages++;
+        telemetry.stats.messageBytes += (uint64_t)length;
+        telemetry.stats.samples += telemetry.batchSamples;
+        telemetry.stats.packedBytes += telemetry.batchLength;
+    } else {
+        telemetry.droppedSinceSent += telemetry.batchSamples;
+        telemetry.stats.samplesDropped += telemetry.batchSamples;
+    }
+    ClearBatch();
+}
+
+/// <summary>
+///     Appends the record of one sample, see imu_telemetry.h for the format.
+/// </summary>
+static void PackSample(const ImuSample *sample)
+{
+    if (telemetry.batchLength + IMU_TELEMETRY_MAX_RECORD > sizeof(telemetry.batch)) {
+        SendBatch();
+    }
+    if (telemetry.batchSamples == 0) {
+        telemetry.batchStartNs = GetMonotonicNs();
+    }
+    telemetry.batchSamples++;
+
+    uint8_t *out = &telemetry.batch[telemetry.batchLength];
+    if (sample->sensor == ImuSensor_Pressure) {
+        out[0] = IMU_TELEMETRY_KIND_PRESSURE;
+        out[1] = (uint8_t)((uint16_t)sample->x & 0xFF);
+        out[2] = (uint8_t)((uint16_t)sample->x >> 8);
+        out[3] = (uint8_t)sample->y;
+        out[4] = (uint8_t)((uint16_t)sample->z & 0xFF);
+        out[5] = (uint8_t)((uint16_t)sample->z >> 8);
+        telemetry.batchLength += 6;
+        return;
+    }
+
+    int sensor = sample->sensor == ImuSensor_Gyro ? 1 : 0;
+    uint8_t tag = sensor == 1 ? IMU_TELEMETRY_GYRO : 0;
+    ImuSample *previous = &telemetry.previous[sensor];
+    int dx = sample->x - previous->x;
+    int dy = sample->y - previous->y;
+    int dz = sample->z - previous->z;
+    bool valid = telemetry.previousValid[sensor];
+    *previous = *sample;
+    telemetry.previousValid[sensor] = true;
+
+    if (valid && dx == 0 && dy == 0 && dz == 0) {
+        long offset = telemetry.repeatOffset[sensor];
+        if (offset >= 0 && (telemetry.batch[offset] & 0x1F) < IMU_TELEMETRY_MAX_REPEAT - 1) {
+            telemetry.batch[offset]++;
+            return;
+        }
+        telemetry.repeatOffset[sensor] = (long)telemetry.batchLength;
+        out[0] = tag | IMU_TELEMETRY_KIND_REPEAT;
+        telemetry.batchLength += 1;
+        return;
+    }
+
+    telemetry.repeatOffset[sensor] = -1;
+    if (valid && dx >= INT8_MIN && dx <= INT8_MAX && dy >= INT8_MIN && dy <= INT8_MAX &&
+        dz >= INT8_MIN && dz <= INT8_MAX) {
+        out[0] = tag | IMU_TELEMETRY_KIND_DELTA8;
+        out[1] = (uint8_t)(int8_t)dx;
+        out[2] = (uint8_t)(int8_t)dy;
+        out[3] = (uint8_t)(int8_t)dz;
+        telemetry.batchLength += 4;
+        return;
+    }
+
+    const int16_t axes[3] = {sample->x, sample->y, sample->z};
+    out[0] = tag | IMU_TELEMETRY_KIND_RAW;
+    for (int axis = 0; axis < 3; axis++) {
+        out[1 + axis * 2] = (uint8_t)((uint16_t)axes[axis] & 0xFF);
+        out[2 + axis * 2] = (uint8_t)((uint16_t)axes[axis] >> 8);
+    }
+    telemetry.batchLength += IMU_TELEMETRY_MAX_RECORD;
+}
+
+/// <summary>
+///     Counts the samples the ring has dropped since the last call as lost.
+/// </summary>
+static void CountRingDrops(void)
+{
+    uint32_t dropped = ImuRing_GetDropped(telemetry.ring);
+    uint32_t lost = dropped - telemetry.ringDropped;
+    telemetry.ringDropped = dropped;
+    telemetry.droppedSinceSent += lost;
+    telemetry.stats.samplesDropped += lost;
+}
+
+/// <summary>
+///     Moves the samples of the ring into the batch and sends it when it has aged.
+/// </summary>
+static void TelemetryTimerEventHandler(EventData *eventData)
+{
+    ImuSample samples[64];
+    size_t count;
+    if (imuTelemetryBytesPerSecond <= 0) {
+        // Off: keep the ring from filling up, so that turning on starts with fresh samples
+        while (ImuRing_Read(telemetry.ring, samples, sizeof(samples) / sizeof(samples[0])) != 0) {
+        }
+        ClearBatch();
+        telemetry.budget = 0;
+        telemetry.budgetNs = GetMonotonicNs();
+        telemetry.ringDropped = ImuRing_GetDropped(telemetry.ring);
+        return;
+    }
+
+    CountRingDrops();
+
+    while ((count = ImuRing_Read(telemetry.ring, samples, sizeof(samples) / sizeof(samples[0]))) != 0) {
+        for (size_t i = 0; i < count; i++) {
+            PackSample(&samples[i]);
+        }
+    }
+    if (telemetry.batchSamples != 0 &&
+        GetMonotonicNs() - telemetry.batchStartNs >= IMU_TELEMETRY_MAX_BATCH_AGE_S * 1000000000ULL) {
+        SendBatch();
+    }
+}
+
+int ImuTelemetry_Start(ImuRing *ring)
+{
+    telemetry.ring = ring;
+    telemetry.ringDropped = ImuRing_GetDropped(ring);
+    ClearBatch();
+    telemetry.budgetNs = GetMonotonicNs();
+    static const struct timespec period = {.tv_sec = IMU_TELEMETRY_PERIOD_MS / 1000,
+                                           .tv_nsec = IMU_TELEMETRY_PERIOD_MS % 1000 * 1000000};
+    return SetSoftTimerToPeriod(&telemetryTimer, &period);
+}
+
+void ImuTelemetry_Stop(void)
+{
+    CancelSoftTimer(&telemetryTimer);
+}
+
+void ImuTelemetry_LogStats(void)
+{
+    const ImuTelemetryStats *stats = &telemetry.stats;
+    Log_Debug("INFO: IMU telemetry: %u messages of %u bytes, %u samples packed into %u bytes "
+              "(%u raw), %u samples dropped.\n",
+              stats->messages, (uint32_t)stats->messageBytes, (uint32_t)stats->samples,
+              (uint32_t)stats->packedBytes, (uint32_t)(stats->samples * 6), stats->samplesDropped);
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <stdint.h>
+#include "imu_ring.h"
+
+/// <summary>
+/// <para>Raw IMU telemetry for tuning the detection thresholds on data from the field. The
+/// samples of the IMU ring are delta packed into batches, and a batch is sent as one IoT Hub
+/// message when it is full or IMU_TELEMETRY_MAX_BATCH_AGE_S old. Messages are sent only while the
+/// bandwidth cap of <see cref="imuTelemetryBytesPerSecond" /> allows; a batch over the cap is
+/// dropped and its samples counted.</para>
+/// <para>Message: {"imu":{"seq":n,"samples":n,"dropped":n,"data":"base64"}}, dropped being the
+/// samples lost since the message before. Each record of data starts with a tag byte, bit 7
+/// the sensor (0 accelerometer, 1 gyroscope) and bits 6:5 the kind:
+/// 0: the sample before repeats (bits 4:0 + 1) times;
+/// 1: three int8 differences to the sample before, x, y, z;
+/// 2: three int16 samples, x, y, z, little endian;
+/// 3: an LPS22HH sample of the LSM6DSO sensor hub, bit 7 being 0: int24 pressure in 1/4096 hPa
+/// and int16 temperature in 1/100 degrees Celsius, little endian. It comes in between the IMU
+/// records at the position of its word in the FIFO, so it is aligned with them in time.
+/// The first record of each sensor in a message has kind 2, so every message decodes on its
+/// own. The records of one sensor are in sample order; a repeat record is counted up while the
+/// other sensor's records follow it, so the two sensors only interleave approximately.</para>
+/// </summary>
+
+/// <summary>
+///     Packed bytes of one message at most, before base64.
+/// </summary>
+#define IMU_TELEMETRY_BATCH_BYTES 4096
+
+/// <summary>
+///     Age at which a batch which has not filled up is sent.
+/// </summary>
+#define IMU_TELEMETRY_MAX_BATCH_AGE_S 60
+
+/// <summary>
+///     Period of moving the samples from the ring into the batch.
+/// </summary>
+#define IMU_TELEMETRY_PERIOD_MS 500
+
+/// <summary>
+///     Bandwidth cap of the messages in bytes per second, 0 turns the telemetry off. Set by the
+///     ImuTelemetryBytesPerSecond twin property.
+/// </summary>
+extern int imuTelemetryBytesPerSecond;
+
+/// <summary>
+///     Starts moving the samples of ring into batches; while the cap is 0 they are discarded.
+/// </summary>
+/// <returns>0 on success, or -1 on failure</returns>
+int ImuTelemetry_Start(ImuRing *ring);
+
+/// <summary>
+///     Stops the telemetry, the batch being collected is not sent.
+/// </summary>
+void ImuTelemetry_Stop(void);
+
+/// <summary>
+///     Prints the messages sent, the packing ratio and the samples dropped with Log_Debug.
+/// </summary>
+void ImuTelemetry_LogStats(void);
@@ -68,6 +68,17 @@ int32_t mg3030_read_data(void *data)
 }
 
 
+int32_t mg3030_read_data_async(void *data, i2c_read_done_t done)
+{
+	if (i2c_read_msg_async(data, done) < 0)
+	{
+		return -1;
+	}
+	mgc_info.gesture = GESTURE_NOT_DEFINED;
+	return 0;
+}
+
+
 int32_t read_version_info(void *data)
 {
     int ret = 0;
@@ -135,8 +135,17 @@ int32_t parse_sensor_msg(uint8_t *data);
 */
 int32_t mg3030_read_data(void *data);
 
+/**Start reading data from sensor without waiting for the bus or sleeping for the TS handshake.
+ * @param data        The data buf that store the msg received, MAX_RECV_LEN + 1 bytes, valid
+ *                    until done returns.
+ * @param done        Called with the msg len, or -1, once the msg has been read and TS released.
+ * @return return 0 if the read has been queued, -1 if there is no msg, the last read is not
+ * finished yet or on failure.
+*/
+int32_t mg3030_read_data_async(void *data, i2c_read_done_t done);
+
 /**Reset some global runtime param.
- * 
+ * The param msgs are queued with i2c_send_msg, and written once basic_init is done.
 */
 int32_t mgc3030_init(void);
 /**Set sensor calibration function.
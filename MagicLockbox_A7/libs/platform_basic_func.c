@@ -33,42 +33,111 @@
 #include <applibs/gpio.h>
 #include <applibs/log.h>
 #include <errno.h>
-#include "..\i2c.h"
+#include "../build_options.h"
+#include "../i2c.h"
+#include "../i2c_scheduler.h"
+#include "../i2c_transport.h"
+#include "../sensor_hal.h"
 #include <time.h>
 
 
 static int rstGpioFd = -1;
 static int tsGpioFd = -1;
+// Message reads are long bulk transfers, queued behind the LSM6DSO interrupt servicing
+static I2cTransportDevice mgc3130Device = { .name = "mgc3130", .address = MG3030_DEFAULE_I2C_ADDR, .priority = I2cPriority_Bulk };
+static I2cTransaction msgRead = { .device = &mgc3130Device };
+static uint8_t *msgData;
+static i2c_read_done_t msgReadDone;
+
+// A message starts with its 4 byte header, the first byte of which is the size of the whole
+// message. The reads bring in one pad byte ahead of it, see GestureReadDone.
+#define MSG_PAD_LEN					1
+#define MSG_HEADER_LEN				4
+// A message is read in one transfer, as long as any message in use
+#define MSG_READ_LEN				192
+// Request_Message and the Fw_Version_Info message it asks for when probing the bus speed,
+// whose answer is polled for every ms, MGC3130_PROBE_POLLS times at most
+#define MSG_ID_REQUEST				0x06
+#define MSG_ID_FW_VERSION			0x83
+#define MSG_REQUEST_LEN				12
+#define MGC3130_PROBE_POLLS			100
+// Messages written with i2c_send_msg wait in a queue, each written with MSG_SEND_GAP_MS to
+// either side of it
+#define MSG_SEND_QUEUE_LEN			8
+#define MSG_SEND_MAX_LEN			16
+#define MSG_SEND_GAP_MS				10
+// The reset pulse, the time the MGC3130 takes to start after it and the time it is left after
+// the message it sends at start before it is configured
+#define RESET_PULSE_MS				10
+#define RESET_START_MS				50
+#define RESET_SETTLE_MS				150
+
+// TS handshake of the queued message reads. TS is pulled low and the message read, then TS is
+// released and left released for MGC3130_TS_RELEASE_MS before the next read, the loop never
+// sleeping in between.
+typedef enum {
+	TS_IDLE,
+	TS_READING,
+	TS_RELEASED,
+} ts_state_t;
+
+static ts_state_t tsState = TS_IDLE;
+
+static void ts_release_timer_handler(EventData *eventData)
+{
+	tsState = TS_IDLE;
+}
+
+static SoftTimer tsReleaseTimer = { .eventData.eventHandler = &ts_release_timer_handler, .eventData.name = "mgc3130Ts", .eventData.priority = EventPriority_Sensor };
+
+// Steps of basic_init and of writing the queued messages, each step going on from a timer or
+// the completion of a transaction so that the loop never sleeps in between
+typedef enum {
+	INIT_IDLE,
+	INIT_RESETTING,
+	INIT_STARTING,
+	INIT_PROBING,
+	INIT_DRAINING,
+	INIT_SETTLING,
+	INIT_SENDING,
+	INIT_SENT,
+} init_state_t;
+
+static void init_timer_handler(EventData *eventData);
+
+static init_state_t initState = INIT_IDLE;
+static SoftTimer initTimer = { .eventData.eventHandler = &init_timer_handler, .eventData.name = "mgc3130Init", .eventData.priority = EventPriority_Sensor };
+static basic_init_done_t initDone;
+static int32_t initResult;
+// The speed is chosen once, by the first basic_init
+static bool speedSelected;
+static unsigned int probePolls;
+static uint8_t probeAnswer[MAX_RECV_LEN + 1];
+static I2cTransaction probeWrite = { .device = &mgc3130Device };
+
+static uint8_t sendQueue[MSG_SEND_QUEUE_LEN][MSG_SEND_MAX_LEN];
+static uint32_t sendLength[MSG_SEND_QUEUE_LEN];
+static unsigned int sendHead;
+static unsigned int sendCount;
+static I2cTransaction sendWrite = { .device = &mgc3130Device };
 
 
 /********************************************************************/
 /*******************************gpio*********************************/
 /********************************************************************/
 
-void power_reset(void)
+static int32_t gpio_config(void)
 {
-	GPIO_SetValue(rstGpioFd, GPIO_Value_Low);
-	delay_us(10000);
-	GPIO_SetValue(rstGpioFd, GPIO_Value_High);
-	delay_us(50000);
-}
-
-
-void gpio_config(void)
-{
-	if (tsGpioFd > 0)
+	// The lines are opened once and kept open across resets
+	if (tsGpioFd < 0)
 	{
-		close(tsGpioFd);
+		tsGpioFd = SensorHal_GpioOpenAsOutput(TRANS_PIN, GPIO_OutputMode_OpenDrain, GPIO_Value_High);
 	}
-	if (rstGpioFd > 0)
+	if (rstGpioFd < 0)
 	{
-		close(rstGpioFd);
+		rstGpioFd = SensorHal_GpioOpenAsOutput(RESET_PIN, GPIO_OutputMode_PushPull, GPIO_Value_High);
 	}
-	tsGpioFd = GPIO_OpenAsOutput(TRANS_PIN, GPIO_OutputMode_OpenDrain, GPIO_Value_High);
-	rstGpioFd = GPIO_OpenAsOutput(RESET_PIN, GPIO_OutputMode_PushPull, GPIO_Value_High);
-
-    power_reset();
-
+	return tsGpioFd < 0 || rstGpioFd < 0 ? -1 : 0;
 }
 
 
@@ -87,45 +156,347 @@ int32_t i2c_init(char *path)
 
 int32_t i2c_config(void)
 {
-	// I2c configured outdie of this module
+	// I2c configured outdie of this module, the speed is chosen by basic_init
     return 0;
 }
 
 
+uint32_t i2c_error_count(void)
+{
+	return mgc3130Device.stats.errors;
+}
+
+
+static int32_t msg_length(const uint8_t *data)
+{
+	uint8_t size = data[MSG_PAD_LEN];
+	if (size < MSG_HEADER_LEN) {
+		return 0;
+	}
+	// A read brings in at most MSG_READ_LEN bytes of a message
+	return MSG_PAD_LEN + size < MSG_READ_LEN ? MSG_PAD_LEN + size : MSG_READ_LEN;
+}
+
+
 int32_t i2c_read_block_data(uint8_t *data)
 {
 	// Read the data into the provided buffer
-	int32_t retVal = I2CMaster_Read(i2cFd, MG3030_DEFAULE_I2C_ADDR, data, 192);
+	I2cTransaction read = { .device = &mgc3130Device, .readData = data, .readLength = MSG_READ_LEN };
+	int32_t retVal = I2cScheduler_Transfer(&read);
 	if (retVal < 0) {
 		Log_Debug("ERROR: platform_read(read step): errno=%d (%s)\n", errno, strerror(errno));
+		return retVal;
+	}
+	return msg_length(data);
+}
+
+
+static void ts_release(void)
+{
+	gpio_release_trans();
+	static const struct timespec releaseTime = { .tv_sec = 0, .tv_nsec = MGC3130_TS_RELEASE_MS * 1000000 };
+	tsState = SetSoftTimerToSingleExpiry(&tsReleaseTimer, &releaseTime) == 0 ? TS_RELEASED : TS_IDLE;
+}
+
+
+static void msg_read_complete(I2cTransaction *transaction)
+{
+	if (transaction->result < 0) {
+		Log_Debug("ERROR: platform_read(read step): errno=%d (%s)\n", transaction->error, strerror(transaction->error));
+		ts_release();
+		msgReadDone(-1);
+		return;
+	}
+
+	// One message per TS assertion, a further one keeps TS low for the next read
+	int32_t length = msg_length(msgData);
+	ts_release();
+	msgReadDone(length);
+}
+
+
+static int32_t msg_read_start(uint8_t *data, i2c_read_done_t done)
+{
+	if (tsState != TS_IDLE) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (!gpio_is_trans_low()) {
+		errno = EAGAIN;
+		return -1;
+	}
+	// Hold TS low so that the message is not updated while it is read, then queue the read
+	gpio_pull_trans_low();
+	msgRead.callback = msg_read_complete;
+	msgRead.readData = data;
+	msgRead.readLength = MSG_READ_LEN;
+	msgData = data;
+	msgReadDone = done;
+	tsState = TS_READING;
+	if (I2cScheduler_Submit(&msgRead) < 0) {
+		tsState = TS_IDLE;
+		gpio_release_trans();
+		return -1;
+	}
+	return 0;
+}
+
+
+int32_t i2c_read_msg_async(uint8_t *data, i2c_read_done_t done)
+{
+	// The messages are left to basic_init until the device is configured
+	if (initState != INIT_IDLE) {
+		errno = EBUSY;
+		return -1;
+	}
+	return msg_read_start(data, done);
+}
+
+
+/********************************************************************/
+/*****************************init steps*****************************/
+/********************************************************************/
+
+static int32_t init_wait(init_state_t state, unsigned int ms)
+{
+	const struct timespec delay = { .tv_sec = ms / 1000, .tv_nsec = ms % 1000 * 1000000 };
+	initState = state;
+	if (SetSoftTimerToSingleExpiry(&initTimer, &delay) < 0) {
+		Log_Debug("ERROR: Could not arm the MGC3130 init timer.\n");
+		initState = INIT_IDLE;
+		return -1;
+	}
+	return 0;
+}
+
+
+static void init_finish(int32_t result)
+{
+	CancelSoftTimer(&initTimer);
+	initState = INIT_IDLE;
+	sendCount = 0;
+	basic_init_done_t done = initDone;
+	initDone = NULL;
+	if (done != NULL) {
+		done(result);
+	}
+}
+
+
+static void init_send_next(void)
+{
+	if (sendCount == 0) {
+		init_finish(initResult);
+		return;
+	}
+	if (init_wait(INIT_SENDING, MSG_SEND_GAP_MS) < 0) {
+		init_finish(-1);
+	}
+}
+
+
+static void init_settle(void)
+{
+	if (init_wait(INIT_SETTLING, RESET_SETTLE_MS) < 0) {
+		init_finish(-1);
+	}
+}
+
+
+static void drain_read_done(int32_t ret)
+{
+	if (initState != INIT_DRAINING) {
+		return;
+	}
+	// Whatever the device sent at start is dropped, as the configuration overrides it
+	init_settle();
+}
+
+
+static void init_drain(void)
+{
+	// Read the message sent at start, Fw_Version_Info, so that the device is ready for writes
+	initState = INIT_DRAINING;
+	if (msg_read_start(probeAnswer, drain_read_done) < 0) {
+		init_settle();
+	}
+}
+
+
+static void probe_start(void);
+
+
+static void probe_failed(void)
+{
+	Log_Debug("INFO: I2C %s does not answer at %u kHz.\n", mgc3130Device.name,
+		I2cTransport_GetSpeedHz(mgc3130Device.speed) / 1000);
+	if (mgc3130Device.speed > I2cSpeed_Standard) {
+		mgc3130Device.speed = (I2cSpeed)(mgc3130Device.speed - 1);
+		probe_start();
+		return;
+	}
+	Log_Debug("INFO: MGC3130 did not answer the firmware version request, staying at %u kHz.\n",
+		I2cTransport_GetSpeedHz(I2cSpeed_Standard) / 1000);
+	speedSelected = true;
+	init_drain();
+}
+
+
+static void probe_poll_next(void)
+{
+	if (++probePolls >= MGC3130_PROBE_POLLS) {
+		probe_failed();
+	}
+	else if (init_wait(INIT_PROBING, 1) < 0) {
+		init_finish(-1);
+	}
+}
+
+
+static void probe_read_done(int32_t ret)
+{
+	// A read or write completing after basic_init has started over belongs to the earlier run
+	if (initState != INIT_PROBING) {
+		return;
+	}
+	if (ret < 0) {
+		probe_failed();
+	}
+	else if (ret > MSG_PAD_LEN + 3 && probeAnswer[MSG_PAD_LEN + 3] == MSG_ID_FW_VERSION) {
+		Log_Debug("I2C %s at %u kHz.\n", mgc3130Device.name, I2cTransport_GetSpeedHz(mgc3130Device.speed) / 1000);
+		speedSelected = true;
+		init_settle();
+	}
+	else {
+		// The answer comes in behind any message already waiting, such as the one sent at start
+		probe_poll_next();
+	}
+}
+
+
+static void probe_write_done(I2cTransaction *transaction)
+{
+	if (initState != INIT_PROBING) {
+		return;
+	}
+	if (transaction->result < 0) {
+		probe_failed();
+		return;
+	}
+	probePolls = 0;
+	if (init_wait(INIT_PROBING, 1) < 0) {
+		init_finish(-1);
+	}
+}
+
+
+static void probe_start(void)
+{
+	// Request_Message asking for Fw_Version_Info: size, flags, sequence, id, then the id of
+	// the message requested, 3 reserved bytes and a 4 byte parameter
+	static const uint8_t request[MSG_REQUEST_LEN] = { MSG_REQUEST_LEN, 0, 0, MSG_ID_REQUEST, MSG_ID_FW_VERSION };
+	initState = INIT_PROBING;
+	probeWrite.writeData = request;
+	probeWrite.writeLength = sizeof(request);
+	probeWrite.callback = probe_write_done;
+	if (I2cScheduler_Submit(&probeWrite) < 0) {
+		init_finish(-1);
+	}
+}
+
+
+static void send_write_done(I2cTransaction *transaction)
+{
+	if (initState != INIT_SENDING) {
+		return;
+	}
+	if (transaction->result < 0) {
+		Log_Debug("ERROR: platform_write: errno=%d (%s)\n", transaction->error, strerror(transaction->error));
+		initResult = -1;
+	}
+	sendHead = (sendHead + 1) % MSG_SEND_QUEUE_LEN;
+	sendCount--;
+	if (init_wait(INIT_SENT, MSG_SEND_GAP_MS) < 0) {
+		init_finish(-1);
+	}
+}
+
+
+static void init_timer_handler(EventData *eventData)
+{
+	switch (initState) {
+	case INIT_RESETTING:
+		SensorHal_GpioSetValue(rstGpioFd, GPIO_Value_High);
+		if (init_wait(INIT_STARTING, RESET_START_MS) < 0) {
+			init_finish(-1);
+		}
+		break;
+	case INIT_STARTING:
+		// The speed is probed with the firmware version request, which also brings the
+		// message sent at start in ahead of the answer
+		if (speedSelected) {
+			init_drain();
+		}
+		else {
+			mgc3130Device.speed = MGC3130_I2C_SPEED;
+			probe_start();
+		}
+		break;
+	case INIT_PROBING:
+		if (tsState != TS_IDLE || !gpio_is_trans_low() || msg_read_start(probeAnswer, probe_read_done) < 0) {
+			probe_poll_next();
+		}
+		break;
+	case INIT_SETTLING:
+	case INIT_SENT:
+		init_send_next();
+		break;
+	case INIT_SENDING:
+		sendWrite.writeData = sendQueue[sendHead];
+		sendWrite.writeLength = sendLength[sendHead];
+		sendWrite.callback = send_write_done;
+		if (I2cScheduler_Submit(&sendWrite) < 0) {
+			Log_Debug("ERROR: platform_write: errno=%d (%s)\n", errno, strerror(errno));
+			init_finish(-1);
+		}
+		break;
+	default:
+		break;
 	}
-    return retVal; 
 }
 
 
 int32_t i2c_send_msg(void *data,uint32_t len)
 {
-    if(NULL == data){
+    if(NULL == data || len > MSG_SEND_MAX_LEN || sendCount == MSG_SEND_QUEUE_LEN){
         return -1;
     }
-    delay_us(10000);
-	// Write the data to the device
-	int32_t retVal = I2CMaster_Write(i2cFd, MG3030_DEFAULE_I2C_ADDR, data, (size_t)len);
-	if (retVal < 0) {
-		Log_Debug("ERROR: platform_write: errno=%d (%s)\n", errno, strerror(errno));
-		return -1;
+	// Queue the message, it is written once the ones ahead of it and basic_init are done
+	unsigned int tail = (sendHead + sendCount) % MSG_SEND_QUEUE_LEN;
+	memcpy(sendQueue[tail], data, len);
+	sendLength[tail] = len;
+	sendCount++;
+	if (initState == INIT_IDLE) {
+		init_send_next();
 	}
-	delay_us(10000);
 
-    return retVal;
+    return (int32_t)len;
 }
 
 
 
-int32_t basic_init(void)
+int32_t basic_init(basic_init_done_t done)
 {
-    gpio_config();
-    return 0;
+	if (gpio_config() < 0) {
+		return -1;
+	}
+	// Start over, dropping the messages of an earlier configuration still waiting
+	CancelSoftTimer(&initTimer);
+	sendCount = 0;
+	initDone = done;
+	initResult = 0;
+	SensorHal_GpioSetValue(rstGpioFd, GPIO_Value_Low);
+	return init_wait(INIT_RESETTING, RESET_PULSE_MS);
 }
 
 void mgc_exit(void)
@@ -136,7 +507,7 @@ void mgc_exit(void)
 bool gpio_is_trans_low()
 {	
 	GPIO_Value_Type ret;
-	if (GPIO_GetValue(tsGpioFd, &ret) < 0)
+	if (SensorHal_GpioGetValue(tsGpioFd, &ret) < 0)
 	{
 		Log_Debug("Get TS value error\n");
 		return -1;
@@ -147,17 +518,12 @@ bool gpio_is_trans_low()
 
 int32_t gpio_pull_trans_low()
 {	
-	int ret = GPIO_SetValue(tsGpioFd, GPIO_Value_Low);
-	delay_us(10000);
-	return ret;
+	return SensorHal_GpioSetValue(tsGpioFd, GPIO_Value_Low);
 }
 
 int32_t gpio_release_trans()
 {
-	int ret = GPIO_SetValue(tsGpioFd, GPIO_Value_High);
-	delay_us(10000);
-
-	return ret;
+	return SensorHal_GpioSetValue(tsGpioFd, GPIO_Value_High);
 }
 
 void delay_us(int us)
@@ -47,8 +47,47 @@
 #define PIN_INPUT				0x12
 
 
-int32_t basic_init(void);
+/**Called on the event loop when basic_init has reset and configured the MGC3130.
+ * @param ret 0 on success, or -1 if a step or the write of a queued msg failed.
+*/
+typedef void (*basic_init_done_t)(int32_t ret);
+/**Resets the MGC3130 without blocking, which also frees SDA should it be holding the bus. The
+ * reset line is pulsed and the device left to start, then, the first time only, the speed is
+ * chosen: the fastest up to MGC3130_I2C_SPEED at which it answers a firmware version request,
+ * or standard speed if it answers at none. The msgs queued with i2c_send_msg are written after
+ * that, and done is called once they all are. Calling it again starts over, dropping the msgs
+ * still queued.
+ * @return 0 if the reset has started, or -1 on failure, in which case done is not called.
+*/
+int32_t basic_init(basic_init_done_t done);
+/**The speed is chosen by basic_init.
+ * @return 0.
+*/
+int32_t i2c_config(void);
+/**@return The number of failed MGC3130 transactions.
+*/
+uint32_t i2c_error_count(void);
+/**Reads the waiting message into data, which must hold MAX_RECV_LEN + 1 bytes. Blocks, for use
+ * at init only.
+ * @return The msg len counting the pad byte ahead of it, 0 if there is none, or -1 on failure.
+*/
 int32_t i2c_read_block_data(uint8_t *data);
+/**Called on the event loop when a queued message read has completed.
+ * @param ret The msg len counting the pad byte ahead of it, 0 if there was none, or -1 on failure.
+*/
+typedef void (*i2c_read_done_t)(int32_t ret);
+/**Pulls TS low and queues the read of the waiting message into data, which must hold
+ * MAX_RECV_LEN + 1 bytes, without blocking. TS is released when the read has completed, before
+ * done is called, or after a failure, which done gets as -1.
+ * @return 0 if the read is queued, or -1 with errno set to EAGAIN if no message is waiting or
+ * EBUSY while the last read is queued, TS has been released less than MGC3130_TS_RELEASE_MS ago or
+ * basic_init is running.
+*/
+int32_t i2c_read_msg_async(uint8_t *data, i2c_read_done_t done);
+/**Queues a msg of at most 16 bytes without blocking. The msgs are written on the event loop
+ * one at a time with 10 ms to either side, after basic_init if it is running.
+ * @return len if the msg is queued, or -1 if it is too long or the queue is full.
+*/
 int32_t i2c_send_msg(void *data,uint32_t len);
 void mgc_exit(void);
 bool gpio_is_trans_low();
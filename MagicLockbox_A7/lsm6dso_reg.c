@@ -35,6 +35,7 @@
   */
 
 #include "lsm6dso_reg.h"
+#include <stddef.h>
 #include <applibs/log.h>
 /**
   * @defgroup  LSM6DSO
@@ -53,6 +54,80 @@
   *
 */
 
+static void lsm6dso_shadow_invalidate_all(lsm6dso_shadow_t *shadow)
+{
+  uint8_t i;
+
+  for (i = 0; i < (uint8_t)sizeof(shadow->valid); i++) {
+    shadow->valid[i] = 0;
+  }
+}
+
+/**
+  * @brief  User bank registers which the device changes by itself:
+  *         the sources, status and output registers, the timestamp,
+  *         the FIFO and the self clearing COUNTER_BDR_REG1.
+  *
+  * @param  reg   register address
+  * @retval       1 if the register must not be cached
+  *
+  */
+static uint8_t lsm6dso_shadow_volatile(uint8_t reg)
+{
+  return (uint8_t)((reg == LSM6DSO_COUNTER_BDR_REG1) ||
+                   ((reg >= LSM6DSO_ALL_INT_SRC) && (reg <= LSM6DSO_OUTZ_H_A)) ||
+                   ((reg >= LSM6DSO_EMB_FUNC_STATUS_MAINPAGE) &&
+                    (reg <= LSM6DSO_TIMESTAMP3)) ||
+                   (reg >= LSM6DSO_FIFO_DATA_OUT_TAG));
+}
+
+/**
+  * @brief  Whether a register can be kept in the shadow copy, given
+  *         the bank selected now.
+  *
+  */
+static uint8_t lsm6dso_shadow_cacheable(lsm6dso_shadow_t *shadow, uint8_t reg)
+{
+  return (uint8_t)(((shadow->bank == (uint8_t)LSM6DSO_USER_BANK) ||
+                    (reg == LSM6DSO_FUNC_CFG_ACCESS)) &&
+                   (reg < 128U) && (lsm6dso_shadow_volatile(reg) == 0U));
+}
+
+static uint8_t lsm6dso_shadow_valid(lsm6dso_shadow_t *shadow, uint8_t reg)
+{
+  return (uint8_t)((shadow->valid[reg / 8U] >> (reg % 8U)) & 0x01U);
+}
+
+/**
+  * @brief  Updates the shadow copy with the values of a transfer.
+  *         A software reset or reboot through CTRL3_C restores the
+  *         defaults, so the whole copy is dropped; CTRL3_C itself is
+  *         not kept until SW_RESET and BOOT have cleared.
+  *
+  */
+static void lsm6dso_shadow_update(lsm6dso_shadow_t *shadow, uint8_t reg,
+                                  const uint8_t* data, uint16_t len)
+{
+  uint16_t i;
+
+  for (i = 0; i < len; i++) {
+    uint8_t addr = (uint8_t)(reg + i);
+    if (lsm6dso_shadow_cacheable(shadow, addr) == 0U) {
+      continue;
+    }
+    if ((addr == LSM6DSO_CTRL3_C) && ((data[i] & 0x81U) != 0U)) {
+      lsm6dso_shadow_invalidate_all(shadow);
+      shadow->bank = (uint8_t)LSM6DSO_USER_BANK;
+      continue;
+    }
+    if (addr == LSM6DSO_FUNC_CFG_ACCESS) {
+      shadow->bank = (uint8_t)((data[i] >> 6) & 0x03U);
+    }
+    shadow->value[addr] = data[i];
+    shadow->valid[addr / 8U] |= (uint8_t)(1U << (addr % 8U));
+  }
+}
+
 /**
   * @brief  Read generic device register
   *
@@ -66,8 +141,31 @@
 int32_t lsm6dso_read_reg(lsm6dso_ctx_t* ctx, uint8_t reg, uint8_t* data,
                          uint16_t len)
 {
+  lsm6dso_shadow_t *shadow = ctx->shadow;
   int32_t ret;
+  uint16_t i;
+
+  if (shadow != NULL) {
+    for (i = 0; i < len; i++) {
+      uint8_t addr = (uint8_t)(reg + i);
+      if ((lsm6dso_shadow_cacheable(shadow, addr) == 0U) ||
+          (lsm6dso_shadow_valid(shadow, addr) == 0U)) {
+        break;
+      }
+    }
+    if (i == len) {
+      for (i = 0; i < len; i++) {
+        data[i] = shadow->value[(uint8_t)(reg + i)];
+      }
+      shadow->hits++;
+      return 0;
+    }
+  }
+
   ret = ctx->read_reg(ctx->handle, reg, data, len);
+  if ((ret == 0) && (shadow != NULL)) {
+    lsm6dso_shadow_update(shadow, reg, data, len);
+  }
   return ret;
 }
 
@@ -86,9 +184,145 @@ int32_t lsm6dso_write_reg(lsm6dso_ctx_t* ctx, uint8_t reg, uint8_t* data,
 {
   int32_t ret;
   ret = ctx->write_reg(ctx->handle, reg, data, len);
+  lsm6dso_shadow_written(ctx, reg, data, len, ret);
   return ret;
 }
 
+/**
+  * @brief  Applies a register configuration table. Entries for the same
+  *         or the next register of the same bank are merged into one
+  *         burst with auto-increment, so a table sorted by bank and
+  *         register takes one write per run of adjacent registers. A
+  *         run is read first only if an entry leaves bits unchanged,
+  *         which the shadow copy serves when valid. IF_INC (CTRL3_C)
+  *         must be set.
+  *
+  * @param  ctx      read / write interface definitions(ptr)
+  * @param  table    register settings
+  * @param  count    number of entries of table
+  * @param  verify   1 to read every run back from the device and count
+  *                  the registers which differ in result->mismatches
+  * @param  result   bursts written and mismatches, may be NULL
+  * @retval          interface status (MANDATORY: return 0 -> no Error)
+  *
+  */
+int32_t lsm6dso_reg_table_apply(lsm6dso_ctx_t *ctx,
+                                const lsm6dso_reg_setting_t *table,
+                                uint16_t count, uint8_t verify,
+                                lsm6dso_reg_table_result_t *result)
+{
+  lsm6dso_reg_table_result_t total = { 0, 0 };
+  uint8_t bank = (uint8_t)LSM6DSO_USER_BANK;
+  uint8_t value[LSM6DSO_REG_TABLE_MAX_BURST];
+  uint8_t mask[LSM6DSO_REG_TABLE_MAX_BURST];
+  uint8_t buff[LSM6DSO_REG_TABLE_MAX_BURST];
+  uint16_t i = 0;
+  uint16_t j;
+  uint16_t len;
+  uint16_t k;
+  uint8_t partial;
+  int32_t ret = 0;
+
+  while ((ret == 0) && (i < count)) {
+    /* Collect the run of registers starting at table[i] */
+    for (k = 0; k < LSM6DSO_REG_TABLE_MAX_BURST; k++) {
+      value[k] = 0;
+      mask[k] = 0;
+      buff[k] = 0;
+    }
+    len = 1;
+    for (j = i; j < count; j++) {
+      k = (uint16_t)table[j].reg - (uint16_t)table[i].reg;
+      if ((table[j].bank != table[i].bank) || (table[j].reg < table[i].reg) ||
+          (k > len) || (k >= LSM6DSO_REG_TABLE_MAX_BURST)) {
+        break;
+      }
+      if (k == len) {
+        len++;
+      }
+      value[k] = (uint8_t)((value[k] & ~table[j].mask) |
+                           (table[j].value & table[j].mask));
+      mask[k] |= table[j].mask;
+    }
+
+    if (table[i].bank != bank) {
+      bank = table[i].bank;
+      ret = lsm6dso_mem_bank_set(ctx, (lsm6dso_reg_access_t)bank);
+    }
+
+    partial = 0;
+    for (k = 0; k < len; k++) {
+      partial |= (uint8_t)(mask[k] != 0xFFU);
+    }
+    if ((ret == 0) && (partial != 0U)) {
+      ret = lsm6dso_read_reg(ctx, table[i].reg, buff, len);
+    }
+    if (ret == 0) {
+      for (k = 0; k < len; k++) {
+        buff[k] = (uint8_t)((buff[k] & ~mask[k]) | value[k]);
+      }
+      ret = lsm6dso_write_reg(ctx, table[i].reg, buff, len);
+      total.bursts++;
+    }
+    if ((ret == 0) && (verify != 0U)) {
+      /* Straight from the device, not from the shadow copy */
+      ret = ctx->read_reg(ctx->handle, table[i].reg, buff, len);
+      for (k = 0; (ret == 0) && (k < len); k++) {
+        if (((buff[k] ^ value[k]) & mask[k]) != 0U) {
+          total.mismatches++;
+        }
+      }
+    }
+    i = j;
+  }
+
+  if ((ret == 0) && (bank != (uint8_t)LSM6DSO_USER_BANK)) {
+    ret = lsm6dso_mem_bank_set(ctx, LSM6DSO_USER_BANK);
+  }
+  if (result != NULL) {
+    *result = total;
+  }
+  return ret;
+}
+
+/**
+  * @brief  Drops the shadow copy, for example after the device lost
+  *         power or was reconfigured through another context.
+  *
+  * @param  ctx   read / write interface definitions(ptr)
+  *
+  */
+void lsm6dso_shadow_invalidate(lsm6dso_ctx_t *ctx)
+{
+  if (ctx->shadow != NULL) {
+    lsm6dso_shadow_invalidate_all(ctx->shadow);
+  }
+}
+
+/**
+  * @brief  Updates the shadow copy with a write made without going
+  *         through ctx, such as a queued bus transaction.
+  *
+  * @param  ctx   read / write interface definitions(ptr)
+  * @param  reg   first register written
+  * @param  data  values written(ptr)
+  * @param  len   number of consecutive registers written
+  * @param  ret   interface status of the write; on failure the device
+  *               may have taken part of it, so the copy is dropped
+  *
+  */
+void lsm6dso_shadow_written(lsm6dso_ctx_t *ctx, uint8_t reg,
+                            const uint8_t* data, uint16_t len, int32_t ret)
+{
+  if (ctx->shadow != NULL) {
+    if (ret == 0) {
+      lsm6dso_shadow_update(ctx->shadow, reg, data, len);
+    } else {
+      lsm6dso_shadow_invalidate_all(ctx->shadow);
+    }
+  }
+}
+
 /**
   * @}
   *
@@ -638,60 +872,95 @@ int32_t lsm6dso_gy_power_mode_get(lsm6dso_ctx_t *ctx,
   return ret;
 }
 
+/**
+  * @brief  Copy one register byte into a register bitfield structure
+  *
+  */
+static void bytecpy(uint8_t *target, const uint8_t *source)
+{
+  *target = *source;
+}
+
 /**
   * @brief  Read all the interrupt flag of the device.[get]
   *
   * @param  ctx      read / write interface definitions
-  * @param  val      registers ALL_INT_SRC; WAKE_UP_SRC;
-  *                              TAP_SRC; D6D_SRC; STATUS_REG;
-  *                              EMB_FUNC_STATUS; FSM_STATUS_A/B
+  * @param  val      registers WAKE_UP_SRC; TAP_SRC; D6D_SRC
   *
   */
 int32_t lsm6dso_all_sources_get(lsm6dso_ctx_t *ctx,
                                 lsm6dso_all_sources_t *val)
 {
-  int32_t ret = 0;
+  // ALL_INT_SRC is not read, reading it may clear the latched sources;
+  // STATUS_REG and the embedded function flags are left out to minimize
+  // i2c handle time
+  return lsm6dso_all_sources_burst_get(ctx, val, 0);
+}
 
-  // this code may lead to clearing of registers if latching is enabled
-  /*ret = lsm6dso_read_reg(ctx, LSM6DSO_ALL_INT_SRC,
-                         (uint8_t*)&val->all_int_src, 1);*/
-  if (ret == 0) {
-    ret = lsm6dso_read_reg(ctx, LSM6DSO_WAKE_UP_SRC,
-                           (uint8_t*)&val->wake_up_src, 1);
-  }
-  if (ret == 0) {
-    ret = lsm6dso_read_reg(ctx, LSM6DSO_TAP_SRC,
-                           (uint8_t*)&val->tap_src, 1);
-  }
-  if (ret == 0) {
-    ret = lsm6dso_read_reg(ctx, LSM6DSO_D6D_SRC,
-                           (uint8_t*)&val->d6d_src, 1);
-  }
-  // removed for this current application to minimize i2c handle time
-  /*if (ret == 0) {
-    ret = lsm6dso_read_reg(ctx, LSM6DSO_STATUS_REG,
-                           (uint8_t*)&val->status_reg, 1);
-  }
-  if (ret == 0) {
+/**
+  * @brief  Read the interrupt flags of the device with as few bus
+  *         transactions as possible.[get]
+  *
+  *         WAKE_UP_SRC, TAP_SRC and D6D_SRC, plus STATUS_REG when selected,
+  *         are contiguous and read in one auto-increment transaction.
+  *         EMB_FUNC_STATUS and FSM_STATUS_A/B are read in a second one from
+  *         their copies in the user bank, without switching memory banks.
+  *         ALL_INT_SRC is never read, reading it may clear the latched
+  *         sources. Fields which are not read are left unchanged.
+  *
+  * @param  ctx      read / write interface definitions
+  * @param  val      registers WAKE_UP_SRC; TAP_SRC; D6D_SRC; and
+  *                  as selected STATUS_REG; EMB_FUNC_STATUS; FSM_STATUS_A/B
+  * @param  select   LSM6DSO_SOURCES_STATUS_REG | LSM6DSO_SOURCES_EMB_FUNC
+  *
+  */
+int32_t lsm6dso_all_sources_burst_get(lsm6dso_ctx_t *ctx,
+                                      lsm6dso_all_sources_t *val,
+                                      uint8_t select)
+{
+  uint8_t buff[7];
+  uint16_t len;
+  int32_t ret;
 
-    ret = lsm6dso_mem_bank_set(ctx, LSM6DSO_EMBEDDED_FUNC_BANK);
+  len = ((select & LSM6DSO_SOURCES_STATUS_REG) != 0U) ? 4U : 3U;
+  ret = lsm6dso_read_reg(ctx, LSM6DSO_WAKE_UP_SRC, buff, len);
+  if ((ret == 0) && ((select & LSM6DSO_SOURCES_EMB_FUNC) != 0U)) {
+    ret = lsm6dso_read_reg(ctx, LSM6DSO_EMB_FUNC_STATUS_MAINPAGE, &buff[len], 3);
   }
   if (ret == 0) {
-    ret = lsm6dso_read_reg(ctx, LSM6DSO_EMB_FUNC_STATUS,
-                           (uint8_t*)&val->emb_func_status, 1);
+    lsm6dso_all_sources_unpack(val, buff, select);
   }
-  if (ret == 0) {
-    ret = lsm6dso_read_reg(ctx, LSM6DSO_FSM_STATUS_A,
-                           (uint8_t*)&val->fsm_status_a, 1);
+  return ret;
+}
+
+/**
+  * @brief  Fill the interrupt flags from registers read by other means,
+  *         such as a queued bus transaction.
+  *
+  * @param  val      registers WAKE_UP_SRC; TAP_SRC; D6D_SRC; and
+  *                  as selected STATUS_REG; EMB_FUNC_STATUS; FSM_STATUS_A/B
+  * @param  buff     WAKE_UP_SRC to D6D_SRC, followed by STATUS_REG and
+  *                  EMB_FUNC_STATUS_MAINPAGE to FSM_STATUS_B_MAINPAGE
+  *                  as selected
+  * @param  select   LSM6DSO_SOURCES_STATUS_REG | LSM6DSO_SOURCES_EMB_FUNC
+  *
+  */
+void lsm6dso_all_sources_unpack(lsm6dso_all_sources_t *val,
+                                const uint8_t *buff, uint8_t select)
+{
+  bytecpy((uint8_t*)&val->wake_up_src, &buff[0]);
+  bytecpy((uint8_t*)&val->tap_src, &buff[1]);
+  bytecpy((uint8_t*)&val->d6d_src, &buff[2]);
+  buff += 3;
+  if ((select & LSM6DSO_SOURCES_STATUS_REG) != 0U) {
+    bytecpy((uint8_t*)&val->status_reg, &buff[0]);
+    buff++;
   }
-  if (ret == 0) {
-    ret = lsm6dso_read_reg(ctx, LSM6DSO_FSM_STATUS_B,
-                           (uint8_t*)&val->fsm_status_b, 1);
+  if ((select & LSM6DSO_SOURCES_EMB_FUNC) != 0U) {
+    bytecpy((uint8_t*)&val->emb_func_status, &buff[0]);
+    bytecpy((uint8_t*)&val->fsm_status_a, &buff[1]);
+    bytecpy((uint8_t*)&val->fsm_status_b, &buff[2]);
   }
-  if (ret == 0) {
-    ret = lsm6dso_mem_bank_set(ctx, LSM6DSO_USER_BANK);
-  }*/
-  return ret;
 }
 
 /**
@@ -1091,6 +1360,26 @@ int32_t lsm6dso_fifo_out_raw_get(lsm6dso_ctx_t *ctx, uint8_t *buff)
   return ret;
 }
 
+/**
+  * @brief  FIFO data output, several words in one burst.[get]
+  *         Every word is the TAG byte followed by the six data bytes;
+  *         the register address rolls over from FIFO_DATA_OUT_Z_H back
+  *         to FIFO_DATA_OUT_TAG, so the whole burst is one read.
+  *
+  * @param  ctx      read / write interface definitions
+  * @param  buff     buffer that stores data read, 7 * num bytes
+  * @param  num      number of FIFO words to read
+  *
+  */
+int32_t lsm6dso_fifo_out_burst_get(lsm6dso_ctx_t *ctx, uint8_t *buff,
+                                   uint16_t num)
+{
+  int32_t ret;
+  ret = lsm6dso_read_reg(ctx, LSM6DSO_FIFO_DATA_OUT_TAG, buff,
+                         (uint16_t)(num * 7U));
+  return ret;
+}
+
 /**
   * @brief  Step counter output register.[get]
   *
@@ -1354,10 +1643,10 @@ int32_t lsm6dso_ln_pg_write(lsm6dso_ctx_t *ctx, uint16_t address,
     for (i = 0; ( (i < len) && (ret == 0) ); i++)
     {
       ret = lsm6dso_write_reg(ctx, LSM6DSO_PAGE_VALUE, &buf[i], 1);
+      lsb++;
 
       /* Check if page wrap */
       if ( (lsb == 0x00U) && (ret == 0) ) {
-        lsb++;
         msb++;
         ret = lsm6dso_read_reg(ctx, LSM6DSO_PAGE_SEL, (uint8_t*)&page_sel, 1);
         if (ret == 0) {
@@ -6006,6 +6295,44 @@ int32_t lsm6dso_fifo_data_level_get(lsm6dso_ctx_t *ctx, uint16_t *val)
   return ret;
 }
 
+/**
+  * @brief  Number of unread words and FIFO status flags, read in one
+  *         transaction.[get]
+  *
+  * @param  ctx      read / write interface definitions
+  * @param  level    diff_fifo of FIFO_STATUS1 and FIFO_STATUS2
+  * @param  status   register FIFO_STATUS2
+  *
+  */
+int32_t lsm6dso_fifo_level_status_get(lsm6dso_ctx_t *ctx, uint16_t *level,
+                                      lsm6dso_fifo_status2_t *status)
+{
+  uint8_t buff[2];
+  int32_t ret;
+
+  ret = lsm6dso_read_reg(ctx, LSM6DSO_FIFO_STATUS1, buff, 2);
+  if (ret == 0) {
+    lsm6dso_fifo_level_status_unpack(buff, level, status);
+  }
+  return ret;
+}
+
+/**
+  * @brief  Number of unread words and FIFO status flags from FIFO_STATUS1
+  *         and FIFO_STATUS2 read by other means.
+  *
+  * @param  buff     FIFO_STATUS1 and FIFO_STATUS2
+  * @param  level    diff_fifo of FIFO_STATUS1 and FIFO_STATUS2
+  * @param  status   register FIFO_STATUS2
+  *
+  */
+void lsm6dso_fifo_level_status_unpack(const uint8_t *buff, uint16_t *level,
+                                      lsm6dso_fifo_status2_t *status)
+{
+  bytecpy((uint8_t*)status, &buff[1]);
+  *level = ((uint16_t)status->diff_fifo << 8) + (uint16_t)buff[0];
+}
+
 /**
   * @brief  FIFO status.[get]
   *
@@ -8669,7 +8996,7 @@ int32_t lsm6dso_sh_reset_get(lsm6dso_ctx_t *ctx, uint8_t *val)
   * @brief  Rate at which the master communicates.[set]
   *
   * @param  ctx      read / write interface definitions
-  * @param  val      change the values of shub_odr in reg slv1_CONFIG
+  * @param  val      change the values of shub_odr in reg SLV0_CONFIG
   *
   */
 int32_t lsm6dso_sh_data_rate_set(lsm6dso_ctx_t *ctx, lsm6dso_shub_odr_t val)
@@ -8679,11 +9006,11 @@ int32_t lsm6dso_sh_data_rate_set(lsm6dso_ctx_t *ctx, lsm6dso_shub_odr_t val)
 
   ret = lsm6dso_mem_bank_set(ctx, LSM6DSO_SENSOR_HUB_BANK);
   if (ret == 0) {
-    ret = lsm6dso_read_reg(ctx, LSM6DSO_SLV1_CONFIG, (uint8_t*)&reg, 1);
+    ret = lsm6dso_read_reg(ctx, LSM6DSO_SLV0_CONFIG, (uint8_t*)&reg, 1);
   }
   if (ret == 0) {
     reg.shub_odr = (uint8_t)val;
-    ret = lsm6dso_write_reg(ctx, LSM6DSO_SLV1_CONFIG, (uint8_t*)&reg, 1);
+    ret = lsm6dso_write_reg(ctx, LSM6DSO_SLV0_CONFIG, (uint8_t*)&reg, 1);
   }
   if (ret == 0) {
     ret = lsm6dso_mem_bank_set(ctx, LSM6DSO_USER_BANK);
@@ -8696,7 +9023,7 @@ int32_t lsm6dso_sh_data_rate_set(lsm6dso_ctx_t *ctx, lsm6dso_shub_odr_t val)
   * @brief  Rate at which the master communicates.[get]
   *
   * @param  ctx      read / write interface definitions
-  * @param  val      Get the values of shub_odr in reg slv1_CONFIG
+  * @param  val      Get the values of shub_odr in reg SLV0_CONFIG
   *
   */
 int32_t lsm6dso_sh_data_rate_get(lsm6dso_ctx_t *ctx,
@@ -8707,7 +9034,7 @@ int32_t lsm6dso_sh_data_rate_get(lsm6dso_ctx_t *ctx,
 
   ret = lsm6dso_mem_bank_set(ctx, LSM6DSO_SENSOR_HUB_BANK);
   if (ret == 0) {
-    ret = lsm6dso_read_reg(ctx, LSM6DSO_SLV1_CONFIG, (uint8_t*)&reg, 1);
+    ret = lsm6dso_read_reg(ctx, LSM6DSO_SLV0_CONFIG, (uint8_t*)&reg, 1);
   }
   if (ret == 0) {
     switch (reg.shub_odr) {
@@ -129,12 +129,30 @@ typedef struct{
 typedef int32_t (*lsm6dso_write_ptr)(int*, uint8_t, uint8_t*, uint16_t);
 typedef int32_t (*lsm6dso_read_ptr) (int*, uint8_t, uint8_t*, uint16_t);
 
+/**
+  * @brief  Shadow copy of the user bank configuration registers.
+  *         Reads of a valid register are served from the copy, so the
+  *         read-modify-write of the *_set functions only writes.
+  *         Status, source, output and FIFO registers are never cached.
+  *         Zero initialized is empty, with the user bank selected.
+  */
+typedef struct {
+  uint8_t  value[128];
+  uint8_t  valid[128 / 8];
+  /** reg_access of FUNC_CFG_ACCESS, only the user bank is cached **/
+  uint8_t  bank;
+  /** Register reads served from the copy **/
+  uint32_t hits;
+} lsm6dso_shadow_t;
+
 typedef struct {
   /** Component mandatory fields **/
   lsm6dso_write_ptr  write_reg;
   lsm6dso_read_ptr   read_reg;
   /** Customizable optional pointer **/
   int *handle;
+  /** Optional shadow register cache, NULL to access the device always **/
+  lsm6dso_shadow_t *shadow;
 } lsm6dso_ctx_t;
 
 /**
@@ -1552,6 +1570,37 @@ int32_t lsm6dso_read_reg(lsm6dso_ctx_t *ctx, uint8_t reg, uint8_t* data,
                          uint16_t len);
 int32_t lsm6dso_write_reg(lsm6dso_ctx_t *ctx, uint8_t reg, uint8_t* data,
                           uint16_t len);
+void lsm6dso_shadow_invalidate(lsm6dso_ctx_t *ctx);
+void lsm6dso_shadow_written(lsm6dso_ctx_t *ctx, uint8_t reg,
+                            const uint8_t* data, uint16_t len, int32_t ret);
+
+/**
+  * @brief  One entry of a register configuration table: the bits of
+  *         mask in register reg of bank are set to the same bits of
+  *         value. Several entries may set fields of the same register,
+  *         a mask of 0 leaves the register as it is.
+  */
+typedef struct {
+  uint8_t bank; /* lsm6dso_reg_access_t */
+  uint8_t reg;
+  uint8_t value;
+  uint8_t mask;
+} lsm6dso_reg_setting_t;
+
+typedef struct {
+  /** Burst writes the table took **/
+  uint16_t bursts;
+  /** Registers which read back different from the table **/
+  uint16_t mismatches;
+} lsm6dso_reg_table_result_t;
+
+/** Longest run of registers written in one burst **/
+#define LSM6DSO_REG_TABLE_MAX_BURST  16U
+
+int32_t lsm6dso_reg_table_apply(lsm6dso_ctx_t *ctx,
+                                const lsm6dso_reg_setting_t *table,
+                                uint16_t count, uint8_t verify,
+                                lsm6dso_reg_table_result_t *result);
 
 extern float_t lsm6dso_from_fs2_to_mg(int16_t lsb);
 extern float_t lsm6dso_from_fs4_to_mg(int16_t lsb);
@@ -1661,6 +1710,14 @@ typedef struct {
 int32_t lsm6dso_all_sources_get(lsm6dso_ctx_t *ctx,
                                 lsm6dso_all_sources_t *val);
 
+#define LSM6DSO_SOURCES_STATUS_REG   0x01U
+#define LSM6DSO_SOURCES_EMB_FUNC     0x02U
+int32_t lsm6dso_all_sources_burst_get(lsm6dso_ctx_t *ctx,
+                                      lsm6dso_all_sources_t *val,
+                                      uint8_t select);
+void lsm6dso_all_sources_unpack(lsm6dso_all_sources_t *val,
+                                const uint8_t *buff, uint8_t select);
+
 int32_t lsm6dso_status_reg_get(lsm6dso_ctx_t *ctx,
                                lsm6dso_status_reg_t *val);
 
@@ -1705,6 +1762,8 @@ int32_t lsm6dso_angular_rate_raw_get(lsm6dso_ctx_t *ctx, uint8_t *buff);
 int32_t lsm6dso_acceleration_raw_get(lsm6dso_ctx_t *ctx, uint8_t *buff);
 
 int32_t lsm6dso_fifo_out_raw_get(lsm6dso_ctx_t *ctx, uint8_t *buff);
+int32_t lsm6dso_fifo_out_burst_get(lsm6dso_ctx_t *ctx, uint8_t *buff,
+                                   uint16_t num);
 
 int32_t lsm6dso_number_of_steps_get(lsm6dso_ctx_t *ctx, uint8_t *buff);
 
@@ -2368,6 +2427,11 @@ int32_t lsm6dso_batch_counter_threshold_get(lsm6dso_ctx_t *ctx,
 
 int32_t lsm6dso_fifo_data_level_get(lsm6dso_ctx_t *ctx, uint16_t *val);
 
+int32_t lsm6dso_fifo_level_status_get(lsm6dso_ctx_t *ctx, uint16_t *level,
+                                      lsm6dso_fifo_status2_t *status);
+void lsm6dso_fifo_level_status_unpack(const uint8_t *buff, uint16_t *level,
+                                      lsm6dso_fifo_status2_t *status);
+
 int32_t lsm6dso_fifo_status_get(lsm6dso_ctx_t *ctx,
                                 lsm6dso_fifo_status2_t *val);
 
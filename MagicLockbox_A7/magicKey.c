@@ -5,6 +5,7 @@
 #include <math.h>
 #include <stdlib.h>
 #include <string.h> 
+#include <time.h>
 
 // applibs_versions.h defines the API struct versions to use for applibs APIs.
 //#include "applibs_versions.h"
@@ -22,8 +23,6 @@
 
 // File descriptors - initialized to invalid value
 static int pwmFd = -1;
-static int servoDurationTimerFd = -1;
-static int oneSecTimerFd = -1;
 
 typedef struct MagicLockboxState
 {
@@ -43,7 +42,6 @@ CONSTANTS
 /**
 EXTERN VARIABLES
 **/
-extern int epollFd; //get access to epoll for adding more timers
 extern volatile sig_atomic_t terminationRequired; //get access to mcu abort
 
 /**
@@ -75,12 +73,19 @@ static void overwriteWindowTimerHandler(EventData* event);
 
 static void chainNotCompleteTimerHandler(EventData* event);
 
-static int8_t enableOverwriteWindow(void);
+static int8_t enableOverwriteWindow(uint64_t eventNs);
+
+
+static int8_t setTimerToDeadline(SoftTimer* timer, uint64_t deadlineNs);
+
+static void scheduleLockToggleForEvent(uint64_t eventNs);
 
 static KeyEvent_t* getCollectedEvents(void);
 
 static bool checkInputEventsMatch(void);
 
+static void loopTaskHandler(EventData* event);
+
 
 typedef struct MagicKeyState
 {
@@ -100,17 +105,25 @@ char magicKeyRecipe[MAGIC_LOCKBOX_RECIPE_LEN] = DEFAULT_RECIPE;
 
 //timer for time window for single event - it will be used to allow 
 //event to be overwritten if another event comes in quick succession
-static int eventOverwriteWindowTimerFd = -1;
+static SoftTimer eventOverwriteWindowTimer = { .eventData.eventHandler = overwriteWindowTimerHandler, .eventData.name = "overwriteWindow" };
 //timer for clearing all registered events if no activity too long 
 //- usefull for reseting whole event sequence in case wrong input
-static int eventChainNotCompleteTimerFd = -1;
+static SoftTimer eventChainNotCompleteTimer = { .eventData.eventHandler = chainNotCompleteTimerHandler, .eventData.name = "chainNotComplete" };
 //timer that schedules lock toggle in short time
-static int lockToggleTimerFd = -1;
+static SoftTimer lockToggleTimer = { .eventData.eventHandler = lockToggleTimerHandler, .eventData.name = "lockToggle", .eventData.priority = EventPriority_Actuator };
+//deferred task running magicLockbox_loopTask whenever events, lock state or recipe change
+static DeferredTask loopTask = { .eventData.eventHandler = loopTaskHandler, .eventData.name = "loopTask" };
 //Table for holding current key events that were registered
 KeyEvent_t inputKeyEvents[EVENT_TABLE_SIZE];
 static uint8_t inputKeyEventsIndex = 0;
-//Current event that is waiting to be moved to table
+//Current event that is waiting to be moved to table, and when its source detected it
 static KeyEvent_t currentEvent = event_last;
+static uint64_t currentEventNs = 0;
+//When the source detected the event last moved to table
+static uint64_t latchedEventNs = 0;
+//When the source detected the event completing the recipe of the scheduled lock toggle, 0 if
+//the toggle was not scheduled by the recipe
+static uint64_t toggleEventNs = 0;
 //Flag indicating that current event can be still overwriten by immidiate occurance of other one
 static bool eventOverwriteActive = false; //needed?
 
@@ -144,8 +157,9 @@ void notifyState(EventData* event)
 
 }
 
-// Event handler data structures. Only the event handler field needs to be populated.
-static EventData oneSecEventData = { .eventHandler = notifyState };
+// Timer data structures: the event handler, the name in the handler stats and the priority class.
+static SoftTimer oneSecTimer = { .eventData.eventHandler = notifyState, .eventData.name = "notifyState", .eventData.priority = EventPriority_Actuator };
+static SoftTimer servoDurationTimer = { .eventData.eventHandler = servoActionStop, .eventData.name = "servoStop", .eventData.priority = EventPriority_Actuator };
 
 // The polarity is inverted because LEDs are driven low
 static PwmState ledPwmState = { .period_nsec = FULL_CYCLE_NS,
@@ -179,7 +193,7 @@ static int setupServoAction(bool locking)
 {
 	// Timer state variables
 	static const struct timespec servoActionDuration = { .tv_sec = LOCK_TOGGLE_DURATION_S, .tv_nsec = 0 };
-	SetTimerFdToSingleExpiry(servoDurationTimerFd, &servoActionDuration);
+	SetSoftTimerToSingleExpiry(&servoDurationTimer, &servoActionDuration);
 
 	//Set servo control signal for fixed angle
 	if (locking)
@@ -210,16 +224,9 @@ static int setupServoAction(bool locking)
 
 static void servoActionStop(EventData* event)
 {
-	if (ConsumeTimerFdEvent(event->fd) != 0) {
-		terminationRequired = true;
-		return;
-	}
 	turnAllChannelsOff();
 }
 
-// Event handler data structures. Only the event handler field needs to be populated.
-static EventData servoDurationEventData = { .eventHandler = servoActionStop };
-
 /// <summary>
 /// Write an integer to this application's persistent data file
 /// </summary>
@@ -290,6 +297,10 @@ static KeyEvent_t findEventWithCode(uint8_t eventCode)
 		case event_tap_x:
 		case event_tap_y:
 		case event_tap_z:
+		case event_double_tap_x:
+		case event_double_tap_y:
+		case event_double_tap_z:
+		case event_free_fall:
 		case event_4d_top_x:
 		case event_4d_bottom_x:
 		case event_4d_top_y:
@@ -300,6 +311,9 @@ static KeyEvent_t findEventWithCode(uint8_t eventCode)
 		case event_swipe_right:
 		case event_swipe_up:
 		case event_swipe_down:
+		case event_fsm_knock:
+		case event_fsm_twist:
+		case event_fsm_shake:
 			returnEvent = (KeyEvent_t)eventCode;
 			break;
 		default: 
@@ -322,8 +336,14 @@ static void toggleLock(void)
 	clearEventTable();
 	keyState.action_scheduled = false;
 	setupServoAction(!keyState.locked);
+	if (toggleEventNs != 0)
+	{
+		Log_Debug("Servo driven %u ms after the last event of the recipe\n", (unsigned int)((GetMonotonicNs() - toggleEventNs) / 1000000));
+		toggleEventNs = 0;
+	}
 	keyState.locked = !keyState.locked;
 	writeToMutableFile();
+	magicLockbox_markDirty();
 }
 
 static int8_t updateGoalEventChain(void)
@@ -367,18 +387,15 @@ static void moveCurrentEventToTable(void)
 		clearEventTable();
 	}	
 	inputKeyEvents[inputKeyEventsIndex] = currentEvent;
+	latchedEventNs = currentEventNs;
 	Log_Debug("Saved event %d to %d\n", currentEvent, inputKeyEventsIndex);
 	inputKeyEventsIndex++;
 	currentEvent = event_none;	
+	magicLockbox_markDirty();
 }
 
 static void lockToggleTimerHandler(EventData* event)
 {
-	//Clear event
-	if (ConsumeTimerFdEvent(lockToggleTimerFd) != 0) {
-		terminationRequired = true;
-		return;
-	}
 	//Schedule lock toggle in short time
 	toggleLock();
 }
@@ -386,37 +403,36 @@ static void lockToggleTimerHandler(EventData* event)
 static void overwriteWindowTimerHandler(EventData * event)
 {
 	eventOverwriteActive = false;
-	//Clear event //todo chec if fd from event can be used
-	if (ConsumeTimerFdEvent(eventOverwriteWindowTimerFd) != 0) {
-		terminationRequired = true;
-		return;
-	}
 	moveCurrentEventToTable();
 	Log_Debug("Overwrite window expired\n", strerror(errno), errno);
-	//Start chain reset timer to reset chain if not completed within time
-	static struct timespec expiryTime = { .tv_sec = EVENT_SEQUENCE_RESET_S,.tv_nsec = 0 }; //todo move to build options
-	//Set zero time to next timer expiry
-	SetTimerFdToSingleExpiry(eventChainNotCompleteTimerFd, &expiryTime);
+	//Start chain reset timer to reset chain if not completed within time, counted like the 
+	//overwrite window from the detection of the event
+	setTimerToDeadline(&eventChainNotCompleteTimer, latchedEventNs + 
+		(EVENT_OVERWRITE_S + EVENT_SEQUENCE_RESET_S) * 1000000000ULL + EVENT_OVERWRITE_NS);
 }
 
 static void chainNotCompleteTimerHandler(EventData* event)
 {
 	eventOverwriteActive = false;
 	clearEventTable();
-	//Clear event
-	if (ConsumeTimerFdEvent(eventChainNotCompleteTimerFd) != 0) {
-		terminationRequired = true;
-		return;
-	}
 	
 	Log_Debug("Chain not completed expired\n", strerror(errno), errno);
 }
 
-static int8_t enableOverwriteWindow(void)
+//Arms timer to expire at deadlineNs (CLOCK_MONOTONIC), a deadline that has passed already 
+//expires on the next timer tick
+static int8_t setTimerToDeadline(SoftTimer* timer, uint64_t deadlineNs)
 {
-	static struct timespec expiryTime = { .tv_sec = EVENT_OVERWRITE_S,.tv_nsec = EVENT_OVERWRITE_NS }; 
-	//Set zero time to next timer expiry
-	if (SetTimerFdToSingleExpiry(eventOverwriteWindowTimerFd, &expiryTime) < 0)
+	uint64_t nowNs = GetMonotonicNs();
+	uint64_t remainingNs = deadlineNs > nowNs ? deadlineNs - nowNs : 1;
+	struct timespec expiryTime = { .tv_sec = (time_t)(remainingNs / 1000000000ULL),.tv_nsec = (long)(remainingNs % 1000000000ULL) };
+	return SetSoftTimerToSingleExpiry(timer, &expiryTime) < 0 ? -1 : 0;
+}
+
+static int8_t enableOverwriteWindow(uint64_t eventNs)
+{
+	//Re-arming only moves the timer inside the timer wheel
+	if (setTimerToDeadline(&eventOverwriteWindowTimer, eventNs + EVENT_OVERWRITE_S * 1000000000ULL + EVENT_OVERWRITE_NS) < 0)
 	{
 		return -1;
 	}
@@ -453,26 +469,6 @@ int8_t magicLockbox_initialize(void)
 	readMutableFile();
 	updateGoalEventChain();	
 
-	static struct timespec timePeriod = { .tv_sec = 0,.tv_nsec = 0 };
-	// event handler data structures. Only the event handler field needs to be populated.
-	static EventData eventOverwriteWindowTimerData = { .eventHandler = overwriteWindowTimerHandler };
-	eventOverwriteWindowTimerFd = CreateTimerFdAndAddToEpoll(epollFd, &timePeriod, &eventOverwriteWindowTimerData, EPOLLIN);
-	if (eventOverwriteWindowTimerFd < 0) {
-		return -1;
-	}
-
-	static EventData eventChainNotCompletedTimerData = { .eventHandler = chainNotCompleteTimerHandler };
-	eventChainNotCompleteTimerFd = CreateTimerFdAndAddToEpoll(epollFd, &timePeriod, &eventChainNotCompletedTimerData, EPOLLIN);
-	if (eventChainNotCompleteTimerFd < 0) {
-		return -1;
-	}
-
-	static EventData eventLockToggleTimerData = { .eventHandler = lockToggleTimerHandler };
-	lockToggleTimerFd = CreateTimerFdAndAddToEpoll(epollFd, &timePeriod, &eventLockToggleTimerData, EPOLLIN);
-	if (lockToggleTimerFd < 0) {
-		return -1;
-	}	
-
 	pwmFd = PWM_Open(AVNET_MT3620_SK_PWM_CONTROLLER0);
 	if (pwmFd < 0) {
 		Log_Debug(
@@ -486,20 +482,15 @@ int8_t magicLockbox_initialize(void)
 		return -1;
 	}
 
-	servoDurationTimerFd =
-		CreateTimerFdAndAddToEpoll(epollFd, &timePeriod, &servoDurationEventData, EPOLLIN);
-	if (servoDurationTimerFd < 0) {
-		return -1;
-	}
-
-	timePeriod.tv_sec = 1;
-	oneSecTimerFd = CreateTimerFdAndAddToEpoll(epollFd, &timePeriod, &oneSecEventData, EPOLLIN);
-	if (oneSecTimerFd < 0) {
+	static const struct timespec notifyPeriod = { .tv_sec = 1,.tv_nsec = 0 };
+	static const struct timespec notifySlack = { .tv_sec = 0,.tv_nsec = 10000000 * COARSE_TIMER_SLACK_PERCENT };
+	if (SetSoftTimerToPeriodWithSlack(&oneSecTimer, &notifyPeriod, &notifySlack) < 0) {
 		return -1;
 	}
 
 
 	magicLockbox_notifyState(state_ready);
+	magicLockbox_markDirty();
 	if (keyState.locked)
 	{
 		sendStateTelemetry("lock", "unlocked");
@@ -514,9 +505,15 @@ int8_t magicLockbox_initialize(void)
 
 void magicLockbox_registerEvent(KeyEvent_t keyEvent)
 {
-	enableOverwriteWindow();
+	magicLockbox_registerEventAt(keyEvent, GetMonotonicNs());
+}
+
+void magicLockbox_registerEventAt(KeyEvent_t keyEvent, uint64_t eventNs)
+{
+	enableOverwriteWindow(eventNs);
 	currentEvent = keyEvent;
-	Log_Debug("Got event %c\n", keyEvent);
+	currentEventNs = eventNs;
+	Log_Debug("Got event %c, detected %u us ago\n", keyEvent, (unsigned int)((GetMonotonicNs() - eventNs) / 1000));
 }
 
 static KeyEvent_t* getCollectedEvents(void)
@@ -530,7 +527,7 @@ static bool checkInputEventsMatch(void)
 	{
 		if (keyState.locked && !keyState.action_scheduled)
 		{	
-			magicLockbox_scheduleLockToggle();
+			scheduleLockToggleForEvent(latchedEventNs);
 			return true;
 		}
 	}
@@ -544,12 +541,27 @@ void magicLockbox_loopTask(void)
 
 }
 
-void magicLockbox_scheduleLockToggle(void)
+void magicLockbox_markDirty(void)
+{
+	PostDeferredTask(&loopTask);
+}
+
+static void loopTaskHandler(EventData* event)
+{
+	magicLockbox_loopTask();
+}
+
+static void scheduleLockToggleForEvent(uint64_t eventNs)
 {
 	static struct timespec expiryTime = { .tv_sec = LOCK_TOGGLE_DELAY_S,.tv_nsec = 0 }; 
-	//Set zero time to next timer expiry
-	SetTimerFdToSingleExpiry(lockToggleTimerFd, &expiryTime);
+	SetSoftTimerToSingleExpiry(&lockToggleTimer, &expiryTime);
 	keyState.action_scheduled = true;
+	toggleEventNs = eventNs;
+}
+
+void magicLockbox_scheduleLockToggle(void)
+{
+	scheduleLockToggleForEvent(0);
 }
 
 bool magicLockbox_isLocked(void)
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
 /**
  >>> MagicLockbox general description
@@ -19,16 +20,17 @@ from outside module
 TODO: 
 -add failsafe methods for lock opening if input devices do not respond or powersupply gets low
 -move reading of accelerometer events to m4 core (when I2C support is in place) to utilize 
-pulse mode interrupts and to handle also double tap
+pulse mode interrupts
 
  >>> General operation 
 Device intializes with recipe from device file storage. After that it awaits for new events. Each incoming 
 event is temporarly stored and timer starts to measure EVENT_OVERWRITE time. If new event comes before timer expires
 it overwrites the one that was already stored. If the timer expires before new event is observed stroed event is latched
 into array that will be compared against recipe. If array runs out of space or no event is registered for more than 
-EVENT_SEQUENCE_RESET then array is cleared. Each run of loop task checks if new recipe has been copied from cloud to be updated 
-or registered event sequence matches the recpie. Newly copied recipes are checked for validity and stored in device files for future
-reference. If recipe has matched the input then lockbox will unlock.
+EVENT_SEQUENCE_RESET then array is cleared. Both windows run from the time at which the event was detected by its source,
+not from the time it was registered, so the latency of reading the sensors does not stretch them. Each run of loop task
+checks if new recipe has been copied from cloud to be updated or registered event sequence matches the recpie. Newly copied
+recipes are checked for validity and stored in device files for future reference. If recipe has matched the input then lockbox will unlock.
  
  >>> Unlocking
  Unlocking is implemented by controling a micro servo to move sliding bolt inside magick box. Unlocking can be started by
@@ -36,10 +38,16 @@ reference. If recipe has matched the input then lockbox will unlock.
  of recpie. Locking and unlocking procedure looks similar. Servo is being powered up with transistor acting as a switch. Then, 
  proper servo position is issued with PWM signal and after LOCK_TOGGLE_DURATION servo is powered off. There is additional delay for
  lcok operation (LOCK_TOGGLE_DELAY) so the lid of lockbox can be closed.
+ When the recipe is matched the time from the detection of its last event to driving the servo is logged, measuring
+ the latency from sensor to actuator end to end.
 
  >>> Events
  Events are defined in KeyEvent_t enum. They can be expanded with wahtever comes to ones mind. At this stage events are read from 
  Azure Spheres Starte kit accelerometr in the form of rotations and taping.
+ Knock, twist and shake are recognized by programs running in the accelerometer's finite state machine,
+ when the programs are in the image package (see accel_fsm.h).
+ Double taps (X, Y, Z) and free fall (f) are detected by the accelerometer itself. The first tap of a double
+ tap comes in as a single tap and is overwritten by the double tap within EVENT_OVERWRITE.
  TODO add description of gestures.
 
  >>> States
@@ -89,6 +97,10 @@ typedef enum Event
 	event_tap_x = 'x',
 	event_tap_y = 'y',
 	event_tap_z = 'z',
+	event_double_tap_x = 'X',
+	event_double_tap_y = 'Y',
+	event_double_tap_z = 'Z',
+	event_free_fall = 'f',
 	event_4d_top_x = 't',
 	event_4d_bottom_x = 'T',
 	event_4d_top_y = 'b',
@@ -99,6 +111,9 @@ typedef enum Event
 	event_swipe_right = 'r',
 	event_swipe_up = 'u',
 	event_swipe_down = 'd',
+	event_fsm_knock = 'k',
+	event_fsm_twist = 'w',
+	event_fsm_shake = 'h',
 	event_last //keep last to track size needed for type encoding
 } KeyEvent_t;
 
@@ -121,14 +136,21 @@ void magicLockbox_notifyState(State_t);
 // Initialize magic chain of events
 int8_t magicLockbox_initialize(void);
 
-// Registers occurance of new event relevant for the module
+// Registers occurance of new event relevant for the module, detected now
 void magicLockbox_registerEvent(KeyEvent_t keyEvent);
 
+// Registers occurance of new event relevant for the module, detected by its source at eventNs
+// (CLOCK_MONOTONIC time in nanoseconds)
+void magicLockbox_registerEventAt(KeyEvent_t keyEvent, uint64_t eventNs);
+
 // Get lock state
 bool magicLockbox_isLocked(void);
 
 // Schedule change of lock state
 void magicLockbox_scheduleLockToggle(void);
 
-// Task that will perform needed function for each main loop run
+// Task that re-evaluates recipe and collected events, run by the event loop only when marked dirty
 void magicLockbox_loopTask(void);
+
+// Schedule magicLockbox_loopTask to run on the next event loop pass
+void magicLockbox_markDirty(void);
@@ -50,6 +50,9 @@
 #include "applibs_versions.h"
 #include "epoll_timerfd_utilities.h"
 #include "i2c.h"
+#include "i2c_scheduler.h"
+#include "i2c_transport.h"
+#include "imu_telemetry.h"
 #include "hw/avnet_mt3620_sk.h"
 #include "deviceTwin.h"
 #include "azure_iot_utilities.h"
@@ -80,12 +83,12 @@ static void ClosePeripheralsAndHandlers(void);
 
 // File descriptors - initialized to invalid value
 int epollFd = -1;
-static int buttonPollTimerFd = -1;
 static int buttonAGpioFd = -1;
 
 #if (defined(IOT_CENTRAL_APPLICATION) || defined(IOT_HUB_APPLICATION))
 	bool versionStringSent = false;
 #endif
+static const char *versionString = NULL;
 
 // Termination state
 volatile sig_atomic_t terminationRequired = false;
@@ -107,11 +110,6 @@ static void ButtonTimerEventHandler(EventData *eventData)
 	// Button state variables, initilize them to button not-pressed (High)
 	static GPIO_Value_Type buttonAState = GPIO_Value_High;
 
-	if (ConsumeTimerFdEvent(buttonPollTimerFd) != 0) {
-		terminationRequired = true;
-		return;
-	}
-
 	// Check for button A press
 	GPIO_Value_Type newButtonAState;
 	int result = GPIO_GetValue(buttonAGpioFd, &newButtonAState);
@@ -136,8 +134,8 @@ static void ButtonTimerEventHandler(EventData *eventData)
 	}
 }
 
-// event handler data structures. Only the event handler field needs to be populated.
-static EventData buttonEventData = { .eventHandler = &ButtonTimerEventHandler };
+// Timer data structures: the event handler, the name in the handler stats and the priority class.
+static SoftTimer buttonPollTimer = { .eventData.eventHandler = &ButtonTimerEventHandler, .eventData.name = "buttonPoll", .eventData.priority = EventPriority_Sensor };
 
 static int ButtonHandlingInit(void)
 {
@@ -151,14 +149,139 @@ static int ButtonHandlingInit(void)
 
 	// Set up a timer to poll the button	
 	static struct timespec buttonPressCheckPeriod = { 0, 1000000 };
-	buttonPollTimerFd =
-		CreateTimerFdAndAddToEpoll(epollFd, &buttonPressCheckPeriod, &buttonEventData, EPOLLIN);
-	if (buttonPollTimerFd < 0) {
+	if (SetSoftTimerToPeriod(&buttonPollTimer, &buttonPressCheckPeriod) < 0) {
 		return -1;
 	}
 	return 0;
 }
 
+/// <summary>
+///     Dump the event loop histograms and report them as device twin properties, one
+///     "loop_<handler name>" property per named handler plus the total number of handler
+///     time budget overruns as "loopOverruns" and the wakeups saved by timer slack per minute
+///     as "wakeupsSavedPerMin", the bus traffic of every I2C device as "i2c_<device name>" and
+///     the queue depth and bus utilization of the I2C scheduler as "i2cQueue".
+/// </summary>
+static void LoopStatsTimerEventHandler(EventData *eventData)
+{
+	LogEventBatchStats();
+	LogEventHandlerStats();
+	LogTimerWheelStats();
+	I2cTransport_LogStats();
+	I2cScheduler_LogStats();
+#if defined(IMU_TELEMETRY) && defined(ACCEL_FIFO_STREAMING)
+	ImuTelemetry_LogStats();
+#endif
+
+#if (defined(IOT_CENTRAL_APPLICATION) || defined(IOT_HUB_APPLICATION))
+	if (iothubClientHandle == NULL) {
+		return;
+	}
+
+	char key[32];
+	char value[64];
+	for (EventData *handler = GetInstrumentedEventDataList(); handler != NULL; handler = handler->stats.next) {
+		if (handler->name == NULL) {
+			continue;
+		}
+		snprintf(key, sizeof(key), "loop_%s", handler->name);
+		FormatEventHandlerStats(handler, value, sizeof(value));
+		checkAndUpdateDeviceTwin(key, value, TYPE_STRING, false);
+	}
+	int overruns = (int)GetEventBatchStats()->budgetOverruns;
+	checkAndUpdateDeviceTwin("loopOverruns", &overruns, TYPE_INT, false);
+	int wakeupsSaved = (int)GetTimerWheelWakeupsSavedPerMinute();
+	checkAndUpdateDeviceTwin("wakeupsSavedPerMin", &wakeupsSaved, TYPE_INT, false);
+	for (I2cTransportDevice *device = I2cTransport_GetDeviceList(); device != NULL; device = device->next) {
+		snprintf(key, sizeof(key), "i2c_%s", device->name);
+		I2cTransport_FormatStats(device, value, sizeof(value));
+		checkAndUpdateDeviceTwin(key, value, TYPE_STRING, false);
+	}
+	I2cScheduler_FormatStats(value, sizeof(value));
+	checkAndUpdateDeviceTwin("i2cQueue", value, TYPE_STRING, false);
+#endif
+}
+
+#if (defined(IOT_CENTRAL_APPLICATION) || defined(IOT_HUB_APPLICATION))
+/// <summary>
+///     Keep the flow of data with the Azure IoT Hub going and send the version string once
+///     connected.
+/// </summary>
+static void AzureIoTTimerEventHandler(EventData *eventData)
+{
+	// Setup the IoT Hub client.
+	// Notes:
+	// - it is safe to call this function even if the client has already been set up, as in
+	//   this case it would have no effect;
+	// - a failure to setup the client is a fatal error.
+	if (!AzureIoT_SetupClient()) {
+		Log_Debug("ERROR: Failed to set up IoT Hub client\n");
+		terminationRequired = true;
+		return;
+	}
+
+	if (iothubClientHandle != NULL && !versionStringSent && versionString != NULL) {
+
+		checkAndUpdateDeviceTwin("versionString", (void*)versionString, TYPE_STRING, false);
+		versionStringSent = true;
+	}
+
+	// AzureIoT_DoPeriodicTasks() needs to be called frequently in order to keep active
+	// the flow of data with the Azure IoT Hub
+	AzureIoT_DoPeriodicTasks();
+}
+
+static SoftTimer azureIoTTimer = { .eventData.eventHandler = &AzureIoTTimerEventHandler, .eventData.name = "azureIoT", .eventData.priority = EventPriority_Cloud };
+#endif
+
+/// <summary>
+///     Check the connected Wi-Fi network and report it when it changes.
+/// </summary>
+static void WifiStatusTimerEventHandler(EventData *eventData)
+{
+	// Variable to help us send the network config up only once
+	static bool networkConfigSent = false;
+	static char ssid[128];
+	uint32_t frequency;
+	char bssid[20];
+
+	WifiConfig_ConnectedNetwork network;
+	int result = WifiConfig_GetCurrentNetwork(&network);
+
+	if (result < 0) 
+	{
+		Log_Debug("INFO: Not currently connected to a WiFi network.\n");			
+		return;
+	}
+
+	frequency = network.frequencyMHz;
+	snprintf(bssid, sizeof(bssid), "%02x:%02x:%02x:%02x:%02x:%02x",
+		network.bssid[0], network.bssid[1], network.bssid[2], 
+		network.bssid[3], network.bssid[4], network.bssid[5]);
+
+	if ((strncmp(ssid, (char*)&network.ssid, network.ssidLength)!=0) || !networkConfigSent) {
+		
+		memset(ssid, 0, sizeof(ssid));
+		strncpy(ssid, network.ssid, network.ssidLength);
+		Log_Debug("SSID: %s\n", ssid);
+		Log_Debug("Frequency: %dMHz\n", frequency);
+		Log_Debug("bssid: %s\n", bssid);
+		networkConfigSent = true;
+
+#if (defined(IOT_CENTRAL_APPLICATION) || defined(IOT_HUB_APPLICATION))
+		// Note that we send up this data to Azure if it changes, but the IoT Central Properties elements only 
+		// show the data that was currenet when the device first connected to Azure.
+		checkAndUpdateDeviceTwin("ssid", &ssid, TYPE_STRING, false);
+		checkAndUpdateDeviceTwin("freq", &frequency, TYPE_INT, false);
+		checkAndUpdateDeviceTwin("bssid", &bssid, TYPE_STRING, false);
+#endif 
+	}
+}
+
+static SoftTimer wifiStatusTimer = { .eventData.eventHandler = &WifiStatusTimerEventHandler, .eventData.name = "wifiStatus", .eventData.priority = EventPriority_Housekeeping };
+
+static SoftTimer loopStatsTimer = { .eventData.eventHandler = &LoopStatsTimerEventHandler, .eventData.name = "loopStats", .eventData.priority = EventPriority_Housekeeping };
+
 /// <summary>
 ///     Set up SIGTERM termination handler, initialize peripherals, and set up event handlers.
 /// </summary>
@@ -175,12 +298,34 @@ static int InitPeripheralsAndHandlers(void)
 		Log_Debug("ERROR: main epoll init: errno=%d (%s)\n", errno, strerror(errno));
         return -1;
     }
+
+	// Handler calls running longer than the budget are counted and reported as overruns
+	SetEventHandlerTimeBudget(EVENT_HANDLER_BUDGET_US);
+
+	// All application timers are software timers multiplexed onto the timer wheel
+	static const struct timespec timerWheelTick = { .tv_sec = 0,.tv_nsec = TIMER_WHEEL_TICK_NANO_SECONDS };
+	if (CreateTimerWheelAndAddToEpoll(epollFd, &timerWheelTick) < 0) {
+		Log_Debug("ERROR: timer wheel init: errno=%d (%s)\n", errno, strerror(errno));
+		return -1;
+	}
+
+	// Modules post their pending work through the deferred task queue instead of polling
+	if (CreateDeferredTaskQueueAndAddToEpoll(epollFd) < 0) {
+		Log_Debug("ERROR: deferred task queue init: errno=%d (%s)\n", errno, strerror(errno));
+		return -1;
+	}
 	
 	if (initI2c() < 0) {
 		Log_Debug("ERROR: i2c init: errno=%d (%s)\n", errno, strerror(errno));
 		return -1;
 	}	
 
+#if defined(IMU_TELEMETRY) && defined(ACCEL_FIFO_STREAMING)
+	if (ImuTelemetry_Start(&imuSampleRing) < 0) {
+		return -1;
+	}
+#endif
+
 	if (deviceTwinInitialize() < 0)
 	{
 		Log_Debug("ERROR: device twin init: errno=%d (%s)\n", errno, strerror(errno));
@@ -193,6 +338,27 @@ static int InitPeripheralsAndHandlers(void)
 		return -1;
 	}
 		
+	// The coarse periodic timers tolerate some slack so that their expiries share wakeups
+	static const struct timespec loopStatsPeriod = { .tv_sec = EVENT_LOOP_STATS_REPORT_PERIOD_S,.tv_nsec = 0 };
+	static const struct timespec loopStatsSlack = { .tv_sec = EVENT_LOOP_STATS_REPORT_PERIOD_S * COARSE_TIMER_SLACK_PERCENT / 100,.tv_nsec = EVENT_LOOP_STATS_REPORT_PERIOD_S * COARSE_TIMER_SLACK_PERCENT % 100 * 10000000 };
+	if (SetSoftTimerToPeriodWithSlack(&loopStatsTimer, &loopStatsPeriod, &loopStatsSlack) < 0) {
+		return -1;
+	}
+
+#if (defined(IOT_CENTRAL_APPLICATION) || defined(IOT_HUB_APPLICATION))
+	static const struct timespec azureIoTPeriod = { .tv_sec = 0,.tv_nsec = AZURE_IOT_DO_WORK_PERIOD_MS * 1000000 };
+	static const struct timespec azureIoTSlack = { .tv_sec = 0,.tv_nsec = AZURE_IOT_DO_WORK_PERIOD_MS * 10000 * COARSE_TIMER_SLACK_PERCENT };
+	if (SetSoftTimerToPeriodWithSlack(&azureIoTTimer, &azureIoTPeriod, &azureIoTSlack) < 0) {
+		return -1;
+	}
+#endif
+
+	static const struct timespec wifiStatusPeriod = { .tv_sec = WIFI_STATUS_CHECK_PERIOD_S,.tv_nsec = 0 };
+	static const struct timespec wifiStatusSlack = { .tv_sec = WIFI_STATUS_CHECK_PERIOD_S * COARSE_TIMER_SLACK_PERCENT / 100,.tv_nsec = WIFI_STATUS_CHECK_PERIOD_S * COARSE_TIMER_SLACK_PERCENT % 100 * 10000000 };
+	if (SetSoftTimerToPeriodWithSlack(&wifiStatusTimer, &wifiStatusPeriod, &wifiStatusSlack) < 0) {
+		return -1;
+	}
+
 	// Initialze magicLockbox app
 	if (magicLockbox_initialize() < 0) {
 		Log_Debug("ERROR: MagicLockbox init: errno=%d (%s)\n", errno, strerror(errno));
@@ -208,10 +374,20 @@ static int InitPeripheralsAndHandlers(void)
 static void ClosePeripheralsAndHandlers(void)
 {
     Log_Debug("Closing file descriptors.\n");
+    LogEventBatchStats();
+    LogEventHandlerStats();
+    LogTimerWheelStats();
+    I2cTransport_LogStats();
+    I2cScheduler_LogStats();
+#if defined(IMU_TELEMETRY) && defined(ACCEL_FIFO_STREAMING)
+	ImuTelemetry_Stop();
+	ImuTelemetry_LogStats();
+#endif
     
 	closeI2c();
+	CloseTimerWheel();
+	CloseDeferredTaskQueue();
     CloseFdAndPrintError(epollFd, "Epoll");
-	CloseFdAndPrintError(buttonPollTimerFd, "buttonPoll");
 	CloseFdAndPrintError(buttonAGpioFd, "buttonA");
 
 	deviceTwinClose();
@@ -222,15 +398,7 @@ static void ClosePeripheralsAndHandlers(void)
 /// </summary>
 int main(int argc, char *argv[])
 {
-	// Variable to help us send the version string up only once
-	bool networkConfigSent = false;
-	char ssid[128];
-	uint32_t frequency;
-	char bssid[20];
-	
-	// Clear the ssid array
-	memset(ssid, 0, 128);
-
+	versionString = argv[1];
 	Log_Debug("Version String: %s\n", argv[1]);
 	Log_Debug("Avnet Starter Kit Simple Reference Application starting.\n");
 	
@@ -238,69 +406,12 @@ int main(int argc, char *argv[])
         terminationRequired = true;
     }
 
-    // Use epoll to wait for events and trigger handlers, until an error or SIGTERM happens
+    // Use epoll to wait for batches of events and trigger their handlers, until an error or
+    // SIGTERM happens. All other work runs from timers or deferred tasks.
     while (!terminationRequired) {
-        if (WaitForEventAndCallHandler(epollFd) != 0) {
+        if (WaitForEventsAndCallHandlers(epollFd, EVENT_LOOP_MAX_EVENTS_PER_WAIT) < 0) {
             terminationRequired = true;
         }
-
-#if (defined(IOT_CENTRAL_APPLICATION) || defined(IOT_HUB_APPLICATION))
-		// Setup the IoT Hub client.
-		// Notes:
-		// - it is safe to call this function even if the client has already been set up, as in
-		//   this case it would have no effect;
-		// - a failure to setup the client is a fatal error.
-		if (!AzureIoT_SetupClient()) {
-			Log_Debug("ERROR: Failed to set up IoT Hub client\n");
-			break;
-		}
-#endif 
-
-		WifiConfig_ConnectedNetwork network;
-		int result = WifiConfig_GetCurrentNetwork(&network);
-
-		if (result < 0) 
-		{
-			Log_Debug("INFO: Not currently connected to a WiFi network.\n");			
-		}
-		else 
-		{
-
-			frequency = network.frequencyMHz;
-			snprintf(bssid, JSON_BUFFER_SIZE, "%02x:%02x:%02x:%02x:%02x:%02x",
-				network.bssid[0], network.bssid[1], network.bssid[2], 
-				network.bssid[3], network.bssid[4], network.bssid[5]);
-
-			if ((strncmp(ssid, (char*)&network.ssid, network.ssidLength)!=0) || !networkConfigSent) {
-				
-				memset(ssid, 0, 128);
-				strncpy(ssid, network.ssid, network.ssidLength);
-				Log_Debug("SSID: %s\n", ssid);
-				Log_Debug("Frequency: %dMHz\n", frequency);
-				Log_Debug("bssid: %s\n", bssid);
-				networkConfigSent = true;
-
-#if (defined(IOT_CENTRAL_APPLICATION) || defined(IOT_HUB_APPLICATION))
-				// Note that we send up this data to Azure if it changes, but the IoT Central Properties elements only 
-				// show the data that was currenet when the device first connected to Azure.
-				checkAndUpdateDeviceTwin("ssid", &ssid, TYPE_STRING, false);
-				checkAndUpdateDeviceTwin("freq", &frequency, TYPE_INT, false);
-				checkAndUpdateDeviceTwin("bssid", &bssid, TYPE_STRING, false);
-#endif 
-			}
-		}	   		 	  	  	   	
-#if (defined(IOT_CENTRAL_APPLICATION) || defined(IOT_HUB_APPLICATION))
-		if (iothubClientHandle != NULL && !versionStringSent) {
-
-			checkAndUpdateDeviceTwin("versionString", argv[1], TYPE_STRING, false);
-			versionStringSent = true;
-		}
-
-		// AzureIoT_DoPeriodicTasks() needs to be called frequently in order to keep active
-		// the flow of data with the Azure IoT Hub
-		AzureIoT_DoPeriodicTasks();
-#endif
-		magicLockbox_loopTask();
     }
 
     ClosePeripheralsAndHandlers();
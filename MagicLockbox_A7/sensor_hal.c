@@ -0,0 +1,115 @@
+#include <errno.h>
+#include <string.h>
+#include <applibs/log.h>
+#include "gpio_edge.h"
+#include "sensor_hal.h"
+
+static const SensorHalBackend applibsBackend = {.name = "applibs",
+                                                .i2cOpen = I2CMaster_Open,
+                                                .i2cSetBusSpeed = I2CMaster_SetBusSpeed,
+                                                .i2cSetTimeout = I2CMaster_SetTimeout,
+                                                .i2cWrite = I2CMaster_Write,
+                                                .i2cRead = I2CMaster_Read,
+                                                .i2cWriteThenRead = I2CMaster_WriteThenRead,
+                                                .gpioOpenAsInput = GPIO_OpenAsInput,
+                                                .gpioOpenAsOutput = GPIO_OpenAsOutput,
+                                                .gpioOpenEdgeNotifier =
+                                                    GpioEdge_OpenRisingEdgeNotifier,
+                                                .gpioGetValue = GPIO_GetValue,
+                                                .gpioSetValue = GPIO_SetValue};
+
+static const SensorHalBackend *backend = &applibsBackend;
+
+int SensorHal_Init(SensorHalBackendId backendId, const char *recordingPath)
+{
+    switch (backendId) {
+    case SensorHalBackend_Applibs:
+        backend = &applibsBackend;
+        break;
+    case SensorHalBackend_Recorder:
+        backend = SensorHalTrace_GetRecorder();
+        break;
+    case SensorHalBackend_Player:
+        backend = SensorHalTrace_OpenPlayer(recordingPath);
+        if (backend == NULL) {
+            backend = &applibsBackend;
+            return -1;
+        }
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+    Log_Debug("Sensor HAL: %s backend.\n", backend->name);
+    return 0;
+}
+
+int SensorHal_I2cOpen(I2C_InterfaceId id)
+{
+    return backend->i2cOpen(id);
+}
+
+int SensorHal_I2cSetBusSpeed(int fd, uint32_t speedInHz)
+{
+    return backend->i2cSetBusSpeed(fd, speedInHz);
+}
+
+int SensorHal_I2cSetTimeout(int fd, uint32_t timeoutInMs)
+{
+    return backend->i2cSetTimeout(fd, timeoutInMs);
+}
+
+ssize_t SensorHal_I2cWrite(int fd, I2C_DeviceAddress address, const uint8_t *data, size_t length)
+{
+    return backend->i2cWrite(fd, address, data, length);
+}
+
+ssize_t SensorHal_I2cRead(int fd, I2C_DeviceAddress address, uint8_t *buffer, size_t maxLength)
+{
+    return backend->i2cRead(fd, address, buffer, maxLength);
+}
+
+ssize_t SensorHal_I2cWriteThenRead(int fd, I2C_DeviceAddress address, const uint8_t *writeData,
+                                   size_t lenWriteData, uint8_t *readData, size_t lenReadData)
+{
+    return backend->i2cWriteThenRead(fd, address, writeData, lenWriteData, readData,
+                                     lenReadData);
+}
+
+int SensorHal_GpioOpenAsInput(GPIO_Id gpioId)
+{
+    return backend->gpioOpenAsInput(gpioId);
+}
+
+int SensorHal_GpioOpenAsOutput(GPIO_Id gpioId, GPIO_OutputMode_Type outputMode,
+                               GPIO_Value_Type initialValue)
+{
+    return backend->gpioOpenAsOutput(gpioId, outputMode, initialValue);
+}
+
+int SensorHal_GpioOpenEdgeNotifier(GPIO_Id gpioId)
+{
+    return backend->gpioOpenEdgeNotifier(gpioId);
+}
+
+int SensorHal_GpioGetValue(int gpioFd, GPIO_Value_Type *outValue)
+{
+    return backend->gpioGetValue(gpioFd, outValue);
+}
+
+int SensorHal_GpioSetValue(int gpioFd, GPIO_Value_Type value)
+{
+    return backend->gpioSetValue(gpioFd, value);
+}
+
+const char *SensorHal_GetBackendName(void)
+{
+    return backend->name;
+}
+
+void SensorHal_LogStats(void)
+{
+    if (backend->logStats != NULL) {
+        backend->logStats();
+    }
+}
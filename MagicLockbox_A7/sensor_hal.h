@@ -0,0 +1,95 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <applibs/gpio.h>
+#include <applibs/i2c.h>
+
+/// <summary>
+/// <para>The sensor HAL: every I2C transfer and every GPIO access of the sensors goes through
+/// it, so that the backend underneath can be swapped without touching the drivers. The I2C
+/// transport, the LSM6DSO interrupt line and the MGC3130 TS and reset lines use it; the buttons
+/// and the servos do not.</para>
+/// <para>Backends:
+/// SensorHalBackend_Applibs: the applibs I2C master and GPIO calls.
+/// SensorHalBackend_Recorder: the applibs calls, each one also written to the debug log as a
+/// "HAL" line, see sensor_hal_trace.c for the format. Capturing the debug output of a box gives
+/// a recording of its sensor traffic.
+/// SensorHalBackend_Player: answers the calls from a recording instead of the hardware. The
+/// transfers of a device are answered in recorded order and an input reads the level it had
+/// at the same time into the recording, so the drivers and the event loop run under the load
+/// of the box that was recorded. The rises of a line recorded are replayed as its edge
+/// notifications.</para>
+/// </summary>
+
+typedef enum SensorHalBackendId {
+    SensorHalBackend_Applibs = 0,
+    SensorHalBackend_Recorder = 1,
+    SensorHalBackend_Player = 2,
+} SensorHalBackendId;
+
+/// <summary>
+///     The calls of a backend, with the signatures of the applibs calls they stand for.
+/// </summary>
+typedef struct SensorHalBackend {
+    const char *name;
+    int (*i2cOpen)(I2C_InterfaceId id);
+    int (*i2cSetBusSpeed)(int fd, uint32_t speedInHz);
+    int (*i2cSetTimeout)(int fd, uint32_t timeoutInMs);
+    ssize_t (*i2cWrite)(int fd, I2C_DeviceAddress address, const uint8_t *data, size_t length);
+    ssize_t (*i2cRead)(int fd, I2C_DeviceAddress address, uint8_t *buffer, size_t maxLength);
+    ssize_t (*i2cWriteThenRead)(int fd, I2C_DeviceAddress address, const uint8_t *writeData,
+                                size_t lenWriteData, uint8_t *readData, size_t lenReadData);
+    int (*gpioOpenAsInput)(GPIO_Id gpioId);
+    int (*gpioOpenAsOutput)(GPIO_Id gpioId, GPIO_OutputMode_Type outputMode,
+                            GPIO_Value_Type initialValue);
+    int (*gpioOpenEdgeNotifier)(GPIO_Id gpioId);
+    int (*gpioGetValue)(int gpioFd, GPIO_Value_Type *outValue);
+    int (*gpioSetValue)(int gpioFd, GPIO_Value_Type value);
+    void (*logStats)(void);
+} SensorHalBackend;
+
+/// <summary>
+///     Selects the backend, before any other call of the HAL. The player reads the recording
+///     at recordingPath, the other backends ignore it.
+/// </summary>
+/// <returns>0 on success, or -1 on failure</returns>
+int SensorHal_Init(SensorHalBackendId backend, const char *recordingPath);
+
+int SensorHal_I2cOpen(I2C_InterfaceId id);
+int SensorHal_I2cSetBusSpeed(int fd, uint32_t speedInHz);
+int SensorHal_I2cSetTimeout(int fd, uint32_t timeoutInMs);
+ssize_t SensorHal_I2cWrite(int fd, I2C_DeviceAddress address, const uint8_t *data,
+                           size_t length);
+ssize_t SensorHal_I2cRead(int fd, I2C_DeviceAddress address, uint8_t *buffer, size_t maxLength);
+ssize_t SensorHal_I2cWriteThenRead(int fd, I2C_DeviceAddress address, const uint8_t *writeData,
+                                   size_t lenWriteData, uint8_t *readData, size_t lenReadData);
+int SensorHal_GpioOpenAsInput(GPIO_Id gpioId);
+int SensorHal_GpioOpenAsOutput(GPIO_Id gpioId, GPIO_OutputMode_Type outputMode,
+                               GPIO_Value_Type initialValue);
+
+/// <summary>
+///     Opens a rising edge notifier of a line, see <see cref="GpioEdge_OpenRisingEdgeNotifier" />.
+/// </summary>
+/// <returns>The file descriptor, or -1 with errno set to ENOTSUP where the line has to be
+/// polled</returns>
+int SensorHal_GpioOpenEdgeNotifier(GPIO_Id gpioId);
+int SensorHal_GpioGetValue(int gpioFd, GPIO_Value_Type *outValue);
+int SensorHal_GpioSetValue(int gpioFd, GPIO_Value_Type value);
+
+/// <summary>
+///     Returns the name of the backend in use.
+/// </summary>
+const char *SensorHal_GetBackendName(void);
+
+/// <summary>
+///     Prints the statistics of the backend with Log_Debug.
+/// </summary>
+void SensorHal_LogStats(void);
+
+/// <summary>
+///     The backends of sensor_hal_trace.c.
+/// </summary>
+const SensorHalBackend *SensorHalTrace_GetRecorder(void);
+const SensorHalBackend *SensorHalTrace_OpenPlayer(const char *recordingPath);
@@ -0,0 +1,616 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <applibs/log.h>
+#include "epoll_timerfd_utilities.h"
+#include "gpio_edge.h"
+#include "sensor_hal.h"
+
+/// <summary>
+/// <para>Recorder and player backends of the sensor HAL. A recording is the debug log of a box
+/// running the recorder; the player takes the lines starting with "HAL", wherever they start
+/// in the line, and ignores the rest:</para>
+/// <para>HAL &lt;time_us&gt; w &lt;address&gt; &lt;result&gt; &lt;errno&gt; &lt;written&gt;
+/// HAL &lt;time_us&gt; r &lt;address&gt; &lt;length&gt; &lt;result&gt; &lt;errno&gt; &lt;read&gt;
+/// HAL &lt;time_us&gt; x &lt;address&gt; &lt;length&gt; &lt;result&gt; &lt;errno&gt; &lt;written&gt; &lt;read&gt;
+/// HAL &lt;time_us&gt; gpio &lt;gpio&gt; &lt;0|1&gt; &lt;reads&gt;
+/// HAL &lt;time_us&gt; gpio_set &lt;gpio&gt; &lt;0|1&gt;</para>
+/// <para>Times are in microseconds from <see cref="SensorHal_Init" />, the address is
+/// hexadecimal, the data are hexadecimal bytes without separators, "-" for none, and result
+/// and errno are those of the applibs call. A gpio line is written when a read of a line returns
+/// another level than the read before, reads being the number of reads which returned the level
+/// before; a gpio_set line is a level driven onto an output.</para>
+/// </summary>
+
+// Most data bytes of a transfer in a recording, longer transfers are recorded cut short
+#define SENSOR_HAL_TRACE_MAX_DATA 256
+// GPIO lines of the sensors
+#define SENSOR_HAL_TRACE_MAX_PINS 8
+
+static uint64_t startNs;
+
+/// <summary>
+///     A GPIO line opened through the HAL. The recorder keeps the level last read, -1 before
+///     the first read, and how often it has been read. The player keeps the recorded levels,
+///     each with the number of reads which returned it, 0 for the last one, and follows them
+///     with the level being returned and how often it has been.
+/// </summary>
+typedef struct {
+    int fd;
+    GPIO_Id gpio;
+    int lastValue;
+    uint32_t reads;
+    struct {
+        uint64_t timeUs;
+        uint8_t value;
+        uint32_t reads;
+    } *levels;
+    size_t levelCount;
+    size_t levelCursor;
+    uint32_t levelReads;
+    // Timerfd standing in for the edge notifier of the line, -1 if none
+    int edgeFd;
+} HalPin;
+
+static HalPin pins[SENSOR_HAL_TRACE_MAX_PINS];
+static size_t pinCount;
+
+typedef struct {
+    uint64_t timeUs;
+    char kind;
+    uint8_t address;
+    int result;
+    int error;
+    uint8_t *written;
+    size_t writeLength;
+    uint8_t *read;
+    size_t readLength;
+} HalTransfer;
+
+static struct {
+    HalTransfer *transfers;
+    size_t transferCount;
+    // Next transfer to look at for each address
+    size_t cursor[128];
+    uint32_t replayed;
+    uint32_t diverged;
+    uint32_t exhausted;
+} player;
+
+static struct {
+    uint32_t transfers;
+    uint32_t levels;
+} recorder;
+
+static uint64_t GetTimeUs(void)
+{
+    return (GetMonotonicNs() - startNs) / 1000;
+}
+
+static HalPin *FindPinByFd(int fd)
+{
+    for (size_t i = 0; i < pinCount; i++) {
+        if (pins[i].fd == fd) {
+            return &pins[i];
+        }
+    }
+    return NULL;
+}
+
+static HalPin *FindPinByGpio(GPIO_Id gpio, bool add)
+{
+    for (size_t i = 0; i < pinCount; i++) {
+        if (pins[i].gpio == gpio) {
+            return &pins[i];
+        }
+    }
+    if (!add || pinCount == SENSOR_HAL_TRACE_MAX_PINS) {
+        return NULL;
+    }
+    HalPin *pin = &pins[pinCount++];
+    memset(pin, 0, sizeof(*pin));
+    pin->fd = -1;
+    pin->edgeFd = -1;
+    pin->gpio = gpio;
+    pin->lastValue = -1;
+    return pin;
+}
+
+/// <summary>
+///     Remembers the line of a descriptor, the same line opened again gets the new descriptor.
+/// </summary>
+static void AddPin(GPIO_Id gpio, int fd)
+{
+    HalPin *pin = FindPinByGpio(gpio, true);
+    if (pin != NULL) {
+        pin->fd = fd;
+        pin->lastValue = -1;
+    }
+}
+
+/// <summary>
+///     Writes data as hexadecimal bytes into out, which holds 2 * SENSOR_HAL_TRACE_MAX_DATA + 1
+///     characters, or "-" for no data.
+/// </summary>
+static void FormatHex(char *out, const uint8_t *data, size_t length)
+{
+    static const char digits[] = "0123456789abcdef";
+    if (length == 0 || data == NULL) {
+        strcpy(out, "-");
+        return;
+    }
+    if (length > SENSOR_HAL_TRACE_MAX_DATA) {
+        length = SENSOR_HAL_TRACE_MAX_DATA;
+    }
+    for (size_t i = 0; i < length; i++) {
+        *out++ = digits[data[i] >> 4];
+        *out++ = digits[data[i] & 0x0F];
+    }
+    *out = '\0';
+}
+
+static ssize_t RecordI2cWrite(int fd, I2C_DeviceAddress address, const uint8_t *data,
+                              size_t length)
+{
+    ssize_t result = I2CMaster_Write(fd, address, data, length);
+    int error = result < 0 ? errno : 0;
+    char written[2 * SENSOR_HAL_TRACE_MAX_DATA + 1];
+    FormatHex(written, data, length);
+    Log_Debug("HAL %llu w %02x %d %d %s\n", (unsigned long long)GetTimeUs(),
+              (unsigned int)address, (int)result, error, written);
+    recorder.transfers++;
+    errno = error;
+    return result;
+}
+
+static ssize_t RecordI2cRead(int fd, I2C_DeviceAddress address, uint8_t *buffer,
+                             size_t maxLength)
+{
+    ssize_t result = I2CMaster_Read(fd, address, buffer, maxLength);
+    int error = result < 0 ? errno : 0;
+    char read[2 * SENSOR_HAL_TRACE_MAX_DATA + 1];
+    FormatHex(read, buffer, result < 0 ? 0 : (size_t)result);
+    Log_Debug("HAL %llu r %02x %u %d %d %s\n", (unsigned long long)GetTimeUs(),
+              (unsigned int)address, (unsigned int)maxLength, (int)result, error, read);
+    recorder.transfers++;
+    errno = error;
+    return result;
+}
+
+static ssize_t RecordI2cWriteThenRead(int fd, I2C_DeviceAddress address,
+                                      const uint8_t *writeData, size_t lenWriteData,
+                                      uint8_t *readData, size_t lenReadData)
+{
+    ssize_t result =
+        I2CMaster_WriteThenRead(fd, address, writeData, lenWriteData, readData, lenReadData);
+    int error = result < 0 ? errno : 0;
+    char written[2 * SENSOR_HAL_TRACE_MAX_DATA + 1];
+    char read[2 * SENSOR_HAL_TRACE_MAX_DATA + 1];
+    FormatHex(written, writeData, lenWriteData);
+    FormatHex(read, readData, result < 0 ? 0 : lenReadData);
+    Log_Debug("HAL %llu x %02x %u %d %d %s %s\n", (unsigned long long)GetTimeUs(),
+              (unsigned int)address, (unsigned int)lenReadData, (int)result, error, written,
+              read);
+    recorder.transfers++;
+    errno = error;
+    return result;
+}
+
+static void RecordLevel(const char *kind, GPIO_Id gpio, GPIO_Value_Type value, const char *reads)
+{
+    Log_Debug("HAL %llu %s %d %d%s\n", (unsigned long long)GetTimeUs(), kind, (int)gpio,
+              value == GPIO_Value_High ? 1 : 0, reads);
+    recorder.levels++;
+}
+
+static int RecordGpioOpenAsInput(GPIO_Id gpioId)
+{
+    int fd = GPIO_OpenAsInput(gpioId);
+    if (fd >= 0) {
+        AddPin(gpioId, fd);
+    }
+    return fd;
+}
+
+static int RecordGpioOpenAsOutput(GPIO_Id gpioId, GPIO_OutputMode_Type outputMode,
+                                  GPIO_Value_Type initialValue)
+{
+    int fd = GPIO_OpenAsOutput(gpioId, outputMode, initialValue);
+    if (fd >= 0) {
+        AddPin(gpioId, fd);
+        RecordLevel("gpio_set", gpioId, initialValue, "");
+    }
+    return fd;
+}
+
+static int RecordGpioGetValue(int gpioFd, GPIO_Value_Type *outValue)
+{
+    int result = GPIO_GetValue(gpioFd, outValue);
+    HalPin *pin = FindPinByFd(gpioFd);
+    if (result != 0 || pin == NULL) {
+        return result;
+    }
+    if (pin->lastValue != (int)*outValue) {
+        char reads[16];
+        snprintf(reads, sizeof(reads), " %u", pin->reads);
+        RecordLevel("gpio", pin->gpio, *outValue, reads);
+        pin->lastValue = (int)*outValue;
+        pin->reads = 0;
+    }
+    pin->reads++;
+    return result;
+}
+
+static int RecordGpioSetValue(int gpioFd, GPIO_Value_Type value)
+{
+    int result = GPIO_SetValue(gpioFd, value);
+    HalPin *pin = FindPinByFd(gpioFd);
+    if (result == 0 && pin != NULL) {
+        RecordLevel("gpio_set", pin->gpio, value, "");
+    }
+    return result;
+}
+
+static void LogRecorderStats(void)
+{
+    Log_Debug("INFO: Sensor HAL recorder: %u transfers, %u GPIO levels recorded.\n",
+              recorder.transfers, recorder.levels);
+}
+
+static const SensorHalBackend recorderBackend = {.name = "recorder",
+                                                 .i2cOpen = I2CMaster_Open,
+                                                 .i2cSetBusSpeed = I2CMaster_SetBusSpeed,
+                                                 .i2cSetTimeout = I2CMaster_SetTimeout,
+                                                 .i2cWrite = RecordI2cWrite,
+                                                 .i2cRead = RecordI2cRead,
+                                                 .i2cWriteThenRead = RecordI2cWriteThenRead,
+                                                 .gpioOpenAsInput = RecordGpioOpenAsInput,
+                                                 .gpioOpenAsOutput = RecordGpioOpenAsOutput,
+                                                 .gpioOpenEdgeNotifier =
+                                                     GpioEdge_OpenRisingEdgeNotifier,
+                                                 .gpioGetValue = RecordGpioGetValue,
+                                                 .gpioSetValue = RecordGpioSetValue,
+                                                 .logStats = LogRecorderStats};
+
+const SensorHalBackend *SensorHalTrace_GetRecorder(void)
+{
+    startNs = GetMonotonicNs();
+    return &recorderBackend;
+}
+
+/// <summary>
+///     Returns the next recorded transfer of an address, or NULL past the end of the recording.
+/// </summary>
+static HalTransfer *NextTransfer(uint8_t address)
+{
+    size_t i = player.cursor[address & 0x7F];
+    while (i < player.transferCount && player.transfers[i].address != address) {
+        i++;
+    }
+    player.cursor[address & 0x7F] = i < player.transferCount ? i + 1 : i;
+    if (i == player.transferCount) {
+        if (player.exhausted++ == 0) {
+            Log_Debug("INFO: Sensor HAL recording has no more transfers of 0x%02x.\n", address);
+        }
+        return NULL;
+    }
+    return &player.transfers[i];
+}
+
+/// <summary>
+///     Answers a transfer from the recording: the recorded result and read data. A transfer
+///     which differs from the recorded one in kind, lengths or written data is still answered
+///     and counted as diverged.
+/// </summary>
+static ssize_t PlayTransfer(char kind, I2C_DeviceAddress address, const uint8_t *written,
+                            size_t writeLength, uint8_t *read, size_t readLength)
+{
+    HalTransfer *transfer = NextTransfer((uint8_t)address);
+    if (transfer == NULL) {
+        errno = EIO;
+        return -1;
+    }
+    player.replayed++;
+    if (transfer->kind != kind || transfer->readLength != readLength ||
+        transfer->writeLength != writeLength ||
+        (writeLength != 0 && memcmp(transfer->written, written, writeLength) != 0)) {
+        player.diverged++;
+    }
+    if (read != NULL) {
+        memset(read, 0, readLength);
+        memcpy(read, transfer->read,
+               transfer->readLength < readLength ? transfer->readLength : readLength);
+    }
+    errno = transfer->error;
+    return transfer->result;
+}
+
+static ssize_t PlayI2cWrite(int fd, I2C_DeviceAddress address, const uint8_t *data,
+                            size_t length)
+{
+    return PlayTransfer('w', address, data, length, NULL, 0);
+}
+
+static ssize_t PlayI2cRead(int fd, I2C_DeviceAddress address, uint8_t *buffer, size_t maxLength)
+{
+    return PlayTransfer('r', address, NULL, 0, buffer, maxLength);
+}
+
+static ssize_t PlayI2cWriteThenRead(int fd, I2C_DeviceAddress address, const uint8_t *writeData,
+                                    size_t lenWriteData, uint8_t *readData, size_t lenReadData)
+{
+    return PlayTransfer('x', address, writeData, lenWriteData, readData, lenReadData);
+}
+
+/// <summary>
+///     Returns a descriptor which stands for an opened bus or line, so that closing it works.
+/// </summary>
+static int OpenPlaceholderFd(void)
+{
+    return open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+static int PlayI2cOpen(I2C_InterfaceId id)
+{
+    return OpenPlaceholderFd();
+}
+
+static int PlayI2cSetting(int fd, uint32_t value)
+{
+    return 0;
+}
+
+static int PlayGpioOpenAsInput(GPIO_Id gpioId)
+{
+    int fd = OpenPlaceholderFd();
+    HalPin *pin = FindPinByGpio(gpioId, true);
+    if (fd >= 0 && pin != NULL) {
+        pin->fd = fd;
+    }
+    return fd;
+}
+
+static int PlayGpioOpenAsOutput(GPIO_Id gpioId, GPIO_OutputMode_Type outputMode,
+                                GPIO_Value_Type initialValue)
+{
+    return PlayGpioOpenAsInput(gpioId);
+}
+
+/// <summary>
+///     Sets the edge timer of a line to the first recorded rise after the current level, or
+///     disarms it after the last one.
+/// </summary>
+static void ArmEdge(HalPin *pin)
+{
+    struct itimerspec expiry = {0};
+    for (size_t i = pin->levelCursor + 1; i < pin->levelCount; i++) {
+        if (pin->levels[i].value != 0 && pin->levels[i - 1].value == 0) {
+            uint64_t edgeNs = startNs + pin->levels[i].timeUs * 1000;
+            expiry.it_value.tv_sec = (time_t)(edgeNs / 1000000000ULL);
+            expiry.it_value.tv_nsec = (long)(edgeNs % 1000000000ULL);
+            break;
+        }
+    }
+    timerfd_settime(pin->edgeFd, TFD_TIMER_ABSTIME, &expiry, NULL);
+}
+
+/// <summary>
+///     Replays the rises of a line as edge notifications: a timerfd, whose read returns the
+///     expirations as the read of a notifier returns the edges, expires at the time of each
+///     recorded rise. The timer is set again whenever the line is read.
+/// </summary>
+static int PlayGpioOpenEdgeNotifier(GPIO_Id gpioId)
+{
+    HalPin *pin = FindPinByGpio(gpioId, false);
+    if (pin == NULL || pin->levelCount == 0) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    pin->edgeFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (pin->edgeFd >= 0) {
+        ArmEdge(pin);
+    }
+    return pin->edgeFd;
+}
+
+static int PlayGpioGetValue(int gpioFd, GPIO_Value_Type *outValue)
+{
+    HalPin *pin = FindPinByFd(gpioFd);
+    if (pin == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+    // The recorded levels are returned as often as they were read, a level recorded by now
+    // takes over at once, so that reads the recording did not have do not shift the rest
+    uint64_t nowUs = GetTimeUs();
+    while (pin->levelCursor + 1 < pin->levelCount &&
+           (pin->levels[pin->levelCursor + 1].timeUs <= nowUs ||
+            (pin->levels[pin->levelCursor].reads != 0 &&
+             pin->levelReads >= pin->levels[pin->levelCursor].reads))) {
+        pin->levelCursor++;
+        pin->levelReads = 0;
+    }
+    pin->levelReads++;
+    bool high = pin->levelCount == 0 || pin->levels[pin->levelCursor].value != 0;
+    *outValue = high ? GPIO_Value_High : GPIO_Value_Low;
+    if (pin->edgeFd >= 0) {
+        ArmEdge(pin);
+    }
+    return 0;
+}
+
+static int PlayGpioSetValue(int gpioFd, GPIO_Value_Type value)
+{
+    return FindPinByFd(gpioFd) == NULL ? -1 : 0;
+}
+
+static void LogPlayerStats(void)
+{
+    Log_Debug("INFO: Sensor HAL player: %u of %u transfers replayed, %u diverged, %u past the "
+              "end of the recording.\n",
+              player.replayed, (unsigned int)player.transferCount, player.diverged,
+              player.exhausted);
+}
+
+static const SensorHalBackend playerBackend = {.name = "player",
+                                               .i2cOpen = PlayI2cOpen,
+                                               .i2cSetBusSpeed = PlayI2cSetting,
+                                               .i2cSetTimeout = PlayI2cSetting,
+                                               .i2cWrite = PlayI2cWrite,
+                                               .i2cRead = PlayI2cRead,
+                                               .i2cWriteThenRead = PlayI2cWriteThenRead,
+                                               .gpioOpenAsInput = PlayGpioOpenAsInput,
+                                               .gpioOpenAsOutput = PlayGpioOpenAsOutput,
+                                               .gpioOpenEdgeNotifier = PlayGpioOpenEdgeNotifier,
+                                               .gpioGetValue = PlayGpioGetValue,
+                                               .gpioSetValue = PlayGpioSetValue,
+                                               .logStats = LogPlayerStats};
+
+/// <summary>
+///     Parses hexadecimal bytes, or "-", into a newly allocated buffer.
+/// </summary>
+/// <returns>true on success</returns>
+static bool ParseHex(const char *text, uint8_t **data, size_t *length)
+{
+    *data = NULL;
+    *length = 0;
+    if (text == NULL) {
+        return false;
+    }
+    if (strcmp(text, "-") == 0) {
+        return true;
+    }
+    size_t digits = strlen(text);
+    if (digits % 2 != 0) {
+        return false;
+    }
+    *data = malloc(digits / 2);
+    for (size_t i = 0; i < digits / 2; i++) {
+        char byte[3] = {text[i * 2], text[i * 2 + 1], '\0'};
+        char *end;
+        (*data)[i] = (uint8_t)strtoul(byte, &end, 16);
+        if (*end != '\0') {
+            free(*data);
+            *data = NULL;
+            return false;
+        }
+    }
+    *length = digits / 2;
+    return true;
+}
+
+/// <summary>
+///     Adds the record of one "HAL" line to the player.
+/// </summary>
+/// <returns>true on success, false if the line is malformed</returns>
+static bool ParseRecord(char *line)
+{
+    char *savePtr;
+    strtok_r(line, " \t", &savePtr);
+    const char *time = strtok_r(NULL, " \t", &savePtr);
+    const char *kind = strtok_r(NULL, " \t", &savePtr);
+    if (time == NULL || kind == NULL) {
+        return false;
+    }
+    uint64_t timeUs = strtoull(time, NULL, 10);
+
+    if (strcmp(kind, "gpio_set") == 0) {
+        // The outputs are not replayed
+        return true;
+    }
+    if (strcmp(kind, "gpio") == 0) {
+        const char *gpio = strtok_r(NULL, " \t", &savePtr);
+        const char *value = strtok_r(NULL, " \t", &savePtr);
+        const char *reads = strtok_r(NULL, " \t", &savePtr);
+        if (gpio == NULL || value == NULL || reads == NULL) {
+            return false;
+        }
+        HalPin *pin = FindPinByGpio((GPIO_Id)atoi(gpio), true);
+        if (pin == NULL) {
+            return false;
+        }
+        if (pin->levelCount != 0) {
+            pin->levels[pin->levelCount - 1].reads = (uint32_t)strtoul(reads, NULL, 10);
+        }
+        pin->levels = realloc(pin->levels, (pin->levelCount + 1) * sizeof(pin->levels[0]));
+        pin->levels[pin->levelCount].timeUs = timeUs;
+        pin->levels[pin->levelCount].value = (uint8_t)(atoi(value) != 0);
+        pin->levels[pin->levelCount].reads = 0;
+        pin->levelCount++;
+        return true;
+    }
+
+    if (strlen(kind) != 1 || strchr("wrx", kind[0]) == NULL) {
+        return false;
+    }
+    HalTransfer transfer = {.timeUs = timeUs, .kind = kind[0]};
+    const char *address = strtok_r(NULL, " \t", &savePtr);
+    const char *length = kind[0] == 'w' ? "0" : strtok_r(NULL, " \t", &savePtr);
+    const char *result = strtok_r(NULL, " \t", &savePtr);
+    const char *error = strtok_r(NULL, " \t", &savePtr);
+    if (address == NULL || length == NULL || result == NULL || error == NULL) {
+        return false;
+    }
+    transfer.address = (uint8_t)(strtoul(address, NULL, 16) & 0x7F);
+    transfer.readLength = strtoul(length, NULL, 10);
+    transfer.result = atoi(result);
+    transfer.error = atoi(error);
+    if (kind[0] != 'r' &&
+        !ParseHex(strtok_r(NULL, " \t", &savePtr), &transfer.written, &transfer.writeLength)) {
+        return false;
+    }
+    if (kind[0] != 'w') {
+        // The recorded data of a failed read are empty; read buffers are compared by length
+        uint8_t *read;
+        size_t readBytes;
+        if (!ParseHex(strtok_r(NULL, " \t", &savePtr), &read, &readBytes)) {
+            free(transfer.written);
+            return false;
+        }
+        transfer.read = read;
+        if (readBytes < transfer.readLength) {
+            transfer.read = realloc(read, transfer.readLength);
+            memset(transfer.read + readBytes, 0, transfer.readLength - readBytes);
+        }
+    }
+
+    player.transfers =
+        realloc(player.transfers, (player.transferCount + 1) * sizeof(player.transfers[0]));
+    player.transfers[player.transferCount++] = transfer;
+    return true;
+}
+
+const SensorHalBackend *SensorHalTrace_OpenPlayer(const char *recordingPath)
+{
+    FILE *file = recordingPath == NULL ? NULL : fopen(recordingPath, "r");
+    if (file == NULL) {
+        Log_Debug("ERROR: Could not open the sensor HAL recording %s: %s (%d).\n",
+                  recordingPath == NULL ? "(none)" : recordingPath, strerror(errno), errno);
+        return NULL;
+    }
+
+    char *line = NULL;
+    size_t lineSize = 0;
+    uint32_t malformed = 0;
+    while (getline(&line, &lineSize, file) != -1) {
+        line[strcspn(line, "\r\n")] = '\0';
+        // Skips the prefix the log adds, and other lines which mention the HAL
+        char *record = strstr(line, "HAL ");
+        if (record != NULL && isdigit((unsigned char)record[4]) && !ParseRecord(record)) {
+            malformed++;
+        }
+    }
+    free(line);
+    fclose(file);
+
+    startNs = GetMonotonicNs();
+    Log_Debug("Sensor HAL recording %s: %u transfers, %u malformed lines.\n", recordingPath,
+              (unsigned int)player.transferCount, malformed);
+    return &playerBackend;
+}